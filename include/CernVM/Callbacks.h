@@ -23,6 +23,7 @@
 #define CALLBACKS_H
 
 #include <map>
+#include <deque>
 #include <string>
 #include <vector>
 #include <boost/bind.hpp>
@@ -31,7 +32,10 @@
 #include <boost/make_shared.hpp>
 #include <boost/enable_shared_from_this.hpp>
 #include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/condition_variable.hpp>
 
+#include <CernVM/Config.h>
 #include <CernVM/Utilities.h>
 #include <CernVM/ArgumentList.h>
 
@@ -69,15 +73,123 @@ public:
 };
 typedef boost::shared_ptr< NamedEventSlot >	NamedEventSlotPtr;
 
+/**
+ * Immutable snapshots of the registered slots. They are replaced as a whole
+ * when a callback is registered or unregistered.
+ */
+typedef std::vector< AnyEventSlotPtr >												AnyEventSlotList;
+typedef boost::shared_ptr< const AnyEventSlotList >									AnyEventSlotListPtr;
+typedef std::vector< NamedEventSlotPtr >											NamedEventSlotList;
+typedef std::map< std::string, boost::shared_ptr< const NamedEventSlotList > >		NamedEventSlotMap;
+typedef boost::shared_ptr< const NamedEventSlotMap >								NamedEventSlotMapPtr;
+
+/**
+ * What to do when the event queue of an asynchronous Callbacks instance is full
+ */
+enum CallbacksOverflow {
+	CBO_BLOCK = 0,			// Block the thread that fires the event until there is space
+	CBO_DROP_NEWEST,		// Drop the event that is being fired
+	CBO_DROP_OLDEST			// Drop the oldest event in the queue
+};
+
+/**
+ * An event waiting in the queue of a dispatcher: a named event, or a call
+ * that delivers a typed signal (see Callbacks::post)
+ */
+struct CallbacksEvent {
+	std::string 				name;
+	VariantArgList 				args;
+	boost::function< void () >	call;
+};
+
+/**
+ * A bounded queue of events that are delivered in order by the shared dispatcher
+ * threads (see CALLBACKS_DISPATCH_THREADS). Only one thread delivers the events of
+ * a queue at a time. This is used by the Callbacks class in asynchronous mode.
+ */
+class Callbacks;
+class CallbacksExecutor;
+class CallbacksDispatcher : public boost::enable_shared_from_this<CallbacksDispatcher> {
+public:
+
+	CallbacksDispatcher( Callbacks * owner, size_t maxDepth, CallbacksOverflow overflow );
+
+	/**
+	 * Deliver the pending events and stop accepting new ones. When called
+	 * from a handler, the pending events are dropped and the owner is not used again.
+	 */
+	void 				stop 		( );
+
+	/**
+	 * Add an event (or a call, if specified) in the queue. Returns false if the
+	 * dispatcher is stopping.
+	 */
+	bool 				enqueue		( const std::string& name, VariantArgList& args, const boost::function< void () >& call );
+
+	/**
+	 * Wait until all the events in the queue are delivered. If no thread is
+	 * delivering them, they are delivered by the calling thread.
+	 */
+	void 				wait 		( );
+
+	/**
+	 * Queue metrics
+	 */
+	size_t 				depth 		( );
+	size_t 				peakDepth 	( );
+	unsigned long 		dropped 	( );
+
+private:
+	friend class CallbacksExecutor;
+
+	// Deliver the queued events on the calling thread, unless another thread
+	// is delivering them. The executor calls it with pooled=true.
+	void 				run 		( bool pooled );
+
+	// True if the calling thread is delivering our events (the mutex must be locked)
+	bool 				inHandler	( );
+
+	Callbacks *			owner;
+	size_t 				maxDepth;
+	CallbacksOverflow	overflow;
+
+	std::deque< CallbacksEvent >	queue;
+	boost::mutex 				mutex;
+	boost::condition_variable	cond;
+	bool 						exiting;
+	bool 						running;
+	bool 						scheduled;
+	boost::thread::id 			runner;
+	size_t 						peak;
+	unsigned long 				droppedCount;
+
+};
+typedef boost::shared_ptr< CallbacksDispatcher >	CallbacksDispatcherPtr;
 
 /**
  * The Callbacks class provides the interface to register and fire
  * callbacks by name.
+ *
+ * The slots are kept in copy-on-write lists, so fire() does not hold any
+ * lock while calling the handlers and the handlers can register or
+ * unregister callbacks. A callback unregistered while an event is being
+ * fired by another thread might still receive that event.
+ *
+ * In asynchronous mode (see setAsync) the events are placed in a bounded
+ * queue and they are delivered in the order they were fired by the shared
+ * dispatcher threads, so the thread that fires them is not stalled by
+ * slow handlers.
  */
 class Callbacks {
 public:
 
-	Callbacks() : anyEventCallbacks(), namedEventCallbacks(), shopMutex() { };
+	Callbacks() : anyEventCallbacks( boost::make_shared< AnyEventSlotList >() ),
+				  namedEventCallbacks( boost::make_shared< NamedEventSlotMap >() ), shopMutex(), dispatcher() { };
+
+	/**
+	 * Deliver any pending events
+	 */
+	virtual ~Callbacks();
 
 	/**
 	 * Register a callback that will be fired for all events
@@ -104,15 +216,73 @@ public:
 	  */
 	 void 				fire 		( const std::string& name, VariantArgList& args );
 
+	/**
+	 * Return true if there are handlers that will receive the specified event.
+	 * This can be used to avoid building the arguments of an event nobody listens to.
+	 */
+	bool 				hasHandlers	( const std::string& name );
+
+	/**
+	 * Enable or disable the asynchronous delivery of the events. When disabled,
+	 * the events already in the queue are delivered before the function returns.
+	 */
+	void 				setAsync	( bool enabled, size_t maxDepth = CALLBACKS_QUEUE_DEPTH, CallbacksOverflow overflow = CBO_BLOCK );
+
+	/**
+	 * Wait until all the events fired so far are delivered
+	 */
+	void 				waitEvents	( );
+
+	/**
+	 * Event queue metrics: the current and the maximum number of events
+	 * in the queue and the number of events dropped because it was full.
+	 */
+	size_t 				queueDepth		( );
+	size_t 				queuePeakDepth	( );
+	unsigned long 		queueDropped	( );
+
+	/**
+	 * Call the handlers of an event in the current thread
+	 */
+	void 				dispatch	( const std::string& name, VariantArgList& args );
+
+	/**
+	 * Call the specified function in order with the events: from the dispatcher
+	 * in asynchronous mode, otherwise right away. This is used for delivering
+	 * the typed signals.
+	 */
+	void 				post		( const boost::function< void () >& call );
+
+	/**
+	 * Return true if the events are delivered asynchronously
+	 */
+	bool 				isAsync		( );
+
+protected:
+
+	/**
+	 * Locally overridable function that is called when a callback is
+	 * registered or unregistered, with shopMutex locked
+	 */
+	virtual void 		handlersChanged	( ) { };
+
+	/**
+	 * Deliver an event (or a call) through the dispatcher, if any
+	 */
+	void 				deliver		( const std::string& name, VariantArgList& args, const boost::function< void () >& call );
+
 public:
 
-	// Callback list
-	std::vector< AnyEventSlotPtr >								anyEventCallbacks;
-	std::map< std::string, std::vector< NamedEventSlotPtr > > 	namedEventCallbacks;
+	// Callback lists (accessed with boost::atomic_load/atomic_store)
+	AnyEventSlotListPtr			anyEventCallbacks;
+	NamedEventSlotMapPtr		namedEventCallbacks;
 
-	// Shared operations mutex
+	// Mutex that serializes the updates of the callback lists
 	boost::mutex 		shopMutex;
 
+	// The dispatcher in asynchronous mode (accessed with boost::atomic_load/atomic_store)
+	CallbacksDispatcherPtr		dispatcher;
+
 };
 
 #endif /* end of include guard: CALLBACKS_H */
\ No newline at end of file
@@ -23,14 +23,40 @@
 #define CALLBACKS_PROGRESS_H
 
 #include <CernVM/Callbacks.h>
+#include <CernVM/CallbacksSignal.h>
 
+/**
+ * The progress events are delivered both to the typed signals below and,
+ * through the string-keyed interface of the Callbacks class, to the
+ * handlers registered by name. The arguments of the latter are built only
+ * if somebody listens for the event. In asynchronous mode both are delivered
+ * in order by the dispatcher.
+ */
 class CallbacksProgress: public Callbacks {
 public:
 
     /**
      * Initialize parent
      */
-    CallbacksProgress(): Callbacks() { };
+    CallbacksProgress(): Callbacks(), startedEvent(), completedEvent(), failedEvent(), progressEvent(), lengthyTaskEvent(),
+    	namedStarted(false), namedCompleted(false), namedFailed(false), namedProgress(false), namedLengthyTask(false) { };
+
+	/**
+	 * Typed progress events
+	 */
+	CallbacksSignal< void( const std::string& ) >				startedEvent;
+	CallbacksSignal< void( const std::string& ) >				completedEvent;
+	CallbacksSignal< void( const std::string&, int ) >			failedEvent;
+	CallbacksSignal< void( const std::string&, double ) >		progressEvent;
+	CallbacksSignal< void( const std::string&, bool ) >			lengthyTaskEvent;
+
+	/**
+	 * Return true if somebody listens for the 'progress' event
+	 */
+	bool hasProgressListeners( )
+		{
+			return !progressEvent.empty() || namedProgress.load( boost::memory_order_relaxed );
+		};
 
 	/**
 	 * Fire 'started' event
@@ -38,7 +64,15 @@ public:
 	void fireStarted( const std::string & msg )
 		{ 
 	        CRASH_REPORT_BEGIN;
-			fire("started", ArgumentList(msg) ); 
+			if (!startedEvent.empty()) {
+				if (isAsync()) {
+					post( startedEvent.deferred( msg ) );
+				} else {
+					startedEvent.fire( msg );
+				}
+			}
+			if (namedStarted.load( boost::memory_order_relaxed ))
+				fire("started", ArgumentList(msg) ); 
 	        CRASH_REPORT_END;
 		};
 
@@ -48,7 +82,15 @@ public:
 	void fireCompleted( const std::string & msg )
 		{ 
 	        CRASH_REPORT_BEGIN;
-			fire("completed", ArgumentList(msg) ); 
+			if (!completedEvent.empty()) {
+				if (isAsync()) {
+					post( completedEvent.deferred( msg ) );
+				} else {
+					completedEvent.fire( msg );
+				}
+			}
+			if (namedCompleted.load( boost::memory_order_relaxed ))
+				fire("completed", ArgumentList(msg) ); 
 	        CRASH_REPORT_END;
 		};
 
@@ -58,7 +100,15 @@ public:
 	void fireFailed( const std::string & msg, const int errorCode )
 		{ 
 	        CRASH_REPORT_BEGIN;
-			fire("failed", ArgumentList(msg)(errorCode) ); 
+			if (!failedEvent.empty()) {
+				if (isAsync()) {
+					post( failedEvent.deferred( msg, errorCode ) );
+				} else {
+					failedEvent.fire( msg, errorCode );
+				}
+			}
+			if (namedFailed.load( boost::memory_order_relaxed ))
+				fire("failed", ArgumentList(msg)(errorCode) ); 
 	        CRASH_REPORT_END;
 		};
 
@@ -68,7 +118,15 @@ public:
 	void fireProgress( const std::string& msg, const double progress )
 		{ 
 	        CRASH_REPORT_BEGIN;
-			fire("progress", ArgumentList(msg)(progress) ); 
+			if (!progressEvent.empty()) {
+				if (isAsync()) {
+					post( progressEvent.deferred( msg, progress ) );
+				} else {
+					progressEvent.fire( msg, progress );
+				}
+			}
+			if (namedProgress.load( boost::memory_order_relaxed ))
+				fire("progress", ArgumentList(msg)(progress) ); 
 	        CRASH_REPORT_END;
 		};
 
@@ -78,14 +136,47 @@ public:
 	void fireIsLengthy( const std::string& msg, const bool isLengthy )
 		{
 			CRASH_REPORT_BEGIN;
-			if (isLengthy) {
-				fire("lengthyTask", ArgumentList(msg)(1) );
-			} else {
-				fire("lengthyTask", ArgumentList(msg)(0) );
+			if (!lengthyTaskEvent.empty()) {
+				if (isAsync()) {
+					post( lengthyTaskEvent.deferred( msg, isLengthy ) );
+				} else {
+					lengthyTaskEvent.fire( msg, isLengthy );
+				}
+			}
+			if (namedLengthyTask.load( boost::memory_order_relaxed )) {
+				if (isLengthy) {
+					fire("lengthyTask", ArgumentList(msg)(1) );
+				} else {
+					fire("lengthyTask", ArgumentList(msg)(0) );
+				}
 			}
 			CRASH_REPORT_END;
 		}
 
+protected:
+
+	/**
+	 * Overrided function from Callbacks to cache which events have handlers
+	 */
+	virtual void handlersChanged( )
+		{
+			namedStarted.store( hasHandlers("started"), boost::memory_order_relaxed );
+			namedCompleted.store( hasHandlers("completed"), boost::memory_order_relaxed );
+			namedFailed.store( hasHandlers("failed"), boost::memory_order_relaxed );
+			namedProgress.store( hasHandlers("progress"), boost::memory_order_relaxed );
+			namedLengthyTask.store( hasHandlers("lengthyTask"), boost::memory_order_relaxed );
+		}
+
+private:
+
+	/**
+	 * Flags if there are handlers for each event, registered by name or for any event
+	 */
+	boost::atomic<bool>		namedStarted;
+	boost::atomic<bool>		namedCompleted;
+	boost::atomic<bool>		namedFailed;
+	boost::atomic<bool>		namedProgress;
+	boost::atomic<bool>		namedLengthyTask;
 
 };
 
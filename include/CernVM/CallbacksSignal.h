@@ -0,0 +1,193 @@
+/**
+ * This file is part of CernVM Web API Plugin.
+ *
+ * CVMWebAPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CVMWebAPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CVMWebAPI. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Developed by Ioannis Charalampidis 2013
+ * Contact: <ioannis.charalampidis[at]cern.ch>
+ */
+
+#pragma once
+#ifndef CALLBACKS_SIGNAL_H
+#define CALLBACKS_SIGNAL_H
+
+#include <vector>
+#include <algorithm>
+#include <boost/bind.hpp>
+#include <boost/atomic.hpp>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <CernVM/Utilities.h>
+
+/**
+ * Common slot management for the typed signals.
+ *
+ * Like in the Callbacks class, the slots are kept in a copy-on-write list,
+ * so firing a signal takes no lock and the handlers can connect or
+ * disconnect slots. Firing a signal does not allocate any memory: the
+ * arguments are passed to the handlers as they are. A signal can also be
+ * fired later, by calling the function returned by deferred() (ex. from the
+ * dispatcher of a Callbacks instance, see Callbacks::post).
+ */
+template< typename F > class CallbacksSignalBase {
+public:
+
+	typedef boost::function< F >						Function;
+	typedef boost::shared_ptr< Function >				SlotPtr;
+	typedef std::vector< SlotPtr >						SlotList;
+	typedef boost::shared_ptr< const SlotList >			SlotListPtr;
+
+	CallbacksSignalBase() : slots( boost::make_shared< SlotList >() ), mutex(), hasSlots(false) { };
+
+	/**
+	 * Register a handler, returning the slot to use for unregistering it
+	 */
+	SlotPtr 			connect		( const Function& cb ) {
+		boost::mutex::scoped_lock lock(mutex);
+		SlotPtr ptr = boost::make_shared< Function >( cb );
+		boost::shared_ptr< SlotList > cbs = boost::make_shared< SlotList >( *boost::atomic_load(&slots) );
+		cbs->push_back( ptr );
+		boost::atomic_store( &slots, SlotListPtr(cbs) );
+		hasSlots.store( true, boost::memory_order_relaxed );
+		return ptr;
+	}
+
+	/**
+	 * Unregister a handler
+	 */
+	void 				disconnect	( SlotPtr slot ) {
+		if (!slot) return;
+		boost::mutex::scoped_lock lock(mutex);
+		boost::shared_ptr< SlotList > cbs = boost::make_shared< SlotList >( *boost::atomic_load(&slots) );
+		typename SlotList::iterator it = std::find( cbs->begin(), cbs->end(), slot );
+		if (it == cbs->end()) return;
+		cbs->erase( it );
+		boost::atomic_store( &slots, SlotListPtr(cbs) );
+		hasSlots.store( !cbs->empty(), boost::memory_order_relaxed );
+	}
+
+	/**
+	 * Return true if there are no handlers
+	 */
+	bool 				empty		( ) {
+		return !hasSlots.load( boost::memory_order_relaxed );
+	}
+
+protected:
+
+	// The registered slots (accessed with boost::atomic_load/atomic_store)
+	SlotListPtr			slots;
+
+	// Mutex that serializes the updates of the slot list
+	boost::mutex 		mutex;
+
+	// Flags if there are slots, so empty() takes no lock
+	boost::atomic<bool>	hasSlots;
+
+};
+
+/**
+ * A typed event with compile-time checked arguments, declared with the
+ * signature of the handlers, for example:
+ *
+ *   CallbacksSignal< void( const std::string&, double ) > progressEvent;
+ *
+ * It's meant for the frequent events, where building the VariantArgList of
+ * the string-keyed Callbacks interface is too expensive.
+ */
+template< typename Sig > class CallbacksSignal;
+
+template< > class CallbacksSignal< void() > : public CallbacksSignalBase< void() > {
+public:
+	void fire( ) {
+		deliver( boost::atomic_load(&slots) );
+	}
+	boost::function< void () > deferred( ) {
+		return boost::bind( &CallbacksSignal::deliver, boost::atomic_load(&slots) );
+	}
+	static void deliver( SlotListPtr cbs ) {
+		for (SlotList::const_iterator it = cbs->begin(); it != cbs->end(); ++it) {
+			try {
+				(**it)( );
+			} catch (...) {
+				CVMWA_LOG("Error", "Exception while forwarding event to CallbacksSignal")
+			}
+		}
+	}
+};
+
+template< typename A1 > class CallbacksSignal< void(A1) > : public CallbacksSignalBase< void(A1) > {
+public:
+	typedef CallbacksSignalBase< void(A1) > Base;
+	void fire( A1 a1 ) {
+		deliver( boost::atomic_load(&this->slots), a1 );
+	}
+	boost::function< void () > deferred( A1 a1 ) {
+		return boost::bind( &CallbacksSignal::deliver, boost::atomic_load(&this->slots), a1 );
+	}
+	static void deliver( typename Base::SlotListPtr cbs, A1 a1 ) {
+		for (typename Base::SlotList::const_iterator it = cbs->begin(); it != cbs->end(); ++it) {
+			try {
+				(**it)( a1 );
+			} catch (...) {
+				CVMWA_LOG("Error", "Exception while forwarding event to CallbacksSignal")
+			}
+		}
+	}
+};
+
+template< typename A1, typename A2 > class CallbacksSignal< void(A1, A2) > : public CallbacksSignalBase< void(A1, A2) > {
+public:
+	typedef CallbacksSignalBase< void(A1, A2) > Base;
+	void fire( A1 a1, A2 a2 ) {
+		deliver( boost::atomic_load(&this->slots), a1, a2 );
+	}
+	boost::function< void () > deferred( A1 a1, A2 a2 ) {
+		return boost::bind( &CallbacksSignal::deliver, boost::atomic_load(&this->slots), a1, a2 );
+	}
+	static void deliver( typename Base::SlotListPtr cbs, A1 a1, A2 a2 ) {
+		for (typename Base::SlotList::const_iterator it = cbs->begin(); it != cbs->end(); ++it) {
+			try {
+				(**it)( a1, a2 );
+			} catch (...) {
+				CVMWA_LOG("Error", "Exception while forwarding event to CallbacksSignal")
+			}
+		}
+	}
+};
+
+template< typename A1, typename A2, typename A3 > class CallbacksSignal< void(A1, A2, A3) > : public CallbacksSignalBase< void(A1, A2, A3) > {
+public:
+	typedef CallbacksSignalBase< void(A1, A2, A3) > Base;
+	void fire( A1 a1, A2 a2, A3 a3 ) {
+		deliver( boost::atomic_load(&this->slots), a1, a2, a3 );
+	}
+	boost::function< void () > deferred( A1 a1, A2 a2, A3 a3 ) {
+		return boost::bind( &CallbacksSignal::deliver, boost::atomic_load(&this->slots), a1, a2, a3 );
+	}
+	static void deliver( typename Base::SlotListPtr cbs, A1 a1, A2 a2, A3 a3 ) {
+		for (typename Base::SlotList::const_iterator it = cbs->begin(); it != cbs->end(); ++it) {
+			try {
+				(**it)( a1, a2, a3 );
+			} catch (...) {
+				CVMWA_LOG("Error", "Exception while forwarding event to CallbacksSignal")
+			}
+		}
+	}
+};
+
+#endif /* end of include guard: CALLBACKS_SIGNAL_H */
@@ -197,5 +197,172 @@
  */
 #define 	PMAP_GROUP_SEPARATOR			"/"
 
+/**
+ * The maximum nesting of the JSON objects accepted by ParameterMap::fromJSONStream
+ */
+#define 	PMAP_JSON_MAX_DEPTH			32
+
+/**
+ * How long (in milliseconds) a write-behind LocalConfig waits for more
+ * changes before flushing them to the disk.
+ */
+#define 	LOCALCONFIG_FLUSH_DELAY			500
+
+/**
+ * After how many pending changes a write-behind LocalConfig will flush
+ * to the disk without waiting for the flush delay.
+ */
+#define 	LOCALCONFIG_FLUSH_CHANGES		32
+
+/**
+ * The size (in bytes) after which the journal of a journaled LocalConfig
+ * is compacted back to the snapshot file.
+ */
+#define 	LOCALCONFIG_JOURNAL_COMPACT		65536
+
+/**
+ * How often (in milliseconds) a watched LocalConfig checks for changes
+ * when inotify is not available. This is also the time it takes for the
+ * watch thread to notice that it should exit.
+ */
+#define 	LOCALCONFIG_WATCH_INTERVAL		500
+
+/**
+ * How long (in milliseconds) a watched LocalConfig waits for a burst
+ * of file events to settle before merging the changes.
+ */
+#define 	LOCALCONFIG_WATCH_SETTLE		50
+
+/**
+ * The initial number of index slots in the session store
+ */
+#define 	SESSIONSTORE_INITIAL_SLOTS		64
+
+/**
+ * The minimum space (in bytes) allocated for a record in the session store
+ */
+#define 	SESSIONSTORE_MIN_CAPACITY		512
+
+/**
+ * How long (in milliseconds) the changes of a session are kept in memory
+ * before they are written to the session store
+ */
+#define 	SESSIONSTORE_FLUSH_DELAY		500
+
+/**
+ * How often (in milliseconds) the session store is checked for changes
+ * done by other processes
+ */
+#define 	SESSIONSTORE_WATCH_INTERVAL		500
+
+/**
+ * The default maximum number of events waiting in the queue of
+ * a Callbacks instance in asynchronous mode
+ */
+#define 	CALLBACKS_QUEUE_DEPTH			256
+
+/**
+ * The number of threads that deliver the events of all the Callbacks
+ * instances in asynchronous mode
+ */
+#define 	CALLBACKS_DISPATCH_THREADS		2
+
+/**
+ * The minimum interval (in milliseconds) between two progress events
+ * emitted by the same tree of progress tasks
+ */
+#define 	PROGRESS_THROTTLE_TIMER			250
+
+/**
+ * The default maximum number of transfers that the shared download
+ * engine runs in parallel. Additional transfers are queued.
+ */
+#define 	DOWNLOAD_MAX_TRANSFERS			4
+
+/**
+ * The maximum time (in milliseconds) the download engine waits for
+ * socket activity before it checks for new or aborted transfers
+ */
+#define 	DOWNLOAD_POLL_TIMER				100
+
+/**
+ * How many bytes (per transfer) the download engine keeps for the thread that
+ * writes them. The transfer is paused while the thread is behind.
+ */
+#define 	DOWNLOAD_BUFFER_SIZE			1048576
+
+/**
+ * The default number of parallel byte ranges a large file is split to
+ * when the server supports range requests
+ */
+#define 	DOWNLOAD_SEGMENTS				4
+
+/**
+ * The maximum number of byte ranges requested at the same time from a server
+ */
+#define 	DOWNLOAD_RANGE_BATCH			16
+
+/**
+ * Files smaller than this (in bytes) are always downloaded as a single stream
+ */
+#define 	DOWNLOAD_SEGMENT_MIN_SIZE		16777216
+
+/**
+ * How often (in milliseconds) the state of a download in byte ranges is saved,
+ * so it can be resumed if the process is terminated
+ */
+#define 	DOWNLOAD_STATE_INTERVAL			2000
+
+/**
+ * How many bytes of a file are requested from every mirror in order to rank them,
+ * and how long (in seconds) to wait for them
+ */
+#define 	DOWNLOAD_PROBE_SIZE				65536
+#define 	DOWNLOAD_PROBE_TIMEOUT			10
+
+/**
+ * For how long (in milliseconds) the ranking of the mirrors is used before
+ * they are probed again
+ */
+#define 	DOWNLOAD_MIRROR_TTL				600000
+
+/**
+ * The default size limit (in megabytes) of the cached disk images. It can be
+ * overriden with the "cacheQuota" key of the global config.
+ */
+#define 	IMAGE_CACHE_QUOTA				20480
+
+/**
+ * The block manifest of an image is published at the URL of the image with this suffix.
+ * When a previous version of the image is in the cache, only the blocks that changed are
+ * downloaded. DELTA_BLOCK_SIZE is the block size used when creating a manifest, and at
+ * most DELTA_MAX_SEEDS cached images are scanned for blocks.
+ */
+#define 	DELTA_MANIFEST_SUFFIX			".blocks"
+#define 	DELTA_BLOCK_SIZE				16384
+#define 	DELTA_MAX_SEEDS					2
+
+/**
+ * The size of the blocks (in bytes) in which files are read while calculating their digest
+ */
+#define 	DIGEST_READ_BLOCK				1048576
+
+/**
+ * The alignment (in bytes) of the buffers in which files are read while calculating their digest
+ */
+#define 	DIGEST_BUFFER_ALIGN				4096
+
+/**
+ * How many blocks of a block-compressed (BGZF) image a decompression thread
+ * takes at a time
+ */
+#define 	DECOMPRESS_BATCH_BLOCKS			64
+
+/**
+ * How many downloaded blocks of a block-compressed (BGZF) image can wait for
+ * a decompression thread before the download waits too
+ */
+#define 	DECOMPRESS_QUEUE_BLOCKS			256
+
 
 #endif /* End of include guard COMMON_CONFIG_H */
\ No newline at end of file
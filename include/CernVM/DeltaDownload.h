@@ -0,0 +1,119 @@
+/**
+ * This file is part of CernVM Web API Plugin.
+ *
+ * CVMWebAPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CVMWebAPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CVMWebAPI. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Developed by Ioannis Charalampidis 2013
+ * Contact: <ioannis.charalampidis[at]cern.ch>
+ */
+
+#pragma once
+#ifndef DELTADOWNLOAD_H
+#define DELTADOWNLOAD_H
+
+#include <CernVM/Config.h>
+#include <CernVM/Utilities.h>
+#include <CernVM/CrashReport.h>
+#include <CernVM/DownloadProvider.h>
+#include <CernVM/ProgressFeedback.h>
+
+#include <string>
+#include <vector>
+
+#include <boost/cstdint.hpp>
+#include <boost/unordered_map.hpp>
+
+/**
+ * A block of the file described by the manifest
+ */
+struct DeltaBlock {
+    boost::uint32_t             weak;           // Rolling checksum of the block
+    std::string                 strong;         // SHA-256 digest of the block (binary)
+};
+
+/**
+ * The missing blocks of the file that have the same contents
+ */
+struct DeltaBlockGroup {
+    std::string                 strong;         // SHA-256 digest of the blocks (binary)
+    std::vector< size_t >       blocks;         // The indices of the blocks
+};
+
+/**
+ * Assembles a file from the blocks it shares with similar local files (ex. the previous
+ * version of a disk image) and downloads only the rest, in the way of zsync.
+ *
+ * The blocks of the file are described by a manifest that is published next to it:
+ *
+ *   size=<size of the file>
+ *   blocksize=<size of the blocks>
+ *   <weak checksum> <SHA-256>      (one line per block, in hex)
+ *
+ * The local files are scanned with a rolling checksum, so the blocks are found at any offset.
+ * The caller must still validate the checksum of the complete file.
+ */
+class DeltaDownload {
+public:
+
+    /**
+     * Prepare to assemble the specified file
+     */
+    DeltaDownload ( const std::string& destination );
+
+    /**
+     * Parse the manifest of the file and create the (empty) destination file.
+     * Returns HVE_NOT_VALIDATED if the manifest is not valid.
+     */
+    int                         open            ( const std::string& manifest );
+
+    /**
+     * Copy the blocks found in the specified file to the destination and return
+     * the number of bytes reused
+     */
+    long long                   seed            ( const std::string& file );
+
+    /**
+     * Download the blocks that are still missing with the specified provider
+     */
+    int                         fetch           ( const DownloadProviderPtr& provider, const std::string& url, const VariableTaskPtr& pf = VariableTaskPtr() );
+
+    /**
+     * The number of bytes that are still missing
+     */
+    long long                   missing         ( );
+
+    /**
+     * Create the manifest of the specified file
+     */
+    static int                  createManifest  ( const std::string& file, std::string * manifest, long blockSize = DELTA_BLOCK_SIZE );
+
+private:
+
+    // The length of the given block
+    long                        blockLength     ( size_t block );
+
+    std::string                 destination;
+    long long                   fileSize;
+    long                        blockSize;
+
+    // The blocks of the file, the ones we have, and the missing ones grouped by contents and
+    // indexed by weak checksum (a group is removed once its blocks are found)
+    std::vector< DeltaBlock >   blocks;
+    std::vector< bool >         have;
+    boost::unordered_map< boost::uint32_t, std::vector< DeltaBlockGroup > >  index;
+    std::vector< bool >         filter;
+
+};
+
+#endif /* end of include guard: DELTADOWNLOAD_H */
@@ -0,0 +1,143 @@
+/**
+ * This file is part of CernVM Web API Plugin.
+ *
+ * CVMWebAPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CVMWebAPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CVMWebAPI. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Developed by Ioannis Charalampidis 2013
+ * Contact: <ioannis.charalampidis[at]cern.ch>
+ */
+
+#pragma once
+#ifndef DOWNLOADPIPELINE_H
+#define DOWNLOADPIPELINE_H
+
+#include <CernVM/Utilities.h>
+#include <CernVM/CrashReport.h>
+
+#include <string>
+#include <deque>
+#include <fstream>
+#include <streambuf>
+
+#include <boost/thread.hpp>
+
+#include <openssl/evp.h>
+#include "zlib.h"
+
+/**
+ * A block of block-compressed (BGZF) data waiting to be decompressed
+ */
+struct DownloadPipelineBlock {
+    std::string                 data;           // The complete gzip member of the block
+    unsigned long long          output;         // Offset of the block contents in the output file
+    unsigned long               length;         // Size of the block contents
+};
+
+/**
+ * An output stream buffer that processes the downloaded data in a single pass:
+ * it calculates the SHA-256 checksum of the data as they arrive and writes them,
+ * optionally decompressed with gunzip, to the output file. The blocks of zeros
+ * are left as holes in the output file.
+ *
+ * Block-compressed (BGZF) data are detected from their first header, and each
+ * block is decompressed by a pool of threads as soon as it's complete.
+ *
+ * Use it with an std::ostream as the destination of DownloadProvider::downloadStream
+ * and call finish() when the download is completed.
+ */
+class DownloadPipeline : public std::streambuf {
+public:
+
+    /**
+     * Open the output file. If gunzip is true the data are decompressed before
+     * they are written to the file.
+     */
+    DownloadPipeline ( const std::string& output, bool gunzip );
+
+    /**
+     * Release the resources of the pipeline
+     */
+    virtual ~DownloadPipeline ( );
+
+    /**
+     * Complete the processing, close the output file and return the SHA-256
+     * checksum of the data (before decompression) as a hex string. Returns
+     * HVE_IO_ERROR if the data could not be written or decompressed.
+     */
+    int                         finish          ( std::string * checksum );
+
+    /**
+     * The number of bytes written to the pipeline
+     */
+    unsigned long long          size            ( ) { return total; };
+
+    /**
+     * Return false if the data could not be written or decompressed
+     */
+    bool                        good            ( ) { return !failed; };
+
+protected:
+
+    /**
+     * Overrides from std::streambuf
+     */
+    virtual std::streamsize     xsputn          ( const char * s, std::streamsize n );
+    virtual int_type            overflow        ( int_type c );
+    virtual pos_type            seekoff         ( off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which );
+
+private:
+
+    // The output file
+    std::string                 filename;
+    std::ofstream               out;
+
+    // The checksum and decompression state
+    EVP_MD_CTX *                mdctx;
+    z_stream                    zs;
+    bool                        gunzip;
+    bool                        streamEnd;
+
+    // The format of the compressed data, detected from the first header
+    enum { FORMAT_UNKNOWN, FORMAT_GZIP, FORMAT_BGZF } format;
+
+    // Inflate the data of a (non-BGZF) compressed stream
+    void                        inflateStream   ( const char * s, size_t n );
+
+    // Dispatch the complete BGZF blocks of the pending data to the workers
+    void                        dispatchBlocks  ( );
+
+    // Wait for the workers to decompress all the blocks and stop them
+    void                        stopWorkers     ( bool discard );
+
+    // Worker thread that decompresses BGZF blocks to the output file
+    void                        inflateBlocks   ( );
+
+    // The compressed data of the incomplete block, and the blocks waiting for a worker
+    std::string                 pending;
+    std::deque< DownloadPipelineBlock > queue;
+    boost::thread_group         workers;
+    boost::mutex                queueMutex;
+    boost::condition_variable   queueCond;
+    size_t                      busy;
+    bool                        stopping;
+    bool                        workerFailed;
+
+    // Status
+    unsigned long long          total;
+    unsigned long long          written;
+    bool                        failed;
+
+};
+
+#endif /* end of include guard: DOWNLOADPIPELINE_H */
@@ -22,6 +22,7 @@
 #ifndef DOWNLOADPROVIDERS_H
 #define DOWNLOADPROVIDERS_H
 
+#include <CernVM/Config.h>
 #include <CernVM/Utilities.h>
 #include <CernVM/ProgressFeedback.h>
 #include <CernVM/CrashReport.h>
@@ -30,6 +31,10 @@
 #include <iostream>
 #include <sstream>
 #include <fstream>
+#include <list>
+#include <deque>
+#include <map>
+#include <vector>
 
 #include <boost/bind.hpp>
 #include <boost/function.hpp>
@@ -38,22 +43,30 @@
 #include <boost/shared_array.hpp>
 #include <boost/tuple/tuple.hpp>
 #include <boost/enable_shared_from_this.hpp>
+#include <boost/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
 
 #include <curl/curl.h>
 #include <curl/easy.h>
-
-/**
- * Throttle timer delay which defines how frequetly the progress events will be fired
- */
-#define DP_THROTTLE_TIMER   250
+#include <curl/multi.h>
 
 /**
  * Forward decleration of pointer types
  */
 class DownloadProvider; 
 class CURLProvider; 
+class CURLTransfer;
+class CURLMultiEngine;
+class CURLMultiProvider;
+class DownloadMirrors;
+struct DownloadRange;
 typedef boost::shared_ptr< DownloadProvider >       DownloadProviderPtr;
 typedef boost::shared_ptr< CURLProvider >           CURLProviderPtr;
+typedef boost::shared_ptr< CURLTransfer >           CURLTransferPtr;
+typedef boost::shared_ptr< CURLMultiEngine >        CURLMultiEnginePtr;
+typedef boost::shared_ptr< CURLMultiProvider >      CURLMultiProviderPtr;
+typedef boost::shared_ptr< DownloadMirrors >        DownloadMirrorsPtr;
 
 /**
  * Base class of the download provider
@@ -65,15 +78,24 @@ public:
     DownloadProvider()          { };
     virtual ~DownloadProvider() { };
     
-    // Public interface
+    // Public interface. If offset is not zero, downloadStream continues a previous download
+    // from that byte, or returns HVE_NOT_SUPPORTED without writing anything if it can't.
     virtual int                 downloadFile( const std::string &URL, const std::string &destination, const VariableTaskPtr& pf = VariableTaskPtr() ) = 0;
     virtual int                 downloadText( const std::string &URL, std::string *buffer, const VariableTaskPtr& pf = VariableTaskPtr() ) = 0;
+    virtual int                 downloadStream( const std::string &URL, std::ostream *stream, const VariableTaskPtr& pf = VariableTaskPtr(), long long offset = 0 ) = 0;
     virtual DownloadProviderPtr clone() = 0;
 
+    // Download the given byte ranges (first and last byte, inclusive) of the file to the same offsets
+    // of the existing destination file. Returns HVE_NOT_SUPPORTED if the provider can't do that.
+    virtual int                 downloadRanges( const std::string &URL, const std::string &destination, const std::vector< std::pair< long long, long long > >& ranges, const VariableTaskPtr& pf = VariableTaskPtr() );
+
     // Abort flag
     virtual int                 abort() = 0;
     virtual int                 abortAll() = 0;
 
+    // Define the mirrors of the URLs starting with origin (providers without mirror support ignore them)
+    virtual void                setMirrors( const std::string&, const std::vector< std::string >& ) { };
+
     // Get/set system default download provider
     static DownloadProviderPtr  Default();
     static void                 setDefault( const DownloadProviderPtr& provider );
@@ -91,7 +113,7 @@ class CURLProvider : public DownloadProvider {
 public:
 
     // Constructor & Destructor
-    CURLProvider() : DownloadProvider(), pf(), fStream(), sStream() {
+    CURLProvider() : DownloadProvider(), pf(), oStream(NULL), fStream(), sStream() {
         CRASH_REPORT_BEGIN;
 
         // Initialize global CURL
@@ -124,6 +146,7 @@ public:
     // Curl I/O
     virtual int                 downloadFile( const std::string &URL, const std::string &destination, const VariableTaskPtr& pf = VariableTaskPtr()  ) ;
     virtual int                 downloadText( const std::string &URL, std::string *buffer, const VariableTaskPtr& pf = VariableTaskPtr() );
+    virtual int                 downloadStream( const std::string &URL, std::ostream *stream, const VariableTaskPtr& pf = VariableTaskPtr(), long long offset = 0 );
     virtual DownloadProviderPtr clone();
     virtual int                 abort();
     virtual int                 abortAll();
@@ -135,9 +158,287 @@ public:
     bool                        abortFlag;
     bool                        abortPersistsFlag;
     int                         operationInstances;
+    std::ostream                * oStream;
     std::ofstream               fStream;
     std::ostringstream          sStream;
     
 };
 
+/**
+ * The state of a single transfer in the CURLMultiEngine
+ */
+class CURLTransfer {
+public:
+
+    CURLTransfer( const void * owner, std::ostream * stream, const VariableTaskPtr& pf ) 
+        : curl(NULL), owner(owner), stream(stream), pf(pf), maxStreamSize(0), abortFlag(false), completed(false), result(CURLE_OK),
+          expected(-1), received(0), rangeTotal(-1), totalTime(0), groupReceived(NULL), groupSize(0), validator(), ranged(false), resumeFrom(0), rangeIgnored(false), headers(NULL),
+          engine(NULL), accepted(0), chunks(), buffered(0), paused(false) { };
+
+    ~CURLTransfer() {
+        if (headers != NULL) curl_slist_free_all(headers);
+    };
+
+    /**
+     * Request only the given byte range. Any response other than 206 (Partial Content)
+     * is then rejected before writing anything (see rangeIgnored).
+     */
+    void setRange( const std::string& range ) {
+        curl_easy_setopt(curl, CURLOPT_RANGE, range.c_str());
+        ranged = true;
+    };
+
+    CURL                        * curl;
+    const void                  * owner;
+    std::ostream                * stream;
+    VariableTaskPtr             pf;
+    long                        maxStreamSize;
+    volatile bool               abortFlag;
+    bool                        completed;
+    CURLcode                    result;
+
+    // Number of bytes expected (-1 if unknown) and received (written to the stream)
+    long long                   expected;
+    long long                   received;
+
+    // Total size reported by the Content-Range header (-1 if missing)
+    long long                   rangeTotal;
+
+    // The duration of the transfer in seconds
+    double                      totalTime;
+
+    // Progress shared by all the segments of a file
+    long long                   * groupReceived;
+    long long                   groupSize;
+
+    // The ETag (or Last-Modified) header of the response
+    std::string                 validator;
+
+    // If a byte range was requested, the offset a resumed transfer starts from,
+    // and if the server ignored the range
+    bool                        ranged;
+    long long                   resumeFrom;
+    bool                        rangeIgnored;
+
+    // Additional request headers
+    struct curl_slist           * headers;
+
+    // The engine running the transfer and the number of bytes it has accepted
+    CURLMultiEngine             * engine;
+    long long                   accepted;
+
+    // The data received that the waiting thread has not written yet, and if the
+    // transfer is paused until it does (guarded by the mutex of the engine)
+    std::deque< std::string >   chunks;
+    size_t                      buffered;
+    bool                        paused;
+
+};
+
+/**
+ * A download engine that runs the transfers of all the download providers
+ * on a single curl multi handle, driven by one event loop thread.
+ *
+ * The connections, the DNS cache and the TLS sessions are reused across the
+ * transfers and at most maxTransfers of them are running at the same time.
+ *
+ * The event loop only copies the received data. It's written to the streams
+ * (and the progress is updated) by the thread waiting in performAll, so a slow
+ * stream does not hold back the transfers of the other threads.
+ */
+class CURLMultiEngine {
+public:
+
+    CURLMultiEngine( int maxTransfers = DOWNLOAD_MAX_TRANSFERS );
+
+    /**
+     * Abort the running transfers and stop the event loop thread
+     */
+    ~CURLMultiEngine();
+
+    /**
+     * Return the engine shared by all the sessions
+     */
+    static CURLMultiEnginePtr   Default();
+
+    /**
+     * Run the specified transfer and wait for it to complete
+     */
+    CURLcode                    perform( const CURLTransferPtr& transfer );
+
+    /**
+     * Run the specified transfers in parallel and wait for all of them to complete.
+     * The written function (if any) is called every time received data were written.
+     */
+    void                        performAll( const std::vector< CURLTransferPtr >& transfers, const boost::function< void () >& written = boost::function< void () >() );
+
+    /**
+     * Abort all the transfers started by the specified owner
+     */
+    void                        abort( const void * owner );
+
+    /**
+     * Change the maximum number of parallel transfers
+     */
+    void                        setMaxTransfers( int maxTransfers );
+
+    /**
+     * Return the number of running and queued transfers
+     */
+    size_t                      activeTransfers();
+    size_t                      queuedTransfers();
+
+    /**
+     * [Internal] Keep the data received by a transfer for the waiting thread.
+     * Returns false if the buffer of the transfer is full, in which case the
+     * transfer is paused until the thread writes it.
+     */
+    bool                        deliver( CURLTransfer * transfer, const char * data, size_t length );
+
+private:
+
+    // The event loop thread
+    void                        threadLoop();
+
+    // Wake up the event loop if it's waiting for socket activity
+    void                        wakeup();
+
+    CURLM                       * multi;
+    CURLSH                      * share;
+    int                         maxTransfers;
+
+    std::list< CURLTransferPtr >            pending;
+    std::map< CURL *, CURLTransferPtr >     active;
+    boost::mutex                mutex;
+    boost::condition_variable   workCond;
+    boost::condition_variable   doneCond;
+    boost::thread               * thread;
+    bool                        exiting;
+
+};
+
+/**
+ * The mirrors of the download origins and their ranking.
+ *
+ * A URL that starts with an origin can be fetched from any of the mirrors of the origin
+ * (or the origin itself) by replacing that prefix. The mirrors can also be local
+ * directories (file:// URLs). They are ranked by the time they take to serve the first
+ * bytes of a file and the ranking is kept for DOWNLOAD_MIRROR_TTL milliseconds.
+ */
+class DownloadMirrors {
+public:
+
+    DownloadMirrors() : mirrors(), ranking(), rankingTime(), mutex() { };
+
+    /**
+     * Return the mirror set shared by all the download providers
+     */
+    static DownloadMirrorsPtr   Default();
+
+    /**
+     * Define the mirrors of an origin (an empty list removes them)
+     */
+    void                        set( const std::string& origin, const std::vector< std::string >& mirrors );
+
+    /**
+     * Find the origin of the URL and return the bases that can serve it, ranked if the
+     * ranking is still valid. Returns false if the URL has no mirrors.
+     */
+    bool                        lookup( const std::string& url, std::string * origin, std::vector< std::string > * bases, bool * ranked );
+
+    /**
+     * Store the ranking of the bases of an origin
+     */
+    void                        rank( const std::string& origin, const std::vector< std::string >& bases );
+
+    /**
+     * Move a base that failed to the end of the ranking
+     */
+    void                        demote( const std::string& origin, const std::string& base );
+
+private:
+
+    std::map< std::string, std::vector< std::string > >     mirrors;
+    std::map< std::string, std::vector< std::string > >     ranking;
+    std::map< std::string, long >                           rankingTime;
+    boost::mutex                mutex;
+
+};
+
+/**
+ * A byte range of a file download and the number of bytes completed in it
+ */
+struct DownloadRange {
+    long long   first;
+    long long   last;
+    long long   done;
+};
+
+/**
+ * Download provider that uses the shared CURLMultiEngine. The state of every
+ * transfer is kept apart, so the same instance can be used by many threads.
+ *
+ * Files of at least segmentMinSize bytes are downloaded in parallel byte ranges
+ * when the server supports range requests. The progress of an interrupted file
+ * download is kept in a "<destination>.state" file next to it, and the next
+ * download to the same destination continues from there if the file did not
+ * change on the server.
+ *
+ * URLs with mirrors are fetched from the fastest one. If it fails during the transfer,
+ * the download continues from the next one with a range request.
+ */
+class CURLMultiProvider : public DownloadProvider {
+public:
+
+    // Constructor & Destructor
+    CURLMultiProvider( const CURLMultiEnginePtr& engine = CURLMultiEngine::Default(), const DownloadMirrorsPtr& mirrors = DownloadMirrors::Default() ) 
+        : DownloadProvider(), engine(engine), mirrors(mirrors), abortPersistsFlag(false), segments(DOWNLOAD_SEGMENTS), segmentMinSize(DOWNLOAD_SEGMENT_MIN_SIZE) { };
+    virtual ~CURLMultiProvider() { };
+
+    // Curl I/O
+    virtual int                 downloadFile( const std::string &URL, const std::string &destination, const VariableTaskPtr& pf = VariableTaskPtr()  ) ;
+    virtual int                 downloadText( const std::string &URL, std::string *buffer, const VariableTaskPtr& pf = VariableTaskPtr() );
+    virtual int                 downloadStream( const std::string &URL, std::ostream *stream, const VariableTaskPtr& pf = VariableTaskPtr(), long long offset = 0 );
+    virtual int                 downloadRanges( const std::string &URL, const std::string &destination, const std::vector< std::pair< long long, long long > >& ranges, const VariableTaskPtr& pf = VariableTaskPtr() );
+    virtual DownloadProviderPtr clone();
+    virtual int                 abort();
+    virtual int                 abortAll();
+    virtual void                setMirrors( const std::string& origin, const std::vector< std::string >& mirrors );
+
+    // Configure the segmented downloads (with segments <= 1 files are fetched as a single range)
+    void                        setSegments( int segments, long long minSize = DOWNLOAD_SEGMENT_MIN_SIZE );
+
+private:
+
+    // Create the state of a transfer to the given stream
+    CURLTransferPtr             prepare( const std::string &URL, std::ostream *stream, const VariableTaskPtr& pf, long timeout );
+
+    // Run a transfer to the given stream on the engine
+    int                         transfer( const std::string &URL, std::ostream *stream, const VariableTaskPtr& pf, long timeout, long long offset = 0 );
+
+    // Download (or resume) the file in ranges. Returns HVE_NOT_SUPPORTED if ranges can't be used.
+    int                         downloadSegmented( const std::string &URL, const std::string &destination, const VariableTaskPtr& pf );
+
+    // Fetch the missing bytes of the ranges to the destination file from the first URL, and the ones that failed
+    // from the next. The validator (if any) is sent in an If-Range header to the first URL only. The progress of
+    // the ranges is passed to the checkpoint function (if any) every DOWNLOAD_STATE_INTERVAL and when interrupted.
+    int                         fetchRanges( const std::vector< std::string >& urls, const std::string& origin, const std::vector< std::string >& bases,
+                                             const std::string &destination, std::vector< DownloadRange > * ranges, const std::string& validator,
+                                             long long * groupReceived, long long groupSize, const VariableTaskPtr& pf,
+                                             const boost::function< void ( const std::vector< DownloadRange >& ) >& checkpoint );
+
+    // Return the URLs the file can be downloaded from, fastest first, and the mirror bases they use
+    std::vector< std::string >  candidates( const std::string &URL, std::string * origin, std::vector< std::string > * bases );
+
+    // Rank the bases of an origin by the time they take to serve the first bytes of the given path
+    void                        probeMirrors( const std::string &origin, const std::string &path, std::vector< std::string > * bases );
+
+    CURLMultiEnginePtr          engine;
+    DownloadMirrorsPtr          mirrors;
+    bool                        abortPersistsFlag;
+    int                         segments;
+    long long                   segmentMinSize;
+
+};
+
 #endif /* end of include guard: DOWNLOADPROVIDERS_H */
@@ -23,6 +23,8 @@
 #define HVENV_H
 
 #include <boost/enable_shared_from_this.hpp>
+#include <boost/function.hpp>
+#include <boost/thread/mutex.hpp>
 #include <boost/regex.hpp> 
 
 #include <CernVM/Config.h>
@@ -31,6 +33,7 @@
 
 #include <CernVM/ProgressFeedback.h>
 #include <CernVM/DownloadProvider.h>
+#include <CernVM/ImageCache.h>
 #include <CernVM/Utilities.h>
 #include <CernVM/CrashReport.h>
 #include <CernVM/ParameterMap.h>
@@ -265,7 +268,7 @@ public:
         
         // Populate local variables
         this->uuid = parameters->get("uuid");
-        this->state = parameters->getNum<int>("state", 0);
+        this->state = ston<int>( parameters->get("state", "0") );
         this->hypervisor = hv;
 
         CRASH_REPORT_END;
@@ -420,6 +423,12 @@ public:
 };
 
 
+/**
+ * A download in progress, shared by all the callers that request the same file
+ */
+class HVDownloadFlight;
+typedef boost::shared_ptr< HVDownloadFlight >                           HVDownloadFlightPtr;
+
 /**
  * Overloadable base hypervisor class
  */
@@ -450,6 +459,11 @@ public:
      */
     std::string             dirDataCache;
 
+    /**
+     * The cache of the downloaded images in dirDataCache
+     */
+    ImageCachePtr           imageCache;
+
     /**
      * HACK: The last STDERR buffer from the exec() function
      */
@@ -557,21 +571,23 @@ public:
 
     /**
      * Download an arbitrary file and validate it against a checksum
-     * file, both provided as URLs
+     * file, both provided as URLs. If an owner is specified (ex. the session UUID), the
+     * cached image is marked as used by it before it's returned (see ImageCache::acquire).
      */
-    int                     downloadFileURL     ( const std::string & fileURL, const std::string & checksumURL, std::string * filename, const FiniteTaskPtr & pf = FiniteTaskPtr(), const int retries = 2, const DownloadProviderPtr & customDownloadProvider = DownloadProviderPtr() );
+    int                     downloadFileURL     ( const std::string & fileURL, const std::string & checksumURL, std::string * filename, const FiniteTaskPtr & pf = FiniteTaskPtr(), const int retries = 2, const DownloadProviderPtr & customDownloadProvider = DownloadProviderPtr(), const std::string & owner = "" );
 
     /**
      * Download an arbitrary file and validate it against a checksum
-     * string specified in parameter
+     * string specified in parameter (see downloadFileURL for the owner)
      */
-    int                     downloadFile        ( const std::string & fileURL, const std::string & checksumString, std::string * filename, const FiniteTaskPtr & pf = FiniteTaskPtr(), const int retries = 2, const DownloadProviderPtr & customDownloadProvider = DownloadProviderPtr() );
+    int                     downloadFile        ( const std::string & fileURL, const std::string & checksumString, std::string * filename, const FiniteTaskPtr & pf = FiniteTaskPtr(), const int retries = 2, const DownloadProviderPtr & customDownloadProvider = DownloadProviderPtr(), const std::string & owner = "" );
     
     /**
      * Download a gzip-compressed arbitrary file and validate it's extracted
-     * contents against a checksum string specified in parameter
+     * contents against a checksum string specified in parameter (see downloadFileURL
+     * for the owner)
      */
-    int                     downloadFileGZ      ( const std::string & fileURL, const std::string & checksumString, std::string * filename, const FiniteTaskPtr & pf = FiniteTaskPtr(), const int retries = 2, const DownloadProviderPtr & customDownloadProvider = DownloadProviderPtr() );
+    int                     downloadFileGZ      ( const std::string & fileURL, const std::string & checksumString, std::string * filename, const FiniteTaskPtr & pf = FiniteTaskPtr(), const int retries = 2, const DownloadProviderPtr & customDownloadProvider = DownloadProviderPtr(), const std::string & owner = "" );
 
     /**
      * Download a specific version of CernVM and return the path where it was saved.
@@ -583,7 +599,7 @@ public:
      * Internally it uses downloadFileURL in order to download the final file in place.
      *
      */
-    int                     cernVMDownload      ( std::string& version, const std::string flavor, const std::string machineArch, std::string * toFilename, const FiniteTaskPtr & pf, const int retries, const DownloadProviderPtr& downloadProvider );
+    int                     cernVMDownload      ( std::string& version, const std::string flavor, const std::string machineArch, std::string * toFilename, const FiniteTaskPtr & pf, const int retries, const DownloadProviderPtr& downloadProvider, const std::string & owner = "" );
 
     /**
      * Return the cached disk image for the specified CernVM version
@@ -637,6 +653,28 @@ protected:
     int                     sessionID;
     DownloadProviderPtr     downloadProvider;
     UserInteractionPtr      userInteraction;
+
+    /**
+     * The downloads in progress, by the URL and the checksum of the file
+     */
+    std::map< std::string, HVDownloadFlightPtr > downloads;
+    boost::mutex            downloadsMutex;
+
+    /**
+     * Run the specified download function, unless an identical download is already
+     * in progress, in which case wait for it and share it's result. Every caller
+     * gets it's own progress feed under the specified progress object.
+     */
+    int                     sharedDownload      ( const std::string & key, std::string * filename, const FiniteTaskPtr & pf, 
+                                                  const boost::function< int ( std::string *, const FiniteTaskPtr & ) > & download );
+
+    /**
+     * The implementation of downloadFileURL, downloadFile and downloadFileGZ
+     */
+    int                     _downloadFileURL    ( const std::string & fileURL, const std::string & checksumURL, std::string * filename, const FiniteTaskPtr & pf, const int retries, const DownloadProviderPtr & customDownloadProvider, const std::string & owner );
+    int                     _downloadFile       ( const std::string & fileURL, const std::string & checksumString, std::string * filename, const FiniteTaskPtr & pf, const int retries, const DownloadProviderPtr & customDownloadProvider, const std::string & owner );
+    int                     _downloadFileGZ     ( const std::string & fileURL, const std::string & checksumString, std::string * filename, const FiniteTaskPtr & pf, const int retries, const DownloadProviderPtr & customDownloadProvider, const std::string & owner );
+
 };
 
 //////////////////////////////////////////////
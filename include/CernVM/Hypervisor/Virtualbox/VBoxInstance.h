@@ -32,6 +32,7 @@
 #include "CernVM/ProgressFeedback.h"
 #include "CernVM/CrashReport.h"
 #include "CernVM/LocalConfig.h"
+#include "CernVM/SessionStore.h"
 #include "CernVM/DomainKeystore.h"
 
 #include <boost/regex.hpp>
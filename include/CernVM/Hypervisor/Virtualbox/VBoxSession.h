@@ -54,70 +54,73 @@ public:
     VBoxSession( ParameterMapPtr param, HVInstancePtr hv ) : SimpleFSM(), HVSession(param, hv), execConfig() {
         CRASH_REPORT_BEGIN;
 
-        FSM_REGISTRY(1,             // Entry point is on '1'
-        {
+        // The FSM graph is validated at compile-time (see FSMStaticGraph)
+        typedef FSMStaticGraph< 1,                                  // Entry point is on '1'
+        FSMNodes<
 
             // Target states
-            FSM_STATE(1, 100);      // Entry point
-            FSM_STATE(2, 102,112);  // Error
-            FSM_STATE(3, 104);      // Destroyed
-            FSM_STATE(4, 105,108);  // Power off
-            FSM_STATE(5, 107,211);  // Saved
-            FSM_STATE(6, 109,111);  // Paused
-            FSM_STATE(7, 110,106);  // Running
+            FSM_STATIC_STATE(1, 100),                               // Entry point
+            FSM_STATIC_STATE(2, 102,112),                           // Error
+            FSM_STATIC_STATE(3, 104),                               // Destroyed
+            FSM_STATIC_STATE(4, 105,108),                           // Power off
+            FSM_STATIC_STATE(5, 107,211),                           // Saved
+            FSM_STATIC_STATE(6, 109,111),                           // Paused
+            FSM_STATIC_STATE(7, 110,106),                           // Running
 
             // 100: INITIALIZE HYPERVISOR
-            FSM_HANDLER(100, &VBoxSession::Initialize,              101);
+            FSM_STATIC_HANDLER(VBoxSession, 100, Initialize,            101),
 
             // 101: UPDATE SESSION STATE FROM THE HYPERVISOR
-            FSM_HANDLER(101, &VBoxSession::UpdateSession,           2,3,4,5,6,7);
+            FSM_STATIC_HANDLER(VBoxSession, 101, UpdateSession,         2,3,4,5,6,7),
 
             // 102: HANDLE ERROR SEQUENCE
-            FSM_HANDLER(102, &VBoxSession::HandleError,             103);
-                FSM_HANDLER(103, &VBoxSession::CureError,           101);       // Try to recover error and recheck state
+            FSM_STATIC_HANDLER(VBoxSession, 102, HandleError,           103),
+                FSM_STATIC_HANDLER(VBoxSession, 103, CureError,         101),       // Try to recover error and recheck state
 
             // 104: CREATE SEQUENCE
-            FSM_HANDLER(104, &VBoxSession::CreateVM,                4);         // Create new VM
+            FSM_STATIC_HANDLER(VBoxSession, 104, CreateVM,              4),         // Create new VM
 
             // 105: DESTROY SEQUENCE
-            FSM_HANDLER(105, &VBoxSession::ReleaseVMScratch,        207);       // Release Scratch storage
-                FSM_HANDLER(207, &VBoxSession::ReleaseVMBoot,       208);       // Release Boot Media
-                FSM_HANDLER(208, &VBoxSession::DestroyVM,           3);         // Destroy VM
+            FSM_STATIC_HANDLER(VBoxSession, 105, ReleaseVMScratch,      207),       // Release Scratch storage
+                FSM_STATIC_HANDLER(VBoxSession, 207, ReleaseVMBoot,     208),       // Release Boot Media
+                FSM_STATIC_HANDLER(VBoxSession, 208, DestroyVM,         3),         // Destroy VM
 
             // 106: POWEROFF SEQUENCE
-            FSM_HANDLER(106, &VBoxSession::PoweroffVM,              209);       // Power off the VM
-                FSM_HANDLER(209, &VBoxSession::ReleaseVMAPI,        4);         // Release the VM API media
+            FSM_STATIC_HANDLER(VBoxSession, 106, PoweroffVM,            209),       // Power off the VM
+                FSM_STATIC_HANDLER(VBoxSession, 209, ReleaseVMAPI,      4),         // Release the VM API media
 
             // 211: CHECK VMAPI STATE
-            FSM_HANDLER(211, &VBoxSession::CheckVMAPI,              206);       // Check if we can resume from current VMAPI Data of we should restart
+            FSM_STATIC_HANDLER(VBoxSession, 211, CheckVMAPI,            206),       // Check if we can resume from current VMAPI Data of we should restart
 
             // 107: DISCARD STATE SEQUENCE
-            FSM_HANDLER(107, &VBoxSession::DiscardVMState,          209);       // Discard saved state of the VM
-                FSM_HANDLER(209, &VBoxSession::ReleaseVMAPI,        4);         // Release the VM API media
+            FSM_STATIC_HANDLER(VBoxSession, 107, DiscardVMState,        209),       // Discard saved state of the VM (continues to 209)
 
             // 108: START SEQUENCE
-            FSM_HANDLER(108, &VBoxSession::PrepareVMBoot,           210);       // Prepare start parameters
-                FSM_HANDLER(210, &VBoxSession::ConfigNetwork,       201);       // Configure the network devices
-                FSM_HANDLER(201, &VBoxSession::ConfigureVM,         202);       // Configure VM
-                FSM_HANDLER(202, &VBoxSession::DownloadMedia,       203);       // Download required media files
-                FSM_HANDLER(203, &VBoxSession::ConfigureVMBoot,     204);       // Configure Boot media
-                FSM_HANDLER(204, &VBoxSession::ConfigureVMScratch,  205);       // Configure Scratch storage
-                FSM_HANDLER(205, &VBoxSession::ConfigureVMAPI,      206);       // Configure API Disks
-                FSM_HANDLER(206, &VBoxSession::StartVM,             7);         // Launch the VM
+            FSM_STATIC_HANDLER(VBoxSession, 108, PrepareVMBoot,         210),       // Prepare start parameters
+                FSM_STATIC_HANDLER(VBoxSession, 210, ConfigNetwork,     201),       // Configure the network devices
+                FSM_STATIC_HANDLER(VBoxSession, 201, ConfigureVM,       202),       // Configure VM
+                FSM_STATIC_HANDLER(VBoxSession, 202, DownloadMedia,     203),       // Download required media files
+                FSM_STATIC_HANDLER(VBoxSession, 203, ConfigureVMBoot,   204),       // Configure Boot media
+                FSM_STATIC_HANDLER(VBoxSession, 204, ConfigureVMScratch,205),       // Configure Scratch storage
+                FSM_STATIC_HANDLER(VBoxSession, 205, ConfigureVMAPI,    206),       // Configure API Disks
+                FSM_STATIC_HANDLER(VBoxSession, 206, StartVM,           7),         // Launch the VM
 
             // 109: SAVE STATE SEQUENCE
-            FSM_HANDLER(109, &VBoxSession::SaveVMState,             5);         // Save VM state
+            FSM_STATIC_HANDLER(VBoxSession, 109, SaveVMState,           5),         // Save VM state
 
             // 110: PAUSE SEQUENCE
-            FSM_HANDLER(110, &VBoxSession::PauseVM,                 6);         // Pause VM
+            FSM_STATIC_HANDLER(VBoxSession, 110, PauseVM,               6),         // Pause VM
 
             // 111: PAUSE SEQUENCE
-            FSM_HANDLER(111, &VBoxSession::ResumeVM,                7);         // Resume VM
+            FSM_STATIC_HANDLER(VBoxSession, 111, ResumeVM,              7),         // Resume VM
 
             // 112: FATAL ERROR HANDLING
-            FSM_HANDLER(112, &VBoxSession::FatalErrorSink,          0);         // Fatal Error Sink
+            FSM_STATIC_HANDLER(VBoxSession, 112, FatalErrorSink,        0)          // Fatal Error Sink
 
-        });
+        > > VBoxSessionFSM;
+
+        // Install the FSM graph
+        FSMRegistryStatic< VBoxSessionFSM >();
 
         // Reset error states
         errorCount = 0;
@@ -127,6 +130,10 @@ public:
         lastMachineInfoTimestamp = 0;
         isAborting = false;
 
+        // Deliver the events from the shared dispatcher threads, so
+        // the FSM is not stalled by slow handlers
+        setAsync( true );
+
         CRASH_REPORT_END;
     }
 
@@ -0,0 +1,167 @@
+/**
+ * This file is part of CernVM Web API Plugin.
+ *
+ * CVMWebAPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CVMWebAPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CVMWebAPI. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Developed by Ioannis Charalampidis 2013
+ * Contact: <ioannis.charalampidis[at]cern.ch>
+ */
+
+#pragma once
+#ifndef IMAGECACHE_H
+#define IMAGECACHE_H
+
+#include <CernVM/Config.h>
+#include <CernVM/Utilities.h>
+#include <CernVM/CrashReport.h>
+#include <CernVM/LocalConfig.h>
+
+#include <string>
+#include <set>
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/interprocess/sync/file_lock.hpp>
+
+/**
+ * Shared pointer for the ImageCache class
+ */
+class ImageCache;
+typedef boost::shared_ptr< ImageCache >                                 ImageCachePtr;
+
+/**
+ * An image in the cache
+ */
+struct ImageCacheEntry {
+    std::string                 file;           // Full path to the image
+    long long                   size;           // Size of the image in bytes
+    long                        used;           // Value of the use clock the last time it was used
+    std::set< std::string >     refs;           // The sessions that use the image
+};
+
+/**
+ * A cache of the downloaded disk images, keyed by the SHA-256 checksum of their contents.
+ *
+ * The images are registered in an index (stored in the "imagecache" runtime config) that
+ * is kept in memory, so looking up an image never scans the cache directory. The sessions
+ * reference the images they use and, when the total size exceeds the quota, the least
+ * recently used images that are not referenced by any session are removed.
+ *
+ * The index is shared by all the processes, so every change is done while holding
+ * a lock file in the cache directory, after picking up the changes of the others.
+ */
+class ImageCache {
+public:
+
+    /**
+     * Create a cache on the specified directory, using the given map as index
+     */
+    ImageCache ( const std::string& dir, const LocalConfigPtr& index, long quotaMB = IMAGE_CACHE_QUOTA );
+
+    /**
+     * Destroy the cache
+     */
+    ~ImageCache ( );
+
+    /**
+     * Return the path of the image with the specified checksum, or an empty string
+     * if it's not in the cache. If an owner is specified, the image is also marked
+     * as used by it (see acquire).
+     */
+    std::string                 lookup          ( const std::string& checksum, const std::string& owner = "" );
+
+    /**
+     * Return the path where a new image with the specified checksum and name should be stored,
+     * or an empty string if the checksum is not a valid SHA-256 digest
+     */
+    std::string                 allocate        ( const std::string& checksum, const std::string& name );
+
+    /**
+     * Return the paths of the cached images with the same name as the given one apart
+     * from the numbers in it (ex. the other versions of an image), most recently used first
+     */
+    std::vector< std::string >  similar         ( const std::string& name );
+
+    /**
+     * Register a downloaded image with the specified checksum and apply the quota.
+     * If an owner is specified, the image is also marked as used by it (see acquire),
+     * so it cannot be evicted before the owner gets to use it.
+     */
+    bool                        insert          ( const std::string& checksum, const std::string& file, const std::string& owner = "" );
+
+    /**
+     * Mark the specified image as used by the given owner (ex. the session UUID).
+     * Referenced images are never evicted.
+     */
+    bool                        acquire         ( const std::string& file, const std::string& owner );
+
+    /**
+     * Release all the images used by the given owner
+     */
+    void                        release         ( const std::string& owner );
+
+    /**
+     * Change the quota (in megabytes) and evict images if needed
+     */
+    void                        setQuota        ( long quotaMB );
+
+    /**
+     * Return the total size of the images in the cache (in bytes)
+     */
+    long long                   size            ( );
+
+    /**
+     * Evict the least recently used, unreferenced images until the cache fits in the quota.
+     * The image with the checksum specified in keep is not evicted. Returns the number of
+     * images removed.
+     */
+    int                         evict           ( const std::string& keep = "" );
+
+private:
+
+    // Pick up the changes of the other processes (with the lock acquired)
+    void                        _sync           ( );
+
+    // Reload the index from the disk
+    void                        _reload         ( );
+
+    // Store an entry to the index
+    void                        _store          ( const std::string& checksum, const ImageCacheEntry& entry );
+
+    // Remove an entry from the index and the disk
+    void                        _remove         ( const std::string& checksum );
+
+    // Evict images (with the mutex acquired)
+    int                         _evict          ( const std::string& keep );
+
+    // Advance the use clock and return the new value
+    long                        _tick           ( );
+
+    std::string                 dir;
+    LocalConfigPtr              index;
+    long long                   quota;
+    long long                   totalSize;
+    long                        clock;
+
+    boost::unordered_map< std::string, ImageCacheEntry >   entries;
+    boost::unordered_map< std::string, std::string >       files;
+    boost::mutex                mutex;
+    boost::interprocess::file_lock * fileLock;
+
+};
+
+#endif /* end of include guard: IMAGECACHE_H */
@@ -25,9 +25,15 @@
 #include <CernVM/Utilities.h>
 #include <CernVM/CrashReport.h>
 #include <CernVM/ParameterMap.h>
+#include <CernVM/Callbacks.h>
 
 #include <boost/enable_shared_from_this.hpp>
 #include <boost/make_shared.hpp>
+#include <boost/thread.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <set>
 
 /**
  * Shared pointer for the LocalConfig class
@@ -38,8 +44,12 @@ typedef boost::shared_ptr< LocalConfig >                                LocalCon
 /**
  * LocalConfig is a subclass of ParameterMap that can be stored
  * to the local configuration slot.
+ *
+ * When watching is enabled (see setWatch) the "changed" event is fired
+ * with the names of the keys that were changed by other processes. It is
+ * also fired with the keys changed by fromMap.
  */
-class LocalConfig : public ParameterMap
+class LocalConfig : public ParameterMap, public Callbacks
 {
 public:
 
@@ -55,7 +65,7 @@ public:
     /**
      * Virtual destructor
      */
-    virtual ~LocalConfig() { };
+    virtual ~LocalConfig();
 
     /**
      * Return a LocalConfig Shared Pointer for the global config
@@ -142,6 +152,39 @@ public:
      */
     virtual bool                sync            ( );
 
+    /**
+     * Enable or disable the write-behind mode.
+     *
+     * In write-behind mode the changes are not written to the disk right away. Instead,
+     * they are collected and flushed by a background thread after LOCALCONFIG_FLUSH_DELAY
+     * milliseconds or after LOCALCONFIG_FLUSH_CHANGES changes.
+     */
+    void                        setWriteBehind  ( bool enabled );
+
+    /**
+     * Write any pending write-behind changes to the disk
+     */
+    virtual bool                flush           ( );
+
+    /**
+     * Enable or disable the journaled storage mode.
+     *
+     * In journaled mode the changes are appended as records to a '.journal' file next to
+     * the '.conf' snapshot instead of rewriting the entire file. sync() replays only the
+     * records appended by other processes and the journal is compacted to the snapshot in
+     * the background when it grows larger than LOCALCONFIG_JOURNAL_COMPACT bytes.
+     */
+    void                        setJournaled    ( bool enabled );
+
+    /**
+     * Enable or disable watching for changes done by other processes.
+     *
+     * When enabled, a background thread watches the config directory (using inotify
+     * where available), merges the external changes preferring the local ones that
+     * are not yet saved, and fires the "changed" event with the changed keys.
+     */
+    void                        setWatch        ( bool enabled );
+
     /**
      * Override the erase function so we can keep track of the 
      * changes done in the buffer.
@@ -201,6 +244,126 @@ private:
      */
     std::list<std::string>      keysDeleted;
 
+    /**
+     * Mutex that protects timeLoaded, timeModified and keysDeleted, since they are
+     * changed by set() and erase() while the flush thread is saving.
+     */
+    boost::mutex                changesMutex;
+
+    /**
+     * The state (inode, size and modification time) of the snapshot and the journal
+     * the last time we wrote or merged them, so the watch thread can skip the events
+     * caused by our own writes. Protected by changesMutex.
+     */
+    std::string                 confStamp;
+    std::string                 journalStamp;
+
+    /**
+     * Remember the current state of the files as seen by us
+     */
+    void                        updateStamps    ( );
+
+    /**
+     * Write-behind state
+     */
+    bool                        writeBehind;
+    bool                        dirty;
+    int                         dirtyCount;
+    unsigned long long          dirtySince;
+
+    /**
+     * The write-behind flush thread and it's synchronization variables
+     */
+    boost::thread *             flushThread;
+    bool                        flushThreadExit;
+    boost::mutex                flushMutex;
+    boost::condition_variable   flushCond;
+
+    /**
+     * Mutex that serializes the flushes with the file removal and the merging
+     * of the external changes
+     */
+    boost::mutex                saveMutex;
+
+    /**
+     * The entry point of the flush thread
+     */
+    void                        flushThreadLoop ( );
+
+    /**
+     * Start the flush thread if it's not running (flushMutex must be locked)
+     */
+    void                        startFlushThread( );
+
+    /**
+     * Write the changes to the disk, using the active storage mode
+     */
+    bool                        persist         ( );
+
+    /**
+     * Journaled mode state
+     */
+    bool                        journaled;
+    bool                        compactPending;
+    ParameterDataMapPtr         journalBase;
+    unsigned long long          journalOffset;
+    std::string                 journalSnapshotStamp;
+
+    /**
+     * The keys set or erased locally since the last journal commit. Only these are
+     * compared with the journal base when committing, and the records of other
+     * processes don't override them. Protected by the parameters lock.
+     */
+    std::set< std::string >     journalTouched;
+
+    /**
+     * Re-initialize the journal state from the current parameters
+     * and replay the journal.
+     */
+    void                        resetJournal    ( );
+
+    /**
+     * Replay the journal records written by other processes
+     */
+    bool                        syncJournal     ( );
+
+    /**
+     * Append the changes to the journal
+     */
+    bool                        commitJournal   ( );
+
+    /**
+     * Write the journal contents to the snapshot and truncate it
+     */
+    bool                        compactJournal  ( );
+
+    /**
+     * Journal helpers. The journal lock (in-process and inter-process) must be held.
+     */
+    bool                        _replayJournal  ( std::vector<std::string> * changedKeys );
+    bool                        _writeSnapshot  ( );
+
+    /**
+     * The watch thread and it's exit flag
+     */
+    boost::thread *             watchThread;
+    bool                        watchThreadExit;
+
+    /**
+     * The entry point of the watch thread
+     */
+    void                        watchThreadLoop ( );
+
+    /**
+     * Merge the changes done by other processes and fire the "changed" event
+     */
+    void                        mergeExternal   ( );
+
+    /**
+     * Merge the file contents with the local changes, preferring 'ours'
+     */
+    bool                        mergeFile       ( );
+
 protected:
     
     /**
@@ -208,6 +371,16 @@ protected:
      */
     virtual void                commitChanges   ( );
 
+    /**
+     * Overrided function from ParameterMap to fire the "changed" event
+     */
+    virtual void                notifyChanges   ( const std::vector< std::string >& keys );
+
+    /**
+     * Overrided function from ParameterMap to track the keys to journal
+     */
+    virtual void                touchKey        ( const std::string& key );
+
 };
 
 
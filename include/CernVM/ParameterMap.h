@@ -26,10 +26,13 @@
 #include <string>
 #include <map>
 #include <vector>
+#include <iostream>
 
 #include <boost/enable_shared_from_this.hpp>
 #include <boost/make_shared.hpp>
+#include <boost/atomic.hpp>
 #include <boost/thread/mutex.hpp>
+#include <boost/thread/shared_mutex.hpp>
 
 #include <json/json.h>
 
@@ -59,25 +62,29 @@ public:
 	/**
 	 * Create a new blank parameter map
 	 */
-	ParameterMap( ) : parameters(), prefix(""), locked(false), parent(),  changed(false) {
+	ParameterMap( ) : parameters(), prefix(""), locked(false), parent(),  changed(false), unloaded(false), root(this) {
 
 		// Allocate a new shared pointer
 		parameters = boost::make_shared< std::map< const std::string, const std::string > >( );
-		parametersMutex = new boost::mutex();
+		parametersMutex = new boost::shared_mutex();
 
 	};
 
 	/**
 	 * Create a new parameter map with the specified parameters
 	 */
-	ParameterMap( ParameterDataMapPtr parametersptr, std::string pfx ) : parameters(parametersptr), prefix(pfx), locked(false), parent(), changed(false)
-		{ };
+	ParameterMap( ParameterDataMapPtr parametersptr, std::string pfx ) : parameters(parametersptr), prefix(pfx), locked(false), parent(), changed(false), unloaded(false), root(this) {
+
+		// We are the root of this map
+		parametersMutex = new boost::shared_mutex();
+
+	};
 
 
 	/**
 	 * Create a new parameter map by using the specified as parent
 	 */
-	ParameterMap( ParameterMapPtr parentptr, std::string pfx ) : parameters(), prefix(pfx), locked(false), parent(parentptr), changed(false) {
+	ParameterMap( ParameterMapPtr parentptr, std::string pfx ) : parameters(), prefix(pfx), locked(false), parent(parentptr), changed(false), unloaded(false), root(parentptr->root) {
 
 		// Use the pointer from the parent class
 		parameters = parentptr->parameters;
@@ -133,6 +140,11 @@ public:
      */
     virtual bool 				sync 			( );
 
+    /**
+     * Write any pending changes to the underlaying system
+     */
+    virtual bool 				flush 			( );
+
 	/** 
 	 * Lock updates
 	 *
@@ -180,6 +192,12 @@ public:
      */
     ParameterMapPtr				subgroup		( const std::string& name );
 
+    /**
+     * Return a detached copy of this group that can be used for consistent
+     * reads of multiple keys without holding the lock of the shared map.
+     */
+    ParameterMapPtr				snapshot		( );
+
     /**
      * Enumerate the variable names that match our current prefix
      */
@@ -192,18 +210,37 @@ public:
 
     /**
      * Update all the parameters from the specified map
+     *
+     * Only the keys with different values are updated (and if clearBefore is true,
+     * the keys missing from the map are removed). The changes are committed only
+     * if something has changed, in which case the function returns true, reports
+     * the changed keys to the listeners (see notifyChanges) and appends their
+     * names to changedKeys (if specified).
+     */
+    bool						fromMap			( std::map< const std::string, const std::string> * map, bool clearBefore = false, const bool replace = true, std::vector< std::string > * changedKeys = NULL );
+
+    /**
+     * Update all the parameters from the specified parameter map (see fromMap)
+     */
+    bool						fromParameters	( const ParameterMapPtr& ptr, bool clearBefore = false, const bool replace = true, std::vector< std::string > * changedKeys = NULL );
+
+    /**
+     * Update all the parameters from a JSON map (see fromMap)
      */
-    void						fromMap			( std::map< const std::string, const std::string> * map, bool clearBefore = false, const bool replace = true );
+    bool						fromJSON		( const Json::Value& json, bool clearBefore = false, const bool replace = true, std::vector< std::string > * changedKeys = NULL );
 
     /**
-     * Update all the parameters from the specified parameter map
+     * Update all the parameters from the JSON text read from the specified stream
+     * (see fromMap). The text is parsed directly to the parameter names, without
+     * building a JSON document first. If the text is not valid nothing is updated.
      */
-    void						fromParameters	( const ParameterMapPtr& ptr, bool clearBefore = false, const bool replace = true );
+    bool						fromJSONStream	( std::istream& in, bool clearBefore = false, const bool replace = true, std::vector< std::string > * changedKeys = NULL );
 
     /**
-     * Update all the parameters from a JSON map
+     * Write all the parameters of this group, including the sub-groups as
+     * nested objects, as JSON text to the specified stream
      */
-    void						fromJSON		( const Json::Value& json, bool clearBefore = false, const bool replace = true );
+    void						toJSONStream	( std::ostream& out );
 
     /**
      * Store all the parameters to the specified map
@@ -214,8 +251,8 @@ public:
    	/**
    	 * Overload bracket operator
    	 */
-    const std::string operator 		[]			(const std::string& i) const { return parameters->at(i); }
-    const std::string & operator 	[]			(const std::string& i) {return parameters->at(i);}
+    const std::string operator 		[]			(const std::string& i) const { ensureLoaded(); return parameters->at(i); }
+    const std::string & operator 	[]			(const std::string& i) { ensureLoaded(); return parameters->at(i);}
 
 	/**
 	 * The parameter map contents
@@ -251,16 +288,71 @@ protected:
 	 */
 	virtual void 				commitChanges	( );
 
+	/**
+	 * Locally overridable function to report the keys (including the prefix)
+	 * that were changed by fromMap. The default implementation forwards them
+	 * to the parent.
+	 */
+	virtual void 				notifyChanges	( const std::vector< std::string >& keys );
+
+	/**
+	 * Locally overridable function to track the keys (including the prefix) that
+	 * are set or erased. It's called with the write lock held. The default
+	 * implementation forwards them to the parent.
+	 */
+	virtual void 				touchKey		( const std::string& key );
+
     /**
-     * Mutex for accessing properties
+     * Reader/writer mutex for accessing properties. Lookups take a shared
+     * lock, so concurrent readers don't block each other.
      */
-    boost::mutex *              parametersMutex;
+    boost::shared_mutex *       parametersMutex;
 
     /**
      * Helper function to perform []= on const map
      */
     void						putOnMap( ParameterDataMapPtr map, const std::string& key, const std::string& value);
 
+    /**
+     * Locally overridable function to load the parameters from the underlaying
+     * system. It's called with the write lock held, before the first access to
+     * the parameters of a map that was marked with setUnloaded.
+     */
+    virtual void                loadParameters  ( );
+
+    /**
+     * Mark the parameters of this (root) map as not loaded yet. The defaults
+     * set until they are loaded are kept in pendingDefaults.
+     */
+    void                        setUnloaded     ( );
+
+    /**
+     * Load the parameters of the root map if they are not loaded yet
+     */
+    void                        ensureLoaded    ( ) const;
+
+    /**
+     * True while the parameters of the root map are not loaded yet
+     */
+    boost::atomic<bool>         unloaded;
+
+    /**
+     * The defaults set on the root map before its parameters were loaded
+     */
+    std::map< const std::string, const std::string > pendingDefaults;
+
+private:
+
+    /**
+     * The root map that loads the parameters
+     */
+    ParameterMap *              root;
+
+    /**
+     * Load the parameters of this (root) map and apply the pending defaults
+     */
+    void                        loadNow         ( );
+
 };
 
 #endif /* end of include guard: PARAMETERMAP_H */
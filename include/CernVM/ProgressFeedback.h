@@ -28,6 +28,8 @@
 #include <list>
 
 #include <boost/bind.hpp>
+#include <boost/thread.hpp>
+#include <boost/thread/recursive_mutex.hpp>
 #include <boost/function.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/make_shared.hpp>
@@ -53,7 +55,8 @@ public:
 	// Constructor
 	//////////////////////
 	ProgressTask() 
-		: CallbacksProgress(), __lastEventTime(0), parent(), lastMessage(""), started(false), completed(false) { };
+		: CallbacksProgress(), __reportedProgress(0.0), __counted(false), parent(), lastMessage(""), 
+		  started(false), completed(false), lastEmitTime(0), trailingTask(), trailingTimer(false), emitMutex() { };
 
 
 	//////////////////////
@@ -81,9 +84,12 @@ public:
 	void				markLengthy		( const bool isLengthy, const std::string& message = "" );
 
     /**
-     * Used for throttling
+     * The progress value of this task that is accounted in the progress of
+     * the parent, and a flag that denotes if this task occupies a slot there
+     * (changed with the mutex of the tree acquired)
      */
-    unsigned long                       __lastEventTime;
+    double                              __reportedProgress;
+    bool                                __counted;
 
 	//////////////////////////
 	// Overridable callbacks
@@ -128,10 +134,66 @@ protected:
 	bool				 				started;
 	bool 								completed;
 
+	/**
+	 * When the root task emitted the last progress event
+	 */
+	long 								lastEmitTime;
+
+	/**
+	 * The task whose last progress event was throttled, and a flag that denotes
+	 * that the root task is scheduled on the progress timer to emit it
+	 */
+	ProgressTaskPtr 					trailingTask;
+	bool 								trailingTimer;
+
+	/**
+	 * Serializes the changes and the progress events of the tree (used on the root task)
+	 */
+	boost::recursive_mutex 				emitMutex;
+
+	/**
+	 * The timer that emits the throttled events
+	 */
+	friend class 						ProgressTimer;
+
 	//////////////////////
 	// Internal callbacks
 	//////////////////////
 
+	/**
+	 * [Internal] Return the mutex of the tree (the emitMutex of the root task),
+	 * that must be held while changing the state of any of it's tasks
+	 */
+	boost::recursive_mutex & 	_treeMutex( );
+
+	/**
+	 * [Internal] Push the change of the progress of this task to the parent.
+	 * This must be called every time the value of getProgress() changes.
+	 */
+	void 				_updateProgress( );
+
+	/**
+	 * [Internal] Receive the change of the progress of a child task
+	 */
+	virtual void 		_childProgress( double ) { };
+
+	/**
+	 * [Internal] Emit the progress event of this task through the rate limiter of
+	 * the root task. If the event is throttled, the latest event of the tree is
+	 * emitted when the interval expires.
+	 */
+	void 				_throttledUpdate( );
+
+	/**
+	 * [Internal] Emit the progress event of this task
+	 */
+	virtual void 		_emitUpdate( ) { _notifyUpdate( lastMessage ); };
+
+	/**
+	 * [Internal] Emit the throttled event of the tree (called by the progress timer)
+	 */
+	static void 		_trailingUpdate( ProgressTaskPtr root );
+
 	/**
 	 * [Internal] Callback to let listeners know that we started progress
 	 */
@@ -153,7 +215,8 @@ protected:
 	void 				_notifyFailed( const std::string& message, const int errorCode );
 
     /**
-     * [Internal] Propagate a progress event to the callbacks and parent
+     * [Internal] Propagate a progress event to the callbacks of this task and it's
+     * ancestors, calculating the progress only on the ones that have listeners
      */
     void                _forwardProgress( const std::string& message );
 
@@ -175,7 +238,7 @@ public:
 	// Constructor
 	//////////////////////
 
-	FiniteTask() : ProgressTask(), tasks(), taskObjects(), taskIndex(0) { };
+	FiniteTask() : ProgressTask(), doneUnits(0.0), tasks(), taskObjects(), taskIndex(0) { };
 
 	/**
 	 * Define the maximum number of tasks
@@ -221,13 +284,29 @@ protected:
 	 */
 	virtual double 		getProgress		( );
 
+	/**
+	 * Add the progress change of a sub-task
+	 */
+	virtual void 		_childProgress	( double delta );
+
 
 private:
 
+	/**
+	 * Recalculate the number of completed tasks from scratch
+	 */
+	void 				_recalculate	( );
+
 	//////////////////////
 	// State variables
 	//////////////////////
 
+	/**
+	 * The number of completed tasks, including the fractions of the sub-tasks
+	 * (changed with the mutex of the tree acquired)
+	 */
+	double 							doneUnits;
+
 	/**
 	 * The status of the tasks that were flagged as done
 	 */
@@ -296,6 +375,11 @@ protected:
 	 */
 	virtual double 		getProgress		( );
 
+	/**
+	 * Emit the progress event, advancing the spinner
+	 */
+	virtual void 		_emitUpdate		( );
+
 
 private:
 
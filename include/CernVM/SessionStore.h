@@ -0,0 +1,382 @@
+/**
+ * This file is part of CernVM Web API Plugin.
+ *
+ * CVMWebAPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CVMWebAPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CVMWebAPI. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Developed by Ioannis Charalampidis 2013
+ * Contact: <ioannis.charalampidis[at]cern.ch>
+ */
+
+#pragma once
+#ifndef SESSIONSTORE_H
+#define SESSIONSTORE_H
+
+#include <CernVM/Utilities.h>
+#include <CernVM/CrashReport.h>
+#include <CernVM/ParameterMap.h>
+#include <CernVM/LocalConfig.h>
+#include <CernVM/Callbacks.h>
+
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+
+#include <boost/cstdint.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/weak_ptr.hpp>
+#include <boost/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/interprocess/sync/file_lock.hpp>
+
+/**
+ * Shared pointer for the SessionStore class
+ */
+class SessionStore;
+typedef boost::shared_ptr< SessionStore >                               SessionStorePtr;
+class SessionStoreMap;
+typedef boost::shared_ptr< SessionStoreMap >                            SessionStoreMapPtr;
+
+/**
+ * On-disk header of the session store
+ */
+struct SessionStoreHeader {
+    char                        magic[8];
+    boost::uint32_t             version;
+    boost::uint32_t             slots;          // Size of the index (power of two)
+    boost::uint32_t             used;           // Number of live records
+    boost::uint32_t             deleted;        // Number of deleted index slots
+    boost::uint64_t             heapEnd;        // End of the allocated heap space
+    boost::uint64_t             garbage;        // Bytes in the heap not used by any record
+    boost::uint64_t             changes;        // Incremented on every record update
+    boost::uint32_t             retired;        // Set when the file was replaced by a new generation
+    boost::uint32_t             reserved;
+};
+
+/**
+ * One of the two copies of a record in the heap
+ */
+struct SessionStoreCopy {
+    boost::uint64_t             offset;         // Offset of the record data in the file
+    boost::uint32_t             length;         // Length of the record data
+    boost::uint32_t             capacity;       // Space allocated for the record data
+};
+
+/**
+ * On-disk index slot of the session store
+ */
+struct SessionStoreSlot {
+    char                        uuid[40];       // Zero-padded session UUID
+    boost::uint32_t             state;          // 0=Empty, 1=Used, 2=Deleted
+    boost::uint32_t             current;        // The copy that holds the record
+    SessionStoreCopy            copies[2];
+    boost::uint64_t             changes;        // The header counter when the record was updated
+};
+
+/**
+ * A single memory-mapped file that stores the parameters of all the sessions.
+ *
+ * The file starts with a fixed header, followed by an open-addressing hash index
+ * keyed by the session UUID and the heap with the serialized records. Opening the
+ * store does not depend on the number of sessions and the records are decoded only
+ * when they are requested.
+ *
+ * Every record has two copies in the heap. An update is written to the copy that
+ * is not in use and it's published by switching the current copy of the slot, so
+ * a process that crashes in the middle of an update leaves the previous record
+ * intact.
+ *
+ * The mapped file is never resized or renamed, since that's not possible on Windows
+ * while other processes have it mapped. When the heap or the index is full, the live
+ * records are written to a new generation of the file (<file>.<generation>), the
+ * store file is updated to point to it and the old file is marked as retired, so
+ * the other processes map the new one the next time they access the store.
+ */
+class SessionStore : public boost::enable_shared_from_this<SessionStore>
+{
+public:
+
+    /**
+     * Create a session store on the given file. Use SessionStore::runtime() to
+     * get the shared store instance.
+     */
+    SessionStore ( const std::string& file );
+
+    /**
+     * Virtual destructor
+     */
+    virtual ~SessionStore ( );
+
+    /**
+     * Return the session store in the runtime directory
+     */
+    static      SessionStorePtr runtime         ( );
+
+    /**
+     * Return the UUIDs of the sessions in the store
+     */
+    std::vector< std::string >  enumSessions    ( );
+
+    /**
+     * Check if the given session exists in the store
+     */
+    bool                        contains        ( const std::string& uuid );
+
+    /**
+     * Populate the given dictionary from the record of the specified session. If
+     * revision is specified, it's set to the revision of the record.
+     */
+    bool                        load            ( const std::string& uuid, std::map<const std::string, const std::string> * map, boost::uint64_t * revision = NULL );
+
+    /**
+     * Store the contents of the given dictionary to the record of the specified session.
+     * If create is false, the record is updated only if it exists. If revision is specified
+     * (and not zero), the record is updated only if it still has that revision, which is
+     * then replaced with the new one.
+     */
+    bool                        store           ( const std::string& uuid, std::map<const std::string, const std::string> * map, bool create = true, boost::uint64_t * revision = NULL );
+
+    /**
+     * Return the revision of the record of the specified session, that changes every time
+     * the record is updated (by any process), or zero if the record is missing
+     */
+    boost::uint64_t             revision        ( const std::string& uuid );
+
+    /**
+     * Remove the record of the specified session
+     */
+    bool                        erase           ( const std::string& uuid );
+
+    /**
+     * Write the modified pages of the store to the disk
+     */
+    bool                        flush           ( );
+
+    /**
+     * Import the sessions stored in the runtime config files with the specified prefix
+     * and remove the files. Returns the number of sessions imported.
+     */
+    int                         migrate         ( const std::string& prefix );
+
+    /**
+     * Return a ParameterMap that is backed by the record of the specified session.
+     * If create is true, an empty record is created if it's missing.
+     */
+    ParameterMapPtr             session         ( const std::string& uuid, bool create = false );
+
+    /**
+     * Read the value of a single parameter from the record of the specified session,
+     * without decoding the entire record. Returns false if the record or the parameter
+     * is missing.
+     */
+    bool                        lookup          ( const std::string& uuid, const std::string& key, std::string * value );
+
+    /**
+     * Queue the record of the given map to be written by the flush thread after
+     * SESSIONSTORE_FLUSH_DELAY milliseconds
+     */
+    void                        scheduleWrite   ( const SessionStoreMapPtr& map );
+
+    /**
+     * Check the given map for changes done by other processes every
+     * SESSIONSTORE_WATCH_INTERVAL milliseconds, for as long as it exists
+     */
+    void                        watch           ( const SessionStoreMapPtr& map );
+
+private:
+
+    /**
+     * The store file (that contains the current generation), the lock file
+     * and the generation that is mapped
+     */
+    std::string                 file;
+    std::string                 lockFile;
+    long                        generation;
+
+    /**
+     * Mutexes for serializing the access within the process and between processes
+     */
+    boost::mutex                storeMutex;
+    boost::interprocess::file_lock * fileLock;
+
+    /**
+     * The memory mapping of the file
+     */
+    boost::interprocess::file_mapping * fileMapping;
+    boost::interprocess::mapped_region * region;
+
+    /**
+     * The background thread that writes the pending changes and merges the
+     * external ones, and it's synchronization variables
+     */
+    boost::thread *             syncThread;
+    bool                        syncThreadExit;
+    boost::mutex                syncMutex;
+    boost::condition_variable   syncCond;
+
+    /**
+     * The maps with pending changes (along with the time they were queued)
+     * and the maps that are watched for external changes
+     */
+    std::map< SessionStoreMap *, std::pair< boost::weak_ptr< SessionStoreMap >, unsigned long long > > flushQueue;
+    std::map< SessionStoreMap *, boost::weak_ptr< SessionStoreMap > > watched;
+
+    /**
+     * Used by the runtime() function to implement singleton template
+     */
+    static SessionStorePtr      runtimeStoreSingleton;
+
+    /**
+     * The entry point of the sync thread
+     */
+    void                        syncThreadLoop  ( );
+
+    /**
+     * Start the sync thread if it's not running (syncMutex must be locked)
+     */
+    void                        startSyncThread ( );
+
+    // Map the current generation of the store (creating it if needed) and unmap it
+    bool                        _open           ( );
+    void                        _close          ( );
+
+    // Make sure the mapping reflects the current generation
+    bool                        _ensureMapped   ( );
+
+    // The file of the given generation, and read/write the current generation
+    std::string                 _dataFile       ( long gen );
+    long                        _readGeneration ( );
+    bool                        _writeGeneration( long gen );
+
+    // Pointers in the mapped region
+    SessionStoreHeader *        _header         ( );
+    SessionStoreSlot *          _slot           ( size_t index );
+
+    // Index lookup
+    int                         _find           ( const std::string& uuid );
+    int                         _insert         ( const std::string& uuid );
+
+    // Allocate heap space for a record
+    bool                        _allocate       ( size_t length, boost::uint64_t * offset, boost::uint32_t * capacity );
+
+    // Write the record data to the unused copy of the slot and publish it
+    bool                        _write          ( const std::string& uuid, const std::string& data, boost::uint64_t * revision );
+
+    // Write a new generation with the live records, the given index size and
+    // at least the given free heap space
+    bool                        _rebuild        ( size_t slots, size_t reserve );
+
+};
+
+/**
+ * A ParameterMap that is backed by a record in the SessionStore.
+ *
+ * The record is decoded the first time the parameters are accessed. Until then,
+ * get() reads the requested parameter directly from the store. The changes are
+ * written to the store by a background thread after SESSIONSTORE_FLUSH_DELAY
+ * milliseconds, or when flush() is called.
+ *
+ * Once decoded, the record is watched for changes done by other processes. They
+ * are merged, preferring the local changes that are not written yet, and the
+ * "changed" event is fired with the names of the changed keys. It is also fired
+ * with the keys changed by fromMap.
+ */
+class SessionStoreMap : public ParameterMap, public Callbacks
+{
+public:
+
+    /**
+     * Load the parameters of the specified session from the store
+     */
+    SessionStoreMap ( SessionStorePtr store, const std::string& uuid );
+
+    /**
+     * Write the pending changes to the store
+     */
+    virtual ~SessionStoreMap ( );
+
+    /**
+     * Overrided function from ParameterMap to read a single parameter
+     * from the store if the record is not decoded yet
+     */
+    virtual std::string         get             ( const std::string& name, std::string defaultValue = "", bool strict = false );
+
+    /**
+     * Write the pending changes to the store and the modified pages
+     * of the store to the disk
+     */
+    virtual bool                flush           ( );
+
+    /**
+     * Write the pending changes to the record in the store
+     */
+    bool                        writeRecord     ( );
+
+    /**
+     * Merge the changes done to the record by other processes, if any,
+     * and fire the "changed" event. Returns false if nothing was merged.
+     */
+    bool                        mergeExternal   ( );
+
+protected:
+
+    /**
+     * Overrided function from ParameterMap to decode the record
+     */
+    virtual void                loadParameters  ( );
+
+    /**
+     * Overrided function from ParameterMap to commit changes to the store
+     */
+    virtual void                commitChanges   ( );
+
+    /**
+     * Overrided function from ParameterMap to fire the "changed" event
+     */
+    virtual void                notifyChanges   ( const std::vector< std::string >& keys );
+
+    /**
+     * Overrided function from ParameterMap to track the local changes
+     */
+    virtual void                touchKey        ( const std::string& key );
+
+private:
+
+    /**
+     * The store and the session UUID
+     */
+    SessionStorePtr             store;
+    std::string                 uuid;
+
+    /**
+     * Flags if there are changes not written to the store
+     */
+    boost::mutex                dirtyMutex;
+    bool                        dirty;
+
+    /**
+     * The revision and the contents of the record as we last read or wrote
+     * it, and the keys changed since then (protected by dirtyMutex)
+     */
+    boost::uint64_t             revision;
+    ParameterDataMapPtr         base;
+    std::set< std::string >     touched;
+
+};
+
+#endif /* end of include guard: SESSIONSTORE_H */
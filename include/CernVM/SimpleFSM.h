@@ -29,6 +29,8 @@
 #include <vector>
 #include <map>
 
+#include <boost/cstdint.hpp>
+#include <boost/static_assert.hpp>
 #include <boost/thread.hpp>
 #include <boost/thread/condition_variable.hpp>
 #include <boost/thread/mutex.hpp>
@@ -36,9 +38,15 @@
 typedef boost::function< void () >	fsmHandler;
 
 // Forward declerations
+class   SimpleFSM;
 struct  _FSMNode;
 typedef _FSMNode FSMNode;
 
+/**
+ * Raw handler trampoline used by the compile-time FSM graphs
+ */
+typedef void (*fsmThunk)( SimpleFSM * self );
+
 /**
  * Structure of the FSM node
  * This is in principle a directional graph
@@ -48,9 +56,13 @@ struct  _FSMNode{
 	// FSM description
 	int								id;
 	unsigned char 					type;
+	fsmThunk						thunk;
 	fsmHandler						handler;
 	std::vector<FSMNode*>			children;
 
+	// Check if this is an action node (and not a state node)
+	bool 							hasHandler() const { return (thunk != NULL) || !handler.empty(); }
+
 };
 
 /**
@@ -67,6 +79,204 @@ struct  _FSMNode{
 #define FSM_STATE(id,...) \
  	FSMRegistryAdd(id, 0, __VA_ARGS__, 0);
 
+/////////////////////////////////////
+// Compile-time FSM graph
+/////////////////////////////////////
+
+/**
+ * Maximum number of children and nodes in a compile-time FSM graph
+ */
+#define FSM_STATIC_MAX_CHILDREN		8
+#define FSM_STATIC_MAX_NODES		64
+
+/**
+ * Helper macros for declaring the nodes of a compile-time FSM graph.
+ * A child ID of 0 means 'no child'.
+ */
+#define FSM_STATIC_STATE(id,...) \
+ 	FSMStateDecl< id, __VA_ARGS__ >
+
+#define FSM_STATIC_HANDLER(cls,id,cb,...) \
+ 	FSMHandlerDecl< cls, &cls::cb, id, __VA_ARGS__ >
+
+/**
+ * Trampoline that calls the given member function handler
+ */
+template <typename T, void (T::*H)()>
+void fsmHandlerThunk( SimpleFSM * self ) {
+	(static_cast<T*>(self)->*H)();
+}
+
+/**
+ * Compile-time decleration of a state node (a node without handler)
+ */
+template <int ID, int C0 = 0, int C1 = 0, int C2 = 0, int C3 = 0, int C4 = 0, int C5 = 0, int C6 = 0, int C7 = 0>
+struct FSMStateDecl {
+	enum { id = ID, c0 = C0, c1 = C1, c2 = C2, c3 = C3, c4 = C4, c5 = C5, c6 = C6, c7 = C7 };
+	static fsmThunk 				thunk() { return NULL; }
+	static void 					links( std::vector<int> * v ) {
+		const int l[FSM_STATIC_MAX_CHILDREN] = { C0, C1, C2, C3, C4, C5, C6, C7 };
+		for (int i=0; i<FSM_STATIC_MAX_CHILDREN; i++)
+			if (l[i] != 0) v->push_back(l[i]);
+	}
+};
+
+/**
+ * Compile-time decleration of an action node, bound to the member function H of class T
+ */
+template <typename T, void (T::*H)(), int ID, int C0 = 0, int C1 = 0, int C2 = 0, int C3 = 0, int C4 = 0, int C5 = 0, int C6 = 0, int C7 = 0>
+struct FSMHandlerDecl : public FSMStateDecl< ID, C0, C1, C2, C3, C4, C5, C6, C7 > {
+	static fsmThunk 				thunk() { return &fsmHandlerThunk<T,H>; }
+};
+
+/**
+ * Terminator for the compile-time node list
+ */
+struct FSMNil {
+	enum { id = -1, c0 = 0, c1 = 0, c2 = 0, c3 = 0, c4 = 0, c5 = 0, c6 = 0, c7 = 0 };
+};
+
+/**
+ * Compile-time list of FSM nodes
+ */
+template <
+	typename N0  = FSMNil, typename N1  = FSMNil, typename N2  = FSMNil, typename N3  = FSMNil, typename N4  = FSMNil,
+	typename N5  = FSMNil, typename N6  = FSMNil, typename N7  = FSMNil, typename N8  = FSMNil, typename N9  = FSMNil,
+	typename N10 = FSMNil, typename N11 = FSMNil, typename N12 = FSMNil, typename N13 = FSMNil, typename N14 = FSMNil,
+	typename N15 = FSMNil, typename N16 = FSMNil, typename N17 = FSMNil, typename N18 = FSMNil, typename N19 = FSMNil,
+	typename N20 = FSMNil, typename N21 = FSMNil, typename N22 = FSMNil, typename N23 = FSMNil, typename N24 = FSMNil,
+	typename N25 = FSMNil, typename N26 = FSMNil, typename N27 = FSMNil, typename N28 = FSMNil, typename N29 = FSMNil,
+	typename N30 = FSMNil, typename N31 = FSMNil, typename N32 = FSMNil, typename N33 = FSMNil, typename N34 = FSMNil,
+	typename N35 = FSMNil, typename N36 = FSMNil, typename N37 = FSMNil, typename N38 = FSMNil, typename N39 = FSMNil
+>
+struct FSMNodes {
+	typedef N0 head;
+	typedef FSMNodes< N1, N2, N3, N4, N5, N6, N7, N8, N9, N10, N11, N12, N13, N14, N15, N16, N17, N18, N19,
+			N20, N21, N22, N23, N24, N25, N26, N27, N28, N29, N30, N31, N32, N33, N34, N35, N36, N37, N38, N39 > tail;
+};
+typedef FSMNodes<> FSMNodesEnd;
+
+/**
+ * [Meta] Number of nodes in the list
+ */
+template <typename L> struct FSMNodeCount {
+	enum { value = 1 + FSMNodeCount< typename L::tail >::value };
+};
+template <> struct FSMNodeCount< FSMNodesEnd > {
+	enum { value = 0 };
+};
+
+/**
+ * [Meta] Dense index of the node with the given ID in the list (or -1 if missing)
+ */
+template <typename L, int ID, int I = 0, bool Match = ((int)L::head::id == ID)> struct FSMNodeIndex {
+	enum { value = FSMNodeIndex< typename L::tail, ID, I+1 >::value };
+};
+template <typename L, int ID, int I> struct FSMNodeIndex< L, ID, I, true > {
+	enum { value = I };
+};
+template <int ID, int I> struct FSMNodeIndex< FSMNodesEnd, ID, I, false > {
+	enum { value = -1 };
+};
+
+/**
+ * [Meta] Bit mask of the node with the given ID (0 for missing nodes or ID=0)
+ */
+template <typename L, int ID> struct FSMNodeBit {
+	static const boost::uint64_t value = (ID == 0) || (FSMNodeIndex<L,ID>::value < 0) ? 0
+		: ((boost::uint64_t)1 << (FSMNodeIndex<L,ID>::value < 0 ? 0 : FSMNodeIndex<L,ID>::value));
+};
+
+/**
+ * [Meta] Bit mask of the children of the given node
+ */
+template <typename L, typename N> struct FSMChildBits {
+	static const boost::uint64_t value = 
+		FSMNodeBit<L,N::c0>::value | FSMNodeBit<L,N::c1>::value | FSMNodeBit<L,N::c2>::value | FSMNodeBit<L,N::c3>::value |
+		FSMNodeBit<L,N::c4>::value | FSMNodeBit<L,N::c5>::value | FSMNodeBit<L,N::c6>::value | FSMNodeBit<L,N::c7>::value;
+};
+
+/**
+ * [Meta] Expand the given set of nodes by one step, following their links
+ */
+template <typename L, typename All, boost::uint64_t Mask, int I = 0> struct FSMExpand {
+	static const boost::uint64_t value = 
+		( ((Mask >> I) & 1) ? FSMChildBits< All, typename L::head >::value : 0 ) | 
+		FSMExpand< typename L::tail, All, Mask, I+1 >::value;
+};
+template <typename All, boost::uint64_t Mask, int I> struct FSMExpand< FSMNodesEnd, All, Mask, I > {
+	static const boost::uint64_t value = 0;
+};
+
+/**
+ * [Meta] Set of nodes reachable from the given set (fixed point of FSMExpand)
+ */
+template <typename L, boost::uint64_t Mask, boost::uint64_t Next = (Mask | FSMExpand<L,L,Mask>::value)> struct FSMReachable {
+	static const boost::uint64_t value = FSMReachable< L, Next >::value;
+};
+template <typename L, boost::uint64_t Mask> struct FSMReachable< L, Mask, Mask > {
+	static const boost::uint64_t value = Mask;
+};
+
+/**
+ * [Meta] Per-node validation: Unique IDs and no dangling links
+ */
+template <typename L, typename All, int I = 0> struct FSMValidateNodes {
+	typedef typename L::head N;
+
+	// The node ID must be positive and declared only once
+	BOOST_STATIC_ASSERT( N::id > 0 );
+	BOOST_STATIC_ASSERT( (FSMNodeIndex< All, N::id >::value == I) );
+
+	// Every link must point to a declared node
+	BOOST_STATIC_ASSERT( (N::c0 == 0) || (FSMNodeIndex< All, N::c0 >::value >= 0) );
+	BOOST_STATIC_ASSERT( (N::c1 == 0) || (FSMNodeIndex< All, N::c1 >::value >= 0) );
+	BOOST_STATIC_ASSERT( (N::c2 == 0) || (FSMNodeIndex< All, N::c2 >::value >= 0) );
+	BOOST_STATIC_ASSERT( (N::c3 == 0) || (FSMNodeIndex< All, N::c3 >::value >= 0) );
+	BOOST_STATIC_ASSERT( (N::c4 == 0) || (FSMNodeIndex< All, N::c4 >::value >= 0) );
+	BOOST_STATIC_ASSERT( (N::c5 == 0) || (FSMNodeIndex< All, N::c5 >::value >= 0) );
+	BOOST_STATIC_ASSERT( (N::c6 == 0) || (FSMNodeIndex< All, N::c6 >::value >= 0) );
+	BOOST_STATIC_ASSERT( (N::c7 == 0) || (FSMNodeIndex< All, N::c7 >::value >= 0) );
+
+	enum { value = FSMValidateNodes< typename L::tail, All, I+1 >::value };
+};
+template <typename All, int I> struct FSMValidateNodes< FSMNodesEnd, All, I > {
+	enum { value = 1 };
+};
+
+/**
+ * Compile-time FSM graph.
+ *
+ * The graph is validated when it's installed with SimpleFSM::FSMRegistryStatic(). A
+ * graph with duplicate IDs, dangling links or states not reachable from the root
+ * node will not compile.
+ */
+template <int Root, typename L>
+struct FSMStaticGraph {
+	typedef L nodes;
+	enum { root = Root, count = FSMNodeCount<L>::value, valid = FSMValidateNodes<L,L>::value };
+
+	// Check size limits and the root node
+	BOOST_STATIC_ASSERT( (int)count > 0 );
+	BOOST_STATIC_ASSERT( (int)count < FSM_STATIC_MAX_NODES );
+	BOOST_STATIC_ASSERT( (FSMNodeIndex< L, Root >::value >= 0) );
+
+	// Every node must be reachable from the root node
+	static const boost::uint64_t all = ((boost::uint64_t)1 << count) - 1;
+	BOOST_STATIC_ASSERT( (FSMReachable< L, FSMNodeBit< L, Root >::value >::value == all) );
+
+};
+
+/**
+ * [Internal] Append the nodes of a compile-time list in the SimpleFSM registry
+ */
+template <typename L> struct FSMStaticAppend {
+	static void 					append( SimpleFSM * fsm );
+};
+template <> struct FSMStaticAppend< FSMNodesEnd > {
+	static void 					append( SimpleFSM * ) { }
+};
+
 /**
  * Auto-routed Finite-State-Machine class
  */
@@ -80,7 +290,7 @@ public:
 			  	  fsmwState(NULL), fsmwStateWaiting(false), fsmwStateMutex(), fsmwStateChanged(),
 				  fsmInsideHandler(false), fsmProgress(), fsmGotoMutex(), fsmTargetState(0), 
 				  fsmwWaitCond(), fsmwWaitMutex(), fsmRootNode(NULL), fsmCurrentNode(),
-				  fsmTmpRouteLinks(), fsmNodes(), fsmCurrentPath(), fsmThreadActive(false),
+				  fsmTmpRouteLinks(), fsmNodes(), fsmNodeIndex(), fsmCurrentPath(), fsmThreadActive(false),
 				  fsmtInterruptRequested(false)
 				  { };
 
@@ -185,14 +395,26 @@ protected:
 	void 					        FSMRegistryAdd		( int id, fsmHandler handler, ... );
 	void 					        FSMRegistryEnd		( int rootID );
 
+	/**
+	 * Install the given compile-time FSM graph (see FSMStaticGraph)
+	 */
+	template <typename G>
+	void 							FSMRegistryStatic	( );
+
+	/**
+	 * Return the node with the given ID or NULL if it's missing
+	 */
+	FSMNode *						FSMNodeByID			( int id );
+
 	/**
 	 * The entry point for the thread loop
 	 */
 	void 							FSMThreadLoop		();
 
 	// Private variables
-    std::map<int,std::vector<int> > fsmTmpRouteLinks;
-	std::map<int,FSMNode>	        fsmNodes;
+    std::vector<std::vector<int> >  fsmTmpRouteLinks;
+	std::vector<FSMNode>	        fsmNodes;
+	std::vector<int>				fsmNodeIndex;
 	FSMNode	*						fsmRootNode;
 	FSMNode *						fsmCurrentNode;
 	std::list<FSMNode*>				fsmCurrentPath;
@@ -236,7 +458,35 @@ private:
 	// Reusable function to run the node handler
 	bool 							_callHandler( FSMNode * node, bool inThread );
 
+	// Allocate (or reset) the node with the given ID in the registry
+	FSMNode *						_registryNode( int id, const std::vector<int> & links );
+
+	// The compile-time graph helper appends nodes in the registry
+	template <typename L> friend struct FSMStaticAppend;
+
 };
 
+/**
+ * Append the head of the compile-time list and continue with the tail
+ */
+template <typename L>
+void FSMStaticAppend<L>::append( SimpleFSM * fsm ) {
+	std::vector<int> links;
+	L::head::links( &links );
+	fsm->_registryNode( L::head::id, links )->thunk = L::head::thunk();
+	FSMStaticAppend< typename L::tail >::append( fsm );
+}
+
+/**
+ * Install the given compile-time FSM graph
+ */
+template <typename G>
+void SimpleFSM::FSMRegistryStatic( ) {
+	BOOST_STATIC_ASSERT( (int)G::valid == 1 );
+	FSMRegistryBegin();
+	FSMStaticAppend< typename G::nodes >::append( this );
+	FSMRegistryEnd( G::root );
+}
+
 
 #endif /* end of include guard: SIMPLEFSM_H */
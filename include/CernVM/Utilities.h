@@ -115,6 +115,9 @@
 // GZip decompression block size (64k)
 #define GZ_BLOCK_SIZE 0x10000
 
+// The size of the zero blocks skipped by writeSparse (the usual filesystem block)
+#define SPARSE_BLOCK_SIZE 4096
+
 // Safe alphanumeric chars for sysExec
 #define SAFE_ALNUM_CHARS   "abcdefghijklmnopqrstuvwxyz+ABCDEFGHIJKLMNOPQRSTUVWXYZ-0123456789_~"
 #define SAFE_VERSION_CHARS "01234567890.-ab"
@@ -372,7 +375,20 @@ void                                                hexDump         (const char
 bool                                                isSanitized     ( std::string * check, const char * chars );
 
 /**
- * Decompress a GZipped file from src and write it to dst
+ * Write the data to the stream, seeking over the blocks that contain only zeros
+ * instead of writing them, so they are left as holes in the file. Since a trailing
+ * hole is not written, the caller must set the final size of the file.
+ */
+bool                                                writeSparse     ( std::ostream& out, const char * data, size_t length );
+
+/**
+ * Decompress a GZipped file from src and write it to dst.
+ * Block-compressed (BGZF) files are decompressed in parallel.
+ * The blocks of zeros are left as holes in the output file.
+ *
+ * The new downloads are decompressed while they arrive by the DownloadPipeline
+ * (also in parallel for BGZF), so this is only used for the compressed files
+ * already in the download folder.
  */
 int                                                 decompressFile  ( const std::string& filename, const std::string& output );
 
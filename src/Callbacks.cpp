@@ -19,6 +19,7 @@
  */
 
 #include "CernVM/Callbacks.h"
+#include <algorithm>
 
 /**
  * Register a callback that handles a named event
@@ -26,14 +27,19 @@
 NamedEventSlotPtr Callbacks::on ( const std::string& name, cbNamedEvent cb ) {
     CRASH_REPORT_BEGIN;
 	boost::mutex::scoped_lock lock(shopMutex);
+    NamedEventSlotPtr ptr = boost::make_shared<NamedEventSlot>( cb );
+
+    // Copy the map and the list of this event
+    boost::shared_ptr< NamedEventSlotMap > map = boost::make_shared< NamedEventSlotMap >( *boost::atomic_load(&namedEventCallbacks) );
+    boost::shared_ptr< NamedEventSlotList > cbs = boost::make_shared< NamedEventSlotList >();
+    NamedEventSlotMap::iterator it = map->find(name);
+    if (it != map->end()) *cbs = *it->second;
 
-    // Allocate missing entry
-	if (namedEventCallbacks.find(name) == namedEventCallbacks.end())
-        namedEventCallbacks[name] = std::vector< NamedEventSlotPtr >();
     // Update map
-    std::vector< NamedEventSlotPtr > * cbs = &namedEventCallbacks[name];
-    NamedEventSlotPtr ptr = boost::make_shared<NamedEventSlot>( cb );
 	cbs->push_back( ptr );
+    (*map)[name] = cbs;
+    boost::atomic_store( &namedEventCallbacks, NamedEventSlotMapPtr(map) );
+    handlersChanged();
 	return ptr;
     CRASH_REPORT_END;
 }
@@ -46,17 +52,25 @@ void Callbacks::off ( const std::string& name, NamedEventSlotPtr cb ) {
 	if (!cb) return;
 	boost::mutex::scoped_lock lock(shopMutex);
 
-    // Allocate missing entry
-	if (namedEventCallbacks.find(name) == namedEventCallbacks.end()) return;
-    // Lookup and delete entry from map
-    std::vector< NamedEventSlotPtr > * cbs = &namedEventCallbacks[name];
-    for (std::vector< NamedEventSlotPtr >::iterator it = cbs->begin(); it != cbs->end(); ++it) {
-        if (*it == cb) {
-        	CVMWA_LOG("Callbacks", "Found and erased");
-            cbs->erase(it);
-            return;
-        }
+    // Lookup the entry
+    NamedEventSlotMapPtr current = boost::atomic_load(&namedEventCallbacks);
+    NamedEventSlotMap::const_iterator it = current->find(name);
+	if (it == current->end()) return;
+    NamedEventSlotList::const_iterator jt = std::find( it->second->begin(), it->second->end(), cb );
+    if (jt == it->second->end()) return;
+    CVMWA_LOG("Callbacks", "Found and erased");
+
+    // Replace the list without the entry
+    boost::shared_ptr< NamedEventSlotMap > map = boost::make_shared< NamedEventSlotMap >( *current );
+    if (it->second->size() == 1) {
+        map->erase( name );
+    } else {
+        boost::shared_ptr< NamedEventSlotList > cbs = boost::make_shared< NamedEventSlotList >( *it->second );
+        cbs->erase( cbs->begin() + (jt - it->second->begin()) );
+        (*map)[name] = cbs;
     }
+    boost::atomic_store( &namedEventCallbacks, NamedEventSlotMapPtr(map) );
+    handlersChanged();
     CRASH_REPORT_END;
 }
 
@@ -67,7 +81,12 @@ AnyEventSlotPtr Callbacks::onAnyEvent ( cbAnyEvent cb ) {
     CRASH_REPORT_BEGIN;
 	boost::mutex::scoped_lock lock(shopMutex);
 	AnyEventSlotPtr ptr = boost::make_shared<AnyEventSlot>( cb );
-	anyEventCallbacks.push_back( ptr );
+
+	// Replace the list with a copy that includes the slot
+	boost::shared_ptr< AnyEventSlotList > cbs = boost::make_shared< AnyEventSlotList >( *boost::atomic_load(&anyEventCallbacks) );
+	cbs->push_back( ptr );
+	boost::atomic_store( &anyEventCallbacks, AnyEventSlotListPtr(cbs) );
+	handlersChanged();
 	return ptr;
     CRASH_REPORT_END;
 }
@@ -81,12 +100,12 @@ void Callbacks::offAnyEvent ( AnyEventSlotPtr cb ) {
 	boost::mutex::scoped_lock lock(shopMutex);
 
 	// Find and erase the given anyEvent slot
-	for (std::vector< AnyEventSlotPtr >::iterator it = anyEventCallbacks.begin(); it != anyEventCallbacks.end(); ++it) {
-	    if (*it == cb) {
-		    anyEventCallbacks.erase(it);
-            return;
-	    }
-    }
+	boost::shared_ptr< AnyEventSlotList > cbs = boost::make_shared< AnyEventSlotList >( *boost::atomic_load(&anyEventCallbacks) );
+	AnyEventSlotList::iterator it = std::find( cbs->begin(), cbs->end(), cb );
+	if (it == cbs->end()) return;
+	cbs->erase(it);
+	boost::atomic_store( &anyEventCallbacks, AnyEventSlotListPtr(cbs) );
+	handlersChanged();
     CRASH_REPORT_END;
 }
 
@@ -95,10 +114,79 @@ void Callbacks::offAnyEvent ( AnyEventSlotPtr cb ) {
  */
 void Callbacks::fire( const std::string& name, VariantArgList& args ){
     CRASH_REPORT_BEGIN;
-	boost::mutex::scoped_lock lock(shopMutex);
+    deliver( name, args, boost::function< void () >() );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Call a function in order with the events
+ */
+void Callbacks::post( const boost::function< void () >& call ){
+    CRASH_REPORT_BEGIN;
+    VariantArgList args;
+    deliver( "", args, call );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Check if we are in asynchronous mode
+ */
+bool Callbacks::isAsync( ){
+    return (bool) boost::atomic_load(&dispatcher);
+}
+
+/**
+ * Deliver an event (or a call) through the dispatcher, if any
+ */
+void Callbacks::deliver( const std::string& name, VariantArgList& args, const boost::function< void () >& call ){
+    CRASH_REPORT_BEGIN;
+
+    // In asynchronous mode, place the event in the queue
+    CallbacksDispatcherPtr q = boost::atomic_load(&dispatcher);
+    if (q && q->enqueue( name, args, call )) return;
+
+    // If the dispatcher is stopping, let it deliver the events fired
+    // before this one and use the dispatcher that replaced it (if any)
+    if (q) {
+        q->wait();
+        CallbacksDispatcherPtr next = boost::atomic_load(&dispatcher);
+        if (next && (next != q) && next->enqueue( name, args, call )) return;
+    }
+
+    // Otherwise deliver it now
+    if (call) {
+        call();
+    } else {
+        dispatch( name, args );
+    }
+
+    CRASH_REPORT_END;
+}
+
+/**
+ * Check if somebody listens for the given event
+ */
+bool Callbacks::hasHandlers( const std::string& name ) {
+    CRASH_REPORT_BEGIN;
+    if (!boost::atomic_load(&anyEventCallbacks)->empty()) return true;
+    NamedEventSlotMapPtr namedCbs = boost::atomic_load(&namedEventCallbacks);
+    return namedCbs->find(name) != namedCbs->end();
+    CRASH_REPORT_END;
+}
+
+/**
+ * Call the handlers of the given event
+ */
+void Callbacks::dispatch( const std::string& name, VariantArgList& args ){
+    CRASH_REPORT_BEGIN;
+
+	// Take a snapshot of the slots. No lock is held while calling
+	// the handlers, so they are free to register or unregister callbacks.
+	AnyEventSlotListPtr anyCbs = boost::atomic_load(&anyEventCallbacks);
+	NamedEventSlotMapPtr namedCbs = boost::atomic_load(&namedEventCallbacks);
 
 	// First, call the anyEvent handlers
-	for (std::vector< AnyEventSlotPtr >::iterator it = anyEventCallbacks.begin(); it != anyEventCallbacks.end(); ++it) {
+	for (AnyEventSlotList::const_iterator it = anyCbs->begin(); it != anyCbs->end(); ++it) {
 		AnyEventSlotPtr cb = *it;
 		try {
 			if (cb) cb->callback( name, args );
@@ -108,9 +196,9 @@ void Callbacks::fire( const std::string& name, VariantArgList& args ){
 	}
 
 	// Then, call the named event hanlers
-	if (namedEventCallbacks.find(name) != namedEventCallbacks.end()) {
-    	std::vector< NamedEventSlotPtr > * cbs = &namedEventCallbacks[name];
-        for (std::vector< NamedEventSlotPtr >::iterator it = cbs->begin(); it != cbs->end(); ++it) {
+	NamedEventSlotMap::const_iterator nt = namedCbs->find(name);
+	if (nt != namedCbs->end()) {
+        for (NamedEventSlotList::const_iterator it = nt->second->begin(); it != nt->second->end(); ++it) {
 	        NamedEventSlotPtr cb = *it;
 	        try {
 		        if (cb) cb->callback( args );
@@ -121,3 +209,323 @@ void Callbacks::fire( const std::string& name, VariantArgList& args ){
     }
     CRASH_REPORT_END;
 }
+
+/**
+ * Deliver the pending events when destructed
+ */
+Callbacks::~Callbacks() {
+    setAsync( false );
+}
+
+/**
+ * Enable or disable the asynchronous delivery of the events
+ */
+void Callbacks::setAsync( bool enabled, size_t maxDepth, CallbacksOverflow overflow ) {
+    CRASH_REPORT_BEGIN;
+    CallbacksDispatcherPtr prev;
+    {
+        boost::mutex::scoped_lock lock(shopMutex);
+        prev = boost::atomic_load(&dispatcher);
+
+        // Replace the dispatcher
+        CallbacksDispatcherPtr q;
+        if (enabled) {
+            q = boost::make_shared< CallbacksDispatcher >( this, (maxDepth == 0) ? 1 : maxDepth, overflow );
+        }
+        boost::atomic_store( &dispatcher, q );
+    }
+
+    // Deliver the events of the previous dispatcher
+    if (prev) prev->stop();
+    CRASH_REPORT_END;
+}
+
+/**
+ * Wait until all the events are delivered
+ */
+void Callbacks::waitEvents( ) {
+    CRASH_REPORT_BEGIN;
+    CallbacksDispatcherPtr q = boost::atomic_load(&dispatcher);
+    if (q) q->wait();
+    CRASH_REPORT_END;
+}
+
+/**
+ * Event queue metrics
+ */
+size_t Callbacks::queueDepth( ) {
+    CallbacksDispatcherPtr q = boost::atomic_load(&dispatcher);
+    return q ? q->depth() : 0;
+}
+size_t Callbacks::queuePeakDepth( ) {
+    CallbacksDispatcherPtr q = boost::atomic_load(&dispatcher);
+    return q ? q->peakDepth() : 0;
+}
+unsigned long Callbacks::queueDropped( ) {
+    CallbacksDispatcherPtr q = boost::atomic_load(&dispatcher);
+    return q ? q->dropped() : 0;
+}
+
+/**
+ * The threads that deliver the events of all the dispatchers. A dispatcher with
+ * events is placed in the ready list once, and it's drained by one thread.
+ */
+class CallbacksExecutor {
+public:
+
+	/**
+	 * Schedule the delivery of the events of the given dispatcher
+	 */
+	static void 		post 			( const CallbacksDispatcherPtr& dispatcher );
+
+	/**
+	 * Return true if called from one of the executor threads
+	 */
+	static bool 		isWorker 		( );
+
+private:
+
+	CallbacksExecutor();
+
+	/**
+	 * Create the executor (called once)
+	 */
+	static void 		create 			( );
+
+	/**
+	 * The executor threads
+	 */
+	void 				run 			( );
+
+	boost::mutex 									mutex;
+	boost::condition_variable 						cond;
+	std::deque< CallbacksDispatcherPtr > 			ready;
+	boost::thread_group 							threads;
+	std::vector< boost::thread::id > 				workers;
+
+	static CallbacksExecutor * 						instance;
+	static boost::once_flag 						instanceFlag;
+
+};
+
+// The executor lives for as long as the process
+CallbacksExecutor * CallbacksExecutor::instance = NULL;
+boost::once_flag CallbacksExecutor::instanceFlag = BOOST_ONCE_INIT;
+
+/**
+ * Start the executor threads
+ */
+CallbacksExecutor::CallbacksExecutor() : mutex(), cond(), ready(), threads(), workers() {
+    for (int i = 0; i < CALLBACKS_DISPATCH_THREADS; i++)
+        workers.push_back( threads.create_thread( boost::bind( &CallbacksExecutor::run, this ) )->get_id() );
+}
+
+/**
+ * Create the executor
+ */
+void CallbacksExecutor::create ( ) {
+    instance = new CallbacksExecutor();
+}
+
+/**
+ * Place a dispatcher in the ready list
+ */
+void CallbacksExecutor::post ( const CallbacksDispatcherPtr& dispatcher ) {
+    CRASH_REPORT_BEGIN;
+    boost::call_once( instanceFlag, &CallbacksExecutor::create );
+    {
+        boost::mutex::scoped_lock lock(instance->mutex);
+        instance->ready.push_back( dispatcher );
+    }
+    instance->cond.notify_one();
+    CRASH_REPORT_END;
+}
+
+/**
+ * Check if we are one of the executor threads
+ */
+bool CallbacksExecutor::isWorker ( ) {
+    if (instance == NULL) return false;
+    return std::find( instance->workers.begin(), instance->workers.end(), boost::this_thread::get_id() ) != instance->workers.end();
+}
+
+/**
+ * Drain the ready dispatchers
+ */
+void CallbacksExecutor::run ( ) {
+    CRASH_REPORT_BEGIN;
+    for (;;) {
+        CallbacksDispatcherPtr dispatcher;
+        {
+            boost::mutex::scoped_lock lock(mutex);
+            while (ready.empty()) cond.wait(lock);
+            dispatcher = ready.front();
+            ready.pop_front();
+        }
+        dispatcher->run( true );
+    }
+    CRASH_REPORT_END;
+}
+
+/**
+ * Initialize the dispatcher
+ */
+CallbacksDispatcher::CallbacksDispatcher( Callbacks * owner, size_t maxDepth, CallbacksOverflow overflow )
+    : owner(owner), maxDepth(maxDepth), overflow(overflow), queue(), mutex(), cond(), exiting(false),
+      running(false), scheduled(false), runner(), peak(0), droppedCount(0) { }
+
+/**
+ * Check if the calling thread is delivering our events
+ */
+bool CallbacksDispatcher::inHandler( ) {
+    return running && (runner == boost::this_thread::get_id());
+}
+
+/**
+ * Deliver the pending events and stop accepting new ones
+ */
+void CallbacksDispatcher::stop( ) {
+    CRASH_REPORT_BEGIN;
+    bool self;
+    {
+        boost::mutex::scoped_lock lock(mutex);
+        exiting = true;
+
+        // When called from a handler (ex. the owner is destroyed by it) we can't wait
+        // for the pending events, and the owner might be gone when the handler returns.
+        // Drop the events and detach from the owner.
+        self = inHandler();
+        if (self) {
+            if (!queue.empty()) {
+                CVMWA_LOG("Warning", "Dropping " << queue.size() << " events of a dispatcher stopped by a handler");
+            }
+            droppedCount += queue.size();
+            queue.clear();
+            owner = NULL;
+        }
+    }
+    cond.notify_all();
+
+    // Wait for the pending events to be delivered
+    if (!self) wait();
+    CRASH_REPORT_END;
+}
+
+/**
+ * Place an event in the queue, applying the overflow policy if it's full
+ */
+bool CallbacksDispatcher::enqueue( const std::string& name, VariantArgList& args, const boost::function< void () >& call ) {
+    CRASH_REPORT_BEGIN;
+    bool schedule = false;
+    {
+        boost::mutex::scoped_lock lock(mutex);
+        bool handler = inHandler();
+
+        // While stopping, only accept the events fired by the handlers, since they
+        // are fired before the events that are still in the queue are delivered.
+        if (exiting && ((owner == NULL) || !handler)) return false;
+
+        // The events fired by the handlers are always accepted, since the thread
+        // that delivers them can't wait for itself. The executor threads never
+        // block either, so they can't all end up waiting for each other.
+        if ((queue.size() >= maxDepth) && !handler) {
+            if ((overflow == CBO_BLOCK) && !CallbacksExecutor::isWorker()) {
+                while ((queue.size() >= maxDepth) && !exiting) cond.wait(lock);
+                if (exiting) return false;
+            } else if (overflow == CBO_DROP_NEWEST) {
+                droppedCount++;
+                return true;
+            } else if (overflow == CBO_DROP_OLDEST) {
+                queue.pop_front();
+                droppedCount++;
+            }
+        }
+
+        // Enqueue, and schedule the delivery if nobody is delivering our events
+        queue.push_back( CallbacksEvent() );
+        queue.back().name = name;
+        queue.back().args = args;
+        queue.back().call = call;
+        if (queue.size() > peak) peak = queue.size();
+        if (!running && !scheduled) {
+            scheduled = true;
+            schedule = true;
+        }
+    }
+    cond.notify_all();
+    if (schedule) CallbacksExecutor::post( shared_from_this() );
+    return true;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Wait until the queue is empty, delivering the events ourselves
+ * when no other thread is delivering them
+ */
+void CallbacksDispatcher::wait( ) {
+    CRASH_REPORT_BEGIN;
+    for (;;) {
+        run( false );
+        boost::mutex::scoped_lock lock(mutex);
+        if (inHandler() || (queue.empty() && !running)) return;
+        if (running) cond.wait(lock);
+    }
+    CRASH_REPORT_END;
+}
+
+/**
+ * Queue metrics
+ */
+size_t CallbacksDispatcher::depth( ) {
+    boost::mutex::scoped_lock lock(mutex);
+    return queue.size();
+}
+size_t CallbacksDispatcher::peakDepth( ) {
+    boost::mutex::scoped_lock lock(mutex);
+    return peak;
+}
+unsigned long CallbacksDispatcher::dropped( ) {
+    boost::mutex::scoped_lock lock(mutex);
+    return droppedCount;
+}
+
+/**
+ * Deliver the events in the order they were placed in the queue
+ */
+void CallbacksDispatcher::run( bool pooled ) {
+    CRASH_REPORT_BEGIN;
+    {
+        boost::mutex::scoped_lock lock(mutex);
+        if (pooled) scheduled = false;
+        if (running) return;
+        running = true;
+        runner = boost::this_thread::get_id();
+    }
+    for (;;) {
+        CallbacksEvent ev;
+        Callbacks * target;
+        {
+            boost::mutex::scoped_lock lock(mutex);
+
+            // Stop when drained (or detached from the owner)
+            if (queue.empty() || (owner == NULL)) {
+                running = false;
+                runner = boost::thread::id();
+                cond.notify_all();
+                return;
+            }
+            ev = queue.front();
+            queue.pop_front();
+            target = owner;
+        }
+        cond.notify_all();
+
+        // Deliver
+        if (ev.call) {
+            ev.call();
+        } else {
+            target->dispatch( ev.name, ev.args );
+        }
+    }
+    CRASH_REPORT_END;
+}
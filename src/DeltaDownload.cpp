@@ -0,0 +1,339 @@
+/**
+ * This file is part of CernVM Web API Plugin.
+ *
+ * CVMWebAPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CVMWebAPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CVMWebAPI. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Developed by Ioannis Charalampidis 2013
+ * Contact: <ioannis.charalampidis[at]cern.ch>
+ */
+
+#include "CernVM/DeltaDownload.h"
+#include "CernVM/Hypervisor.h"
+
+#include <cctype>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+
+#include <boost/filesystem.hpp>
+#include <openssl/evp.h>
+
+/**
+ * How many bytes of a local file are read at a time while scanning it
+ */
+#define DELTA_READ_SIZE     1048576
+
+/**
+ * The number of bits of the filter that is checked before looking up a weak checksum
+ */
+#define DELTA_FILTER_BITS   20
+
+/**
+ * The rolling checksum of rsync: a is the sum of the bytes and b the sum of
+ * a over the window, both modulo 2^16
+ */
+inline boost::uint32_t __deltaWeak( boost::uint32_t a, boost::uint32_t b ) {
+    return (a & 0xFFFF) | ((b & 0xFFFF) << 16);
+}
+void __deltaChecksum( const unsigned char * data, size_t length, boost::uint32_t * a, boost::uint32_t * b ) {
+    boost::uint32_t sa = 0, sb = 0;
+    for (size_t i = 0; i < length; i++) {
+        sa += data[i];
+        sb += (boost::uint32_t)(length - i) * data[i];
+    }
+    *a = sa & 0xFFFF;
+    *b = sb & 0xFFFF;
+}
+
+/**
+ * The position of a weak checksum in the filter
+ */
+inline size_t __deltaFilter( boost::uint32_t weak ) {
+    return (size_t)((weak * 2654435761U) >> (32 - DELTA_FILTER_BITS));
+}
+
+/**
+ * The binary SHA-256 digest of a block
+ */
+std::string __deltaStrong( const unsigned char * data, size_t length ) {
+    unsigned char md_value[EVP_MAX_MD_SIZE];
+    unsigned int md_len = 0;
+    EVP_Digest( data, length, md_value, &md_len, EVP_sha256(), NULL );
+    return std::string( (const char *) md_value, md_len );
+}
+
+/**
+ * Convert a hex string to binary. Returns false if it's not valid.
+ */
+bool __deltaUnhex( const std::string& hex, std::string * bin ) {
+    static const std::string digits = "0123456789abcdef";
+    if (hex.length() % 2 != 0) return false;
+    bin->clear();
+    for (size_t i = 0; i < hex.length(); i += 2) {
+        size_t hi = digits.find( ::tolower(hex[i]) ), lo = digits.find( ::tolower(hex[i+1]) );
+        if ((hi == std::string::npos) || (lo == std::string::npos)) return false;
+        bin->push_back( (char)((hi << 4) | lo) );
+    }
+    return true;
+}
+
+/**
+ * Prepare to assemble the specified file
+ */
+DeltaDownload::DeltaDownload ( const std::string& destination )
+    : destination(destination), fileSize(0), blockSize(0), blocks(), have(), index(), filter() {
+}
+
+/**
+ * The length of the given block (only the last one can be shorter)
+ */
+long DeltaDownload::blockLength ( size_t block ) {
+    long long first = (long long)block * blockSize;
+    return (long) std::min( (long long)blockSize, fileSize - first );
+}
+
+/**
+ * Parse the manifest and create the destination file
+ */
+int DeltaDownload::open ( const std::string& manifest ) {
+    CRASH_REPORT_BEGIN;
+    std::istringstream iss( manifest );
+    std::string line;
+
+    blocks.clear();
+    fileSize = -1;
+    blockSize = 0;
+    while (std::getline( iss, line )) {
+        if (!line.empty() && (line[line.length()-1] == '\r')) line.erase( line.length()-1 );
+        if (line.empty()) continue;
+
+        // Header
+        if (line.compare(0, 5, "size=") == 0) {
+            fileSize = ston<long long>( line.substr(5) );
+            continue;
+        } else if (line.compare(0, 10, "blocksize=") == 0) {
+            blockSize = ston<long>( line.substr(10) );
+            continue;
+        }
+
+        // Block checksums
+        DeltaBlock block;
+        std::string weak;
+        size_t space = line.find(' ');
+        if ((space != 8) || !__deltaUnhex( line.substr(0, 8), &weak ) || !__deltaUnhex( line.substr(9), &block.strong ) || (block.strong.length() != 32)) {
+            CVMWA_LOG("Error", "Invalid line in the block manifest: " << line);
+            return HVE_NOT_VALIDATED;
+        }
+        block.weak = ((boost::uint32_t)(unsigned char)weak[0] << 24) | ((boost::uint32_t)(unsigned char)weak[1] << 16) |
+                     ((boost::uint32_t)(unsigned char)weak[2] << 8) | (boost::uint32_t)(unsigned char)weak[3];
+        blocks.push_back( block );
+    }
+
+    // Check that the blocks cover the file
+    if ((fileSize < 0) || (blockSize <= 0) || ((long long)blocks.size() != (fileSize + blockSize - 1) / blockSize)) {
+        CVMWA_LOG("Error", "Invalid block manifest (size=" << fileSize << ", blocksize=" << blockSize << ", blocks=" << blocks.size() << ")");
+        return HVE_NOT_VALIDATED;
+    }
+
+    // Index the full blocks by their weak checksum, grouping the ones with the same contents
+    // (ex. the empty blocks of a disk image) so they are all found with a single comparison
+    index.clear();
+    filter.assign( (size_t)1 << DELTA_FILTER_BITS, false );
+    have.assign( blocks.size(), false );
+    for (size_t i = 0; i < blocks.size(); i++) {
+        if (blockLength(i) != blockSize) continue;
+        std::vector< DeltaBlockGroup > & groups = index[ blocks[i].weak ];
+        std::vector< DeltaBlockGroup >::iterator it = groups.begin();
+        while ((it != groups.end()) && (it->strong != blocks[i].strong)) ++it;
+        if (it == groups.end()) {
+            groups.push_back( DeltaBlockGroup() );
+            groups.back().strong = blocks[i].strong;
+            it = groups.end() - 1;
+        }
+        it->blocks.push_back( i );
+        filter[ __deltaFilter( blocks[i].weak ) ] = true;
+    }
+
+    // Create the destination file (the missing blocks stay as holes)
+    {
+        std::ofstream fStream( destination.c_str(), std::ofstream::binary );
+        if (fStream.fail()) {
+            CVMWA_LOG("Error", "Unable to create '" << destination << "'");
+            return HVE_IO_ERROR;
+        }
+    }
+    try {
+        boost::filesystem::resize_file( destination, (boost::uintmax_t) fileSize );
+    } catch (boost::filesystem::filesystem_error &e) {
+        CVMWA_LOG("Error", "Unable to allocate '" << destination << "': " << e.what() );
+        return HVE_IO_ERROR;
+    }
+
+    return HVE_OK;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Scan the file with the rolling checksum and copy the blocks we are missing
+ */
+long long DeltaDownload::seed ( const std::string& file ) {
+    CRASH_REPORT_BEGIN;
+    if (index.empty()) return 0;
+    std::ifstream in( file.c_str(), std::ifstream::binary );
+    std::fstream out( destination.c_str(), std::fstream::in | std::fstream::out | std::fstream::binary );
+    if (!in.good() || !out.good()) {
+        CVMWA_LOG("Error", "Unable to open '" << file << "' or '" << destination << "'");
+        return 0;
+    }
+
+    // The window is [start, start+blockSize) of the buffer, that holds the bytes up to end
+    const size_t window = (size_t) blockSize;
+    std::vector< unsigned char > buffer( window + DELTA_READ_SIZE );
+    size_t start = 0, end = 0;
+    boost::uint32_t a = 0, b = 0;
+    bool rolling = false, eof = false;
+    long long reused = 0;
+    while (!index.empty()) {
+
+        // Make sure we have the window and the byte after it in the buffer
+        if ((end - start < window + 1) && !eof) {
+            memmove( &buffer[0], &buffer[0] + start, end - start );
+            end -= start;
+            start = 0;
+            in.read( (char *) &buffer[0] + end, buffer.size() - end );
+            end += (size_t) in.gcount();
+            if (in.gcount() == 0) eof = true;
+        }
+        if (end - start < window) break;
+
+        // Start the checksum of a new window
+        if (!rolling) {
+            __deltaChecksum( &buffer[start], window, &a, &b );
+            rolling = true;
+        }
+
+        // Check if the window is one of our blocks
+        boost::uint32_t weak = __deltaWeak( a, b );
+        bool matched = false;
+        if (filter[ __deltaFilter( weak ) ]) {
+            boost::unordered_map< boost::uint32_t, std::vector< DeltaBlockGroup > >::iterator it = index.find( weak );
+            if (it != index.end()) {
+                std::string strong = __deltaStrong( &buffer[start], window );
+                std::vector< DeltaBlockGroup >::iterator jt = it->second.begin();
+                while ((jt != it->second.end()) && (jt->strong != strong)) ++jt;
+                if (jt != it->second.end()) {
+
+                    // Copy the window to all the blocks of the group and drop it
+                    for (std::vector< size_t >::iterator kt = jt->blocks.begin(); kt != jt->blocks.end(); ++kt) {
+                        out.seekp( (long long)*kt * blockSize );
+                        if (!writeSparse( out, (const char *) &buffer[start], window )) {
+                            CVMWA_LOG("Error", "Unable to write to '" << destination << "'");
+                            return reused;
+                        }
+                        have[*kt] = true;
+                        reused += window;
+                    }
+                    it->second.erase( jt );
+                    if (it->second.empty()) index.erase( it );
+                    matched = true;
+                }
+            }
+        }
+
+        // Continue after the block we found, or roll the checksum by one byte
+        if (matched) {
+            start += window;
+            rolling = false;
+        } else {
+            if (end - start < window + 1) break;
+            boost::uint32_t x = buffer[start], y = buffer[start + window];
+            a = (a - x + y) & 0xFFFF;
+            b = (b - (boost::uint32_t)window * x + a) & 0xFFFF;
+            start++;
+        }
+
+    }
+    CVMWA_LOG("Info", "Reused " << reused << " bytes from '" << file << "'");
+    return reused;
+    CRASH_REPORT_END;
+}
+
+/**
+ * The number of bytes we are missing
+ */
+long long DeltaDownload::missing ( ) {
+    long long bytes = 0;
+    for (size_t i = 0; i < have.size(); i++)
+        if (!have[i]) bytes += blockLength(i);
+    return bytes;
+}
+
+/**
+ * Download the missing blocks, merging the consecutive ones in a single range
+ */
+int DeltaDownload::fetch ( const DownloadProviderPtr& provider, const std::string& url, const VariableTaskPtr& pf ) {
+    CRASH_REPORT_BEGIN;
+    std::vector< std::pair< long long, long long > > ranges;
+    for (size_t i = 0; i < have.size(); i++) {
+        if (have[i]) continue;
+        long long first = (long long)i * blockSize, last = first + blockLength(i) - 1;
+        if (!ranges.empty() && (ranges.back().second + 1 == first)) {
+            ranges.back().second = last;
+        } else {
+            ranges.push_back( std::make_pair( first, last ) );
+        }
+    }
+    if (ranges.empty()) {
+        if (pf) pf->complete("All the blocks were found locally");
+        return HVE_OK;
+    }
+
+    CVMWA_LOG("Info", "Downloading " << missing() << " of " << fileSize << " bytes in " << ranges.size() << " ranges");
+    return provider->downloadRanges( url, destination, ranges, pf );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Create the manifest of a file
+ */
+int DeltaDownload::createManifest ( const std::string& file, std::string * manifest, long blockSize ) {
+    CRASH_REPORT_BEGIN;
+    std::ifstream in( file.c_str(), std::ifstream::binary );
+    if (!in.good()) return HVE_IO_ERROR;
+
+    std::ostringstream oss;
+    oss << "size=" << boost::filesystem::file_size( file ) << std::endl;
+    oss << "blocksize=" << blockSize << std::endl;
+    std::vector< unsigned char > buffer( blockSize );
+    static const char hex[] = "0123456789abcdef";
+    for (;;) {
+        in.read( (char *) &buffer[0], blockSize );
+        size_t length = (size_t) in.gcount();
+        if (length == 0) break;
+
+        boost::uint32_t a, b;
+        __deltaChecksum( &buffer[0], length, &a, &b );
+        std::string strong = __deltaStrong( &buffer[0], length );
+        oss << std::hex << std::setw(8) << std::setfill('0') << __deltaWeak( a, b ) << std::dec << " ";
+        for (size_t i = 0; i < strong.length(); i++)
+            oss << hex[(unsigned char)strong[i] >> 4] << hex[(unsigned char)strong[i] & 0xF];
+        oss << std::endl;
+    }
+    if (in.bad()) return HVE_IO_ERROR;
+
+    *manifest = oss.str();
+    return HVE_OK;
+    CRASH_REPORT_END;
+}
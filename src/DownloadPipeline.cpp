@@ -0,0 +1,401 @@
+/**
+ * This file is part of CernVM Web API Plugin.
+ *
+ * CVMWebAPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CVMWebAPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CVMWebAPI. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Developed by Ioannis Charalampidis 2013
+ * Contact: <ioannis.charalampidis[at]cern.ch>
+ */
+
+#include "CernVM/DownloadPipeline.h"
+#include "CernVM/Hypervisor.h"
+
+#include <boost/filesystem.hpp>
+#include <boost/bind.hpp>
+
+/**
+ * Return the size of the BGZF block that starts with the specified data, 0 if its
+ * header is not complete yet, or -1 if it's not a BGZF block. The size of the block
+ * is stored in the 'BC' subfield of the extra field of its gzip header.
+ */
+long __pipelineBlockSize( const unsigned char * p, size_t n ) {
+    if (n < 12) return 0;
+    if ((p[0] != 31) || (p[1] != 139) || (p[2] != 8) || (p[3] != 4)) return -1;
+    size_t xlen = p[10] | (p[11] << 8);
+    if (n < 12 + xlen) return 0;
+    for (size_t i = 0; i + 4 <= xlen; i += 4 + (p[12+i+2] | (p[12+i+3] << 8))) {
+        const unsigned char * f = p + 12 + i;
+        if ((f[0] == 'B') && (f[1] == 'C') && ((f[2] | (f[3] << 8)) == 2) && (i + 6 <= xlen)) {
+            long size = (f[4] | (f[5] << 8)) + 1;
+            return (size < (long)(12 + xlen + 8)) ? -1 : size;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Read a little-endian integer from a buffer
+ */
+inline unsigned long __pipelineU32( const unsigned char * p ) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned long)p[3] << 24);
+}
+
+/**
+ * Open the output file and initialize the checksum and decompression state
+ */
+DownloadPipeline::DownloadPipeline ( const std::string& output, bool gunzip ) 
+    : std::streambuf(), filename(output), out(), mdctx(NULL), zs(), gunzip(gunzip), streamEnd(false), format(FORMAT_UNKNOWN),
+      pending(), queue(), workers(), queueMutex(), queueCond(), busy(0), stopping(false), workerFailed(false), total(0), written(0), failed(false) {
+    CRASH_REPORT_BEGIN;
+
+    // Open output
+    out.open( output.c_str(), std::ofstream::binary );
+    if (!out.good()) {
+        CVMWA_LOG("Error", "Unable to open file `" << output << "' for writing.");
+        failed = true;
+    }
+
+    // Initialize the digest
+    mdctx = EVP_MD_CTX_create();
+    EVP_DigestInit_ex(mdctx, EVP_sha256(), NULL);
+
+    // Initialize the decompression (accepting gzip and zlib headers)
+    if (gunzip) {
+        zs.zalloc = Z_NULL;
+        zs.zfree = Z_NULL;
+        zs.opaque = Z_NULL;
+        zs.next_in = Z_NULL;
+        zs.avail_in = 0;
+        if (inflateInit2( &zs, 15 + 32 ) != Z_OK) {
+            CVMWA_LOG("Error", "Unable to initialize the decompression");
+            this->gunzip = false;
+            failed = true;
+        }
+    }
+
+    CRASH_REPORT_END;
+}
+
+/**
+ * Release resources
+ */
+DownloadPipeline::~DownloadPipeline ( ) {
+    CRASH_REPORT_BEGIN;
+    stopWorkers( true );
+    if (mdctx != NULL) EVP_MD_CTX_destroy(mdctx);
+    if (gunzip) inflateEnd( &zs );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Process a chunk of downloaded data
+ */
+std::streamsize DownloadPipeline::xsputn ( const char * s, std::streamsize n ) {
+    CRASH_REPORT_BEGIN;
+    if (failed) return 0;
+
+    // Update checksum
+    EVP_DigestUpdate( mdctx, s, n );
+    total += n;
+
+    // Write the data as they are
+    if (!gunzip) {
+        if (!writeSparse( out, s, n )) failed = true;
+        written += n;
+        return failed ? 0 : n;
+    }
+
+    // Detect the format from the first header
+    if (format == FORMAT_UNKNOWN) {
+        pending.append( s, n );
+        long size = __pipelineBlockSize( (const unsigned char *) pending.data(), pending.size() );
+        if (size == 0) return n;
+        if (size < 0) {
+            format = FORMAT_GZIP;
+            std::string data;
+            data.swap( pending );
+            inflateStream( data.data(), data.size() );
+        } else {
+
+            // Decompress the blocks on all the cores
+            format = FORMAT_BGZF;
+            size_t numThreads = std::max( boost::thread::hardware_concurrency(), 1u );
+            CVMWA_LOG("Info", "Decompressing the blocks of " << filename << " using " << numThreads << " threads");
+            for (size_t i = 0; i < numThreads; i++)
+                workers.create_thread( boost::bind( &DownloadPipeline::inflateBlocks, this ) );
+            dispatchBlocks();
+
+        }
+        return failed ? 0 : n;
+    }
+
+    // Inflate the data to the output file
+    if (format == FORMAT_BGZF) {
+        pending.append( s, n );
+        dispatchBlocks();
+    } else {
+        inflateStream( s, n );
+    }
+    return failed ? 0 : n;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Inflate the data of a (non-BGZF) compressed stream to the output file
+ */
+void DownloadPipeline::inflateStream ( const char * s, size_t n ) {
+    CRASH_REPORT_BEGIN;
+    unsigned char buffer[GZ_BLOCK_SIZE];
+    zs.next_in = (Bytef *) s;
+    zs.avail_in = (uInt) n;
+    while (zs.avail_in > 0) {
+
+        // Start the next member of a multi-member gzip file
+        if (streamEnd) {
+            if (inflateReset( &zs ) != Z_OK) { failed = true; break; }
+            streamEnd = false;
+        }
+
+        zs.next_out = buffer;
+        zs.avail_out = GZ_BLOCK_SIZE;
+        int err = inflate( &zs, Z_NO_FLUSH );
+        if ((err != Z_OK) && (err != Z_STREAM_END)) {
+            CVMWA_LOG("Error", "Inflate error #" << err );
+            failed = true;
+            break;
+        }
+        if (err == Z_STREAM_END) streamEnd = true;
+
+        // Write the decompressed data
+        if (!writeSparse( out, (const char *) buffer, GZ_BLOCK_SIZE - zs.avail_out )) {
+            failed = true;
+            break;
+        }
+        written += GZ_BLOCK_SIZE - zs.avail_out;
+
+    }
+    CRASH_REPORT_END;
+}
+
+/**
+ * Pass the complete BGZF blocks of the pending data to the workers. The offset of
+ * each block in the output file is the total size of the blocks before it.
+ */
+void DownloadPipeline::dispatchBlocks ( ) {
+    CRASH_REPORT_BEGIN;
+    size_t pos = 0;
+    while (!failed) {
+        const unsigned char * p = (const unsigned char *) pending.data() + pos;
+        size_t avail = pending.size() - pos;
+        long size = __pipelineBlockSize( p, avail );
+        if (size < 0) {
+            CVMWA_LOG("Error", "Invalid block at offset " << (total - pending.size() + pos) << " of the compressed stream");
+            failed = true;
+            break;
+        }
+        if ((size == 0) || (avail < (size_t)size)) break;
+
+        // Check the size of its contents
+        unsigned long length = __pipelineU32( p + size - 4 );
+        if (length > GZ_BLOCK_SIZE) {
+            CVMWA_LOG("Error", "Invalid block at offset " << (total - pending.size() + pos) << " of the compressed stream");
+            failed = true;
+            break;
+        }
+
+        // Wait for a place in the queue. The download can't be interrupted here, the
+        // stream would just report the error.
+        boost::this_thread::disable_interruption di;
+        boost::unique_lock< boost::mutex > lock( queueMutex );
+        while ((queue.size() >= DECOMPRESS_QUEUE_BLOCKS) && !workerFailed) queueCond.wait( lock );
+        if (workerFailed) {
+            failed = true;
+            break;
+        }
+        queue.push_back( DownloadPipelineBlock() );
+        queue.back().data.assign( (const char *) p, size );
+        queue.back().output = written;
+        queue.back().length = length;
+        queueCond.notify_all();
+
+        written += length;
+        pos += size;
+    }
+    pending.erase( 0, pos );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Worker thread that decompresses the queued BGZF blocks at their offsets in the output file
+ */
+void DownloadPipeline::inflateBlocks ( ) {
+    CRASH_REPORT_BEGIN;
+    std::fstream fOut( filename.c_str(), std::fstream::in | std::fstream::out | std::fstream::binary );
+
+    // Raw inflate, the gzip headers are parsed by dispatchBlocks
+    z_stream zsBlock;
+    memset( &zsBlock, 0, sizeof(zsBlock) );
+    bool ok = (inflateInit2( &zsBlock, -15 ) == Z_OK);
+    bool initialized = ok;
+    if (!fOut.good()) {
+        CVMWA_LOG("Error", "Unable to open file `" << filename << "' for writing.");
+        ok = false;
+    }
+
+    std::vector< unsigned char > output( GZ_BLOCK_SIZE );
+    DownloadPipelineBlock block;
+    while (ok) {
+
+        // Take the next block, or quit when there are no more
+        {
+            boost::unique_lock< boost::mutex > lock( queueMutex );
+            while (queue.empty() && !stopping && !workerFailed) queueCond.wait( lock );
+            if (queue.empty() || workerFailed) break;
+            block.data.swap( queue.front().data );
+            block.output = queue.front().output;
+            block.length = queue.front().length;
+            queue.pop_front();
+            busy++;
+            queueCond.notify_all();
+        }
+
+        // Inflate, validate and write it
+        const unsigned char * p = (const unsigned char *) block.data.data();
+        size_t hlen = 12 + (p[10] | (p[11] << 8));
+        inflateReset( &zsBlock );
+        zsBlock.next_in = (Bytef *) p + hlen;
+        zsBlock.avail_in = (uInt) (block.data.size() - hlen - 8);
+        zsBlock.next_out = &output[0];
+        zsBlock.avail_out = (uInt) output.size();
+        ok = (inflate( &zsBlock, Z_FINISH ) == Z_STREAM_END) && (zsBlock.total_out == block.length) &&
+             (crc32( crc32(0L, Z_NULL, 0), &output[0], block.length ) == __pipelineU32( p + block.data.size() - 8 ));
+        if (ok) {
+            fOut.seekp( block.output );
+            ok = writeSparse( fOut, (const char *) &output[0], block.length );
+        }
+        if (!ok) {
+            CVMWA_LOG("Error", "Unable to decompress the block of offset " << block.output << " in " << filename);
+        }
+
+        boost::unique_lock< boost::mutex > lock( queueMutex );
+        busy--;
+        queueCond.notify_all();
+    }
+
+    // Stop everything on error
+    fOut.close();
+    if (fOut.fail()) ok = false;
+    if (!ok) {
+        boost::unique_lock< boost::mutex > lock( queueMutex );
+        workerFailed = true;
+        queueCond.notify_all();
+    }
+    if (initialized) inflateEnd( &zsBlock );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Let the workers decompress the queued blocks (or discard them) and wait for them
+ */
+void DownloadPipeline::stopWorkers ( bool discard ) {
+    CRASH_REPORT_BEGIN;
+    if ((workers.size() == 0) || stopping) return;
+    boost::this_thread::disable_interruption di;
+    {
+        boost::unique_lock< boost::mutex > lock( queueMutex );
+        if (discard) queue.clear();
+        stopping = true;
+        queueCond.notify_all();
+    }
+    workers.join_all();
+    if (workerFailed) failed = true;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Process a single character
+ */
+DownloadPipeline::int_type DownloadPipeline::overflow ( int_type c ) {
+    CRASH_REPORT_BEGIN;
+    if (traits_type::eq_int_type(c, traits_type::eof())) return traits_type::not_eof(c);
+    char ch = traits_type::to_char_type(c);
+    return (xsputn( &ch, 1 ) == 1) ? c : traits_type::eof();
+    CRASH_REPORT_END;
+}
+
+/**
+ * Report the number of bytes written (used for the progress by tellp())
+ */
+DownloadPipeline::pos_type DownloadPipeline::seekoff ( off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which ) {
+    if ((off == 0) && (dir == std::ios_base::cur) && (which & std::ios_base::out))
+        return pos_type( (off_type) total );
+    return pos_type( off_type(-1) );
+}
+
+/**
+ * Complete the processing and return the checksum
+ */
+int DownloadPipeline::finish ( std::string * checksum ) {
+    CRASH_REPORT_BEGIN;
+    static const char hex[] = "0123456789abcdef";
+    unsigned int md_len;
+    unsigned char md_value[EVP_MAX_MD_SIZE];
+
+    // A stream shorter than a BGZF header is a plain compressed stream
+    if (gunzip && (format == FORMAT_UNKNOWN)) {
+        format = FORMAT_GZIP;
+        std::string data;
+        data.swap( pending );
+        if (!failed) inflateStream( data.data(), data.size() );
+    }
+
+    // Wait for the blocks to be decompressed
+    if (format == FORMAT_BGZF) {
+        stopWorkers( false );
+        streamEnd = pending.empty();
+    }
+
+    // The compressed stream must be complete
+    if (gunzip && !failed && !streamEnd) {
+        CVMWA_LOG("Error", "The compressed stream is truncated");
+        failed = true;
+    }
+
+    // Close output
+    out.close();
+    if (out.fail()) failed = true;
+
+    // Write the trailing hole
+    if (!failed) {
+        try {
+            boost::filesystem::resize_file( filename, written );
+        } catch (const boost::filesystem::filesystem_error& e) {
+            CVMWA_LOG("Error", "Unable to resize `" << filename << "' (" << e.what() << ")");
+            failed = true;
+        }
+    }
+
+    // Calculate checksum
+    EVP_DigestFinal_ex( mdctx, md_value, &md_len );
+    EVP_MD_CTX_destroy( mdctx );
+    mdctx = NULL;
+    checksum->clear();
+    for (unsigned int i = 0; i < md_len; i++) {
+        checksum->push_back( hex[md_value[i] >> 4] );
+        checksum->push_back( hex[md_value[i] & 0xF] );
+    }
+
+    return failed ? HVE_IO_ERROR : HVE_OK;
+    CRASH_REPORT_END;
+}
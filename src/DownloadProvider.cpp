@@ -21,7 +21,14 @@
 #include "CernVM/DownloadProvider.h"
 #include "CernVM/Hypervisor.h"
 
+#include <boost/algorithm/string/predicate.hpp>
+#include <boost/algorithm/string/trim.hpp>
+#include <boost/filesystem.hpp>
+#include <algorithm>
+
 DownloadProviderPtr systemProvider;
+CURLMultiEnginePtr systemEngine;
+DownloadMirrorsPtr systemMirrors;
 
 /**
  * Get system-wide download provider singleton
@@ -29,7 +36,7 @@ DownloadProviderPtr systemProvider;
 DownloadProviderPtr DownloadProvider::Default() {
     CRASH_REPORT_BEGIN;
     if (!systemProvider)
-        systemProvider = boost::make_shared< CURLProvider >();
+        systemProvider = boost::make_shared< CURLMultiProvider >();
     return systemProvider;
     CRASH_REPORT_END;
 }
@@ -43,19 +50,22 @@ void DownloadProvider::setDefault( const DownloadProviderPtr& provider ) {
     CRASH_REPORT_END;
 }
 
+/**
+ * Download byte ranges of a file (not supported by default)
+ */
+int DownloadProvider::downloadRanges( const std::string&, const std::string&, const std::vector< std::pair< long long, long long > >&, const VariableTaskPtr& ) {
+    return HVE_NOT_SUPPORTED;
+}
+
 /**
  * Local function to fire the progress event accordingly
  */
 void DownloadProvider::fireProgressEvent( const VariableTaskPtr& fb, size_t pos, size_t max ) {
     CRASH_REPORT_BEGIN;
     if (fb) {
-        
-        // Throttle events on 2 per second, unless that's the last one
-        if ((pos != max) && ((getMillis() - fb->__lastEventTime) < DP_THROTTLE_TIMER)) return;
-        fb->__lastEventTime = getMillis();
 
-        // Update task's progress
-        CVMWA_LOG("Debug", "Updating progress to " << pos << "/" << max );
+        // Update task's progress. The events are rate-limited by the
+        // root of the task tree.
         fb->setMax(max);
         fb->update(pos);
 
@@ -114,8 +124,14 @@ size_t __curl_datacb_file(void *ptr, size_t size, size_t nmemb, CURLProvider * s
 
     //CVMWA_LOG("Debug", "cURL File callback (size=" << dataLen << ")");
 
-    // Write to file stream
-    DownloadProvider::writeToStream( &(self->fStream), self->pf, self->maxStreamSize, (const char *) ptr, dataLen );
+    // Write to the output stream
+    DownloadProvider::writeToStream( self->oStream, self->pf, self->maxStreamSize, (const char *) ptr, dataLen );
+
+    // Abort the transfer if the stream is not accepting data
+    if (self->oStream->fail()) {
+        CVMWA_LOG("Error", "Output stream error" );
+        return 0;
+    }
     
     // Return data len
     return dataLen;
@@ -163,6 +179,38 @@ int __curl_xferinfo(CURLProvider * self, curl_off_t dltotal, curl_off_t dlnow, c
 int CURLProvider::downloadFile( const std::string& url, const std::string& destination, const VariableTaskPtr& pf ) {
     CRASH_REPORT_BEGIN;
 
+    // Open local file
+    CVMWA_LOG("Debug", "Oppening local output stream '" << destination << "'");
+    fStream.clear();
+    fStream.open( destination.c_str(), std::ofstream::binary );
+    if (fStream.fail()) {
+        CVMWA_LOG("Error", "OFStream error" );
+        return HVE_IO_ERROR;
+    }
+
+    // Download to the file stream
+    int res = downloadStream( url, &fStream, pf );
+
+    // Close stream
+    fStream.close();
+    if ((res == HVE_OK) && fStream.fail()) {
+        CVMWA_LOG("Error", "OFStream error" );
+        return HVE_IO_ERROR;
+    }
+    return res;
+    
+    CRASH_REPORT_END;
+}
+
+/**
+ * Download a file using CURL, writing the data to the specified stream
+ */
+int CURLProvider::downloadStream( const std::string& url, std::ostream * stream, const VariableTaskPtr& pf, long long offset ) {
+    CRASH_REPORT_BEGIN;
+
+    // Resuming is not supported
+    if (offset > 0) return HVE_NOT_SUPPORTED;
+
     // We are in operation
     operationInstances++;
 
@@ -178,10 +226,8 @@ int CURLProvider::downloadFile( const std::string& url, const std::string& desti
     // Store a local pointer
     this->pf = pf;
     this->maxStreamSize = 0;
+    this->oStream = stream;
 
-    // Reset timestamp
-    if (pf) pf->__lastEventTime = getMillis();
-    
     // Setup callbacks
     //CURLProviderPtr sharedPtr = boost::dynamic_pointer_cast< CURLProvider >( shared_from_this() );
     curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, __curl_headerfunc);
@@ -192,18 +238,9 @@ int CURLProvider::downloadFile( const std::string& url, const std::string& desti
     curl_easy_setopt(curl, CURLOPT_XFERINFODATA, this);
     curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0);
     
-    // Open local file
-    CVMWA_LOG("Debug", "Oppening local output stream '" << destination << "'");
-    fStream.clear();
-    fStream.open( destination.c_str(), std::ofstream::binary );
-    if (fStream.fail()) {
-        CVMWA_LOG("Error", "OFStream error" );
-        operationInstances--;
-        return HVE_IO_ERROR;
-    }
-    
     // Initiate connection (we have specified CURLOPT_CONNECT_ONLY)
     CURLcode res = curl_easy_perform(curl);
+    this->oStream = NULL;
     if (res != CURLE_OK) {
         CVMWA_LOG("Error", "cURL Error #" << res );
         operationInstances--;
@@ -215,8 +252,6 @@ int CURLProvider::downloadFile( const std::string& url, const std::string& desti
     // Notify completion
     if (pf) pf->complete("Download completed");
     
-    // Close stream
-    fStream.close();
     operationInstances--;
     return HVE_OK;
     
@@ -245,9 +280,6 @@ int CURLProvider::downloadText( const std::string& url, std::string * destinatio
     this->pf = pf;
     this->maxStreamSize = 0;
     
-    // Reset timestamp
-    if (pf) pf->__lastEventTime = getMillis();
-    
     // Setup callbacks
     curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, __curl_headerfunc);
     curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, __curl_datacb_string);
@@ -316,3 +348,1144 @@ int CURLProvider::abortAll() {
     CRASH_REPORT_END;
 }
 
+
+/**
+ * Extract the content-length of a transfer in the multi engine
+ */
+size_t __curlm_headerfunc( void *ptr, size_t size, size_t nmemb, CURLTransfer * self) {
+    CRASH_REPORT_BEGIN;
+    size_t dataLen = size * nmemb;
+
+    // Move data to std::String
+    std::string cppString( (char *) ptr, dataLen );
+    boost::algorithm::trim_right( cppString );
+    if (boost::algorithm::starts_with(cppString, "HTTP/")) {
+        // A new response starts (after a redirect), forget the previous headers
+        self->maxStreamSize = 0;
+        self->rangeTotal = -1;
+        self->validator = "";
+    } else if ((cppString.length() > 16) && boost::algorithm::istarts_with(cppString, "Content-Length: ")) {
+        self->maxStreamSize = ston<size_t>( cppString.substr(16) ) + self->resumeFrom;
+    } else if (boost::algorithm::istarts_with(cppString, "Content-Range: bytes ")) {
+        // Content-Range: bytes <first>-<last>/<total>
+        size_t slash = cppString.find('/');
+        if ((slash != std::string::npos) && (cppString[slash+1] != '*'))
+            self->rangeTotal = ston<long long>( cppString.substr(slash+1) );
+    } else if (boost::algorithm::istarts_with(cppString, "ETag: ")) {
+        self->validator = cppString.substr(6);
+    } else if (boost::algorithm::istarts_with(cppString, "Last-Modified: ") && self->validator.empty()) {
+        self->validator = cppString.substr(15);
+    }
+
+    return dataLen;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Callback function for the data of a transfer in the multi engine. It runs on the
+ * event loop thread, so it only validates the data and hands it to the waiting thread.
+ */
+size_t __curlm_datacb(void *ptr, size_t size, size_t nmemb, CURLTransfer * self ) {
+    CRASH_REPORT_BEGIN;
+    size_t dataLen = size * nmemb;
+    if (self->abortFlag) return 0;
+
+    // A ranged transfer must get only the range, otherwise we would write the
+    // beginning of the file at the offset of the range
+    if (self->ranged && (self->accepted == 0) && !self->rangeIgnored) {
+        long code = 0;
+        curl_easy_getinfo(self->curl, CURLINFO_RESPONSE_CODE, &code);
+        if ((code != 206) && (code != 0)) { // (Local files have no response code)
+            CVMWA_LOG("Warning", "The server ignored the requested range (HTTP " << code << ")" );
+            self->rangeIgnored = true;
+        }
+    }
+    if (self->rangeIgnored) return 0;
+
+    // Reject data beyond the requested range
+    if ((self->expected >= 0) && (self->accepted + (long long)dataLen > self->expected)) {
+        CVMWA_LOG("Error", "Received more data than requested" );
+        return 0;
+    }
+
+    // Hand it over, or pause until the waiting thread catches up
+    if (!self->engine->deliver( self, (const char *) ptr, dataLen ))
+        return CURL_WRITEFUNC_PAUSE;
+    self->accepted += dataLen;
+
+    return dataLen;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Write the data of a transfer in the multi engine to it's stream. It runs on
+ * the thread waiting for the transfer.
+ */
+void __curlm_write( CURLTransfer * self, const std::string& data ) {
+    CRASH_REPORT_BEGIN;
+
+    // Drop the rest of the data if the stream has failed
+    if (self->stream->fail()) return;
+
+    // Write to the output stream
+    if (self->groupReceived != NULL) {
+        // (All the segments are written by the same thread, so the counter is not contended)
+        self->stream->write( data.c_str(), data.length() );
+        *self->groupReceived += data.length();
+        DownloadProvider::fireProgressEvent( self->pf, (size_t) *self->groupReceived, (size_t) self->groupSize );
+    } else {
+        DownloadProvider::writeToStream( self->stream, self->pf, self->maxStreamSize, data.c_str(), data.length() );
+    }
+
+    // Abort the transfer if the stream is not accepting data
+    if (self->stream->fail()) {
+        CVMWA_LOG("Error", "Output stream error" );
+        self->abortFlag = true;
+        return;
+    }
+    self->received += data.length();
+
+    CRASH_REPORT_END;
+}
+
+/**
+ * Callback function for checking for aborted transfers in the multi engine
+ */
+int __curlm_xferinfo(CURLTransfer * self, curl_off_t, curl_off_t, curl_off_t, curl_off_t) {
+    return self->abortFlag ? -1 : 0;
+}
+
+/**
+ * Create the multi engine
+ */
+CURLMultiEngine::CURLMultiEngine( int maxTransfers ) 
+    : multi(NULL), share(NULL), maxTransfers(maxTransfers), pending(), active(), mutex(), workCond(), doneCond(), thread(NULL), exiting(false) {
+    CRASH_REPORT_BEGIN;
+
+    // Initialize global CURL
+    curl_global_init(CURL_GLOBAL_ALL);
+
+    // Create the multi handle, keeping up to one idle connection per transfer slot
+    multi = curl_multi_init();
+    curl_multi_setopt(multi, CURLMOPT_MAXCONNECTS, (long) maxTransfers);
+
+    // Share the DNS cache and the TLS sessions between the transfers. All the
+    // easy handles are used only from the event loop thread, so no locking is needed.
+    share = curl_share_init();
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+
+    CRASH_REPORT_END;
+}
+
+/**
+ * Stop the event loop and release the handles
+ */
+CURLMultiEngine::~CURLMultiEngine() {
+    CRASH_REPORT_BEGIN;
+
+    // Stop the thread
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        exiting = true;
+        workCond.notify_all();
+    }
+    if (thread != NULL) {
+        wakeup();
+        thread->join();
+        delete thread;
+    }
+
+    // Release the handles of the transfers that did not complete
+    for (std::map< CURL *, CURLTransferPtr >::iterator it = active.begin(); it != active.end(); ++it) {
+        curl_multi_remove_handle(multi, it->first);
+        curl_easy_cleanup(it->first);
+    }
+    for (std::list< CURLTransferPtr >::iterator it = pending.begin(); it != pending.end(); ++it) {
+        curl_easy_cleanup((*it)->curl);
+    }
+
+    curl_multi_cleanup(multi);
+    curl_share_cleanup(share);
+
+    CRASH_REPORT_END;
+}
+
+/**
+ * Return the engine shared by all the sessions
+ */
+CURLMultiEnginePtr CURLMultiEngine::Default() {
+    CRASH_REPORT_BEGIN;
+    static boost::mutex defaultMutex;
+    boost::unique_lock<boost::mutex> lock(defaultMutex);
+    if (!systemEngine)
+        systemEngine = boost::make_shared< CURLMultiEngine >();
+    return systemEngine;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Wake up the event loop if it's waiting for socket activity
+ */
+void CURLMultiEngine::wakeup() {
+#if LIBCURL_VERSION_NUM >= 0x074400
+    curl_multi_wakeup(multi);
+#endif
+    // (Older versions notice the changes within DOWNLOAD_POLL_TIMER)
+}
+
+/**
+ * Queue a transfer and wait for it to complete
+ */
+CURLcode CURLMultiEngine::perform( const CURLTransferPtr& transfer ) {
+    CRASH_REPORT_BEGIN;
+    performAll( std::vector< CURLTransferPtr >( 1, transfer ) );
+    return transfer->result;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Queue the transfers and wait for all of them to complete
+ */
+void CURLMultiEngine::performAll( const std::vector< CURLTransferPtr >& transfers, const boost::function< void () >& written ) {
+    CRASH_REPORT_BEGIN;
+    boost::unique_lock<boost::mutex> lock(mutex);
+    if (exiting) {
+        for (std::vector< CURLTransferPtr >::const_iterator it = transfers.begin(); it != transfers.end(); ++it) {
+            curl_easy_cleanup((*it)->curl);
+            (*it)->curl = NULL;
+            (*it)->result = CURLE_ABORTED_BY_CALLBACK;
+            (*it)->completed = true;
+        }
+        return;
+    }
+
+    // Start the event loop on the first transfer
+    if (thread == NULL)
+        thread = new boost::thread( boost::bind( &CURLMultiEngine::threadLoop, this ) );
+
+    // Queue the transfers
+    for (std::vector< CURLTransferPtr >::const_iterator it = transfers.begin(); it != transfers.end(); ++it) {
+        curl_easy_setopt((*it)->curl, CURLOPT_SHARE, share);
+        (*it)->engine = this;
+        pending.push_back( *it );
+    }
+    workCond.notify_all();
+    wakeup();
+
+    // Write the data of the transfers as it arrives, until they are completed
+    try {
+        std::vector< std::pair< CURLTransfer *, std::deque< std::string > > > received;
+        for (;;) {
+
+            // Take the data received so far
+            bool done = true, resume = false;
+            received.clear();
+            for (std::vector< CURLTransferPtr >::const_iterator it = transfers.begin(); it != transfers.end(); ++it) {
+                CURLTransfer * t = it->get();
+                if (!t->chunks.empty()) {
+                    received.push_back( std::make_pair( t, std::deque< std::string >() ) );
+                    received.back().second.swap( t->chunks );
+                    t->buffered = 0;
+                    if (t->paused) resume = true;
+                }
+                if (!t->completed) done = false;
+            }
+            if (received.empty()) {
+                if (done) break;
+                doneCond.wait(lock);
+                continue;
+            }
+
+            // Write it without holding the lock
+            lock.unlock();
+            if (resume) wakeup();
+            for (size_t i = 0; i < received.size(); i++) {
+                for (std::deque< std::string >::iterator jt = received[i].second.begin(); jt != received[i].second.end(); ++jt)
+                    __curlm_write( received[i].first, *jt );
+            }
+            if (written) written();
+            lock.lock();
+
+        }
+    } catch (...) {
+        if (!lock.owns_lock()) lock.lock();
+
+        // The transfers write to the memory of the caller, so they must be finished
+        // before we unwind: drop the queued ones and abort the running ones
+        for (std::vector< CURLTransferPtr >::const_iterator it = transfers.begin(); it != transfers.end(); ++it) {
+            if ((*it)->completed) continue;
+            std::list< CURLTransferPtr >::iterator jt = std::find( pending.begin(), pending.end(), *it );
+            if (jt != pending.end()) {
+                pending.erase( jt );
+                curl_easy_cleanup((*it)->curl);
+                (*it)->curl = NULL;
+                (*it)->result = CURLE_ABORTED_BY_CALLBACK;
+                (*it)->completed = true;
+            } else {
+                (*it)->abortFlag = true;
+            }
+        }
+        wakeup();
+
+        // Wait for the aborted transfers to complete without being interrupted again,
+        // dropping the data they have received
+        {
+            boost::this_thread::disable_interruption di;
+            for (std::vector< CURLTransferPtr >::const_iterator it = transfers.begin(); it != transfers.end(); ++it) {
+                while (!(*it)->completed)
+                    doneCond.wait(lock);
+                (*it)->chunks.clear();
+                (*it)->buffered = 0;
+            }
+        }
+        throw;
+
+    }
+
+    CRASH_REPORT_END;
+}
+
+/**
+ * Keep the data of a transfer for the waiting thread
+ */
+bool CURLMultiEngine::deliver( CURLTransfer * transfer, const char * data, size_t length ) {
+    CRASH_REPORT_BEGIN;
+    boost::unique_lock<boost::mutex> lock(mutex);
+
+    // (A chunk larger than the buffer is accepted when the buffer is empty)
+    if ((transfer->buffered > 0) && (transfer->buffered + length > DOWNLOAD_BUFFER_SIZE)) {
+        transfer->paused = true;
+        return false;
+    }
+    transfer->chunks.push_back( std::string( data, length ) );
+    transfer->buffered += length;
+    doneCond.notify_all();
+    return true;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Abort all the transfers of the specified owner
+ */
+void CURLMultiEngine::abort( const void * owner ) {
+    CRASH_REPORT_BEGIN;
+    boost::unique_lock<boost::mutex> lock(mutex);
+
+    // Complete the queued transfers right away
+    for (std::list< CURLTransferPtr >::iterator it = pending.begin(); it != pending.end(); ) {
+        if ((*it)->owner == owner) {
+            curl_easy_cleanup((*it)->curl);
+            (*it)->curl = NULL;
+            (*it)->result = CURLE_ABORTED_BY_CALLBACK;
+            (*it)->completed = true;
+            it = pending.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    doneCond.notify_all();
+
+    // The running transfers are aborted by the progress callback
+    for (std::map< CURL *, CURLTransferPtr >::iterator it = active.begin(); it != active.end(); ++it) {
+        if (it->second->owner == owner)
+            it->second->abortFlag = true;
+    }
+    wakeup();
+
+    CRASH_REPORT_END;
+}
+
+/**
+ * Change the maximum number of parallel transfers
+ */
+void CURLMultiEngine::setMaxTransfers( int maxTransfers ) {
+    CRASH_REPORT_BEGIN;
+    boost::unique_lock<boost::mutex> lock(mutex);
+    this->maxTransfers = maxTransfers;
+    curl_multi_setopt(multi, CURLMOPT_MAXCONNECTS, (long) maxTransfers);
+    workCond.notify_all();
+    wakeup();
+    CRASH_REPORT_END;
+}
+
+/**
+ * Transfer metrics
+ */
+size_t CURLMultiEngine::activeTransfers() {
+    boost::unique_lock<boost::mutex> lock(mutex);
+    return active.size();
+}
+size_t CURLMultiEngine::queuedTransfers() {
+    boost::unique_lock<boost::mutex> lock(mutex);
+    return pending.size();
+}
+
+/**
+ * The event loop that drives all the transfers
+ */
+void CURLMultiEngine::threadLoop() {
+    CRASH_REPORT_BEGIN;
+    int running, numfds, queued;
+    CURLMsg * msg;
+
+    std::vector< CURL * > resume;
+    for (;;) {
+
+        // Start the queued transfers, or sleep until there is something to do
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            while (!exiting && active.empty() && pending.empty())
+                workCond.wait(lock);
+            if (exiting) break;
+            while (!pending.empty() && ((int)active.size() < maxTransfers)) {
+                CURLTransferPtr transfer = pending.front();
+                pending.pop_front();
+                active[transfer->curl] = transfer;
+                curl_multi_add_handle(multi, transfer->curl);
+            }
+
+            // Find the paused transfers whose data was written (or that were aborted)
+            resume.clear();
+            for (std::map< CURL *, CURLTransferPtr >::iterator it = active.begin(); it != active.end(); ++it) {
+                if (it->second->paused && ((it->second->buffered == 0) || it->second->abortFlag)) {
+                    it->second->paused = false;
+                    resume.push_back( it->first );
+                }
+            }
+        }
+
+        // Resume them (this can call the data callback, so we must not hold the lock)
+        for (size_t i = 0; i < resume.size(); i++)
+            curl_easy_pause( resume[i], CURLPAUSE_CONT );
+
+        // Run the transfers
+        curl_multi_perform(multi, &running);
+
+        // Complete the finished transfers
+        while ((msg = curl_multi_info_read(multi, &queued)) != NULL) {
+            if (msg->msg != CURLMSG_DONE) continue;
+            CURL * curl = msg->easy_handle;
+            CURLcode result = msg->data.result;
+            curl_multi_remove_handle(multi, curl);
+
+            boost::unique_lock<boost::mutex> lock(mutex);
+            std::map< CURL *, CURLTransferPtr >::iterator it = active.find(curl);
+            if (it != active.end())
+                curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME, &it->second->totalTime);
+            curl_easy_cleanup(curl);
+            if (it != active.end()) {
+                it->second->curl = NULL;
+                it->second->result = result;
+                it->second->completed = true;
+                active.erase(it);
+            }
+            doneCond.notify_all();
+        }
+
+        // Wait for socket activity (curl_multi_poll can be interrupted by wakeup())
+        if (running > 0) {
+#if LIBCURL_VERSION_NUM >= 0x074400
+            curl_multi_poll(multi, NULL, 0, DOWNLOAD_POLL_TIMER, &numfds);
+#else
+            curl_multi_wait(multi, NULL, 0, DOWNLOAD_POLL_TIMER, &numfds);
+#endif
+        }
+
+    }
+
+    // Fail the transfers that did not complete
+    boost::unique_lock<boost::mutex> lock(mutex);
+    for (std::map< CURL *, CURLTransferPtr >::iterator it = active.begin(); it != active.end(); ++it) {
+        it->second->result = CURLE_ABORTED_BY_CALLBACK;
+        it->second->completed = true;
+    }
+    for (std::list< CURLTransferPtr >::iterator it = pending.begin(); it != pending.end(); ++it) {
+        (*it)->result = CURLE_ABORTED_BY_CALLBACK;
+        (*it)->completed = true;
+    }
+    doneCond.notify_all();
+
+    CRASH_REPORT_END;
+}
+
+/**
+ * Return the mirror set shared by all the download providers
+ */
+DownloadMirrorsPtr DownloadMirrors::Default() {
+    CRASH_REPORT_BEGIN;
+    static boost::mutex defaultMutex;
+    boost::unique_lock<boost::mutex> lock(defaultMutex);
+    if (!systemMirrors)
+        systemMirrors = boost::make_shared< DownloadMirrors >();
+    return systemMirrors;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Define the mirrors of an origin
+ */
+void DownloadMirrors::set( const std::string& origin, const std::vector< std::string >& mirrors ) {
+    CRASH_REPORT_BEGIN;
+    boost::unique_lock<boost::mutex> lock(mutex);
+    ranking.erase( origin );
+    rankingTime.erase( origin );
+    if (mirrors.empty()) {
+        this->mirrors.erase( origin );
+    } else {
+        this->mirrors[ origin ] = mirrors;
+    }
+    CRASH_REPORT_END;
+}
+
+/**
+ * Find the origin of the URL and the bases that can serve it
+ */
+bool DownloadMirrors::lookup( const std::string& url, std::string * origin, std::vector< std::string > * bases, bool * ranked ) {
+    CRASH_REPORT_BEGIN;
+    boost::unique_lock<boost::mutex> lock(mutex);
+
+    // Pick the longest origin the URL starts with
+    std::map< std::string, std::vector< std::string > >::iterator best = mirrors.end();
+    for (std::map< std::string, std::vector< std::string > >::iterator it = mirrors.begin(); it != mirrors.end(); ++it) {
+        if (boost::algorithm::starts_with( url, it->first ) && ((best == mirrors.end()) || (it->first.length() > best->first.length())))
+            best = it;
+    }
+    if (best == mirrors.end()) return false;
+    *origin = best->first;
+
+    // Use the ranking if it's still valid, otherwise the origin and then the mirrors
+    std::map< std::string, std::vector< std::string > >::iterator it = ranking.find( *origin );
+    if ((it != ranking.end()) && (getMillis() - rankingTime[ *origin ] < DOWNLOAD_MIRROR_TTL)) {
+        *bases = it->second;
+        *ranked = true;
+    } else {
+        bases->assign( 1, *origin );
+        bases->insert( bases->end(), best->second.begin(), best->second.end() );
+        *ranked = false;
+    }
+    return true;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Store the ranking of the bases of an origin
+ */
+void DownloadMirrors::rank( const std::string& origin, const std::vector< std::string >& bases ) {
+    CRASH_REPORT_BEGIN;
+    boost::unique_lock<boost::mutex> lock(mutex);
+    if (mirrors.find( origin ) == mirrors.end()) return;
+    ranking[ origin ] = bases;
+    rankingTime[ origin ] = getMillis();
+    CRASH_REPORT_END;
+}
+
+/**
+ * Move a base that failed to the end of the ranking
+ */
+void DownloadMirrors::demote( const std::string& origin, const std::string& base ) {
+    CRASH_REPORT_BEGIN;
+    boost::unique_lock<boost::mutex> lock(mutex);
+    std::map< std::string, std::vector< std::string > >::iterator it = ranking.find( origin );
+    if (it == ranking.end()) return;
+    std::vector< std::string >::iterator jt = std::find( it->second.begin(), it->second.end(), base );
+    if (jt == it->second.end()) return;
+    it->second.erase( jt );
+    it->second.push_back( base );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Create the state of a transfer to the given stream
+ */
+CURLTransferPtr CURLMultiProvider::prepare( const std::string& url, std::ostream * stream, const VariableTaskPtr& pf, long timeout ) {
+    CRASH_REPORT_BEGIN;
+    CURLTransferPtr t = boost::make_shared< CURLTransfer >( this, stream, pf );
+    t->curl = curl_easy_init();
+    if (t->curl == NULL) return CURLTransferPtr();
+
+    curl_easy_setopt(t->curl, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(t->curl, CURLOPT_AUTOREFERER, 1L);
+    curl_easy_setopt(t->curl, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(t->curl, CURLOPT_FAILONERROR, 1L);
+    curl_easy_setopt(t->curl, CURLOPT_SSL_VERIFYPEER, 0L);
+    curl_easy_setopt(t->curl, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(t->curl, CURLOPT_CONNECTTIMEOUT, 10L );
+    curl_easy_setopt(t->curl, CURLOPT_TIMEOUT, timeout );
+
+    // Setup callbacks
+    curl_easy_setopt(t->curl, CURLOPT_HEADERFUNCTION, __curlm_headerfunc);
+    curl_easy_setopt(t->curl, CURLOPT_WRITEFUNCTION, __curlm_datacb);
+    curl_easy_setopt(t->curl, CURLOPT_XFERINFOFUNCTION, __curlm_xferinfo);
+    curl_easy_setopt(t->curl, CURLOPT_WRITEDATA, t.get());
+    curl_easy_setopt(t->curl, CURLOPT_HEADERDATA, t.get());
+    curl_easy_setopt(t->curl, CURLOPT_XFERINFODATA, t.get());
+    curl_easy_setopt(t->curl, CURLOPT_NOPROGRESS, 0L);
+
+    return t;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Rank the bases of an origin by requesting the first bytes of the file from all of them
+ */
+void CURLMultiProvider::probeMirrors( const std::string& origin, const std::string& path, std::vector< std::string > * bases ) {
+    CRASH_REPORT_BEGIN;
+    long lastByte = DOWNLOAD_PROBE_SIZE - 1;
+    std::string range = "0-" + ntos<long>( lastByte );
+
+    // Probe all of them in parallel
+    std::vector< CURLTransferPtr > transfers;
+    std::vector< boost::shared_ptr< std::ostringstream > > streams;
+    for (std::vector< std::string >::iterator it = bases->begin(); it != bases->end(); ++it) {
+        boost::shared_ptr< std::ostringstream > sStream = boost::make_shared< std::ostringstream >();
+        CURLTransferPtr t = prepare( *it + path, sStream.get(), VariableTaskPtr(), DOWNLOAD_PROBE_TIMEOUT );
+        if (!t) return;
+        t->setRange( range );
+        t->expected = DOWNLOAD_PROBE_SIZE;
+        streams.push_back( sStream );
+        transfers.push_back( t );
+    }
+    engine->performAll( transfers );
+
+    // Sort them by the time they took. The ones that failed go last, in their original order.
+    std::vector< std::pair< double, std::string > > scores;
+    for (size_t i = 0; i < transfers.size(); i++) {
+        const CURLTransferPtr & t = transfers[i];
+        bool ok = (t->received > 0) && ((t->result == CURLE_OK) || ((t->result == CURLE_WRITE_ERROR) && (t->received == t->expected)));
+        if (ok) {
+            CVMWA_LOG("Info", "Mirror '" << (*bases)[i] << "' served " << t->received << " bytes in " << t->totalTime << " s");
+            scores.push_back( std::make_pair( t->totalTime, (*bases)[i] ) );
+        } else {
+            CVMWA_LOG("Warning", "Mirror '" << (*bases)[i] << "' failed (cURL Error #" << t->result << ")");
+            scores.push_back( std::make_pair( DOWNLOAD_PROBE_TIMEOUT + 1.0 + i, (*bases)[i] ) );
+        }
+    }
+    std::sort( scores.begin(), scores.end() );
+
+    bases->clear();
+    for (size_t i = 0; i < scores.size(); i++)
+        bases->push_back( scores[i].second );
+    mirrors->rank( origin, *bases );
+
+    CRASH_REPORT_END;
+}
+
+/**
+ * Return the URLs the file can be downloaded from, fastest first
+ */
+std::vector< std::string > CURLMultiProvider::candidates( const std::string& url, std::string * origin, std::vector< std::string > * bases ) {
+    CRASH_REPORT_BEGIN;
+    bool ranked = false;
+    if (!mirrors || !mirrors->lookup( url, origin, bases, &ranked )) {
+        origin->clear();
+        bases->assign( 1, "" );
+        ranked = true;
+    }
+
+    // Rank the mirrors the first time we use them
+    std::string path = url.substr( origin->length() );
+    if (!ranked) probeMirrors( *origin, path, bases );
+
+    std::vector< std::string > urls;
+    for (std::vector< std::string >::iterator it = bases->begin(); it != bases->end(); ++it)
+        urls.push_back( *it + path );
+    return urls;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Run a transfer to the given stream on the engine
+ */
+int CURLMultiProvider::transfer( const std::string& url, std::ostream * stream, const VariableTaskPtr& pf, long timeout, long long offset ) {
+    CRASH_REPORT_BEGIN;
+
+    // Check if all transfers are blocked
+    if (abortPersistsFlag) {
+        CVMWA_LOG("Error", "Download of '" << url << "' blocked");
+        return HVE_IO_ERROR;
+    }
+
+    // Try the mirrors in order, each one continuing from where the previous one stopped
+    std::string origin;
+    std::vector< std::string > bases;
+    std::vector< std::string > urls = candidates( url, &origin, &bases );
+    long long position = offset;
+    int ans = HVE_IO_ERROR;
+    for (size_t i = 0; i < urls.size(); i++) {
+
+        // Prepare the transfer
+        CVMWA_LOG("Debug", "Downloading from '" << urls[i] << "'");
+        CURLTransferPtr t = prepare( urls[i], stream, pf, timeout );
+        if (!t) return HVE_IO_ERROR;
+
+        // Continue from the given offset
+        if (position > 0) {
+            std::string range = ntos<long long>(position) + "-";
+            t->setRange( range );
+            t->resumeFrom = position;
+        }
+
+        // Run it
+        CURLcode res = engine->perform( t );
+        position += t->received;
+        if ((res == CURLE_OK) && !t->rangeIgnored) {
+            CVMWA_LOG("Info", "cURL Download completed" );
+
+            // Notify completion
+            if (pf) pf->complete("Download completed");
+            return HVE_OK;
+        }
+
+        // Stop if we were aborted or if the stream is not accepting data
+        if (res == CURLE_ABORTED_BY_CALLBACK) return HVE_IO_ERROR;
+        if (stream->fail()) return HVE_IO_ERROR;
+        if (t->rangeIgnored) {
+            ans = HVE_NOT_SUPPORTED;
+        } else {
+            CVMWA_LOG("Error", "cURL Error #" << res );
+            ans = HVE_IO_ERROR;
+        }
+
+        // Fail over to the next mirror
+        if (!origin.empty()) mirrors->demote( origin, bases[i] );
+        if (i + 1 < urls.size()) {
+            CVMWA_LOG("Warning", "Continuing the download from '" << urls[i+1] << "' at byte " << position);
+        }
+    }
+    return ans;
+
+    CRASH_REPORT_END;
+}
+
+/**
+ * Load the state of an interrupted download of the given URL. Returns false if there is
+ * no state or if it does not match the URL, the size and the validator of the file.
+ */
+bool __loadDownloadState( const std::string& stateFile, const std::string& url, const std::string& validator, long long size, std::vector< DownloadRange > * ranges ) {
+    CRASH_REPORT_BEGIN;
+    std::ifstream fIn( stateFile.c_str() );
+    if (!fIn.good()) return false;
+
+    std::string line, key, value, sURL, sValidator;
+    long long sSize = -1;
+    ranges->clear();
+    while (std::getline( fIn, line )) {
+        if (getKV( line, &key, &value, '=', 0 ) == 0) continue;
+        if (key == "url") {
+            sURL = value;
+        } else if (key == "validator") {
+            sValidator = value;
+        } else if (key == "size") {
+            sSize = ston<long long>( value );
+        } else if (key == "range") {
+            // range=<first>-<last>:<done>
+            DownloadRange r;
+            if (sscanf( value.c_str(), "%lld-%lld:%lld", &r.first, &r.last, &r.done ) != 3) return false;
+            if ((r.first > r.last) || (r.done < 0) || (r.done > r.last - r.first + 1)) return false;
+            ranges->push_back( r );
+        }
+    }
+
+    // The file must not have changed on the server
+    if ((sURL != url) || (sSize != size) || ranges->empty()) return false;
+    if (validator.empty() || (sValidator != validator)) return false;
+    return true;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Save the state of a download so it can be resumed later
+ */
+bool __saveDownloadState( const std::string& stateFile, const std::string& url, const std::string& validator, long long size, const std::vector< DownloadRange >& ranges ) {
+    CRASH_REPORT_BEGIN;
+
+    // Write it to a temporary file first, so a crash never leaves a partial state
+    std::string tmpFile = stateFile + ".tmp";
+    {
+        std::ofstream fOut( tmpFile.c_str(), std::ofstream::trunc );
+        if (!fOut.good()) return false;
+        fOut << "url=" << url << std::endl;
+        fOut << "validator=" << validator << std::endl;
+        fOut << "size=" << size << std::endl;
+        for (std::vector< DownloadRange >::const_iterator it = ranges.begin(); it != ranges.end(); ++it)
+            fOut << "range=" << it->first << "-" << it->last << ":" << it->done << std::endl;
+        fOut.close();
+        if (fOut.fail()) {
+            ::remove( tmpFile.c_str() );
+            return false;
+        }
+    }
+    boost::system::error_code ec;
+    boost::filesystem::rename( tmpFile, stateFile, ec );
+    return !ec;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Pass the progress of the ranges of a running batch to the checkpoint function, if
+ * DOWNLOAD_STATE_INTERVAL has passed since the last time. The streams are flushed
+ * first, so the progress never gets ahead of the file.
+ */
+void __checkpointRanges( const boost::function< void ( const std::vector< DownloadRange >& ) >& checkpoint, const std::vector< DownloadRange > * ranges,
+                         const std::vector< size_t > * indices, const std::vector< CURLTransferPtr > * transfers,
+                         const std::vector< boost::shared_ptr< std::fstream > > * streams, long * lastTime ) {
+    CRASH_REPORT_BEGIN;
+    if (getMillis() - *lastTime < DOWNLOAD_STATE_INTERVAL) return;
+    *lastTime = getMillis();
+
+    std::vector< DownloadRange > current( *ranges );
+    for (size_t i = 0; i < transfers->size(); i++) {
+        (*streams)[i]->flush();
+        if (!(*streams)[i]->fail()) current[ (*indices)[i] ].done += (*transfers)[i]->received;
+    }
+    checkpoint( current );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Fetch the missing bytes of the ranges, failing over to the next mirror
+ */
+int CURLMultiProvider::fetchRanges( const std::vector< std::string >& urls, const std::string& origin, const std::vector< std::string >& bases,
+                                    const std::string& destination, std::vector< DownloadRange > * ranges, const std::string& validator,
+                                    long long * groupReceived, long long groupSize, const VariableTaskPtr& pf,
+                                    const boost::function< void ( const std::vector< DownloadRange >& ) >& checkpoint ) {
+    CRASH_REPORT_BEGIN;
+    bool completed = false;
+    long lastCheckpoint = getMillis();
+    for (size_t m = 0; (m < urls.size()) && !completed; m++) {
+        if (m > 0) {
+            if (!origin.empty()) mirrors->demote( origin, bases[m-1] );
+            CVMWA_LOG("Warning", "Continuing the download from '" << urls[m] << "' at " << (groupSize - *groupReceived) << " remaining bytes");
+        }
+        CVMWA_LOG("Debug", "Downloading '" << urls[m] << "' in " << ranges->size() << " ranges (size=" << groupSize << ")");
+
+        // Run the transfers in batches, so we don't open too many connections and files at once
+        completed = true;
+        for (size_t next = 0; next < ranges->size(); ) {
+
+            // Prepare one transfer per incomplete range, each writing through its own stream
+            // positioned at the first missing byte of the range
+            std::vector< size_t > indices;
+            std::vector< CURLTransferPtr > transfers;
+            std::vector< boost::shared_ptr< std::fstream > > streams;
+            for (; (next < ranges->size()) && (transfers.size() < DOWNLOAD_RANGE_BATCH); next++) {
+                DownloadRange & r = (*ranges)[next];
+                long long first = r.first + r.done;
+                if (first > r.last) continue;
+
+                boost::shared_ptr< std::fstream > fStream = boost::make_shared< std::fstream >( destination.c_str(), std::fstream::in | std::fstream::out | std::fstream::binary );
+                fStream->seekp( first );
+                if (fStream->fail()) {
+                    CVMWA_LOG("Error", "FStream error" );
+                    return HVE_IO_ERROR;
+                }
+
+                CURLTransferPtr t = prepare( urls[m], fStream.get(), pf, 7200L );
+                if (!t) return HVE_IO_ERROR;
+                std::string range = ntos<long long>(first) + "-" + ntos<long long>(r.last);
+                t->setRange( range );
+                if (!validator.empty() && (m == 0)) {
+                    // Send the whole file instead if it has changed since the probe
+                    // (the validators of the other mirrors are not comparable)
+                    t->headers = curl_slist_append( t->headers, ("If-Range: " + validator).c_str() );
+                    curl_easy_setopt(t->curl, CURLOPT_HTTPHEADER, t->headers);
+                }
+                t->expected = r.last - first + 1;
+                t->groupReceived = groupReceived;
+                t->groupSize = groupSize;
+
+                indices.push_back( next );
+                streams.push_back( fStream );
+                transfers.push_back( t );
+            }
+
+            // Run them, saving their progress periodically. If we are interrupted, save
+            // the bytes written by the aborted transfers.
+            boost::function< void () > written;
+            if (checkpoint) written = boost::bind( &__checkpointRanges, boost::cref(checkpoint), ranges, &indices, &transfers, &streams, &lastCheckpoint );
+            try {
+                engine->performAll( transfers, written );
+            } catch (boost::thread_interrupted &) {
+                for (size_t i = 0; i < transfers.size(); i++) {
+                    DownloadRange & r = (*ranges)[indices[i]];
+                    streams[i]->close();
+                    if (!streams[i]->fail()) r.done += transfers[i]->received;
+                }
+                if (checkpoint) checkpoint( *ranges );
+                throw;
+            }
+
+            // Update the completed bytes of every range. The transfers whose range was
+            // ignored wrote nothing.
+            bool changed = false;
+            for (size_t i = 0; i < transfers.size(); i++) {
+                DownloadRange & r = (*ranges)[indices[i]];
+                streams[i]->close();
+                if (transfers[i]->rangeIgnored && !validator.empty() && (m == 0)) changed = true;
+                if (!streams[i]->fail()) r.done += transfers[i]->received;
+                if ((transfers[i]->result != CURLE_OK) || (r.done != r.last - r.first + 1) || streams[i]->fail()) {
+                    CVMWA_LOG("Error", "Range #" << indices[i] << " failed (cURL Error #" << transfers[i]->result << ")" );
+
+                    // Stop if we were aborted or if we can't write to the file
+                    if ((transfers[i]->result == CURLE_ABORTED_BY_CALLBACK) || streams[i]->fail())
+                        return HVE_IO_ERROR;
+                    completed = false;
+                }
+            }
+
+            // The server sent the whole file because of the If-Range header, so the
+            // file has changed since the probe and the ranges we have are not valid
+            if (changed) {
+                CVMWA_LOG("Warning", "The file has changed while downloading it");
+                return HVE_IO_ERROR;
+            }
+
+        }
+    }
+    return completed ? HVE_OK : HVE_IO_ERROR;
+
+    CRASH_REPORT_END;
+}
+
+/**
+ * Download a file in byte ranges, resuming an interrupted download if possible
+ */
+int CURLMultiProvider::downloadSegmented( const std::string& url, const std::string& destination, const VariableTaskPtr& pf ) {
+    CRASH_REPORT_BEGIN;
+    if (abortPersistsFlag) return HVE_IO_ERROR;
+    std::string stateFile = destination + ".state";
+
+    // Local mirrors are faster to copy in a single stream
+    std::string origin;
+    std::vector< std::string > bases;
+    std::vector< std::string > urls = candidates( url, &origin, &bases );
+    if (boost::algorithm::istarts_with( urls[0], "file://" )) return HVE_NOT_SUPPORTED;
+
+    // Probe the size of the file, its validator and the support for ranges by requesting
+    // the first byte from the fastest mirror that answers. If the server ignores the range
+    // the probe is aborted after it.
+    CURLTransferPtr probe;
+    size_t primary = 0;
+    for (; primary < urls.size(); primary++) {
+        if (boost::algorithm::istarts_with( urls[primary], "file://" )) continue;
+        std::ostringstream probeStream;
+        probe = prepare( urls[primary], &probeStream, VariableTaskPtr(), 60L );
+        if (!probe) return HVE_IO_ERROR;
+        probe->setRange( "0-0" );
+        probe->expected = 1;
+        CURLcode res = engine->perform( probe );
+        if (res == CURLE_ABORTED_BY_CALLBACK) return HVE_IO_ERROR;
+        if ((res == CURLE_OK) && (probe->received == 1) && (probe->rangeTotal > 0)) break;
+    }
+    if (primary >= urls.size()) {
+        CVMWA_LOG("Debug", "Not using ranges for '" << url << "'");
+        ::remove( stateFile.c_str() );
+        return HVE_NOT_SUPPORTED;
+    }
+    long long size = probe->rangeTotal;
+    std::string validator = probe->validator;
+
+    // Continue an interrupted download if the file did not change, otherwise
+    // allocate the output file and split it in ranges
+    std::vector< DownloadRange > ranges;
+    long long groupReceived = 0;
+    if (file_exists( destination ) && (boost::filesystem::file_size( destination ) == (boost::uintmax_t) size)
+        && __loadDownloadState( stateFile, url, validator, size, &ranges )) {
+
+        for (std::vector< DownloadRange >::iterator it = ranges.begin(); it != ranges.end(); ++it)
+            groupReceived += it->done;
+        CVMWA_LOG("Info", "Resuming download of '" << url << "' from " << groupReceived << "/" << size << " bytes");
+
+    } else {
+
+        {
+            std::ofstream fStream( destination.c_str(), std::ofstream::binary );
+            if (fStream.fail()) {
+                CVMWA_LOG("Error", "OFStream error" );
+                return HVE_IO_ERROR;
+            }
+        }
+        try {
+            boost::filesystem::resize_file( destination, (boost::uintmax_t) size );
+        } catch (boost::filesystem::filesystem_error &e) {
+            CVMWA_LOG("Error", "Unable to allocate '" << destination << "': " << e.what() );
+            return HVE_IO_ERROR;
+        }
+
+        // Small files are fetched as a single range
+        long long count = (size < segmentMinSize) ? 1 : std::max( segments, 1 );
+        long long segmentSize = (size + count - 1) / count;
+        for (long long first = 0; first < size; first += segmentSize) {
+            DownloadRange r;
+            r.first = first;
+            r.last = std::min( first + segmentSize, size ) - 1;
+            r.done = 0;
+            ranges.push_back( r );
+        }
+
+    }
+
+    // Keep the state on disk while we are downloading (only if the server gave us
+    // something to tell if the file has changed)
+    bool resumable = !validator.empty();
+    if (resumable) __saveDownloadState( stateFile, url, validator, size, ranges );
+
+    // Fetch the ranges from the fastest mirror, and the ones that failed from the next
+    std::vector< std::string > rangeURLs( urls.begin() + primary, urls.end() );
+    std::vector< std::string > rangeBases( bases.begin() + primary, bases.end() );
+    boost::function< void ( const std::vector< DownloadRange >& ) > checkpoint;
+    if (resumable) checkpoint = boost::bind( &__saveDownloadState, stateFile, url, validator, size, _1 );
+    bool completed = (fetchRanges( rangeURLs, origin, rangeBases, destination, &ranges, validator, &groupReceived, size, pf, checkpoint ) == HVE_OK);
+
+    // Keep the state of an incomplete download for the next attempt
+    if (!completed) {
+        if (resumable) __saveDownloadState( stateFile, url, validator, size, ranges );
+        return HVE_IO_ERROR;
+    }
+    ::remove( stateFile.c_str() );
+    CVMWA_LOG("Info", "cURL Download completed" );
+
+    // Notify completion
+    if (pf) pf->complete("Download completed");
+    return HVE_OK;
+
+    CRASH_REPORT_END;
+}
+
+/**
+ * Download a file
+ */
+int CURLMultiProvider::downloadFile( const std::string& url, const std::string& destination, const VariableTaskPtr& pf ) {
+    CRASH_REPORT_BEGIN;
+
+    // Download in ranges if the server supports them
+    int res = downloadSegmented( url, destination, pf );
+    if (res != HVE_NOT_SUPPORTED) return res;
+
+    // Open local file
+    std::ofstream fStream( destination.c_str(), std::ofstream::binary );
+    if (fStream.fail()) {
+        CVMWA_LOG("Error", "OFStream error" );
+        return HVE_IO_ERROR;
+    }
+
+    // Files can be big (assume up to 10G), with the worst case of 10Mbps, it won't take more than 2h
+    res = transfer( url, &fStream, pf, 7200L );
+
+    // Close stream
+    fStream.close();
+    if ((res == HVE_OK) && fStream.fail()) {
+        CVMWA_LOG("Error", "OFStream error" );
+        return HVE_IO_ERROR;
+    }
+    return res;
+
+    CRASH_REPORT_END;
+}
+
+/**
+ * Download a file to the specified stream
+ */
+int CURLMultiProvider::downloadStream( const std::string& url, std::ostream * stream, const VariableTaskPtr& pf, long long offset ) {
+    CRASH_REPORT_BEGIN;
+    return transfer( url, stream, pf, 7200L, offset );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Download byte ranges of a file to the same offsets of the destination file
+ */
+int CURLMultiProvider::downloadRanges( const std::string& url, const std::string& destination, const std::vector< std::pair< long long, long long > >& ranges, const VariableTaskPtr& pf ) {
+    CRASH_REPORT_BEGIN;
+    if (abortPersistsFlag) return HVE_IO_ERROR;
+    std::string origin;
+    std::vector< std::string > bases;
+    std::vector< std::string > urls = candidates( url, &origin, &bases );
+
+    // The progress is reported over the total size of the ranges
+    std::vector< DownloadRange > state;
+    long long groupReceived = 0, groupSize = 0;
+    for (std::vector< std::pair< long long, long long > >::const_iterator it = ranges.begin(); it != ranges.end(); ++it) {
+        DownloadRange r;
+        r.first = it->first;
+        r.last = it->second;
+        r.done = 0;
+        state.push_back( r );
+        groupSize += r.last - r.first + 1;
+    }
+
+    int res = fetchRanges( urls, origin, bases, destination, &state, "", &groupReceived, groupSize, pf,
+                           boost::function< void ( const std::vector< DownloadRange >& ) >() );
+    if (res != HVE_OK) return res;
+    CVMWA_LOG("Info", "cURL Download completed" );
+
+    // Notify completion
+    if (pf) pf->complete("Download completed");
+    return HVE_OK;
+
+    CRASH_REPORT_END;
+}
+
+/**
+ * Download a text
+ */
+int CURLMultiProvider::downloadText( const std::string& url, std::string * destination, const VariableTaskPtr& pf ) {
+    CRASH_REPORT_BEGIN;
+    std::ostringstream sStream;
+
+    // Texts are usually small, so we are not expecting it to take more than a minute on the slowest networks ever
+    int res = transfer( url, &sStream, pf, 60L );
+    if (res == HVE_OK)
+        *destination = sStream.str();
+    return res;
+
+    CRASH_REPORT_END;
+}
+
+/**
+ * Create a clone of this instance that uses the same engine
+ */
+DownloadProviderPtr CURLMultiProvider::clone() {
+    CURLMultiProviderPtr provider = boost::make_shared< CURLMultiProvider >( engine, mirrors );
+    provider->setSegments( segments, segmentMinSize );
+    return provider;
+}
+
+/**
+ * Configure the segmented downloads
+ */
+void CURLMultiProvider::setSegments( int segments, long long minSize ) {
+    this->segments = segments;
+    this->segmentMinSize = minSize;
+}
+
+/**
+ * Define the mirrors of the URLs starting with origin
+ */
+void CURLMultiProvider::setMirrors( const std::string& origin, const std::vector< std::string >& mirrors ) {
+    CRASH_REPORT_BEGIN;
+    this->mirrors->set( origin, mirrors );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Abort the transfers of this instance
+ */
+int CURLMultiProvider::abort() {
+    CRASH_REPORT_BEGIN;
+    engine->abort( this );
+    return HVE_OK;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Abort the transfers of this instance and block all the future ones
+ */
+int CURLMultiProvider::abortAll() {
+    CRASH_REPORT_BEGIN;
+    abortPersistsFlag = true;
+    engine->abort( this );
+    return HVE_OK;
+    CRASH_REPORT_END;
+}
@@ -35,6 +35,8 @@
 #include "CernVM/Utilities.h"
 #include "CernVM/Hypervisor.h"
 #include "CernVM/DaemonCtl.h"
+#include "CernVM/DownloadPipeline.h"
+#include "CernVM/DeltaDownload.h"
 
 #include "contextiso.h"
 #include "floppyIO.h"
@@ -454,7 +456,7 @@ int HVInstance::cernVMCached( std::string version, std::string * filename ) {
  * Download a particular version of the CernVM ISO
  */
 int HVInstance::cernVMDownload( std::string& version, const std::string flavor, const std::string machineArch, std::string * toFilename,
-                                const FiniteTaskPtr & pf, const int retries, const DownloadProviderPtr& downloadProvider ) {
+                                const FiniteTaskPtr & pf, const int retries, const DownloadProviderPtr& downloadProvider, const std::string & owner ) {
 
     // Check for latest version
     if (version.compare("latest") == 0) {
@@ -517,7 +519,8 @@ int HVInstance::cernVMDownload( std::string& version, const std::string flavor,
         toFilename,
         pf,
         retries,
-        downloadProvider
+        downloadProvider,
+        owner
     );
 
 }
@@ -638,12 +641,19 @@ int __downloadFile( const std::string & fileURL, const std::string & sOutFilenam
             // Restart VariableTaskPtr
             if (pfDownload) pfDownload->restart("Downloading file", false);
 
-            // Download file
-            ans = downloadProvider->downloadFile( fileURL, sOutFilename, pfDownload );
+            // Download file to a partial file. If the download fails, the provider can
+            // continue it on the next attempt (or the next time we are started)
+            std::string sPartFilename = sOutFilename + ".part";
+            ans = downloadProvider->downloadFile( fileURL, sPartFilename, pfDownload );
             if (ans != HVE_OK) {
-                // Invalid contents. Erase and re-download
                 if (pf) pf->doing("Error while downloading. Will retry.");
-                ::remove( sOutFilename.c_str());
+                continue;
+            }
+
+            // Move it in place
+            if (::rename( sPartFilename.c_str(), sOutFilename.c_str() ) != 0) {
+                if (pf) pf->doing("Could not move downloaded file. Re-downloading.");
+                ::remove( sPartFilename.c_str());
                 continue;
             }
 
@@ -687,11 +697,256 @@ int __downloadFile( const std::string & fileURL, const std::string & sOutFilenam
     CRASH_REPORT_END;
 }
 
+/**
+ * Reusable chunk of code to assemble a file from the other versions of it in the
+ * image cache, downloading only the blocks that changed. The file is validated
+ * afterwards by __downloadFile, that downloads it again if it's not valid.
+ */
+int __deltaDownload( const std::string & fileURL, const std::string & sOutFilename,
+                     const VariableTaskPtr& pfDownload, const FiniteTaskPtr & pf,
+                     const DownloadProviderPtr& downloadProvider, const ImageCachePtr& imageCache ) {
+    CRASH_REPORT_BEGIN;
+    int ans;
+
+    // Let an interrupted download continue instead
+    std::string sPartFilename = sOutFilename + ".part";
+    if (file_exists( sPartFilename + ".state" )) return HVE_NOT_SUPPORTED;
+
+    // We need a previous version of the file and it's block manifest
+    std::vector< std::string > seeds = imageCache->similar( getURLFilename(fileURL) );
+    if (seeds.empty()) return HVE_NOT_SUPPORTED;
+    std::string manifest;
+    if (downloadProvider->downloadText( fileURL + DELTA_MANIFEST_SUFFIX, &manifest ) != HVE_OK) {
+        CVMWA_LOG("Info", "No block manifest for " << fileURL);
+        return HVE_NOT_SUPPORTED;
+    }
+
+    DeltaDownload delta( sPartFilename );
+    ans = delta.open( manifest );
+    if (ans != HVE_OK) {
+        ::remove( sPartFilename.c_str() );
+        return ans;
+    }
+
+    // Copy the blocks we already have. The images are referenced while we
+    // read them, so they are not evicted.
+    if (pf) pf->doing("Looking for reusable blocks in the cached images");
+    std::string owner = "delta:" + sOutFilename;
+    for (size_t i = 0; (i < seeds.size()) && (i < DELTA_MAX_SEEDS) && (delta.missing() > 0); i++) {
+        imageCache->acquire( seeds[i], owner );
+        delta.seed( seeds[i] );
+    }
+    imageCache->release( owner );
+
+    // Download the rest
+    if (pf) pf->doing("Downloading the changed blocks");
+    if (pfDownload) pfDownload->restart("Downloading the changed blocks", false);
+    ans = delta.fetch( downloadProvider, fileURL, pfDownload );
+    if (ans != HVE_OK) {
+        ::remove( sPartFilename.c_str() );
+        return ans;
+    }
+
+    // Move it in place
+    if (::rename( sPartFilename.c_str(), sOutFilename.c_str() ) != 0) {
+        ::remove( sPartFilename.c_str() );
+        return HVE_IO_ERROR;
+    }
+    return HVE_OK;
+
+    CRASH_REPORT_END;
+}
+
+/**
+ * A download in progress. The download itself reports it's progress to the
+ * task of the flight, which is mirrored to the progress feed of every caller.
+ */
+class HVDownloadFlight {
+public:
+
+    HVDownloadFlight() : task(boost::make_shared<FiniteTask>()), mutex(), cond(), done(false), result(HVE_OK), filename() { };
+
+    FiniteTaskPtr               task;
+
+    boost::mutex                mutex;
+    boost::condition_variable   cond;
+    bool                        done;
+    int                         result;
+    std::string                 filename;
+
+};
+
+/**
+ * Forward the progress of a shared download to the progress feed of a caller
+ */
+void __mirrorDownloadProgress( const VariableTaskPtr& pf, const std::string& message, double progress ) {
+    CRASH_REPORT_BEGIN;
+    pf->setMessage( message );
+    pf->update( (size_t)(progress * 1000) );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Run the specified download function, or join the identical download in progress
+ */
+int HVInstance::sharedDownload ( const std::string & key, std::string * filename, const FiniteTaskPtr & pf, 
+                                 const boost::function< int ( std::string *, const FiniteTaskPtr & ) > & download ) {
+    CRASH_REPORT_BEGIN;
+
+    // Our own progress feed
+    VariableTaskPtr pfDownload;
+    if (pf) {
+        pf->setMax(1);
+        pfDownload = pf->begin<VariableTask>("Downloading file");
+        pfDownload->setMax( 1000 );
+    }
+
+    for (;;) {
+
+        // Join the download in progress or start a new one
+        HVDownloadFlightPtr flight;
+        bool leader = false;
+        {
+            boost::unique_lock<boost::mutex> lock(downloadsMutex);
+            std::map< std::string, HVDownloadFlightPtr >::iterator it = downloads.find( key );
+            if (it != downloads.end()) {
+                flight = it->second;
+            } else {
+                flight = boost::make_shared<HVDownloadFlight>();
+                downloads[ key ] = flight;
+                leader = true;
+            }
+        }
+
+        // Follow the progress of the download
+        CallbacksSignal< void( const std::string&, double ) >::SlotPtr slot;
+        if (pfDownload)
+            slot = flight->task->progressEvent.connect( boost::bind( &__mirrorDownloadProgress, pfDownload, _1, _2 ) );
+
+        int ans = HVE_OK;
+        std::string sFilename;
+        if (leader) {
+
+            // Download the file. If we are interrupted, let the callers that
+            // joined us know, so one of them can take over. The flight is handed
+            // over only after the download has unwound, and nothing keeps writing
+            // to the files by then: the engine waits for the aborted transfers and
+            // the decompression for it's workers before they let the interruption
+            // through.
+            try {
+                ans = download( &sFilename, flight->task );
+            } catch (...) {
+                {
+                    boost::unique_lock<boost::mutex> lock(downloadsMutex);
+                    downloads.erase( key );
+                }
+                {
+                    boost::unique_lock<boost::mutex> lock(flight->mutex);
+                    flight->result = HVE_STILL_WORKING;
+                    flight->done = true;
+                }
+                flight->cond.notify_all();
+                if (slot) flight->task->progressEvent.disconnect( slot );
+                throw;
+            }
+
+            // Publish the result to the callers that joined us
+            {
+                boost::unique_lock<boost::mutex> lock(downloadsMutex);
+                downloads.erase( key );
+            }
+            {
+                boost::unique_lock<boost::mutex> lock(flight->mutex);
+                flight->result = ans;
+                flight->filename = sFilename;
+                flight->done = true;
+            }
+            flight->cond.notify_all();
+
+        } else {
+
+            // Wait for the download to complete
+            CVMWA_LOG("Info", "Joining the download in progress for " << key);
+            if (pf) pf->doing("Waiting for the download in progress");
+            {
+                boost::unique_lock<boost::mutex> lock(flight->mutex);
+                try {
+                    while (!flight->done)
+                        flight->cond.wait( lock );
+                } catch (...) {
+                    if (slot) flight->task->progressEvent.disconnect( slot );
+                    throw;
+                }
+                ans = flight->result;
+                sFilename = flight->filename;
+            }
+
+        }
+        if (slot) flight->task->progressEvent.disconnect( slot );
+
+        // The download was interrupted, try again
+        if (ans == HVE_STILL_WORKING) continue;
+
+        // Complete our progress feed
+        if (ans != HVE_OK) {
+            if (pf) pf->fail("Unable to download file", ans);
+            return ans;
+        }
+        if (pf) pf->complete("File downloaded");
+        *filename = sFilename;
+        return HVE_OK;
+
+    }
+    CRASH_REPORT_END;
+}
+
+/**
+ * Download an arbitrary file and validate it against a checksum
+ * file, both provided as URLs
+ */
+int HVInstance::downloadFileURL ( const std::string & fileURL, const std::string & checksumURL, std::string * filename, const FiniteTaskPtr & pf, const int retries, const DownloadProviderPtr& customProvider, const std::string & owner ) {
+    CRASH_REPORT_BEGIN;
+    int ans = sharedDownload( "url:" + fileURL + "#" + checksumURL, filename, pf,
+        boost::bind( &HVInstance::_downloadFileURL, this, fileURL, checksumURL, _1, _2, retries, customProvider, owner ) );
+    // The callers that joined the download reference the image themselves
+    if ((ans == HVE_OK) && !owner.empty()) imageCache->acquire( *filename, owner );
+    return ans;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Download an arbitrary file and validate it against a checksum
+ * string specified in parameter
+ */
+int HVInstance::downloadFile ( const std::string & fileURL, const std::string & checksumString, std::string * filename, const FiniteTaskPtr & pf, const int retries, const DownloadProviderPtr& customProvider, const std::string & owner ) {
+    CRASH_REPORT_BEGIN;
+    int ans = sharedDownload( "file:" + fileURL + "#" + checksumString, filename, pf,
+        boost::bind( &HVInstance::_downloadFile, this, fileURL, checksumString, _1, _2, retries, customProvider, owner ) );
+    // The callers that joined the download reference the image themselves
+    if ((ans == HVE_OK) && !owner.empty()) imageCache->acquire( *filename, owner );
+    return ans;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Download a gzip-compressed arbitrary file and validate it's extracted
+ * contents against a checksum string specified in parameter
+ */
+int HVInstance::downloadFileGZ ( const std::string & fileURL, const std::string & checksumString, std::string * filename, const FiniteTaskPtr & pf, const int retries, const DownloadProviderPtr& customProvider, const std::string & owner ) {
+    CRASH_REPORT_BEGIN;
+    int ans = sharedDownload( "gz:" + fileURL + "#" + checksumString, filename, pf,
+        boost::bind( &HVInstance::_downloadFileGZ, this, fileURL, checksumString, _1, _2, retries, customProvider, owner ) );
+    // The callers that joined the download reference the (extracted) image themselves
+    if ((ans == HVE_OK) && !owner.empty()) imageCache->acquire( filename->substr( 0, filename->length() - 3 ), owner );
+    return ans;
+    CRASH_REPORT_END;
+}
+
 /**
  * Download an arbitrary file and validate it against a checksum
  * file, both provided as URLs
  */
-int HVInstance::downloadFileURL ( const std::string & fileURL, const std::string & checksumURL, std::string * filename, const FiniteTaskPtr & pf, const int retries, const DownloadProviderPtr& customProvider ) {
+int HVInstance::_downloadFileURL ( const std::string & fileURL, const std::string & checksumURL, std::string * filename, const FiniteTaskPtr & pf, const int retries, const DownloadProviderPtr& customProvider, const std::string & owner ) {
     CRASH_REPORT_BEGIN;
     int ans;
 
@@ -723,13 +978,28 @@ int HVInstance::downloadFileURL ( const std::string & fileURL, const std::string
         );
     if (ans != HVE_OK) return ans;
 
-    // Download file
+    // Use the cached image if we already have one with this checksum
+    std::string     sCachedFilename = imageCache->lookup( sChecksumString, owner );
+    if (!sCachedFilename.empty()) {
+        if (pf) pf->complete("File found in cache");
+        *filename = sCachedFilename;
+        return HVE_OK;
+    }
+
+    // Otherwise store it in the cache by it's checksum
+    std::string     sImageFilename = imageCache->allocate( sChecksumString, getURLFilename(fileURL) );
+    if (!sImageFilename.empty()) sOutFilename = sImageFilename;
+
+    // Download file, reusing the blocks of the previous versions we have
     pfDownload = pf->begin<VariableTask>("Downloading file");    
+    if (!sImageFilename.empty() && !file_exists(sOutFilename))
+        __deltaDownload( fileURL, sOutFilename, pfDownload, pf, dp, imageCache );
     ans = __downloadFile(
             fileURL, sOutFilename, pfDownload, pf, dp,
             sChecksumString, retries
         );
     if (ans != HVE_OK) return ans;
+    if (!sImageFilename.empty()) imageCache->insert( sChecksumString, sOutFilename, owner );
 
     // Update the string
     if (pf) pf->complete("File download completed");
@@ -744,7 +1014,7 @@ int HVInstance::downloadFileURL ( const std::string & fileURL, const std::string
  * Download an arbitrary file and validate it against a checksum
  * string specified in parameter
  */
-int HVInstance::downloadFile ( const std::string & fileURL, const std::string & checksumString, std::string * filename, const FiniteTaskPtr & pf, const int retries, const DownloadProviderPtr& customProvider ) {
+int HVInstance::_downloadFile ( const std::string & fileURL, const std::string & checksumString, std::string * filename, const FiniteTaskPtr & pf, const int retries, const DownloadProviderPtr& customProvider, const std::string & owner ) {
     CRASH_REPORT_BEGIN;
     int ans;
 
@@ -757,20 +1027,37 @@ int HVInstance::downloadFile ( const std::string & fileURL, const std::string &
     std::string     sOutFilename = getURLFilename(fileURL);
     sha256_buffer( fileURL, &sOutFilenameHash );
 
-    // Calculate full path for the output file
-    sOutFilename = dirData + "/cache/" + sOutFilenameHash + "-" + sOutFilename;
+    // Use the cached image if we already have one with this checksum
+    std::string     sCachedFilename = imageCache->lookup( checksumString, owner );
+    if (!sCachedFilename.empty()) {
+        if (pf) pf->complete("File found in cache");
+        *filename = sCachedFilename;
+        return HVE_OK;
+    }
+
+    // Calculate full path for the output file. Store it in the cache by it's
+    // checksum, unless the checksum is not usable
+    std::string     sImageFilename = imageCache->allocate( checksumString, sOutFilename );
+    if (sImageFilename.empty()) {
+        sOutFilename = dirData + "/cache/" + sOutFilenameHash + "-" + sOutFilename;
+    } else {
+        sOutFilename = sImageFilename;
+    }
 
     // Prepare progress objects
     VariableTaskPtr   pfDownload;
     if (pf) pf->setMax(3);
 
-    // Download file
+    // Download file, reusing the blocks of the previous versions we have
     pfDownload = pf->begin<VariableTask>("Downloading file");    
+    if (!sImageFilename.empty() && !file_exists(sOutFilename))
+        __deltaDownload( fileURL, sOutFilename, pfDownload, pf, dp, imageCache );
     ans = __downloadFile(
             fileURL, sOutFilename, pfDownload, pf, dp,
             checksumString, retries
         );
     if (ans != HVE_OK) return ans;
+    if (!sImageFilename.empty()) imageCache->insert( checksumString, sOutFilename, owner );
 
     // Update the string
     if (pf) pf->complete("File download completed");
@@ -785,7 +1072,7 @@ int HVInstance::downloadFile ( const std::string & fileURL, const std::string &
  * Download a gzip-compressed arbitrary file and validate it's extracted
  * contents against a checksum string specified in parameter
  */
-int HVInstance::downloadFileGZ ( const std::string & fileURL, const std::string & checksumString, std::string * filename, const FiniteTaskPtr & pf, const int retries, const DownloadProviderPtr& customProvider ) {
+int HVInstance::_downloadFileGZ ( const std::string & fileURL, const std::string & checksumString, std::string * filename, const FiniteTaskPtr & pf, const int retries, const DownloadProviderPtr& customProvider, const std::string & owner ) {
     CRASH_REPORT_BEGIN;
     int ans;
 
@@ -804,9 +1091,25 @@ int HVInstance::downloadFileGZ ( const std::string & fileURL, const std::string
     if ( (gzPos = sExtractedFilename.find(".gz")) != std::string::npos )
         sExtractedFilename = sExtractedFilename.substr(0, gzPos);
 
-    // Calculate full path for the output and extract file
-    sOutFilename = dirData + "/cache/" + sOutFilenameHash + "-" + sOutFilename;
-    sExtractedFilename = dirData + "/cache/" + sOutFilenameHash + "-" + sExtractedFilename;
+    // Use the cached image if we already have one with this checksum. The
+    // caller expects the name of the compressed file.
+    std::string     sCachedFilename = imageCache->lookup( checksumString, owner );
+    if (!sCachedFilename.empty()) {
+        if (pf) pf->complete("File found in cache");
+        *filename = sCachedFilename + ".gz";
+        return HVE_OK;
+    }
+
+    // Calculate full path for the output and extract file. Store the extracted
+    // file in the cache by the checksum, unless the checksum is not usable
+    std::string     sImageFilename = imageCache->allocate( checksumString, sExtractedFilename );
+    if (sImageFilename.empty()) {
+        sOutFilename = dirData + "/cache/" + sOutFilenameHash + "-" + sOutFilename;
+        sExtractedFilename = dirData + "/cache/" + sOutFilenameHash + "-" + sExtractedFilename;
+    } else {
+        sOutFilename = sImageFilename + ".gz";
+        sExtractedFilename = sImageFilename;
+    }
 
     // Prepare progress objects
     VariableTaskPtr pfDownload;
@@ -815,28 +1118,79 @@ int HVInstance::downloadFileGZ ( const std::string & fileURL, const std::string
     // File OK flag
     bool            bFileOK = false;
 
+    // The partial extracted file and the pipeline that produces it
+    std::string     sPartFilename = sExtractedFilename + ".part";
+    boost::shared_ptr< DownloadPipeline > pipeline;
+
     // Start actual file download and validation
     pfDownload = pf->begin<VariableTask>("Downloading file");
     for (int i=0; i<retries; i++) {
 
-        // (1) If no file exists, download compressed file
+        // (1) If no file exists, download the compressed file and validate and
+        //     extract it while it's being downloaded
         if ( !file_exists(sExtractedFilename) && !file_exists(sOutFilename) ) {
 
             // Restart VariableTaskPtr
             if (pfDownload) pfDownload->restart("Downloading compressed file", false);
 
-            // Download file
-            ans = dp->downloadFile( fileURL, sOutFilename, pfDownload );
+            // Continue the previous attempt if it was interrupted by a transfer error, otherwise
+            // start a new checksum/decompression pipeline to the partial file. This resume is
+            // in-process only: the inflate and checksum state of the pipeline is not persisted.
+            long long offset = 0;
+            if (pipeline && pipeline->good()) {
+                offset = pipeline->size();
+            } else {
+                pipeline.reset();
+                pipeline = boost::make_shared< DownloadPipeline >( sPartFilename, true );
+            }
+            {
+                std::ostream stream( pipeline.get() );
+                ans = dp->downloadStream( fileURL, &stream, pfDownload, offset );
+            }
+            if ((ans == HVE_NOT_SUPPORTED) && (offset > 0)) {
+                // The server can't resume, start over (stopping the old pipeline first)
+                pipeline.reset();
+                pipeline = boost::make_shared< DownloadPipeline >( sPartFilename, true );
+                std::ostream stream( pipeline.get() );
+                ans = dp->downloadStream( fileURL, &stream, pfDownload );
+            }
             if (ans != HVE_OK) {
-                // Invalid contents. Erase and re-download
+                // Keep the pipeline to resume from where it stopped on the next attempt
                 if (pf) pf->doing("Error while downloading. Will retry.");
-                ::remove( sOutFilename.c_str());
+                continue;
+            }
+
+            // Complete the pipeline
+            std::string sChecksumFile = "";
+            ans = pipeline->finish( &sChecksumFile );
+            pipeline.reset();
+            if (ans != HVE_OK) {
+                // Invalid contents. Erase and re-download
+                if (pf) pf->doing("Could not extract file. Re-downloading.");
+                ::remove( sPartFilename.c_str());
+                continue;
+            }
+
+            // Compare checksums
+            if (sChecksumFile.compare( checksumString ) != 0) {
+                // Invalid contents. Erase and re-download
+                if (pf) pf->doing("Downloaded file checksum invalid. Re-downloading.");
+                ::remove( sPartFilename.c_str());
+                continue;
+            }
+
+            // Move the extracted file in place
+            ::remove( sExtractedFilename.c_str());
+            if (::rename( sPartFilename.c_str(), sExtractedFilename.c_str() ) != 0) {
+                if (pf) pf->doing("Could not move extracted file. Re-downloading.");
+                ::remove( sPartFilename.c_str());
                 continue;
             }
 
         }
 
-        // (2) If input file exists, but no extracted file exists, decompress
+        // (2) If a compressed file was left by an earlier version, but no extracted
+        //     file exists, validate and decompress it
         if ( !file_exists(sExtractedFilename) && file_exists(sOutFilename) ) {
 
             // Validate downloaded file checksum
@@ -881,13 +1235,18 @@ int HVInstance::downloadFileGZ ( const std::string & fileURL, const std::string
     // Check if we ran out of retries while trying 
     if (!bFileOK) {
         if (pf) pf->fail("Unable to download file", HVE_IO_ERROR);
+        pipeline.reset();
         ::remove( sOutFilename.c_str());
         ::remove( sExtractedFilename.c_str());
+        ::remove( sPartFilename.c_str());
         return HVE_IO_ERROR;
     } else {
         if (pf) pf->done("File downloaded");
     }
 
+    // Register the extracted file in the cache, referenced by the owner
+    if (!sImageFilename.empty()) imageCache->insert( checksumString, sExtractedFilename, owner );
+
     // Update the string
     if (pf) pf->complete("File downloaded");
     *filename = sOutFilename;
@@ -931,18 +1290,33 @@ int HVInstance::exec( string args, vector<string> * stdoutList, string * stderrM
 /**
  * Initialize hypervisor 
  */
-HVInstance::HVInstance() : version(""), openSessions(), sessions(), downloadProvider(), userInteraction() {
+HVInstance::HVInstance() : version(""), openSessions(), sessions(), downloadProvider(), userInteraction(), downloads(), downloadsMutex() {
     CRASH_REPORT_BEGIN;
     this->sessionID = 1;
     
     // Pick a system folder to store persistent information
     this->dirData = getAppDataPath();
     this->dirDataCache = this->dirData + "/cache";
+    this->imageCache = boost::make_shared<ImageCache>( this->dirDataCache, LocalConfig::forRuntime("imagecache"),
+                                                       LocalConfig::global()->getNum<long>("cacheQuota", IMAGE_CACHE_QUOTA) );
     
     // Unless overriden use the default downloadProvider and 
     // userInteraction pointers
     downloadProvider = DownloadProvider::Default();
     userInteraction = UserInteraction::Default();
+
+    // Register the mirrors of the download locations, defined in the global config as
+    // "<origin>=<mirror>,<mirror> <origin>=<mirror> ..."
+    std::vector< std::string > origins;
+    explode( LocalConfig::global()->get("downloadMirrors"), ' ', &origins );
+    for (std::vector< std::string >::iterator it = origins.begin(); it != origins.end(); ++it) {
+        size_t eq = it->find('=');
+        if (eq == std::string::npos) continue;
+        std::vector< std::string > mirrors;
+        explode( it->substr( eq+1 ), ',', &mirrors );
+        mirrors.erase( std::remove( mirrors.begin(), mirrors.end(), std::string() ), mirrors.end() );
+        downloadProvider->setMirrors( it->substr(0, eq), mirrors );
+    }
     
     CRASH_REPORT_END;
 };
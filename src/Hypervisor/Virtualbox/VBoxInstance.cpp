@@ -361,8 +361,8 @@ HVSessionPtr VBoxInstance::allocateSession() {
     // Allocate a new GUID for this session
     std::string guid = newGUID();
 
-    // Fetch a config object
-    LocalConfigPtr cfg = LocalConfig::forRuntime( "vbsess-" + guid );
+    // Allocate a record in the session store
+    ParameterMapPtr cfg = SessionStore::runtime()->session( guid, true );
     cfg->set("uuid", guid);
 
     // Return new session instance
@@ -610,10 +610,8 @@ void VBoxInstance::sessionDelete ( const HVSessionPtr& session ) {
             // Erase session from the sessions list
             this->sessions.erase( i );
 
-            // Erase session file from disk
-            ostringstream oss;
-            oss << "vbsess-" << uuid;
-            LocalConfig::forRuntime(oss.str())->clear();
+            // Erase session record from the store
+            SessionStore::runtime()->erase( uuid );
 
             // Done
             return;
@@ -681,21 +679,26 @@ int VBoxInstance::loadSessions( const FiniteTaskPtr & pf ) {
 
     // [1] Load session registry from the disk
     // =======================================
-    std::vector< std::string > vbDiskSessions  = LocalConfig::runtime()->enumFiles("vbsess-");
+    SessionStorePtr store = SessionStore::runtime();
+
+    // Import the per-session config files of the previous versions
+    store->migrate("vbsess-");
+
+    std::vector< std::string > vbDiskSessions  = store->enumSessions();
     for (std::vector< std::string >::iterator it = vbDiskSessions.begin(); it != vbDiskSessions.end(); ++it) {
         std::string sessName = *it;
-        CVMWA_LOG("Debug", "Importing session config " << sessName << " from disk");
-
-        // Load session config
-        LocalConfigPtr sessConfig = LocalConfig::forRuntime( sessName );
-        if (!sessConfig->contains("name")) {
-            CVMWA_LOG("Warning", "Missing 'name' in file " << sessName );
-        } else if (!sessConfig->contains("uuid")) {
-            CVMWA_LOG("Warning", "Missing 'uuid' in file " << sessName );
+        CVMWA_LOG("Debug", "Importing session config " << sessName << " from the session store");
+
+        // Check the session config without decoding it
+        string sessLabel, sessUuid;
+        if (!store->lookup( sessName, "name", &sessLabel )) {
+            CVMWA_LOG("Warning", "Missing 'name' in session " << sessName );
+        } else if (!store->lookup( sessName, "uuid", &sessUuid )) {
+            CVMWA_LOG("Warning", "Missing 'uuid' in session " << sessName );
         } else {
             // Store session with the given UUID
-            sessions[ sessConfig->get("uuid") ] = boost::make_shared< VBoxSession >( 
-                sessConfig, this->shared_from_this() 
+            sessions[ sessUuid ] = boost::make_shared< VBoxSession >( 
+                store->session( sessName ), this->shared_from_this() 
             );
         }
 
@@ -839,28 +839,30 @@ void VBoxSession::DownloadMedia() {
         if (pf) pfDownload = pf->begin<FiniteTask>("Downloading CernVM ISO");
         if (urlFilenamePart.find(".gz") != std::string::npos) {
             
-            // Download compressed disk
+            // Download compressed disk. The cached image is kept for as long as this session uses it.
             ans = hypervisor->downloadFileGZ(
                             urlFilename,
                             checksum,
                             &sFilename,
                             pfDownload,
                             2,
-                            downloadProvider
+                            downloadProvider,
+                            uuid
                         );
 
             // Strip .gz from the filename
             sFilename = sFilename.substr(0, sFilename.length() - 3 );
 
         } else {
-            // Download boot disk
+            // Download boot disk. The cached image is kept for as long as this session uses it.
             ans = hypervisor->downloadFile(
                             urlFilename,
                             checksum,
                             &sFilename,
                             pfDownload,
                             2,
-                            downloadProvider
+                            downloadProvider,
+                            uuid
                         );
         }
 
@@ -912,7 +914,8 @@ void VBoxSession::DownloadMedia() {
             &sFilename,         // Variable to receive the resulting filename
             pfDownload,         // The download progress feedback
             2,                  // The number of retries
-            downloadProvider    // The custom download provider
+            downloadProvider,   // The custom download provider
+            uuid                // Keep the image in the cache for as long as this session uses it
         );
 
         // If version was 'latest', replace version with the latest version id
@@ -1194,22 +1197,20 @@ void VBoxSession::CheckIntegrity() {
     // Query VM status and fetch local state variable
     map<const string, const string> info = getMachineInfo();
 
+    // Update the machine configuration and get the keys that have changed
+    vector<string> changedKeys;
+    machine->fromMap( &info, true, true, &changedKeys );
+
     // Check if machine configuration is excactly the same as stored
     bool valid = true;
-    for (map<const string, const string>::iterator it = info.begin(); it != info.end(); ++it) {
-        string key = (*it).first;
-        string v1 = (*it).second;
-        string v2 = machine->get(key, "");
-        // Validate key
-        if (v1.compare(v2) != 0) {
+    for (vector<string>::iterator it = changedKeys.begin(); it != changedKeys.end(); ++it) {
+        // Keys missing from the info are not relevant
+        if (info.find(*it) != info.end()) {
             valid = false;
             break;
         }
     }
 
-    // Take this opportunity to update the machine configuration
-    machine->fromMap( &info, true );    
-
     // Skew towards network configuration
     if (!valid) {
         FSMSkew( 210 );
@@ -1384,6 +1385,9 @@ void VBoxSession::DestroyVM() {
         return;
     }
 
+    // The images it used can now be evicted from the cache
+    hypervisor->imageCache->release( uuid );
+
     FSMDone("VM Destroyed");
     CRASH_REPORT_END;
 }
@@ -2063,6 +2067,12 @@ void VBoxSession::FSMEnteringState( const int state, const bool final ) {
         if (final) this->fire( "stateChanged", ArgumentList( SS_RUNNING ) );
     }
 
+    // Checkpoint states are also persistence barriers: make sure
+    // that all the changes so far are written to the disk.
+    if ((state >= 1) && (state <= 7)) {
+        parameters->flush();
+    }
+
     CRASH_REPORT_END;
 }
 
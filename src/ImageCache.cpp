@@ -0,0 +1,399 @@
+/**
+ * This file is part of CernVM Web API Plugin.
+ *
+ * CVMWebAPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CVMWebAPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CVMWebAPI. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Developed by Ioannis Charalampidis 2013
+ * Contact: <ioannis.charalampidis[at]cern.ch>
+ */
+
+#include "CernVM/ImageCache.h"
+
+#include <algorithm>
+#include <fstream>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+/**
+ * Scoped inter-process lock that tolerates a missing lock file
+ */
+class ImageCacheFileLock {
+public:
+    ImageCacheFileLock( boost::interprocess::file_lock * l ) : l(l) { if (l != NULL) l->lock(); }
+    ~ImageCacheFileLock() { if (l != NULL) l->unlock(); }
+private:
+    boost::interprocess::file_lock * l;
+};
+
+/**
+ * Lock the cache both within the process and between processes
+ */
+#define IMAGECACHE_LOCK \
+    boost::unique_lock<boost::mutex> __cacheLock(mutex); \
+    ImageCacheFileLock __fileLock(fileLock);
+
+/**
+ * Create the cache and load the index
+ */
+ImageCache::ImageCache ( const std::string& dir, const LocalConfigPtr& index, long quotaMB )
+    : dir(dir), index(index), quota((long long)quotaMB * 1048576), totalSize(0), clock(0), entries(), files(), mutex(), fileLock(NULL) {
+    CRASH_REPORT_BEGIN;
+
+    // Make sure the lock file exists
+    std::string lockFile = dir + "/imagecache.lock";
+    boost::system::error_code ec;
+    boost::filesystem::create_directories( dir, ec );
+    if (!file_exists(lockFile)) {
+        std::ofstream ofs( lockFile.c_str(), std::ofstream::out | std::ofstream::app );
+        ofs.close();
+    }
+
+    // Open the inter-process lock
+    try {
+        fileLock = new boost::interprocess::file_lock( lockFile.c_str() );
+    } catch (boost::interprocess::interprocess_exception &e) {
+        CVMWA_LOG("Error", "Unable to open image cache lock " << lockFile << ": " << e.what());
+        fileLock = NULL;
+    }
+
+    IMAGECACHE_LOCK;
+    index->sync();
+    _reload();
+    CRASH_REPORT_END;
+}
+
+/**
+ * Release the lock file
+ */
+ImageCache::~ImageCache ( ) {
+    CRASH_REPORT_BEGIN;
+    if (fileLock != NULL) delete fileLock;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Pick up the changes of the other processes. Every change advances
+ * the use clock, so the entries are rebuilt only if it has moved.
+ */
+void ImageCache::_sync ( ) {
+    CRASH_REPORT_BEGIN;
+    index->sync();
+    if (index->getNum<long>( "clock", 0 ) != clock) _reload();
+    CRASH_REPORT_END;
+}
+
+/**
+ * Reload the index from the disk
+ */
+void ImageCache::_reload ( ) {
+    CRASH_REPORT_BEGIN;
+    std::map< const std::string, const std::string > map;
+    index->toMap( &map );
+
+    // Rebuild the entries. Each image is stored in a "<size>:<used>:<refs>:<file>" value
+    // under it's checksum, and "clock" holds the last value of the use clock.
+    entries.clear();
+    files.clear();
+    clock = 0;
+    for (std::map< const std::string, const std::string >::iterator it = map.begin(); it != map.end(); ++it) {
+        if (it->first == "clock") {
+            clock = ston<long>( it->second );
+            continue;
+        }
+
+        // The file is last, since it can contain the separator
+        const std::string& value = it->second;
+        size_t p1 = value.find(':');
+        size_t p2 = (p1 == std::string::npos) ? p1 : value.find(':', p1 + 1);
+        size_t p3 = (p2 == std::string::npos) ? p2 : value.find(':', p2 + 1);
+        if (p3 == std::string::npos) continue;
+
+        ImageCacheEntry entry;
+        entry.size = ston<long long>( value.substr(0, p1) );
+        entry.used = ston<long>( value.substr(p1 + 1, p2 - p1 - 1) );
+        entry.file = value.substr(p3 + 1);
+        std::vector< std::string > refs;
+        explode( value.substr(p2 + 1, p3 - p2 - 1), ',', &refs );
+        for (std::vector< std::string >::iterator r = refs.begin(); r != refs.end(); ++r)
+            if (!r->empty()) entry.refs.insert( *r );
+
+        entries[ it->first ] = entry;
+    }
+
+    // Index the files and calculate the total size
+    totalSize = 0;
+    for (boost::unordered_map< std::string, ImageCacheEntry >::iterator it = entries.begin(); it != entries.end(); ++it) {
+        files[ it->second.file ] = it->first;
+        totalSize += it->second.size;
+    }
+
+    CRASH_REPORT_END;
+}
+
+/**
+ * Advance the use clock
+ */
+long ImageCache::_tick ( ) {
+    return ++clock;
+}
+
+/**
+ * Store an entry (and the use clock) to the index
+ */
+void ImageCache::_store ( const std::string& checksum, const ImageCacheEntry& entry ) {
+    CRASH_REPORT_BEGIN;
+    std::string refs;
+    for (std::set< std::string >::const_iterator it = entry.refs.begin(); it != entry.refs.end(); ++it) {
+        if (!refs.empty()) refs += ",";
+        refs += *it;
+    }
+
+    long long size = entry.size;
+    long used = entry.used;
+    index->lock();
+    index->set( checksum, ntos<long long>( size ) + ":" + ntos<long>( used ) + ":" + refs + ":" + entry.file );
+    index->set( "clock", ntos<long>( clock ) );
+    index->unlock();
+    CRASH_REPORT_END;
+}
+
+/**
+ * Remove an entry from the index and delete the image
+ */
+void ImageCache::_remove ( const std::string& checksum ) {
+    CRASH_REPORT_BEGIN;
+    boost::unordered_map< std::string, ImageCacheEntry >::iterator e = entries.find( checksum );
+    if (e == entries.end()) return;
+
+    CVMWA_LOG("Info", "Removing image " << e->second.file << " from the cache");
+    ::remove( e->second.file.c_str() );
+    totalSize -= e->second.size;
+    files.erase( e->second.file );
+    entries.erase( e );
+
+    // Advance the clock, so the other processes notice the removal
+    _tick();
+    index->lock();
+    index->erase( checksum );
+    index->set( "clock", ntos<long>( clock ) );
+    index->unlock();
+    CRASH_REPORT_END;
+}
+
+/**
+ * Find an image by checksum
+ */
+std::string ImageCache::lookup ( const std::string& checksum, const std::string& owner ) {
+    CRASH_REPORT_BEGIN;
+    IMAGECACHE_LOCK;
+    _sync();
+    boost::unordered_map< std::string, ImageCacheEntry >::iterator e = entries.find( checksum );
+    if (e == entries.end()) return "";
+
+    // Drop images removed from the disk behind our back
+    if (!file_exists( e->second.file )) {
+        _remove( checksum );
+        return "";
+    }
+
+    // Update the LRU information and reference the image
+    if (!owner.empty()) e->second.refs.insert( owner );
+    e->second.used = _tick();
+    _store( checksum, e->second );
+    return e->second.file;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Return the path for a new image
+ */
+std::string ImageCache::allocate ( const std::string& checksum, const std::string& name ) {
+    CRASH_REPORT_BEGIN;
+
+    // The checksum is part of the filename, so accept only SHA-256 hex digests
+    if (checksum.length() != 64) return "";
+    if (checksum.find_first_not_of("0123456789abcdefABCDEF") != std::string::npos) return "";
+
+    return dir + "/" + checksum + "-" + name;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Replace the digits of the name, so the names of different versions compare equal
+ */
+std::string __imageFamily( const std::string& name ) {
+    std::string family = name;
+    for (size_t i = 0; i < family.length(); i++)
+        if ((family[i] >= '0') && (family[i] <= '9')) family[i] = '#';
+    return family;
+}
+
+/**
+ * Return the other versions of an image
+ */
+std::vector< std::string > ImageCache::similar ( const std::string& name ) {
+    CRASH_REPORT_BEGIN;
+    IMAGECACHE_LOCK;
+    _sync();
+    std::string family = __imageFamily( name );
+
+    // The files are named "<checksum>-<name>"
+    std::vector< std::pair< long, std::string > > found;
+    for (boost::unordered_map< std::string, ImageCacheEntry >::iterator it = entries.begin(); it != entries.end(); ++it) {
+        std::string file = boost::filesystem::path( it->second.file ).filename().string();
+        if (file.length() <= it->first.length() + 1) continue;
+        if (__imageFamily( file.substr( it->first.length() + 1 ) ) != family) continue;
+        if (!file_exists( it->second.file )) continue;
+        found.push_back( std::make_pair( -it->second.used, it->second.file ) );
+    }
+    std::sort( found.begin(), found.end() );
+
+    std::vector< std::string > files;
+    for (size_t i = 0; i < found.size(); i++)
+        files.push_back( found[i].second );
+    return files;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Register a downloaded image
+ */
+bool ImageCache::insert ( const std::string& checksum, const std::string& file, const std::string& owner ) {
+    CRASH_REPORT_BEGIN;
+    IMAGECACHE_LOCK;
+    if (!file_exists( file )) return false;
+    _sync();
+
+    // Replace any previous entry
+    ImageCacheEntry entry;
+    boost::unordered_map< std::string, ImageCacheEntry >::iterator e = entries.find( checksum );
+    if (e != entries.end()) {
+        entry.refs = e->second.refs;
+        totalSize -= e->second.size;
+        files.erase( e->second.file );
+    }
+
+    // Store the new entry, referenced by the owner
+    if (!owner.empty()) entry.refs.insert( owner );
+    entry.file = file;
+    entry.size = (long long) boost::filesystem::file_size( file );
+    entry.used = _tick();
+    entries[ checksum ] = entry;
+    files[ file ] = checksum;
+    totalSize += entry.size;
+    _store( checksum, entry );
+
+    // Make room for it
+    _evict( checksum );
+    return true;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Add a reference to an image
+ */
+bool ImageCache::acquire ( const std::string& file, const std::string& owner ) {
+    CRASH_REPORT_BEGIN;
+    IMAGECACHE_LOCK;
+    _sync();
+    boost::unordered_map< std::string, std::string >::iterator f = files.find( file );
+    if (f == files.end()) return false;
+
+    ImageCacheEntry & entry = entries[ f->second ];
+    entry.refs.insert( owner );
+    entry.used = _tick();
+    _store( f->second, entry );
+    return true;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Remove all the references of the given owner
+ */
+void ImageCache::release ( const std::string& owner ) {
+    CRASH_REPORT_BEGIN;
+    IMAGECACHE_LOCK;
+    _sync();
+    for (boost::unordered_map< std::string, ImageCacheEntry >::iterator it = entries.begin(); it != entries.end(); ++it) {
+        if (it->second.refs.erase( owner ) > 0)
+            _store( it->first, it->second );
+    }
+
+    // Released images can now be evicted
+    _evict( "" );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Change the quota
+ */
+void ImageCache::setQuota ( long quotaMB ) {
+    CRASH_REPORT_BEGIN;
+    IMAGECACHE_LOCK;
+    _sync();
+    quota = (long long)quotaMB * 1048576;
+    _evict( "" );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Return the size of the cache
+ */
+long long ImageCache::size ( ) {
+    CRASH_REPORT_BEGIN;
+    boost::unique_lock<boost::mutex> lock(mutex);
+    return totalSize;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Evict images until the cache fits in the quota
+ */
+int ImageCache::evict ( const std::string& keep ) {
+    CRASH_REPORT_BEGIN;
+    IMAGECACHE_LOCK;
+    _sync();
+    return _evict( keep );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Evict the least recently used images that are not referenced
+ */
+int ImageCache::_evict ( const std::string& keep ) {
+    CRASH_REPORT_BEGIN;
+    if (totalSize <= quota) return 0;
+
+    // Collect the candidates in LRU order
+    std::vector< std::pair< long, std::string > > candidates;
+    for (boost::unordered_map< std::string, ImageCacheEntry >::iterator it = entries.begin(); it != entries.end(); ++it) {
+        if (it->second.refs.empty() && (it->first != keep))
+            candidates.push_back( std::make_pair( it->second.used, it->first ) );
+    }
+    std::sort( candidates.begin(), candidates.end() );
+
+    // Remove them until we fit
+    int removed = 0;
+    for (size_t i = 0; (i < candidates.size()) && (totalSize > quota); i++) {
+        _remove( candidates[i].second );
+        removed++;
+    }
+    if (totalSize > quota) {
+        CVMWA_LOG("Warning", "The image cache exceeds the quota with images in use (" << totalSize << " bytes)");
+    }
+
+    return removed;
+    CRASH_REPORT_END;
+}
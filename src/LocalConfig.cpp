@@ -19,10 +19,88 @@
  */
 
 #include <boost/filesystem.hpp> 
+#include <boost/interprocess/sync/file_lock.hpp>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
 
 #include <CernVM/Hypervisor.h>
 #include <CernVM/LocalConfig.h>
 
+/**
+ * Scoped inter-process lock on the given lock file, that is created if missing.
+ * If the lock file cannot be opened we fall back to the in-process lock.
+ */
+class LocalConfigFileLock {
+public:
+    LocalConfigFileLock( const std::string& file ) : l(NULL) {
+        if (!file_exists(file)) {
+            std::ofstream ofs( file.c_str(), std::ofstream::out | std::ofstream::app );
+            ofs.close();
+        }
+        try {
+            l = new boost::interprocess::file_lock( file.c_str() );
+            l->lock();
+        } catch (boost::interprocess::interprocess_exception &e) {
+            CVMWA_LOG("Error", "Unable to lock " << file << ": " << e.what());
+            if (l != NULL) delete l;
+            l = NULL;
+        }
+    }
+    ~LocalConfigFileLock() { if (l != NULL) { l->unlock(); delete l; } }
+private:
+    boost::interprocess::file_lock * l;
+};
+
+/**
+ * Lock the journal both within the process and between processes.
+ * (The file lock is owned by the process, so it does not exclude our own threads)
+ */
+#define JOURNAL_LOCK \
+    NAMED_MUTEX_LOCK(jFile); \
+    LocalConfigFileLock __journalLock( jFile + ".lock" );
+#define JOURNAL_UNLOCK \
+    NAMED_MUTEX_UNLOCK
+
+/**
+ * The first line of a config file, that holds the number of times it was written
+ */
+#define LOCALCONFIG_GENERATION  "#generation="
+
+/**
+ * Return the generation of the given config file (or 0 if it has none)
+ */
+static long long fileGeneration( const std::string& file ) {
+    std::ifstream ifs( file.c_str(), std::ifstream::in );
+    std::string line;
+    if (ifs.fail() || !std::getline(ifs, line)) return 0;
+    if (line.compare(0, strlen(LOCALCONFIG_GENERATION), LOCALCONFIG_GENERATION) != 0) return 0;
+    return ston<long long>( line.substr(strlen(LOCALCONFIG_GENERATION)) );
+}
+
+/**
+ * Return a string that changes when the given file is replaced or written,
+ * or an empty string if the file does not exist. The inode, size and time
+ * do not change if the file is replaced by one with the same size within the
+ * resolution of the modification time, so the generation of the config files
+ * is included as well.
+ */
+static std::string fileStamp( const std::string& file ) {
+    #ifdef _WIN32
+    struct _stat attrib;
+    if (_stat( file.c_str(), &attrib ) != 0) return "";
+    #else
+    struct stat attrib;
+    if (stat( file.c_str(), &attrib ) != 0) return "";
+    #endif
+    std::ostringstream oss;
+    oss << attrib.st_ino << ":" << attrib.st_size << ":" << getFileTimeMs( file ) << ":" << fileGeneration( file );
+    return oss.str();
+}
+
 // Initialize singletons
 LocalConfigPtr LocalConfig::globalConfigSingleton;
 LocalConfigPtr LocalConfig::runtimeConfigSingleton;
@@ -76,7 +154,10 @@ LocalConfigPtr LocalConfig::forRuntime( const std::string& name ) {
 /**
  * Create custom configuration file from the given map file
  */
-LocalConfig::LocalConfig ( std::string path, std::string name ) : ParameterMap(), timeLoaded(0), timeModified(0), keysDeleted() {
+LocalConfig::LocalConfig ( std::string path, std::string name ) : ParameterMap(), timeLoaded(0), timeModified(0), keysDeleted(), changesMutex(), confStamp(), journalStamp(),
+    writeBehind(false), dirty(false), dirtyCount(0), dirtySince(0), flushThread(NULL), flushThreadExit(false), flushMutex(), flushCond(), saveMutex(),
+    journaled(false), compactPending(false), journalBase(), journalOffset(0), journalSnapshotStamp(),
+    watchThread(NULL), watchThreadExit(false) {
     CRASH_REPORT_BEGIN;
 
     // Prepare names
@@ -85,19 +166,761 @@ LocalConfig::LocalConfig ( std::string path, std::string name ) : ParameterMap()
 
     {
         // Mutex for making this thread-safe
-        boost::unique_lock<boost::mutex> lock(*parametersMutex);
+        boost::unique_lock<boost::shared_mutex> lock(*parametersMutex);
 
         // Load parameters in the parameters map
         this->loadMap( name, parameters.get() );
     }
 
+    // Replay the changes from a journal, possibly left
+    // behind by a journaled instance
+    resetJournal();
+
     // Update time it was loaded and modified
     timeLoaded = getTimeInMs();
     timeModified = getTimeInMs();
+    updateStamps();
+
+    CRASH_REPORT_END;
+}
+
+/**
+ * Stop the flush thread and write any pending changes
+ */
+LocalConfig::~LocalConfig ( ) {
+    CRASH_REPORT_BEGIN;
+
+    // Stop the watch thread
+    setWatch( false );
+
+    // Stop the flush thread
+    if (flushThread != NULL) {
+        {
+            boost::unique_lock<boost::mutex> lock(flushMutex);
+            flushThreadExit = true;
+        }
+        flushCond.notify_all();
+        flushThread->join();
+        delete flushThread;
+        flushThread = NULL;
+    }
+
+    // Write pending changes
+    flush();
+
+    CRASH_REPORT_END;
+}
+
+/**
+ * Enable or disable the write-behind mode
+ */
+void LocalConfig::setWriteBehind ( bool enabled ) {
+    CRASH_REPORT_BEGIN;
+
+    // When disabling write-behind, write pending changes
+    writeBehind = enabled;
+    if (!enabled) flush();
 
     CRASH_REPORT_END;
 }
 
+/**
+ * Write any pending write-behind changes to the disk
+ */
+bool LocalConfig::flush ( ) {
+    CRASH_REPORT_BEGIN;
+
+    // Only one flush at a time
+    boost::unique_lock<boost::mutex> saveLock(saveMutex);
+
+    {
+        // Check and reset the dirty flag
+        boost::unique_lock<boost::mutex> lock(flushMutex);
+        if (!dirty) return true;
+        dirty = false;
+        dirtyCount = 0;
+    }
+
+    // Save map to the disk
+    bool ans = this->persist();
+    if (!ans) {
+        // Keep the changes pending so we can retry later
+        boost::unique_lock<boost::mutex> lock(flushMutex);
+        if (!dirty) dirtySince = getTimeInMs();
+        dirty = true;
+    }
+
+    return ans;
+    CRASH_REPORT_END;
+}
+
+/**
+ * The write-behind flush thread, that coalesces the changes
+ * and writes them to the disk.
+ */
+void LocalConfig::flushThreadLoop ( ) {
+    CRASH_REPORT_BEGIN;
+    boost::unique_lock<boost::mutex> lock(flushMutex);
+
+    while (!flushThreadExit) {
+
+        // Compact the journal if requested
+        if (compactPending) {
+            compactPending = false;
+            lock.unlock();
+            this->compactJournal();
+            lock.lock();
+            continue;
+        }
+
+        // Wait for changes
+        if (!dirty) {
+            flushCond.wait(lock);
+            continue;
+        }
+
+        // Wait for more changes until the flush delay expires or 
+        // until we have enough changes pending.
+        unsigned long long elapsed = getTimeInMs() - dirtySince;
+        if ((elapsed < LOCALCONFIG_FLUSH_DELAY) && (dirtyCount < LOCALCONFIG_FLUSH_CHANGES)) {
+            flushCond.timed_wait(lock, boost::posix_time::milliseconds( LOCALCONFIG_FLUSH_DELAY - elapsed ));
+            continue;
+        }
+
+        // Flush without holding the lock
+        lock.unlock();
+        this->flush();
+        lock.lock();
+
+    }
+
+    CRASH_REPORT_END;
+}
+
+/**
+ * Start the flush thread if it's not already running
+ */
+void LocalConfig::startFlushThread ( ) {
+    CRASH_REPORT_BEGIN;
+    if (flushThread == NULL) {
+        flushThreadExit = false;
+        flushThread = new boost::thread( boost::bind( &LocalConfig::flushThreadLoop, this ) );
+    }
+    CRASH_REPORT_END;
+}
+
+/**
+ * Write the changes to the disk, using the active storage mode
+ */
+bool LocalConfig::persist ( ) {
+    CRASH_REPORT_BEGIN;
+    if (journaled) {
+        return this->commitJournal();
+    } else {
+        return this->save();
+    }
+    CRASH_REPORT_END;
+}
+
+/**
+ * Enable or disable the journaled storage mode
+ */
+void LocalConfig::setJournaled ( bool enabled ) {
+    CRASH_REPORT_BEGIN;
+    if (enabled == journaled) return;
+
+    // Write pending changes with the previous mode
+    flush();
+
+    if (enabled) {
+        // Start tracking changes from the current state
+        resetJournal();
+        journaled = true;
+    } else {
+        // Replace the journal with a full snapshot
+        journaled = false;
+        save();
+    }
+
+    CRASH_REPORT_END;
+}
+
+/**
+ * Enable or disable watching for changes done by other processes
+ */
+void LocalConfig::setWatch ( bool enabled ) {
+    CRASH_REPORT_BEGIN;
+
+    if (enabled && (watchThread == NULL)) {
+
+        // Start the watch thread
+        watchThreadExit = false;
+        watchThread = new boost::thread( boost::bind( &LocalConfig::watchThreadLoop, this ) );
+
+    } else if (!enabled && (watchThread != NULL)) {
+
+        // Stop the watch thread
+        watchThreadExit = true;
+        watchThread->interrupt();
+        watchThread->join();
+        delete watchThread;
+        watchThread = NULL;
+
+    }
+
+    CRASH_REPORT_END;
+}
+
+/**
+ * The watch thread, that waits for file events in the config
+ * directory and merges the external changes.
+ */
+void LocalConfig::watchThreadLoop ( ) {
+    CRASH_REPORT_BEGIN;
+    std::string confName = configName + ".conf";
+    std::string journalName = configName + ".journal";
+
+    #ifdef __linux__
+    // Use inotify if available
+    int fd = inotify_init();
+    if ((fd >= 0) && (inotify_add_watch( fd, systemPath(configDir).c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE ) < 0)) {
+        close(fd);
+        fd = -1;
+    }
+    if (fd >= 0) {
+        char buf[4096];
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+
+        while (!watchThreadExit) {
+
+            // Wait for events
+            if (poll( &pfd, 1, LOCALCONFIG_WATCH_INTERVAL ) <= 0) continue;
+            ssize_t len = read( fd, buf, sizeof(buf) );
+            if (len <= 0) continue;
+
+            // Check if the events are about our files
+            bool relevant = false;
+            for (char * p = buf; p < buf + len; ) {
+                struct inotify_event * ev = (struct inotify_event *) p;
+                if (ev->len > 0) {
+                    std::string name( ev->name );
+                    if ((name == confName) || (name == journalName)) relevant = true;
+                }
+                p += sizeof(struct inotify_event) + ev->len;
+            }
+            if (!relevant) continue;
+
+            // Let the burst of events settle and drain them
+            boost::this_thread::sleep( boost::posix_time::milliseconds( LOCALCONFIG_WATCH_SETTLE ) );
+            while (poll( &pfd, 1, 0 ) > 0) {
+                if (read( fd, buf, sizeof(buf) ) <= 0) break;
+            }
+
+            // Merge changes
+            mergeExternal();
+
+        }
+
+        close(fd);
+        return;
+    }
+    #endif
+
+    // Otherwise poll the state of the files
+    std::string confFile = systemPath(this->configDir + "/" + confName);
+    std::string journalFile = systemPath(this->configDir + "/" + journalName);
+    std::string lastConf, lastJournal, t;
+    while (!watchThreadExit) {
+        boost::this_thread::sleep( boost::posix_time::milliseconds( LOCALCONFIG_WATCH_INTERVAL ) );
+
+        // Check for changes
+        bool changed = false;
+        t = fileStamp( confFile );
+        if (t != lastConf) { lastConf = t; changed = true; }
+        t = fileStamp( journalFile );
+        if (t != lastJournal) { lastJournal = t; changed = true; }
+
+        // Merge changes
+        if (changed) mergeExternal();
+    }
+
+    CRASH_REPORT_END;
+}
+
+
+/**
+ * Remember the current state of the files as seen by us
+ */
+void LocalConfig::updateStamps ( ) {
+    CRASH_REPORT_BEGIN;
+    std::string cStamp = fileStamp( systemPath(this->configDir + "/" + configName + ".conf") );
+    std::string jStamp = fileStamp( systemPath(this->configDir + "/" + configName + ".journal") );
+    boost::unique_lock<boost::mutex> lock(changesMutex);
+    confStamp = cStamp;
+    journalStamp = jStamp;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Merge the changes done by other processes and fire the
+ * "changed" event with the keys that were changed.
+ */
+void LocalConfig::mergeExternal ( ) {
+    CRASH_REPORT_BEGIN;
+    typedef std::map< const std::string, const std::string > dataMap;
+    std::vector<std::string> changedKeys;
+    std::string fName = systemPath(this->configDir + "/" + configName + ".conf");
+    std::string jFile = systemPath(this->configDir + "/" + configName + ".journal");
+
+    // Don't merge while we are writing
+    boost::unique_lock<boost::mutex> saveLock(saveMutex);
+
+    {
+        // Skip the events caused by our own writes (or the ones we have already merged).
+        // Anything written after this point changes the stamps and triggers a new merge.
+        std::string cStamp = fileStamp( fName ), jStamp = fileStamp( jFile );
+        boost::unique_lock<boost::mutex> lock(changesMutex);
+        if ((cStamp == confStamp) && (jStamp == journalStamp)) return;
+        confStamp = cStamp;
+        journalStamp = jStamp;
+    }
+
+    if (journaled) {
+
+        // Replay the new journal records
+        JOURNAL_LOCK;
+        _replayJournal( &changedKeys );
+        JOURNAL_UNLOCK;
+
+    } else {
+
+        // The file was removed
+        if (!file_exists(fName)) return;
+
+        // Keep a copy to find the differences
+        dataMap before;
+        {
+            boost::shared_lock<boost::shared_mutex> lock(*parametersMutex);
+            before = *parameters;
+        }
+
+        // We know that the file was changed, so don't rely on the
+        // modification time like sync() does.
+        bool modified;
+        {
+            boost::unique_lock<boost::mutex> lock(changesMutex);
+            modified = (timeModified > timeLoaded);
+        }
+        if (!modified) {
+            this->load();
+        } else {
+            this->mergeFile();
+        }
+
+        // Find the changed keys
+        boost::shared_lock<boost::shared_mutex> lock(*parametersMutex);
+        for (dataMap::iterator it = before.begin(); it != before.end(); ++it) {
+            dataMap::iterator jt = parameters->find(it->first);
+            if ((jt == parameters->end()) || (jt->second != it->second))
+                changedKeys.push_back( it->first );
+        }
+        for (dataMap::iterator it = parameters->begin(); it != parameters->end(); ++it) {
+            if (before.find(it->first) == before.end())
+                changedKeys.push_back( it->first );
+        }
+
+    }
+    saveLock.unlock();
+
+    // Notify listeners
+    if (!changedKeys.empty()) notifyChanges( changedKeys );
+
+    CRASH_REPORT_END;
+}
+
+/**
+ * Fire the "changed" event with the specified keys
+ */
+void LocalConfig::notifyChanges ( const std::vector< std::string >& keys ) {
+    CRASH_REPORT_BEGIN;
+    ArgumentList args;
+    for (std::vector<std::string>::const_iterator it = keys.begin(); it != keys.end(); ++it)
+        args( *it );
+    this->fire( "changed", args );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Remember the keys changed locally, so only they are appended to the journal
+ */
+void LocalConfig::touchKey ( const std::string& key ) {
+    CRASH_REPORT_BEGIN;
+    journalTouched.insert( key );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Escape the new-line characters of the given value, so it spans a single line.
+ * Replace \n to "\n", \r to "\r" and "\" to "\\"
+ */
+static std::string escapeValue( std::string value ) {
+    std::string::size_type pos = 0;
+    while (pos < value.length()) {
+
+        // Replace escape patterns as we find them
+        if (value[pos] == '\\') {
+            value.replace(pos, 1, "\\\\");
+            pos += 1;
+        } else if (value[pos] == '\n') {
+            value.replace(pos, 1, "\\n");
+            pos += 1;
+        } else if (value[pos] == '\r') {
+            value.replace(pos, 1, "\\r");
+            pos += 1;
+        }
+
+        pos += 1;
+    }
+    return value;
+}
+
+/**
+ * Revert the escaping done by escapeValue
+ */
+static std::string unescapeValue( std::string value ) {
+    std::string::size_type pos = 0;
+    while (pos + 1 < value.length()) {
+
+        // Replace escape patterns as we find them
+        if ((value[pos] == '\\') && (value[pos+1] == '\\')) {
+            value.replace(pos, 2, "\\");
+        } else if ((value[pos] == '\\') && (value[pos+1] == 'n')) {
+            value.replace(pos, 2, "\n");
+        } else if ((value[pos] == '\\') && (value[pos+1] == 'r')) {
+            value.replace(pos, 2, "\r");
+        }
+
+        pos += 1;
+    }
+    return value;
+}
+
+/**
+ * Re-initialize the journal state from the current parameters
+ * and replay the journal from the beginning.
+ */
+void LocalConfig::resetJournal ( ) {
+    CRASH_REPORT_BEGIN;
+    std::string jFile = systemPath(this->configDir + "/" + configName + ".journal");
+    std::string sFile = systemPath(this->configDir + "/" + configName + ".conf");
+    JOURNAL_LOCK;
+
+    {
+        // The current parameters reflect the snapshot on disk
+        boost::unique_lock<boost::shared_mutex> lock(*parametersMutex);
+        journalBase = boost::make_shared< std::map< const std::string, const std::string > >( *parameters );
+        journalTouched.clear();
+    }
+    journalOffset = 0;
+    journalSnapshotStamp = fileStamp( sFile );
+
+    // Replay the journal records
+    _replayJournal( NULL );
+
+    JOURNAL_UNLOCK;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Apply the journal records that we have not seen yet, preferring the local changes
+ * that are not yet commited. If the snapshot was replaced (ex. compacted by another
+ * process) the entire journal is replayed.
+ */
+bool LocalConfig::_replayJournal ( std::vector<std::string> * changedKeys ) {
+    CRASH_REPORT_BEGIN;
+    typedef std::map< const std::string, const std::string > dataMap;
+    std::string jFile = systemPath(this->configDir + "/" + configName + ".journal");
+    std::string sFile = systemPath(this->configDir + "/" + configName + ".conf");
+
+    // Check if we need a full reload
+    std::string snapshotStamp = fileStamp( sFile );
+    unsigned long long jSize = 0;
+    if (file_exists(jFile)) jSize = boost::filesystem::file_size( jFile );
+    bool reload = (snapshotStamp != journalSnapshotStamp) || (jSize < journalOffset);
+
+    // Nothing to do
+    if (!reload && (jSize == journalOffset)) return true;
+
+    // The new values of the changed keys
+    std::map< std::string, std::pair<bool, std::string> > delta;
+    ParameterDataMapPtr newBase;
+    if (reload) {
+        newBase = boost::make_shared< dataMap >( );
+        if (!snapshotStamp.empty()) this->loadMap( configName, newBase.get() );
+        journalOffset = 0;
+    }
+
+    // Read the journal tail
+    std::string buffer;
+    if (jSize > journalOffset) {
+        std::ifstream ifs( jFile.c_str(), std::ifstream::in | std::ifstream::binary );
+        if (ifs.fail()) return false;
+        ifs.seekg( journalOffset );
+        buffer.resize( jSize - journalOffset );
+        ifs.read( &buffer[0], buffer.size() );
+        buffer.resize( ifs.gcount() );
+        ifs.close();
+    }
+
+    // Process the complete records
+    std::string::size_type pos = 0, eol;
+    while ((eol = buffer.find('\n', pos)) != std::string::npos) {
+        std::string line = buffer.substr(pos, eol - pos);
+        pos = eol + 1;
+        if (line.empty()) continue;
+
+        std::string key, value;
+        bool present;
+        if (line[0] == '+') {
+            std::string::size_type eq = line.find('=');
+            if (eq == std::string::npos) continue;
+            key = line.substr(1, eq-1);
+            value = unescapeValue( line.substr(eq+1) );
+            present = true;
+        } else if (line[0] == '-') {
+            key = line.substr(1);
+            present = false;
+        } else {
+            continue;
+        }
+
+        // Apply record
+        if (reload) {
+            if (present) {
+                putOnMap( newBase, key, value );
+            } else {
+                newBase->erase( key );
+            }
+        } else {
+            delta[key] = std::make_pair( present, value );
+        }
+    }
+    journalOffset += pos;
+    journalSnapshotStamp = snapshotStamp;
+
+    // On reload, calculate the differences between the two bases
+    if (reload) {
+        for (dataMap::iterator it = journalBase->begin(); it != journalBase->end(); ++it) {
+            if (newBase->find(it->first) == newBase->end())
+                delta[it->first] = std::make_pair( false, std::string("") );
+        }
+        for (dataMap::iterator it = newBase->begin(); it != newBase->end(); ++it) {
+            dataMap::iterator jt = journalBase->find(it->first);
+            if ((jt == journalBase->end()) || (jt->second != it->second))
+                delta[it->first] = std::make_pair( true, it->second );
+        }
+    }
+
+    // Merge the changes with the parameters, skipping the keys that we have
+    // changed locally (they will be written with the next commit)
+    {
+        boost::unique_lock<boost::shared_mutex> lock(*parametersMutex);
+        for (std::map< std::string, std::pair<bool, std::string> >::iterator it = delta.begin(); it != delta.end(); ++it) {
+            const std::string & key = it->first;
+            dataMap::iterator bt = journalBase->find(key);
+            dataMap::iterator pt = parameters->find(key);
+
+            // Check if the key was modified locally
+            bool baseHas = (bt != journalBase->end()), paramHas = (pt != parameters->end());
+            bool localChange = (journalTouched.find(key) != journalTouched.end());
+
+            // Apply to parameters
+            if (!localChange) {
+                if (it->second.first) {
+                    if (!paramHas || (pt->second != it->second.second)) {
+                        putOnMap( parameters, key, it->second.second );
+                        if (changedKeys != NULL) changedKeys->push_back( key );
+                    }
+                } else if (paramHas) {
+                    parameters->erase( pt );
+                    if (changedKeys != NULL) changedKeys->push_back( key );
+                }
+            }
+
+            // Apply to base
+            if (it->second.first) {
+                putOnMap( journalBase, key, it->second.second );
+            } else if (baseHas) {
+                journalBase->erase( bt );
+            }
+        }
+    }
+
+    return true;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Replay the journal records written by other processes
+ * and append our changes.
+ */
+bool LocalConfig::syncJournal ( ) {
+    CRASH_REPORT_BEGIN;
+    return this->commitJournal();
+    CRASH_REPORT_END;
+}
+
+/**
+ * Append the local changes to the journal
+ */
+bool LocalConfig::commitJournal ( ) {
+    CRASH_REPORT_BEGIN;
+    typedef std::map< const std::string, const std::string > dataMap;
+    std::string jFile = systemPath(this->configDir + "/" + configName + ".journal");
+    std::string sFile = systemPath(this->configDir + "/" + configName + ".conf");
+    JOURNAL_LOCK;
+
+    // Without a snapshot the config is not visible to enumFiles(),
+    // so write a snapshot instead of a journal record
+    if (!file_exists(sFile)) {
+        {
+            boost::unique_lock<boost::shared_mutex> lock(*parametersMutex);
+            journalBase = boost::make_shared< dataMap >( *parameters );
+            journalTouched.clear();
+        }
+        return _writeSnapshot();
+    }
+
+    // Pick up the records written by other processes
+    if (!_replayJournal( NULL )) return false;
+
+    // No other process can write to the journal while we hold the lock, so anything
+    // after the last record we replayed is a partial record left behind by a crash.
+    boost::system::error_code ec;
+    if (file_exists(jFile) && (boost::filesystem::file_size( jFile, ec ) > journalOffset))
+        boost::filesystem::resize_file( jFile, journalOffset, ec );
+
+    // Calculate the records of the keys changed since the last commit
+    std::set< std::string > touched;
+    std::map< std::string, std::pair<bool, std::string> > delta;
+    std::string records;
+    {
+        boost::unique_lock<boost::shared_mutex> lock(*parametersMutex);
+        touched.swap( journalTouched );
+        for (std::set< std::string >::iterator it = touched.begin(); it != touched.end(); ++it) {
+            dataMap::iterator pt = parameters->find(*it), bt = journalBase->find(*it);
+            if (pt != parameters->end()) {
+                // New or changed key
+                if ((bt != journalBase->end()) && (bt->second == pt->second)) continue;
+                records += "+" + pt->first + "=" + escapeValue(pt->second) + "\n";
+                delta[*it] = std::make_pair( true, pt->second );
+            } else if (bt != journalBase->end()) {
+                // Deleted key
+                records += "-" + *it + "\n";
+                delta[*it] = std::make_pair( false, std::string("") );
+            }
+        }
+    }
+    if (records.empty()) return true;
+
+    // Append records. If that fails, the keys are committed the next time.
+    std::ofstream ofs( jFile.c_str(), std::ofstream::out | std::ofstream::app | std::ofstream::binary );
+    if (!ofs.fail()) {
+        ofs.write( records.c_str(), records.length() );
+        ofs.flush();
+    }
+    if (ofs.fail()) {
+        CVMWA_LOG("Error", "Unable to write journal " << jFile );
+        ofs.close();
+        boost::unique_lock<boost::shared_mutex> lock(*parametersMutex);
+        journalTouched.insert( touched.begin(), touched.end() );
+        return false;
+    }
+    ofs.close();
+    journalOffset += records.length();
+    updateStamps();
+
+    {
+        // The records are now part of the base
+        boost::unique_lock<boost::shared_mutex> lock(*parametersMutex);
+        for (std::map< std::string, std::pair<bool, std::string> >::iterator it = delta.begin(); it != delta.end(); ++it) {
+            if (it->second.first) {
+                putOnMap( journalBase, it->first, it->second.second );
+            } else {
+                journalBase->erase( it->first );
+            }
+        }
+    }
+
+    {
+        // We are now in sync with the disk
+        boost::unique_lock<boost::mutex> lock(changesMutex);
+        timeLoaded = getTimeInMs();
+        keysDeleted.clear();
+    }
+
+    // Compact the journal in the background if it's too big
+    if (journalOffset > LOCALCONFIG_JOURNAL_COMPACT) {
+        {
+            boost::unique_lock<boost::mutex> lock(flushMutex);
+            compactPending = true;
+            startFlushThread();
+        }
+        flushCond.notify_all();
+    }
+
+    return true;
+    JOURNAL_UNLOCK;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Write the journal contents to the snapshot and truncate the journal
+ */
+bool LocalConfig::compactJournal ( ) {
+    CRASH_REPORT_BEGIN;
+    std::string jFile = systemPath(this->configDir + "/" + configName + ".journal");
+    JOURNAL_LOCK;
+
+    // Nothing to compact (or the config was removed)
+    if (!file_exists(jFile)) return true;
+
+    // Make sure we have all the records before writing the snapshot
+    if (!_replayJournal( NULL )) return false;
+    return _writeSnapshot();
+
+    JOURNAL_UNLOCK;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Write the journal base to the snapshot file and remove the journal.
+ *
+ * The snapshot contains the result of all the journal records, so if we crash
+ * before removing the journal, replaying it again produces the same state.
+ */
+bool LocalConfig::_writeSnapshot ( ) {
+    CRASH_REPORT_BEGIN;
+    std::string jFile = systemPath(this->configDir + "/" + configName + ".journal");
+    std::string sFile = systemPath(this->configDir + "/" + configName + ".conf");
+
+    // Write snapshot
+    if (!this->saveMap( configName, journalBase.get() ))
+        return false;
+
+    // Remove journal
+    if (file_exists(jFile))
+        remove( jFile.c_str() );
+    journalOffset = 0;
+    journalSnapshotStamp = fileStamp( sFile );
+    updateStamps();
+
+    return true;
+    CRASH_REPORT_END;
+}
+
 /**
  * Enumerate the names of the config files in the specified directory that matches the specified prefix.
  */
@@ -196,51 +1019,47 @@ bool LocalConfig::saveMap ( std::string name, std::map< const std::string, const
     
     // Only a single isntance can access the file
     std::string file = systemPath(this->configDir + "/" + name + ".conf");
+    std::string tmpFile = file + ".tmp";
     NAMED_MUTEX_LOCK(file);
     CVMWA_LOG("Config", "OPEN Saving " << file );
 
-    // Truncate file
-    std::ofstream ofs ( file.c_str() , std::ofstream::out | std::ofstream::trunc);
+    // Write to a temporary file, so a crash while writing
+    // does not leave us with a truncated config
+    std::ofstream ofs ( tmpFile.c_str() , std::ofstream::out | std::ofstream::trunc);
     if (ofs.fail()) {
-        CVMWA_LOG("Error", "SaveMap failed while oppening " << file );
+        CVMWA_LOG("Error", "SaveMap failed while oppening " << tmpFile );
         ofs.close();
         return false;
     }
     
-    // Dump the contents
-    std::string::size_type pos = 0;
-    for (std::map<const std::string, const std::string>::iterator it=map->begin(); it!=map->end(); ++it) {
-        std::string key = (*it).first;
-        std::string value = (*it).second;
-
-        // Do not allow new-line span: Replace \n to "\n", \r to "\r" and "\" to "\\"
-        pos = 0;
-        while (true) {
-            if (pos >= value.length()) break;
-
-            // Replace escape patterns as we find them
-            if (value[pos] == '\\') {
-                value.replace(pos, 1, "\\\\");
-                pos += 1;
-            } else if (value[pos] == '\n') {
-                value.replace(pos, 1, "\\n");
-                pos += 1;
-            } else if (value[pos] == '\r') {
-                value.replace(pos, 1, "\\r");
-                pos += 1;
-            }
-
-            pos += 1;
-
-        }
+    // Start with the next generation, so the other processes notice
+    // the change even if the file looks the same
+    ofs << LOCALCONFIG_GENERATION << (fileGeneration( file ) + 1) << std::endl;
 
-        ofs << key << "=" << value << std::endl;
+    // Dump the contents (do not allow new-line span)
+    for (std::map<const std::string, const std::string>::iterator it=map->begin(); it!=map->end(); ++it) {
+        ofs << (*it).first << "=" << escapeValue( (*it).second ) << std::endl;
     }
     
     // Close
     ofs.flush();
+    if (ofs.fail()) {
+        CVMWA_LOG("Error", "SaveMap failed while writing " << tmpFile );
+        ofs.close();
+        remove( tmpFile.c_str() );
+        return false;
+    }
     ofs.close();
 
+    // Replace the config file with the temporary file
+    boost::system::error_code ec;
+    boost::filesystem::rename( tmpFile, file, ec );
+    if (ec) {
+        CVMWA_LOG("Error", "SaveMap failed while replacing " << file << ": " << ec.message() );
+        remove( tmpFile.c_str() );
+        return false;
+    }
+
     CVMWA_LOG("Config", "CLOSE Closing " << file );
 
     return true;
@@ -331,35 +1150,17 @@ bool LocalConfig::loadMap ( std::string name, std::map< const std::string, const
     
     // Read file
     std::string line;
-    std::string::size_type pos = 0;
     map->clear();
     while( std::getline(ifs, line) ) {
+        if (!line.empty() && (line[0] == '#')) continue;
         std::istringstream is_line(line);
         std::string key;
         if( std::getline(is_line, key, '=') ) {
             std::string value;
             if( std::getline(is_line, value) ) {
 
-                // Revert new-line span: Replace "\n" to \n, "\r" to \r and "\\"" to "\"
-                pos = 0;
-                while (true) {
-                    if (pos >= value.length()-1) break;
-
-                    // Replace escape patterns as we find them
-                    if ((value[pos] == '\\') && (value[pos+1] == '\\')) {
-                        value.replace(pos, 2, "\\");
-                    } else if ((value[pos] == '\\') && (value[pos+1] == 'n')) {
-                        value.replace(pos, 2, "\n");
-                    } else if ((value[pos] == '\\') && (value[pos+1] == 'r')) {
-                        value.replace(pos, 2, "\r");
-                    }
-
-                    pos += 1;
-
-                }
-
-                // Insert into map
-                map->insert( std::pair<std::string,std::string>(key, value) );
+                // Revert new-line span and insert into map
+                map->insert( std::pair<std::string,std::string>(key, unescapeValue(value)) );
 
             }
         }
@@ -425,17 +1226,18 @@ time_t LocalConfig::getLastModified ( std::string configFile ) {
 ParameterMap& LocalConfig::erase ( const std::string& name ) {
     CRASH_REPORT_BEGIN;
 
-    // Update time modified
-    timeModified = getTimeInMs();
+    {
+        // Update time modified and store the key on 'deleted keys'
+        // before the change is commited
+        boost::unique_lock<boost::mutex> lock(changesMutex);
+        timeModified = getTimeInMs();
+        if (std::find(keysDeleted.begin(), keysDeleted.end(), prefix+name) == keysDeleted.end())
+            keysDeleted.push_back(prefix + name);
+    }
 
     // Erase key
-    ParameterMap& ans = ParameterMap::erase(name);
-
-    // Store it on 'deleted keys'
-    if (std::find(keysDeleted.begin(), keysDeleted.end(), prefix+name) == keysDeleted.end())
-        keysDeleted.push_back(prefix + name);
+    return ParameterMap::erase(name);
 
-    return ans;
     CRASH_REPORT_END;
 }
 
@@ -445,8 +1247,11 @@ ParameterMap& LocalConfig::erase ( const std::string& name ) {
 ParameterMap& LocalConfig::clear ( ) {
     CRASH_REPORT_BEGIN;
 
-    // Update time modified
-    timeModified = getTimeInMs();
+    {
+        // Update time modified
+        boost::unique_lock<boost::mutex> lock(changesMutex);
+        timeModified = getTimeInMs();
+    }
 
     // Clear all keys
     ParameterMap& ans = ParameterMap::clear();
@@ -455,9 +1260,22 @@ ParameterMap& LocalConfig::clear ( ) {
     // Remove the file as well.
     if (prefix.empty()) {
         if (!parent) {
+            boost::unique_lock<boost::mutex> saveLock(saveMutex);
+            {
+                // Drop pending write-behind changes
+                boost::unique_lock<boost::mutex> lock(flushMutex);
+                dirty = false;
+            }
             std::string fName = systemPath(this->configDir + "/" + configName + ".conf");
+            std::string jFile = systemPath(this->configDir + "/" + configName + ".journal");
+            JOURNAL_LOCK;
             if (file_exists(fName))
                 remove( fName.c_str() );
+            if (file_exists(jFile))
+                remove( jFile.c_str() );
+            updateStamps();
+            JOURNAL_UNLOCK;
+            resetJournal();
         }
     }
 
@@ -471,8 +1289,11 @@ ParameterMap& LocalConfig::clear ( ) {
 ParameterMap& LocalConfig::clearAll ( ) {
     CRASH_REPORT_BEGIN;
 
-    // Update time modified
-    timeModified = getTimeInMs();
+    {
+        // Update time modified
+        boost::unique_lock<boost::mutex> lock(changesMutex);
+        timeModified = getTimeInMs();
+    }
 
     // Clear all keys
     ParameterMap& ans = ParameterMap::clearAll();
@@ -480,9 +1301,22 @@ ParameterMap& LocalConfig::clearAll ( ) {
     // If we don't have a prefix, we just did a 'clearAll'
     // Remove the file as well.
     if (!parent) {
+        boost::unique_lock<boost::mutex> saveLock(saveMutex);
+        {
+            // Drop pending write-behind changes
+            boost::unique_lock<boost::mutex> lock(flushMutex);
+            dirty = false;
+        }
         std::string fName = systemPath(this->configDir + "/" + configName + ".conf");
+        std::string jFile = systemPath(this->configDir + "/" + configName + ".journal");
+        JOURNAL_LOCK;
         if (file_exists(fName))
             remove( fName.c_str() );
+        if (file_exists(jFile))
+            remove( jFile.c_str() );
+        updateStamps();
+        JOURNAL_UNLOCK;
+        resetJournal();
     }
 
     return ans;
@@ -496,18 +1330,19 @@ ParameterMap& LocalConfig::clearAll ( ) {
 ParameterMap& LocalConfig::set ( const std::string& name, std::string value ) {
     CRASH_REPORT_BEGIN;
 
-    // Update time modified
-    timeModified = getTimeInMs();
+    {
+        // Update time modified and erase the key from 'deleted'
+        // before the change is commited
+        boost::unique_lock<boost::mutex> lock(changesMutex);
+        timeModified = getTimeInMs();
+        std::list<std::string>::iterator iItem = std::find(keysDeleted.begin(), keysDeleted.end(), prefix+name);
+        if (iItem != keysDeleted.end())
+            keysDeleted.erase(iItem);
+    }
 
     // Update key value
-    ParameterMap& ans = ParameterMap::set(name, value);
+    return ParameterMap::set(name, value);
 
-    // Find and erase key from 'deleted'
-    std::list<std::string>::iterator iItem = std::find(keysDeleted.begin(), keysDeleted.end(), prefix+name);
-    if (iItem != keysDeleted.end())
-        keysDeleted.erase(iItem);
-
-    return ans;
     CRASH_REPORT_END;
 }
 
@@ -520,8 +1355,23 @@ void LocalConfig::commitChanges ( ) {
 
     CVMWA_LOG("LOG", "commitChanges");
 
+    // In write-behind mode just mark the map as dirty
+    // and let the flush thread write the changes.
+    if (writeBehind) {
+        {
+            boost::unique_lock<boost::mutex> lock(flushMutex);
+            if (!dirty) dirtySince = getTimeInMs();
+            dirty = true;
+            dirtyCount++;
+            startFlushThread();
+        }
+        flushCond.notify_all();
+        return;
+    }
+
     // Synchronize changes with the disk
-    this->save();
+    boost::unique_lock<boost::mutex> saveLock(saveMutex);
+    this->persist();
 
     CRASH_REPORT_END;
 }
@@ -533,22 +1383,48 @@ bool LocalConfig::save ( ) {
     CRASH_REPORT_BEGIN;
     bool ans = false;
 
+    // In journaled mode, commit the changes and compact the journal
+    if (journaled)
+        return this->commitJournal() && this->compactJournal();
+
+    // Take the 'keysDeleted', since the keys erased while we are
+    // saving belong to the next save
+    std::list<std::string> deleted;
+    {
+        boost::unique_lock<boost::mutex> lock(changesMutex);
+        deleted.swap( keysDeleted );
+    }
+
     {
         // Mutex for making this thread-safe
-        boost::unique_lock<boost::mutex> lock(*parametersMutex);
+        boost::unique_lock<boost::shared_mutex> lock(*parametersMutex);
         // Save map to file
-        bool ans = this->saveMap( configName, parameters.get() );
+        ans = this->saveMap( configName, parameters.get() );
     }
 
     // Check answer
     if (ans) {
 
+        // The snapshot replaces any journal left behind
+        std::string jFile = systemPath(this->configDir + "/" + configName + ".journal");
+        JOURNAL_LOCK;
+        if (file_exists(jFile))
+            remove( jFile.c_str() );
+        updateStamps();
+        JOURNAL_UNLOCK;
+
         // Update the time it was loaded (since the moment
         // we wrote something we have replaced it's contents)
+        boost::unique_lock<boost::mutex> lock(changesMutex);
         timeLoaded = getTimeInMs();
 
-        // Reset 'keysDeleted'
-        keysDeleted.clear();
+    } else {
+
+        // Put back the 'keysDeleted' for the next attempt
+        boost::unique_lock<boost::mutex> lock(changesMutex);
+        for (std::list<std::string>::iterator it = deleted.begin(); it != deleted.end(); ++it)
+            if (std::find(keysDeleted.begin(), keysDeleted.end(), *it) == keysDeleted.end())
+                keysDeleted.push_back( *it );
 
     }
 
@@ -567,19 +1443,24 @@ bool LocalConfig::load ( ) {
 
     {
         // Mutex for making this thread-safe
-        boost::unique_lock<boost::mutex> lock(*parametersMutex);
+        boost::unique_lock<boost::shared_mutex> lock(*parametersMutex);
         // Load map from file
-        bool ans = this->loadMap( configName, parameters.get() );
+        ans = this->loadMap( configName, parameters.get() );
     }
 
     // Check answer
     if (ans) {
 
-        // Update the time it was loaded
-        timeLoaded = getTimeInMs();
+        {
+            // Update the time it was loaded and reset 'keysDeleted'
+            boost::unique_lock<boost::mutex> lock(changesMutex);
+            timeLoaded = getTimeInMs();
+            keysDeleted.clear();
+        }
 
-        // Reset 'keysDeleted'
-        keysDeleted.clear();
+        // Replay the journal on top of the snapshot
+        resetJournal();
+        updateStamps();
 
     }
 
@@ -595,18 +1476,33 @@ bool LocalConfig::load ( ) {
  */
 bool LocalConfig::sync ( ) {
     CRASH_REPORT_BEGIN;
+
+    // In journaled mode we only need to replay the new records
+    if (journaled)
+        return this->syncJournal();
+
     
     // If the file is missing, save it 
     std::string fName = systemPath(this->configDir + "/" + configName + ".conf");
     if (!file_exists( fName ))
         return this->save();
 
-    // Load the time the file was modified
-    unsigned long long fileModified = getFileTimeMs( fName );
+    // Check if the file was changed since we last loaded or wrote it. The stamp
+    // includes the generation of the file, since the modification time might
+    // not change if it was written in the same tick.
+    std::string stamp = fileStamp( fName );
+    unsigned long long timeLoaded, timeModified;
+    bool fileChanged;
+    {
+        boost::unique_lock<boost::mutex> lock(changesMutex);
+        timeLoaded = this->timeLoaded;
+        timeModified = this->timeModified;
+        fileChanged = (stamp != confStamp);
+    }
 
     // Check for missing modifications
     if (timeModified <= timeLoaded) {
-        if (fileModified > timeLoaded) {
+        if (fileChanged) {
 
             // [1] Memory : No changes
             //       Disk : Changed
@@ -626,31 +1522,47 @@ bool LocalConfig::sync ( ) {
     // [3] Memory : Changed
     //       Disk : No changes
     //         DO : Replace disk contents
-    if (fileModified <= timeLoaded) {
+    if (!fileChanged) {
         return this->save();
     }
 
     // [4] Memory : Changed
     //       Disk : Changed
     //         DO : Do DIFF, preferring 'ours'
+    return this->mergeFile();
+
+    CRASH_REPORT_END;
+}
+
+/**
+ * Merge the file contents with the local changes, preferring 'ours',
+ * and save the result.
+ */
+bool LocalConfig::mergeFile ( ) {
+    CRASH_REPORT_BEGIN;
 
     // Load file map in a new dictionary
     std::map<const std::string, const std::string> map;
     if (!this->loadMap( configName, &map ))
         return false;
 
+    // Take the 'keysDeleted', since the keys erased while we
+    // are merging belong to the next save
+    std::list<std::string> deleted;
+    {
+        boost::unique_lock<boost::mutex> lock(changesMutex);
+        deleted.swap( keysDeleted );
+    }
+
     // Erase keys from file from which the erase() function was called
-    for (std::list<std::string>::iterator it = keysDeleted.begin(); it != keysDeleted.end(); ++it) {
+    for (std::list<std::string>::iterator it = deleted.begin(); it != deleted.end(); ++it) {
         std::map<const std::string, const std::string>::iterator jt = map.find(*it);
         if (jt != map.end()) map.erase(jt);
     }
 
-    // Reset 'keysDeleted'
-    keysDeleted.clear();
-
     {
         // Mutex for making this thread-safe
-        boost::unique_lock<boost::mutex> lock(*parametersMutex);
+        boost::unique_lock<boost::shared_mutex> lock(*parametersMutex);
 
         // Update the parameters that still exist in the config file and add new ones if they are missing.
         for (std::map<const std::string, const std::string>::iterator it = parameters->begin(); it != parameters->end(); ++it) {
@@ -677,7 +1589,21 @@ bool LocalConfig::sync ( ) {
     }
 
     // Save file contents
-    this->saveMap( configName, &map );
+    if (!this->saveMap( configName, &map )) {
+        // Put back the 'keysDeleted' for the next attempt
+        boost::unique_lock<boost::mutex> lock(changesMutex);
+        for (std::list<std::string>::iterator it = deleted.begin(); it != deleted.end(); ++it)
+            if (std::find(keysDeleted.begin(), keysDeleted.end(), *it) == keysDeleted.end())
+                keysDeleted.push_back( *it );
+        return false;
+    }
+
+    {
+        // We are now in sync with the disk
+        boost::unique_lock<boost::mutex> lock(changesMutex);
+        timeLoaded = getTimeInMs();
+    }
+    updateStamps();
 
     return true;
     CRASH_REPORT_END;
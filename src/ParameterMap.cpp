@@ -24,6 +24,52 @@
 
 const std::string SAFE_KEY_CHARS("0123456789_-abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ");
 
+/**
+ * Return the smallest key that is bigger than all the keys starting with the given prefix
+ */
+static std::string prefixEnd( const std::string& prefix ) {
+    std::string end = prefix;
+    while (!end.empty()) {
+        unsigned char c = end[end.length()-1];
+        if (c < 0xFF) {
+            end[end.length()-1] = (char)(c + 1);
+            return end;
+        }
+        end.erase(end.length()-1);
+    }
+    return end;
+}
+
+/**
+ * Advance the iterator to the next key that belongs directly to the group with the given
+ * prefix (and not to a sub-group). Since the map is sorted, the keys of the group are in
+ * the range starting at lower_bound(prefix) and every sub-group is a contiguous range in it
+ * that can be skipped with a single lookup.
+ *
+ * Returns false when there are no more keys in the group.
+ */
+static bool nextGroupKey( std::map< const std::string, const std::string > * map, const std::string& prefix,
+                          std::map< const std::string, const std::string >::iterator * it ) {
+    static const std::string separator( PMAP_GROUP_SEPARATOR );
+    while (*it != map->end()) {
+        const std::string & key = (*it)->first;
+
+        // We are out of the group range
+        if (key.compare(0, prefix.length(), prefix) != 0) return false;
+
+        // Skip the entire sub-group range
+        std::string::size_type sep = key.find(separator, prefix.length());
+        if (sep != std::string::npos) {
+            std::string end = prefixEnd( key.substr(0, sep + separator.length()) );
+            *it = end.empty() ? map->end() : map->lower_bound( end );
+            continue;
+        }
+
+        return true;
+    }
+    return false;
+}
+
 /**
  * Helper to replace key on the const map
  */
@@ -47,6 +93,7 @@ ParameterMapPtr ParameterMap::instance ( ) {
  */
 std::string ParameterMap::get( const std::string& kname, std::string defaultValue, bool strict ) {
     CRASH_REPORT_BEGIN;
+    ensureLoaded();
     // Replace invalid chars in strict mode
     std::string name = kname;
     if (strict) {
@@ -59,10 +106,11 @@ std::string ParameterMap::get( const std::string& kname, std::string defaultValu
     name = prefix + name;
     {
         // Mutex for thread-safety
-        boost::unique_lock<boost::mutex> lock(*parametersMutex);
-        if (parameters->find(name) == parameters->end())
+        boost::shared_lock<boost::shared_mutex> lock(*parametersMutex);
+        std::map<const std::string, const std::string>::iterator it = parameters->find(name);
+        if (it == parameters->end())
             return defaultValue;
-        return (*parameters)[name];
+        return it->second;
     }
     CRASH_REPORT_END;
 }
@@ -72,12 +120,14 @@ std::string ParameterMap::get( const std::string& kname, std::string defaultValu
  */
 ParameterMap& ParameterMap::set ( const std::string& kname, const std::string value ) {
     CRASH_REPORT_BEGIN;
+    ensureLoaded();
     std::string name = prefix + kname;
     
     {
         // Mutex for thread-safety
-        boost::unique_lock<boost::mutex> lock(*parametersMutex);
+        boost::unique_lock<boost::shared_mutex> lock(*parametersMutex);
         putOnMap(parameters, name, value);
+        touchKey(name);
     }
 
     if (!locked) {
@@ -94,12 +144,14 @@ ParameterMap& ParameterMap::set ( const std::string& kname, const std::string va
  */
 ParameterMap& ParameterMap::erase ( const std::string& name ) {
     CRASH_REPORT_BEGIN;
+    ensureLoaded();
     {
         // Mutex for thread-safety
-        boost::unique_lock<boost::mutex> lock(*parametersMutex);
+        boost::unique_lock<boost::shared_mutex> lock(*parametersMutex);
         std::map<const std::string, const std::string>::iterator e = parameters->find(prefix+name);
         if (e != parameters->end())
             parameters->erase(e);
+        touchKey(prefix+name);
     }
     return *this;
     CRASH_REPORT_END;
@@ -117,8 +169,14 @@ void ParameterMap::setDefault ( const std::string& kname, std::string value ) {
     // and don't trigger commitChanges.
     {
         // Mutex for thread-safety
-        boost::unique_lock<boost::mutex> lock(*parametersMutex);
-        parameters->insert(std::pair< const std::string, const std::string >( name, value ));
+        boost::unique_lock<boost::shared_mutex> lock(*parametersMutex);
+
+        // Keep it aside if the parameters are not loaded yet
+        if (root->unloaded.load( boost::memory_order_relaxed )) {
+            root->pendingDefaults.insert(std::pair< const std::string, const std::string >( name, value ));
+        } else {
+            parameters->insert(std::pair< const std::string, const std::string >( name, value ));
+        }
     }
 
     CRASH_REPORT_END;
@@ -129,13 +187,15 @@ void ParameterMap::setDefault ( const std::string& kname, std::string value ) {
  */
 template<typename T> T ParameterMap::getNum ( const std::string& kname, T defaultValue ) {
     CRASH_REPORT_BEGIN;
+    ensureLoaded();
     std::string name = prefix + kname;
     {
         // Mutex for thread-safety
-        boost::unique_lock<boost::mutex> lock(*parametersMutex);
-        if (parameters->find(name) == parameters->end())
+        boost::shared_lock<boost::shared_mutex> lock(*parametersMutex);
+        std::map<const std::string, const std::string>::iterator it = parameters->find(name);
+        if (it == parameters->end())
             return defaultValue;
-        return ston<T>((*parameters)[name]);
+        return ston<T>(it->second);
     }
     CRASH_REPORT_END;
 }
@@ -155,16 +215,16 @@ template<typename T> ParameterMap& ParameterMap::setNum ( const std::string& kna
  */
 ParameterMap& ParameterMap::clear( ) {
     CRASH_REPORT_BEGIN;
+    ensureLoaded();
 
-    // Get the keys for this group
-    std::vector<std::string> myKeys = enumKeys();
-
-    // Delete keys
+    // Delete the keys of this group
     {
         // Mutex for thread-safety
-        boost::unique_lock<boost::mutex> lock(*parametersMutex);
-        for (std::vector<std::string>::iterator it = myKeys.begin(); it != myKeys.end(); ++it) {
-            parameters->erase( prefix + *it );
+        boost::unique_lock<boost::shared_mutex> lock(*parametersMutex);
+        std::map<const std::string, const std::string>::iterator it = parameters->lower_bound(prefix);
+        while (nextGroupKey(parameters.get(), prefix, &it)) {
+            touchKey( it->first );
+            parameters->erase( it++ );
         }
     }
 
@@ -177,9 +237,12 @@ ParameterMap& ParameterMap::clear( ) {
  */
 ParameterMap& ParameterMap::clearAll( ) {
     CRASH_REPORT_BEGIN;
+    ensureLoaded();
     {
         // Mutex for thread-safety
-        boost::unique_lock<boost::mutex> lock(*parametersMutex);
+        boost::unique_lock<boost::shared_mutex> lock(*parametersMutex);
+        for (std::map<const std::string, const std::string>::iterator it = parameters->begin(); it != parameters->end(); ++it)
+            touchKey( it->first );
         parameters->clear();
     }
     return *this;
@@ -220,6 +283,88 @@ void ParameterMap::commitChanges ( ) {
     CRASH_REPORT_END;
 }
 
+/**
+ * Locally overridable function to report the changed keys
+ */
+void ParameterMap::notifyChanges ( const std::vector< std::string >& keys ) {
+    CRASH_REPORT_BEGIN;
+
+    // Forward event to parent
+    if (parent) parent->notifyChanges( keys );
+
+    CRASH_REPORT_END;
+}
+
+/**
+ * Locally overridable function to load the parameters. The default
+ * implementation has nothing to load.
+ */
+void ParameterMap::loadParameters ( ) {
+}
+
+/**
+ * Mark the parameters as not loaded yet
+ */
+void ParameterMap::setUnloaded ( ) {
+    CRASH_REPORT_BEGIN;
+    boost::unique_lock<boost::shared_mutex> lock(*parametersMutex);
+    root->unloaded.store( true, boost::memory_order_release );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Load the parameters of the root map if they are not loaded yet
+ */
+void ParameterMap::ensureLoaded ( ) const {
+    if (root->unloaded.load( boost::memory_order_acquire ))
+        root->loadNow();
+}
+
+/**
+ * Load the parameters and apply the defaults that were set in the mean time
+ */
+void ParameterMap::loadNow ( ) {
+    CRASH_REPORT_BEGIN;
+    boost::unique_lock<boost::shared_mutex> lock(*parametersMutex);
+
+    // Someone else loaded them while we were waiting
+    if (!unloaded.load( boost::memory_order_relaxed )) return;
+
+    // Load the parameters and apply the defaults on the missing ones
+    loadParameters();
+    parameters->insert( pendingDefaults.begin(), pendingDefaults.end() );
+    pendingDefaults.clear();
+
+    unloaded.store( false, boost::memory_order_release );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Locally overridable function to track the changed keys
+ */
+void ParameterMap::touchKey ( const std::string& key ) {
+    CRASH_REPORT_BEGIN;
+
+    // Forward event to parent
+    if (parent) parent->touchKey( key );
+
+    CRASH_REPORT_END;
+}
+
+/**
+ * Write pending changes. The default implementation just forwards
+ * the request to the parent.
+ */
+bool ParameterMap::flush ( ) {
+    CRASH_REPORT_BEGIN;
+
+    // Forward request to parent
+    if (parent) return parent->flush();
+    return true;
+
+    CRASH_REPORT_END;
+}
+
 /**
  * Return a sub-parameter group instance
  */
@@ -236,28 +381,46 @@ ParameterMapPtr ParameterMap::subgroup( const std::string& kname ) {
     CRASH_REPORT_END;
 }
 
+/**
+ * Return a detached copy of the parameters of this group (including the
+ * sub-groups), taken atomically.
+ */
+ParameterMapPtr ParameterMap::snapshot ( ) {
+    CRASH_REPORT_BEGIN;
+    ensureLoaded();
+    ParameterMapPtr snap = boost::make_shared< ParameterMap >();
+
+    {
+        // Mutex for thread-safety
+        boost::shared_lock<boost::shared_mutex> lock(*parametersMutex);
+        std::map<const std::string, const std::string>::iterator it = parameters->lower_bound(prefix);
+        for ( ; (it != parameters->end()) && (it->first.compare(0, prefix.length(), prefix) == 0); ++it ) {
+            snap->parameters->insert( snap->parameters->end(),
+                std::pair< const std::string, const std::string >( it->first.substr(prefix.length()), it->second ) );
+        }
+    }
+
+    return snap;
+    CRASH_REPORT_END;
+}
+
 /**
  * Enumerate the variable names that match our current prefix
  */
 std::vector<std::string > ParameterMap::enumKeys ( ) {
     CRASH_REPORT_BEGIN;
+    ensureLoaded();
     std::vector<std::string > keys;
 
-    // Loop over the entries in the record
+    // Loop over the entries in the range of our prefix
     {
         // Mutex for thread-safety
-        boost::unique_lock<boost::mutex> lock(*parametersMutex);
-        for ( std::map<const std::string, const std::string>::iterator it = parameters->begin(); it != parameters->end(); ++it ) {
-            std::string key = (*it).first;
-
-            // Check for matching prefix and lack of group separator in the rest of the key
-            if ( (key.substr(0, prefix.length()).compare(prefix) == 0) && // Prefix Matches
-                    (key.substr(prefix.length(), key.length() - prefix.length() ).find(PMAP_GROUP_SEPARATOR) == std::string::npos) // No group separator found
-                ) {
+        boost::shared_lock<boost::shared_mutex> lock(*parametersMutex);
+        std::map<const std::string, const std::string>::iterator it = parameters->lower_bound(prefix);
+        for ( ; nextGroupKey(parameters.get(), prefix, &it); ++it ) {
 
-                // Store key name without prefix
-                keys.push_back( key.substr(prefix.length(), key.length() - prefix.length()) ); 
-            }
+            // Store key name without prefix
+            keys.push_back( it->first.substr(prefix.length()) );
 
         }
     }
@@ -273,49 +436,26 @@ std::vector<std::string > ParameterMap::enumKeys ( ) {
  */
 bool ParameterMap::contains ( const std::string& name, const bool useBlank ) {
     CRASH_REPORT_BEGIN;
+    ensureLoaded();
     // Mutex for thread-safety
-    boost::unique_lock<boost::mutex> lock(*parametersMutex);
+    boost::shared_lock<boost::shared_mutex> lock(*parametersMutex);
 
-    bool ans = (parameters->find(prefix + name) != parameters->end());
-    if ( ans && useBlank ) {
-        return !(*parameters)[prefix+name].empty();
-    } else {
-        return ans;
-    }
+    std::map<const std::string, const std::string>::iterator it = parameters->find(prefix + name);
+    if (it == parameters->end()) return false;
+    return !useBlank || !it->second.empty();
     CRASH_REPORT_END;
 }
 
 /**
  * Update all the parameters from the specified map
  */
-void ParameterMap::fromParameters ( const ParameterMapPtr& ptr, bool clearBefore, const bool replace ) {
+bool ParameterMap::fromParameters ( const ParameterMapPtr& ptr, bool clearBefore, const bool replace, std::vector< std::string > * changedKeys ) {
     CRASH_REPORT_BEGIN;
 
-    // Check if we have to clean the keys first
-    if (clearBefore) clear();
-
-    // Get parameter keys
-    std::vector< std::string > ptrKeys = ptr->enumKeys();
-
-    // Update parameters
-    std::string k;
-    for (std::vector< std::string >::iterator it = ptrKeys.begin(); it != ptrKeys.end(); ++it) {
-        CVMWA_LOG("INFO", "Importing key " << *it << " = " << ptr->parameters->at(*it));
-        k = prefix + *it;
-        if (replace || (this->parameters->find(k) == this->parameters->end())) {
-            // Mutex for thread-safety
-            boost::unique_lock<boost::mutex> lock(*parametersMutex);
-            putOnMap(this->parameters, k, (*ptr->parameters)[*it]);
-        }
-    }
-
-    // If we are not locked, sync changes.
-    // Oherwise mark us as dirty
-    if (!locked) {
-        commitChanges();
-    } else {
-        changed = true;
-    }
+    // Get the parameters of the other group and import them
+    std::map< const std::string, const std::string> map;
+    ptr->toMap( &map );
+    return fromMap( &map, clearBefore, replace, changedKeys );
 
     CRASH_REPORT_END;
 }
@@ -323,27 +463,51 @@ void ParameterMap::fromParameters ( const ParameterMapPtr& ptr, bool clearBefore
 /**
  * Update all the parameters from the specified map
  */
-void ParameterMap::fromMap ( std::map< const std::string, const std::string> * map, bool clearBefore, const bool replace ) {
+bool ParameterMap::fromMap ( std::map< const std::string, const std::string> * map, bool clearBefore, const bool replace, std::vector< std::string > * changedKeys ) {
     CRASH_REPORT_BEGIN;
+    ensureLoaded();
+    std::vector< std::string > keys;
+    std::map< const std::string, const std::string> empty;
+    if (map == NULL) map = &empty;
 
-    // Check if we have to clean the keys first
-    if (clearBefore) clear();
-
-    // Store values
-    if (map == NULL) return;
     {
         // Mutex for thread-safety
-        boost::unique_lock<boost::mutex> lock(*parametersMutex);
+        boost::unique_lock<boost::shared_mutex> lock(*parametersMutex);
+
+        // Remove the keys of this group that are not in the map
+        if (clearBefore) {
+            std::map<const std::string, const std::string>::iterator it = parameters->lower_bound(prefix);
+            while (nextGroupKey(parameters.get(), prefix, &it)) {
+                std::string k = it->first.substr(prefix.length());
+                if (map->find(k) == map->end()) {
+                    keys.push_back( k );
+                    touchKey( it->first );
+                    parameters->erase( it++ );
+                } else {
+                    ++it;
+                }
+            }
+        }
 
-        // Update parameters
-        std::string k;
+        // Update only the parameters that are different
         for (std::map< const std::string, const std::string>::iterator it = map->begin(); it != map->end(); ++it) {
-            k = prefix + (*it).first;
-            if (replace || (parameters->find(k) == parameters->end()))
-            putOnMap(this->parameters, k, (*it).second);
+            std::string k = prefix + it->first;
+            std::map<const std::string, const std::string>::iterator pt = parameters->find(k);
+            if (pt != parameters->end()) {
+                if ((!replace && !clearBefore) || (pt->second == it->second)) continue;
+                parameters->erase( pt++ );
+                parameters->insert( pt, std::pair< const std::string, const std::string >( k, it->second ) );
+            } else {
+                parameters->insert( std::pair< const std::string, const std::string >( k, it->second ) );
+            }
+            touchKey( k );
+            keys.push_back( it->first );
         }
     }
 
+    // Nothing to commit
+    if (keys.empty()) return false;
+
     // If we are not locked, sync changes.
     // Oherwise mark us as dirty
     if (!locked) {
@@ -352,50 +516,338 @@ void ParameterMap::fromMap ( std::map< const std::string, const std::string> * m
         changed = true;
     }
 
+    // Report the changed keys to the listeners
+    std::vector< std::string > fullKeys;
+    for (std::vector< std::string >::iterator it = keys.begin(); it != keys.end(); ++it)
+        fullKeys.push_back( prefix + *it );
+    notifyChanges( fullKeys );
+
+    // And to the caller
+    if (changedKeys != NULL)
+        changedKeys->insert( changedKeys->end(), keys.begin(), keys.end() );
+    return true;
+
     CRASH_REPORT_END;
 }
 
 /**
- * Update all the parameters from the specified JSON Value
+ * Flatten the string and integer members of the JSON object to the specified map,
+ * using the group separator for the nested objects.
  */
-void ParameterMap::fromJSON( const Json::Value& json, bool clearBefore, const bool replace ){
-    CRASH_REPORT_BEGIN;
-
-    // Check if we have to clean the keys first
-    if (clearBefore) clear();
-
-    // Update parameters
+static void flattenJSON( const Json::Value& json, const std::string& pfx, std::map< const std::string, const std::string> * map ) {
     const Json::Value::Members membNames = json.getMemberNames();
     for (std::vector<std::string>::const_iterator it = membNames.begin(); it != membNames.end(); ++it) {
-        std::string k = *it;
-        Json::Value v = json[k];
+        const Json::Value& v = json[*it];
         if (v.isObject()) {
-            ParameterMapPtr sg = subgroup(k);
-            sg->fromJSON(v);
+            flattenJSON( v, pfx + *it + PMAP_GROUP_SEPARATOR, map );
         } else if (v.isString()) {
-            if (replace || (parameters->find(k) == parameters->end())) {
-                // Mutex for thread-safety
-                boost::unique_lock<boost::mutex> lock(*parametersMutex);
-                putOnMap(this->parameters, k, v.asString());
-            }
+            map->insert(std::pair< const std::string, const std::string >( pfx + *it, v.asString() ));
         } else if (v.isInt()) {
             int vv = v.asInt();
-            if (replace || (parameters->find(k) == parameters->end())) {
-                // Mutex for thread-safety
-                boost::unique_lock<boost::mutex> lock(*parametersMutex);
-                putOnMap(this->parameters, k, ntos<int>( vv ));
+            map->insert(std::pair< const std::string, const std::string >( pfx + *it, ntos<int>( vv ) ));
+        }
+    }
+}
+
+/**
+ * A streaming JSON reader that flattens the objects directly to a parameter
+ * dictionary, using the group separator for the nested objects. Like in fromJSON,
+ * only string and numeric values are imported.
+ */
+class ParameterMapJSONReader {
+public:
+
+    ParameterMapJSONReader( std::istream& in ) : sb(in.rdbuf()) { };
+
+    /**
+     * Read a JSON object from the stream to the specified map
+     */
+    bool read( std::map< const std::string, const std::string> * map ) {
+        if ((sb == NULL) || (next() != '{')) return false;
+        if (!readObject( "", map, 0 )) return false;
+        return next() == EOF;
+    }
+
+private:
+
+    std::streambuf *    sb;
+
+    // Return the next non-whitespace character without consuming it
+    int next() {
+        int c = sb->sgetc();
+        while ((c == ' ') || (c == '\t') || (c == '\n') || (c == '\r'))
+            c = sb->snextc();
+        return c;
+    }
+
+    // Read an object and store its members with the given prefix
+    bool readObject( const std::string& pfx, std::map< const std::string, const std::string> * map, int depth ) {
+        std::string key, value;
+        sb->sbumpc();
+        if (next() == '}') {
+            sb->sbumpc();
+            return true;
+        }
+        for (;;) {
+
+            // Read key
+            if ((next() != '"') || !readString( &key )) return false;
+            if (next() != ':') return false;
+            sb->sbumpc();
+
+            // Read value
+            int c = next();
+            if (c == '{') {
+                if (depth >= PMAP_JSON_MAX_DEPTH) return false;
+                if (!readObject( pfx + key + PMAP_GROUP_SEPARATOR, map, depth + 1 )) return false;
+            } else if ((c == '"') || (c == '-') || ((c >= '0') && (c <= '9'))) {
+                if (!((c == '"') ? readString( &value ) : readNumber( &value ))) return false;
+                std::map< const std::string, const std::string>::iterator it = map->find( pfx + key );
+                if (it != map->end()) map->erase( it );
+                map->insert(std::pair< const std::string, const std::string >( pfx + key, value ));
+            } else if (!skipValue( depth )) {
+                return false;
             }
+
+            // Continue with the next member
+            c = next();
+            sb->sbumpc();
+            if (c == '}') return true;
+            if (c != ',') return false;
         }
     }
 
-    // If we are not locked, sync changes.
-    // Oherwise mark us as dirty
-    if (!locked) {
-        commitChanges();
-    } else {
-        changed = true;
+    // Read a string, decoding the escape sequences
+    bool readString( std::string * str ) {
+        str->clear();
+        sb->sbumpc();
+        for (;;) {
+            int c = sb->sbumpc();
+            if (c == EOF) return false;
+            if (c == '"') return true;
+            if (c != '\\') {
+                str->push_back( (char)c );
+                continue;
+            }
+            switch (c = sb->sbumpc()) {
+                case '"': case '\\': case '/': str->push_back( (char)c ); break;
+                case 'b': str->push_back( '\b' ); break;
+                case 'f': str->push_back( '\f' ); break;
+                case 'n': str->push_back( '\n' ); break;
+                case 'r': str->push_back( '\r' ); break;
+                case 't': str->push_back( '\t' ); break;
+                case 'u': {
+                    unsigned long cp;
+                    if (!readHex4( &cp )) return false;
+                    // Combine surrogate pairs
+                    if ((cp >= 0xD800) && (cp <= 0xDBFF)) {
+                        unsigned long lo;
+                        if ((sb->sbumpc() != '\\') || (sb->sbumpc() != 'u') || !readHex4( &lo )) return false;
+                        if ((lo < 0xDC00) || (lo > 0xDFFF)) return false;
+                        cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+                    }
+                    appendUTF8( str, cp );
+                    break;
+                }
+                default:
+                    return false;
+            }
+        }
+    }
+
+    // Read the four hex digits of a \u escape
+    bool readHex4( unsigned long * cp ) {
+        *cp = 0;
+        for (int i=0; i<4; i++) {
+            int c = sb->sbumpc();
+            if ((c >= '0') && (c <= '9')) *cp = (*cp << 4) | (c - '0');
+            else if ((c >= 'a') && (c <= 'f')) *cp = (*cp << 4) | (c - 'a' + 10);
+            else if ((c >= 'A') && (c <= 'F')) *cp = (*cp << 4) | (c - 'A' + 10);
+            else return false;
+        }
+        return true;
+    }
+
+    // Append a code point in UTF-8
+    static void appendUTF8( std::string * str, unsigned long cp ) {
+        if (cp < 0x80) {
+            str->push_back( (char)cp );
+        } else if (cp < 0x800) {
+            str->push_back( (char)(0xC0 | (cp >> 6)) );
+            str->push_back( (char)(0x80 | (cp & 0x3F)) );
+        } else if (cp < 0x10000) {
+            str->push_back( (char)(0xE0 | (cp >> 12)) );
+            str->push_back( (char)(0x80 | ((cp >> 6) & 0x3F)) );
+            str->push_back( (char)(0x80 | (cp & 0x3F)) );
+        } else {
+            str->push_back( (char)(0xF0 | (cp >> 18)) );
+            str->push_back( (char)(0x80 | ((cp >> 12) & 0x3F)) );
+            str->push_back( (char)(0x80 | ((cp >> 6) & 0x3F)) );
+            str->push_back( (char)(0x80 | (cp & 0x3F)) );
+        }
+    }
+
+    // Read a number as it is written
+    bool readNumber( std::string * str ) {
+        str->clear();
+        int c = sb->sgetc();
+        while (((c >= '0') && (c <= '9')) || (c == '-') || (c == '+') || (c == '.') || (c == 'e') || (c == 'E')) {
+            str->push_back( (char)c );
+            c = sb->snextc();
+        }
+        return !str->empty() && (*str != "-");
+    }
+
+    // Skip a value that is not imported (arrays, booleans and nulls)
+    bool skipValue( int depth ) {
+        std::string tmp;
+        int c = next();
+        if (depth > PMAP_JSON_MAX_DEPTH) return false;
+        if (c == '"') return readString( &tmp );
+        if ((c == '-') || ((c >= '0') && (c <= '9'))) return readNumber( &tmp );
+        if ((c == '{') || (c == '[')) {
+            int close = (c == '{') ? '}' : ']';
+            sb->sbumpc();
+            if (next() == close) {
+                sb->sbumpc();
+                return true;
+            }
+            for (;;) {
+                if (close == '}') {
+                    if ((next() != '"') || !readString( &tmp ) || (next() != ':')) return false;
+                    sb->sbumpc();
+                }
+                if (!skipValue( depth + 1 )) return false;
+                c = next();
+                sb->sbumpc();
+                if (c == close) return true;
+                if (c != ',') return false;
+            }
+        }
+        while ((c >= 'a') && (c <= 'z')) {
+            tmp.push_back( (char)c );
+            c = sb->snextc();
+        }
+        return (tmp == "true") || (tmp == "false") || (tmp == "null");
+    }
+
+};
+
+/**
+ * Write a JSON string literal
+ */
+static void writeJSONString( std::ostream& out, const std::string& str ) {
+    static const char hex[] = "0123456789abcdef";
+    out.put('"');
+    for (std::string::const_iterator it = str.begin(); it != str.end(); ++it) {
+        unsigned char c = *it;
+        switch (c) {
+            case '"': out.write("\\\"", 2); break;
+            case '\\': out.write("\\\\", 2); break;
+            case '\b': out.write("\\b", 2); break;
+            case '\f': out.write("\\f", 2); break;
+            case '\n': out.write("\\n", 2); break;
+            case '\r': out.write("\\r", 2); break;
+            case '\t': out.write("\\t", 2); break;
+            default:
+                if (c < 0x20) {
+                    char esc[] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xF] };
+                    out.write(esc, sizeof(esc));
+                } else {
+                    out.put((char)c);
+                }
+        }
+    }
+    out.put('"');
+}
+
+/**
+ * Update all the parameters from the JSON text in the specified stream
+ */
+bool ParameterMap::fromJSONStream( std::istream& in, bool clearBefore, const bool replace, std::vector< std::string > * changedKeys ) {
+    CRASH_REPORT_BEGIN;
+
+    // Parse the entire text before updating the parameters
+    std::map< const std::string, const std::string> map;
+    ParameterMapJSONReader reader( in );
+    if (!reader.read( &map )) {
+        CVMWA_LOG("Error", "Unable to parse the JSON parameters");
+        return false;
     }
 
+    return fromMap( &map, clearBefore, replace, changedKeys );
+
+    CRASH_REPORT_END;
+}
+
+/**
+ * Write all the parameters of this group as JSON text. Since the dictionary is sorted,
+ * the keys of every sub-group are contiguous, so each nested object is opened and
+ * closed only once.
+ */
+void ParameterMap::toJSONStream( std::ostream& out ) {
+    CRASH_REPORT_BEGIN;
+    ensureLoaded();
+    static const std::string separator( PMAP_GROUP_SEPARATOR );
+    std::vector< std::string > groups, path;
+    bool first = true;
+
+    // Mutex for thread-safety
+    boost::shared_lock<boost::shared_mutex> lock(*parametersMutex);
+
+    out.put('{');
+    std::map<const std::string, const std::string>::iterator it = parameters->lower_bound(prefix);
+    for ( ; (it != parameters->end()) && (it->first.compare(0, prefix.length(), prefix) == 0); ++it ) {
+
+        // Split the key to the group names and the parameter name
+        path.clear();
+        std::string::size_type pos = prefix.length(), sep;
+        while ((sep = it->first.find(separator, pos)) != std::string::npos) {
+            path.push_back( it->first.substr(pos, sep - pos) );
+            pos = sep + separator.length();
+        }
+
+        // Close the groups we left and open the new ones
+        size_t common = 0;
+        while ((common < groups.size()) && (common < path.size()) && (groups[common] == path[common])) common++;
+        while (groups.size() > common) {
+            out.put('}');
+            groups.pop_back();
+            first = false;
+        }
+        for (size_t i = common; i < path.size(); ++i) {
+            if (!first) out.put(',');
+            writeJSONString( out, path[i] );
+            out.write(":{", 2);
+            groups.push_back( path[i] );
+            first = true;
+        }
+
+        // Write the parameter
+        if (!first) out.put(',');
+        writeJSONString( out, it->first.substr(pos) );
+        out.put(':');
+        writeJSONString( out, it->second );
+        first = false;
+
+    }
+    for (size_t i = 0; i < groups.size(); ++i) out.put('}');
+    out.put('}');
+
+    CRASH_REPORT_END;
+}
+
+/**
+ * Update all the parameters from the specified JSON Value
+ */
+bool ParameterMap::fromJSON( const Json::Value& json, bool clearBefore, const bool replace, std::vector< std::string > * changedKeys ){
+    CRASH_REPORT_BEGIN;
+
+    // Import the flattened JSON object in a single update
+    std::map< const std::string, const std::string> map;
+    flattenJSON( json, "", &map );
+    return fromMap( &map, clearBefore, replace, changedKeys );
+
     CRASH_REPORT_END;
 }
 
@@ -404,21 +856,19 @@ void ParameterMap::fromJSON( const Json::Value& json, bool clearBefore, const bo
  */
 void ParameterMap::toMap ( std::map< const std::string, const std::string> * map, bool clearBefore ) {
     CRASH_REPORT_BEGIN;
+    ensureLoaded();
 
     // Clear map
-    if (clearBefore) {
-        // Mutex for thread-safety
-        boost::unique_lock<boost::mutex> lock(*parametersMutex);
-        // Clear
-        map->clear();
-    }
-
-    // Get the keys for this group
-    std::vector<std::string> myKeys = enumKeys();
+    if (clearBefore) map->clear();
 
-    // Read parameters
-    for (std::vector<std::string>::iterator it = myKeys.begin(); it != myKeys.end(); ++it) {
-        map->insert(std::pair< const std::string, const std::string >( (const std::string)*it, (*parameters)[ prefix + *it] ));
+    // Read the parameters in the range of our prefix
+    {
+        // Mutex for thread-safety
+        boost::shared_lock<boost::shared_mutex> lock(*parametersMutex);
+        std::map<const std::string, const std::string>::iterator it = parameters->lower_bound(prefix);
+        for ( ; nextGroupKey(parameters.get(), prefix, &it); ++it ) {
+            map->insert(std::pair< const std::string, const std::string >( it->first.substr(prefix.length()), it->second ));
+        }
     }
 
     CRASH_REPORT_END;
@@ -20,15 +20,126 @@
 
 #include <CernVM/ProgressFeedback.h>
 
+#include <map>
+
+/**
+ * The timer that emits the throttled progress events of all the task trees.
+ *
+ * Every root task has at most one pending entry (see ProgressTask::trailingTimer),
+ * so a single thread serves all of them, instead of starting a thread for every
+ * throttled interval. Only weak references to the roots are kept, so a pending
+ * entry does not keep a tree alive.
+ */
+class ProgressTimer {
+public:
+
+	/**
+	 * Emit the throttled event of the given root task at the specified time
+	 */
+	static void 		schedule 		( const ProgressTaskPtr& root, long when );
+
+private:
+
+	ProgressTimer() : mutex(), cond(), pending(), thread( boost::bind( &ProgressTimer::run, this ) ) { };
+
+	/**
+	 * Create the timer (called once)
+	 */
+	static void 		create 			( );
+
+	/**
+	 * The timer thread
+	 */
+	void 				run 			( );
+
+	boost::mutex 										mutex;
+	boost::condition_variable 							cond;
+	std::multimap< long, boost::weak_ptr<ProgressTask> > pending;
+	boost::thread 										thread;
+
+	static ProgressTimer * 								instance;
+	static boost::once_flag 							instanceFlag;
+
+};
+
+// The timer lives for as long as the process
+ProgressTimer * ProgressTimer::instance = NULL;
+boost::once_flag ProgressTimer::instanceFlag = BOOST_ONCE_INIT;
+
+/**
+ * Create the timer
+ */
+void ProgressTimer::create ( ) {
+	instance = new ProgressTimer();
+}
+
+/**
+ * Schedule the throttled event of a root task
+ */
+void ProgressTimer::schedule ( const ProgressTaskPtr& root, long when ) {
+    CRASH_REPORT_BEGIN;
+	boost::call_once( instanceFlag, &ProgressTimer::create );
+	{
+		boost::unique_lock<boost::mutex> lock(instance->mutex);
+		instance->pending.insert( std::make_pair( when, boost::weak_ptr<ProgressTask>( root ) ) );
+	}
+	instance->cond.notify_one();
+    CRASH_REPORT_END;
+}
+
+/**
+ * Emit the events when they are due. The tree is locked by _trailingUpdate,
+ * so we don't hold our own mutex meanwhile.
+ */
+void ProgressTimer::run ( ) {
+    CRASH_REPORT_BEGIN;
+	boost::unique_lock<boost::mutex> lock(mutex);
+	for (;;) {
+
+		// Wait for the next entry
+		if (pending.empty()) {
+			cond.wait( lock );
+			continue;
+		}
+		long delay = pending.begin()->first - getMillis();
+		if (delay > 0) {
+			cond.timed_wait( lock, boost::posix_time::milliseconds( delay ) );
+			continue;
+		}
+
+		// Emit it, if the tree still exists
+		boost::weak_ptr<ProgressTask> entry = pending.begin()->second;
+		pending.erase( pending.begin() );
+		lock.unlock();
+		{
+			ProgressTaskPtr root = entry.lock();
+			if (root) ProgressTask::_trailingUpdate( root );
+		}
+		lock.lock();
+
+	}
+    CRASH_REPORT_END;
+}
+
 /** #####################################################################################
  *  # ProgressTask Implementation - Base Task
  ** ##################################################################################### */
 
+/**
+ * Return the mutex of the tree
+ */
+boost::recursive_mutex & ProgressTask::_treeMutex ( ) {
+    ProgressTask * root = this;
+    while (root->parent) root = root->parent.get();
+    return root->emitMutex;
+}
+
 /**
  * Mark the task as completed
  */
 void ProgressTask::complete ( const std::string& message ) {
     CRASH_REPORT_BEGIN;
+    boost::recursive_mutex::scoped_lock lock( _treeMutex() );
 //	std::cout << "  complete(" << message << ")" << std::endl;
     std::string msg = message;
 
@@ -50,6 +161,7 @@ void ProgressTask::complete ( const std::string& message ) {
  */
 void ProgressTask::fail ( const std::string& message, const int errorCode ) {
     CRASH_REPORT_BEGIN;
+    boost::recursive_mutex::scoped_lock lock( _treeMutex() );
     std::string msg = message;
 
 	// Build empty message
@@ -61,6 +173,7 @@ void ProgressTask::fail ( const std::string& message, const int errorCode ) {
 
     // Mark us as completed
     completed = true;
+    _updateProgress();
 
 	// Notify failure
 	_notifyFailed(msg, errorCode);
@@ -78,6 +191,7 @@ void ProgressTask::fail ( const std::string& message, const int errorCode ) {
  */
 void ProgressTask::doing ( const std::string& message ) {
     CRASH_REPORT_BEGIN;
+    boost::recursive_mutex::scoped_lock lock( _treeMutex() );
 //	std::cout << "  doing(" << message << ")" << std::endl;
 
 	// Notify started
@@ -89,11 +203,73 @@ void ProgressTask::doing ( const std::string& message ) {
     CRASH_REPORT_END;
 }
 
+/**
+ * Push the progress change to the parent (with the mutex of the tree acquired)
+ */
+void ProgressTask::_updateProgress ( ) {
+    CRASH_REPORT_BEGIN;
+    double value = getProgress();
+    double delta = value - __reportedProgress;
+    __reportedProgress = value;
+    if (parent && __counted && (delta != 0.0))
+        parent->_childProgress( delta );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Emit the progress event through the rate limiter of the root task
+ * (with the mutex of the tree acquired)
+ */
+void ProgressTask::_throttledUpdate ( ) {
+    CRASH_REPORT_BEGIN;
+    ProgressTask * root = this;
+    while (root->parent) root = root->parent.get();
+
+    // Coalesce the intermediate events, keeping the latest one
+    // to be emitted when the interval expires
+    long now = getMillis();
+    long elapsed = now - root->lastEmitTime;
+    if (!isCompleted() && (elapsed < PROGRESS_THROTTLE_TIMER)) {
+        root->trailingTask = shared_from_this();
+        if (!root->trailingTimer) {
+            root->trailingTimer = true;
+            ProgressTimer::schedule( root->shared_from_this(), root->lastEmitTime + PROGRESS_THROTTLE_TIMER );
+        }
+        return;
+    }
+
+    // This event carries our latest values
+    root->lastEmitTime = now;
+    if (root->trailingTask.get() == this) root->trailingTask.reset();
+    _emitUpdate();
+
+    CRASH_REPORT_END;
+}
+
+/**
+ * Emit the throttled event of the tree when the interval expires
+ */
+void ProgressTask::_trailingUpdate ( ProgressTaskPtr root ) {
+    CRASH_REPORT_BEGIN;
+    boost::recursive_mutex::scoped_lock lock(root->emitMutex);
+    root->trailingTimer = false;
+
+    // The completion event has already delivered the final values
+    ProgressTaskPtr task = root->trailingTask;
+    root->trailingTask.reset();
+    if (!task || task->completed) return;
+
+    root->lastEmitTime = getMillis();
+    task->_emitUpdate();
+    CRASH_REPORT_END;
+}
+
 /**
  * Mark the task as lengthy
  */
 void ProgressTask::markLengthy ( const bool isLengthy, const std::string& message ) {
 	CRASH_REPORT_BEGIN;
+    boost::recursive_mutex::scoped_lock lock( _treeMutex() );
 
 	// Mark the task as lengthy
 	_notifyLengthyTask( message, isLengthy );
@@ -112,6 +288,7 @@ void ProgressTask::_notifyCompleted ( const std::string& message ) {
 
 	// Mark as completed
 	completed = true;
+	_updateProgress();
 
 	// Store the last message
 	lastMessage = message;
@@ -164,13 +341,9 @@ void ProgressTask::_notifyUpdate ( const std::string& message ) {
 
 	} else {
 
-		// Call all the progress callbacks
-		fireProgress( message, getProgress() );
-
-		// Propagate event
-		if (parent) {
-			parent->_notifyUpdate( message );
-		}
+		// Call the progress callbacks here and on the ancestors. A change that
+		// does not complete this task cannot complete them either.
+		_forwardProgress( message );
 
 	}
 
@@ -188,6 +361,7 @@ void ProgressTask::_notifyStarted ( const std::string& message ) {
 
 	// Mark us as started
 	started = true;
+	_updateProgress();
 
 	// Store the last message
 	lastMessage = message;
@@ -204,22 +378,21 @@ void ProgressTask::_notifyStarted ( const std::string& message ) {
 }
 
 /**
- * Forward progress event
- * TODO: Optimizations are needed (too many nested loops on calculating getProgress)
+ * Forward progress event up to the root, skipping the
+ * tasks that nobody listens to
  */
 void ProgressTask::_forwardProgress( const std::string& message ) {
     CRASH_REPORT_BEGIN;
+	for (ProgressTask * task = this; task != NULL; task = task->parent.get()) {
 
-	// Store the last message
-	lastMessage = message;
+		// Store the last message
+		task->lastMessage = message;
 
-	// Call all the progress callbacks
-	fireProgress( message, getProgress() );
-
-	// Forward event to the parent elements
-	if (parent)
-		parent->_forwardProgress( message );
+		// Call the progress callbacks
+		if (task->hasProgressListeners())
+			task->fireProgress( message, task->getProgress() );
 
+	}
     CRASH_REPORT_END;
 }
 
@@ -259,6 +432,9 @@ bool FiniteTask::isCompleted ( ) {
 	// Get the number of tasks
 	size_t len = tasks.size();
 
+	// We can't be completed before all the tasks have full progress
+	if (doneUnits + 1e-9 < (double)len) return false;
+
 	// Loop over tasks
 	for (size_t i=0; i<len; i++) {
 
@@ -293,31 +469,38 @@ double FiniteTask::getProgress ( ) {
 	// If I haven't started, return 0.0
 	if (!started) return 0.0;
 
-	// Get the number of tasks
-	size_t len = tasks.size();
+	// Return the fraction of the completed tasks
+	if (tasks.empty()) return 0.0;
+	return doneUnits / (double)tasks.size();
 
-	// Calculate the step size
-	double stepSize = 1.0 / (double)len;
-	double value = 0.0;
+    CRASH_REPORT_END;
+}
 
-	// Loop over tasks
-	for (size_t i=0; i<len; i++) {
+/**
+ * Add the progress change of a sub-task
+ */
+void FiniteTask::_childProgress ( double delta ) {
+    CRASH_REPORT_BEGIN;
+	doneUnits += delta;
+	_updateProgress();
+    CRASH_REPORT_END;
+}
 
+/**
+ * Recalculate the number of completed tasks, adding the
+ * progress of the sub-tasks
+ */
+void FiniteTask::_recalculate ( ) {
+    CRASH_REPORT_BEGIN;
+	doneUnits = 0.0;
+	for (size_t i=0; i<tasks.size(); i++) {
 		if (tasks[i] == 1) {
-			// If task is completed, add a step
-			value += stepSize;
-
+			doneUnits += 1.0;
 		} else if (tasks[i] == 2) {
-			// If we have a sub-task, calculate the sub-progress
-			value += stepSize * taskObjects[i]->getProgress();
-
+			doneUnits += taskObjects[i]->__reportedProgress;
 		}
-
 	}
-
-	// Return value
-	return value;
-
+	_updateProgress();
     CRASH_REPORT_END;
 }
 
@@ -326,6 +509,7 @@ double FiniteTask::getProgress ( ) {
  */
 void FiniteTask::setMax ( size_t maxTasks, bool triggerUpdate ) {
     CRASH_REPORT_BEGIN;
+    boost::recursive_mutex::scoped_lock lock( _treeMutex() );
 //	std::cout << "  setMax(" << maxTasks << ", " << triggerUpdate << ")" << std::endl;
 
 	// Get the size of the array
@@ -333,6 +517,8 @@ void FiniteTask::setMax ( size_t maxTasks, bool triggerUpdate ) {
 
 	if (maxTasks < len) {
 		// Delete elements if smaller
+		for (size_t i=maxTasks; i<len; i++)
+			if (taskObjects[i]) taskObjects[i]->__counted = false;
 		tasks.resize( maxTasks );
 		taskObjects.resize( maxTasks );
 
@@ -343,6 +529,9 @@ void FiniteTask::setMax ( size_t maxTasks, bool triggerUpdate ) {
 
 	}
 
+	// The step size has changed
+	_recalculate();
+
 	// Notify update events if we are in the middle of something
 	if (started && triggerUpdate) _notifyUpdate( lastMessage );
 
@@ -354,6 +543,7 @@ void FiniteTask::setMax ( size_t maxTasks, bool triggerUpdate ) {
  */
 void FiniteTask::done( const std::string& message ) {
     CRASH_REPORT_BEGIN;
+    boost::recursive_mutex::scoped_lock lock( _treeMutex() );
 //	std::cout << "  done(" << message << ")" << std::endl;
 
 	// Notify started
@@ -367,6 +557,8 @@ void FiniteTask::done( const std::string& message ) {
 
 		// Mark the given task as completed
 		tasks[taskIndex] = 1;
+		doneUnits += 1.0;
+		_updateProgress();
 
 		// Go to next step
 		taskIndex += 1;
@@ -385,6 +577,7 @@ void FiniteTask::done( const std::string& message ) {
 template <typename T> boost::shared_ptr<T> 
 FiniteTask::begin( const std::string& message ) {
     CRASH_REPORT_BEGIN;
+    boost::recursive_mutex::scoped_lock lock( _treeMutex() );
 
 	// Notify started
 	_notifyStarted( message );
@@ -404,7 +597,9 @@ FiniteTask::begin( const std::string& message ) {
 		tasks[taskIndex] = 2;
 
 		// Make a new shared object of the given kind
+		if (taskObjects[taskIndex]) taskObjects[taskIndex]->__counted = false;
 		taskObjects[taskIndex] = newPtr;
+		newPtr->__counted = true;
 
 		// Go to next step
 		taskIndex += 1;
@@ -425,6 +620,7 @@ FiniteTask::begin( const std::string& message ) {
  */
 void FiniteTask::restart ( const std::string& message, bool triggerUpdate ) {
     CRASH_REPORT_BEGIN;
+    boost::recursive_mutex::scoped_lock lock( _treeMutex() );
 
     // Reset state
 	if (completed) started = false;
@@ -449,6 +645,9 @@ void FiniteTask::restart ( const std::string& message, bool triggerUpdate ) {
 
 	}
 
+	// Update progress
+	_recalculate();
+
     // Fire update
     if (triggerUpdate) {
     	if (!started) _notifyStarted( message );
@@ -496,6 +695,7 @@ double VariableTask::getProgress ( ) {
 	if (!started) return 0.0;
 
 	// Return ammount of tasks completed
+	if (max == 0) return 0.0;
 	return (double)current / (double)max;
 
     CRASH_REPORT_END;
@@ -506,10 +706,12 @@ double VariableTask::getProgress ( ) {
  */
 void VariableTask::setMax ( size_t maxValue, bool triggerUpdate ) {
     CRASH_REPORT_BEGIN;
+    boost::recursive_mutex::scoped_lock lock( _treeMutex() );
 //	std::cout << "  setMax(" << maxValue << ", " << triggerUpdate << ")" << std::endl;
 
 	// Update max value
 	max = maxValue;
+	_updateProgress();
 
 	// Trigger update if we were in the middle of something
 	if (started && triggerUpdate) _notifyUpdate( lastMessage );
@@ -522,12 +724,26 @@ void VariableTask::setMax ( size_t maxValue, bool triggerUpdate ) {
  */
 void VariableTask::update ( size_t value ) {
     CRASH_REPORT_BEGIN;
+    boost::recursive_mutex::scoped_lock lock( _treeMutex() );
 
 	// Notify started
 	_notifyStarted( lastMessage );
 
 	// Update value
 	current = value;
+	_updateProgress();
+
+	// Coalesce the progress events of the entire task tree
+	_throttledUpdate();
+
+    CRASH_REPORT_END;
+}
+
+/**
+ * Emit the progress event, advancing the spinner
+ */
+void VariableTask::_emitUpdate ( ) {
+    CRASH_REPORT_BEGIN;
 
 	// Check spinner suffix
 	std::string suffix = "";
@@ -559,6 +775,7 @@ void VariableTask::update ( size_t value ) {
  */
 void VariableTask::setMessage ( const std::string& message ) {
     CRASH_REPORT_BEGIN;
+    boost::recursive_mutex::scoped_lock lock( _treeMutex() );
 	lastMessage = message;
     CRASH_REPORT_END;
 }
@@ -568,6 +785,7 @@ void VariableTask::setMessage ( const std::string& message ) {
  */
 void VariableTask::restart ( const std::string& message, bool triggerUpdate ) {
     CRASH_REPORT_BEGIN;
+    boost::recursive_mutex::scoped_lock lock( _treeMutex() );
 
     // Reset states
 	if (completed) started = false;
@@ -575,6 +793,7 @@ void VariableTask::restart ( const std::string& message, bool triggerUpdate ) {
 
     // Reset progress
     current = 0;
+    _updateProgress();
 
     // Fire update
     if (triggerUpdate) {
@@ -629,10 +848,12 @@ double BooleanTask::getProgress ( ) {
  */
 void BooleanTask::restart ( const std::string& message, bool triggerUpdate ) {
     CRASH_REPORT_BEGIN;
+    boost::recursive_mutex::scoped_lock lock( _treeMutex() );
 
 	// Reset state
 	if (completed) started = false;
 	completed = false;
+	_updateProgress();
 
     // Notify update
     if (triggerUpdate) {
@@ -0,0 +1,1136 @@
+/**
+ * This file is part of CernVM Web API Plugin.
+ *
+ * CVMWebAPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CVMWebAPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CVMWebAPI. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Developed by Ioannis Charalampidis 2013
+ * Contact: <ioannis.charalampidis[at]cern.ch>
+ */
+
+#include <boost/filesystem.hpp>
+
+#include <CernVM/Config.h>
+#include <CernVM/SessionStore.h>
+
+/**
+ * File format identification
+ */
+#define SESSIONSTORE_MAGIC      "CVMSSTR1"
+#define SESSIONSTORE_VERSION    2
+
+/**
+ * Scoped inter-process lock that tolerates a missing lock file
+ */
+class SessionStoreFileLock {
+public:
+    SessionStoreFileLock( boost::interprocess::file_lock * l ) : l(l) { if (l != NULL) l->lock(); }
+    ~SessionStoreFileLock() { if (l != NULL) l->unlock(); }
+private:
+    boost::interprocess::file_lock * l;
+};
+
+/**
+ * Lock the store both within the process and between processes
+ */
+#define SESSIONSTORE_LOCK \
+    boost::unique_lock<boost::mutex> __storeLock(storeMutex); \
+    SessionStoreFileLock __fileLock(fileLock);
+
+// Initialize singletons
+SessionStorePtr SessionStore::runtimeStoreSingleton;
+
+/**
+ * FNV-1a hash of the session UUID, used for the index lookup
+ */
+static boost::uint32_t uuidHash( const std::string& uuid ) {
+    boost::uint32_t h = 2166136261U;
+    for (size_t i=0; i<uuid.length(); i++) {
+        h ^= (unsigned char)uuid[i];
+        h *= 16777619U;
+    }
+    return h;
+}
+
+/**
+ * Calculate the heap space to allocate for a record of the given length
+ */
+static boost::uint32_t recordCapacity( size_t length ) {
+    boost::uint32_t cap = SESSIONSTORE_MIN_CAPACITY;
+    while (cap < length) cap <<= 1;
+    return cap;
+}
+
+/**
+ * Serialize the given map into length-prefixed key/value pairs
+ */
+static void serializeMap( std::map<const std::string, const std::string> * map, std::string * data ) {
+    boost::uint32_t len;
+    data->clear();
+    for (std::map<const std::string, const std::string>::iterator it = map->begin(); it != map->end(); ++it) {
+        len = it->first.length();
+        data->append( (const char *)&len, sizeof(len) );
+        data->append( it->first );
+        len = it->second.length();
+        data->append( (const char *)&len, sizeof(len) );
+        data->append( it->second );
+    }
+}
+
+/**
+ * Read one length-prefixed string from the given buffer
+ */
+static bool readString( const char * data, size_t length, size_t * pos, std::string * str ) {
+    boost::uint32_t len;
+    if (*pos + sizeof(len) > length) return false;
+    memcpy( &len, data + *pos, sizeof(len) );
+    *pos += sizeof(len);
+    if (*pos + len > length) return false;
+    str->assign( data + *pos, len );
+    *pos += len;
+    return true;
+}
+
+/**
+ * Find the value of the given key in length-prefixed key/value pairs
+ */
+static bool findValue( const char * data, size_t length, const std::string& key, std::string * value ) {
+    boost::uint32_t len;
+    size_t pos = 0;
+    while (pos + sizeof(len) <= length) {
+
+        // Compare the key
+        memcpy( &len, data + pos, sizeof(len) );
+        pos += sizeof(len);
+        if (pos + len > length) return false;
+        bool found = (len == key.length()) && (memcmp( data + pos, key.c_str(), len ) == 0);
+        pos += len;
+
+        // Read or skip the value
+        if (found) return readString( data, length, &pos, value );
+        if (pos + sizeof(len) > length) return false;
+        memcpy( &len, data + pos, sizeof(len) );
+        pos += sizeof(len) + len;
+
+    }
+    return false;
+}
+
+/**
+ * Populate the given map from length-prefixed key/value pairs
+ */
+static bool deserializeMap( const char * data, size_t length, std::map<const std::string, const std::string> * map ) {
+    std::string key, value;
+    size_t pos = 0;
+    map->clear();
+    while (pos < length) {
+        if (!readString(data, length, &pos, &key)) return false;
+        if (!readString(data, length, &pos, &value)) return false;
+        map->insert( std::pair<const std::string, const std::string>(key, value) );
+    }
+    return true;
+}
+
+/**
+ * Return the session store in the runtime directory
+ */
+SessionStorePtr SessionStore::runtime() {
+    CRASH_REPORT_BEGIN;
+
+    // Ensure we have signeton
+    if (!SessionStore::runtimeStoreSingleton) {
+        SessionStore::runtimeStoreSingleton = boost::make_shared< SessionStore >( systemPath(getAppDataPath() + "/run/sessions.db") );
+    }
+
+    // Return reference
+    return SessionStore::runtimeStoreSingleton;
+
+    CRASH_REPORT_END;
+}
+
+/**
+ * Create a session store on the given file
+ */
+SessionStore::SessionStore ( const std::string& file ) : file(file), lockFile(file + ".lock"), generation(0), storeMutex(),
+    fileLock(NULL), fileMapping(NULL), region(NULL), syncThread(NULL), syncThreadExit(false), syncMutex(), syncCond(), flushQueue(), watched() {
+    CRASH_REPORT_BEGIN;
+
+    // Make sure the lock file exists
+    if (!file_exists(lockFile)) {
+        std::ofstream ofs( lockFile.c_str(), std::ofstream::out | std::ofstream::app );
+        ofs.close();
+    }
+
+    // Open the inter-process lock
+    try {
+        fileLock = new boost::interprocess::file_lock( lockFile.c_str() );
+    } catch (boost::interprocess::interprocess_exception &e) {
+        CVMWA_LOG("Error", "Unable to open session store lock " << lockFile << ": " << e.what());
+        fileLock = NULL;
+    }
+
+    CRASH_REPORT_END;
+}
+
+/**
+ * Stop the sync thread and unmap the store
+ */
+SessionStore::~SessionStore ( ) {
+    CRASH_REPORT_BEGIN;
+
+    // Stop the sync thread. The maps keep a reference to the store,
+    // so there are no pending changes by now.
+    if (syncThread != NULL) {
+        {
+            boost::unique_lock<boost::mutex> lock(syncMutex);
+            syncThreadExit = true;
+        }
+        syncCond.notify_all();
+
+        // The sync thread might have released the last map
+        if (boost::this_thread::get_id() == syncThread->get_id()) {
+            syncThread->detach();
+        } else {
+            syncThread->join();
+        }
+        delete syncThread;
+        syncThread = NULL;
+    }
+
+    _close();
+    if (fileLock != NULL) delete fileLock;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Return the header of the mapped file
+ */
+SessionStoreHeader * SessionStore::_header ( ) {
+    return (SessionStoreHeader *) region->get_address();
+}
+
+/**
+ * Return the index slot with the given index
+ */
+SessionStoreSlot * SessionStore::_slot ( size_t index ) {
+    return ((SessionStoreSlot *)( (char *)region->get_address() + sizeof(SessionStoreHeader) )) + index;
+}
+
+/**
+ * Return the data file of the given generation
+ */
+std::string SessionStore::_dataFile ( long gen ) {
+    return file + "." + ntos<long>( gen );
+}
+
+/**
+ * Read the current generation from the store file (0 if missing)
+ */
+long SessionStore::_readGeneration ( ) {
+    long gen = 0;
+    std::ifstream ifs( file.c_str() );
+    if (ifs.fail()) return 0;
+    ifs >> gen;
+    if (ifs.fail()) return 0;
+    return gen;
+}
+
+/**
+ * Replace the store file with one that points to the given generation
+ */
+bool SessionStore::_writeGeneration ( long gen ) {
+    CRASH_REPORT_BEGIN;
+    boost::system::error_code ec;
+    std::string tmpFile = file + ".tmp";
+
+    // Write the new generation
+    std::ofstream ofs( tmpFile.c_str(), std::ofstream::out | std::ofstream::trunc );
+    if (ofs.fail()) {
+        CVMWA_LOG("Error", "Unable to create session store " << tmpFile);
+        return false;
+    }
+    ofs << gen << std::endl;
+    ofs.close();
+    if (ofs.fail()) {
+        CVMWA_LOG("Error", "Unable to write session store " << tmpFile);
+        remove( tmpFile.c_str() );
+        return false;
+    }
+
+    // Replace the store file. It's never mapped, so this works on Windows too.
+    boost::filesystem::rename( tmpFile, file, ec );
+    if (ec) {
+        CVMWA_LOG("Error", "Unable to replace session store " << file << ": " << ec.message());
+        remove( tmpFile.c_str() );
+        return false;
+    }
+
+    return true;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Unmap the store file
+ */
+void SessionStore::_close ( ) {
+    if (region != NULL) {
+        region->flush();
+        delete region;
+        region = NULL;
+    }
+    if (fileMapping != NULL) {
+        delete fileMapping;
+        fileMapping = NULL;
+    }
+}
+
+/**
+ * Map the current generation of the store, creating a new one if it's missing or invalid
+ */
+bool SessionStore::_open ( ) {
+    CRASH_REPORT_BEGIN;
+    boost::system::error_code ec;
+
+    // Create a new store if missing
+    generation = _readGeneration();
+    std::string dataFile = _dataFile( generation );
+    if ((generation == 0) || !file_exists(dataFile) || (boost::filesystem::file_size(dataFile, ec) < sizeof(SessionStoreHeader)))
+        return _rebuild( SESSIONSTORE_INITIAL_SLOTS, 0 );
+
+    // Map the file
+    try {
+        fileMapping = new boost::interprocess::file_mapping( dataFile.c_str(), boost::interprocess::read_write );
+        region = new boost::interprocess::mapped_region( *fileMapping, boost::interprocess::read_write );
+    } catch (boost::interprocess::interprocess_exception &e) {
+        CVMWA_LOG("Error", "Unable to map session store " << dataFile << ": " << e.what());
+        _close();
+        return false;
+    }
+
+    // Validate the file
+    SessionStoreHeader * h = _header();
+    if ( (memcmp(h->magic, SESSIONSTORE_MAGIC, sizeof(h->magic)) != 0) || (h->version != SESSIONSTORE_VERSION) ||
+         (h->slots == 0) || ((h->slots & (h->slots - 1)) != 0) ||
+         (region->get_size() < sizeof(SessionStoreHeader) + h->slots * sizeof(SessionStoreSlot)) ||
+         (region->get_size() < h->heapEnd) ) {
+
+        // Keep the invalid file aside and start over
+        CVMWA_LOG("Error", "Invalid session store " << dataFile << ", creating a new one");
+        _close();
+        boost::filesystem::rename( dataFile, file + ".bad", ec );
+        return _rebuild( SESSIONSTORE_INITIAL_SLOTS, 0 );
+
+    }
+
+    // A process was interrupted while replacing the file, before
+    // switching to the new generation. Keep using this one.
+    if (h->retired) h->retired = 0;
+
+    return true;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Make sure the mapping reflects the current generation. Another
+ * process might have replaced it.
+ */
+bool SessionStore::_ensureMapped ( ) {
+    CRASH_REPORT_BEGIN;
+
+    // Not mapped yet
+    if (region == NULL) return _open();
+
+    // The file was replaced by a new generation
+    if (_header()->retired) {
+        _close();
+        return _open();
+    }
+
+    return true;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Find the index slot of the given session (or -1 if missing)
+ */
+int SessionStore::_find ( const std::string& uuid ) {
+    boost::uint32_t slots = _header()->slots;
+    boost::uint32_t i = uuidHash(uuid) & (slots - 1);
+    for (boost::uint32_t n=0; n<slots; n++) {
+        SessionStoreSlot * s = _slot(i);
+        if (s->state == 0) return -1;
+        if ((s->state == 1) && (strncmp(s->uuid, uuid.c_str(), sizeof(s->uuid)) == 0)) return i;
+        i = (i + 1) & (slots - 1);
+    }
+    return -1;
+}
+
+/**
+ * Allocate an index slot for the given session (that must not exist)
+ */
+int SessionStore::_insert ( const std::string& uuid ) {
+    SessionStoreHeader * h = _header();
+    boost::uint32_t i = uuidHash(uuid) & (h->slots - 1);
+    for (boost::uint32_t n=0; n<h->slots; n++) {
+        SessionStoreSlot * s = _slot(i);
+        if (s->state != 1) {
+            if (s->state == 2) h->deleted--;
+            memset( s, 0, sizeof(SessionStoreSlot) );
+            strncpy( s->uuid, uuid.c_str(), sizeof(s->uuid) - 1 );
+            s->state = 1;
+            h->used++;
+            return i;
+        }
+        i = (i + 1) & (h->slots - 1);
+    }
+    return -1;
+}
+
+/**
+ * Allocate heap space for a record. Returns false if the heap is full.
+ */
+bool SessionStore::_allocate ( size_t length, boost::uint64_t * offset, boost::uint32_t * capacity ) {
+    *capacity = recordCapacity( length );
+    *offset = _header()->heapEnd;
+    if (*offset + *capacity > region->get_size()) return false;
+    _header()->heapEnd = *offset + *capacity;
+    return true;
+}
+
+/**
+ * Write the record data to the copy of the slot that is not in use and
+ * switch to it. The previous record stays intact until the switch.
+ */
+bool SessionStore::_write ( const std::string& uuid, const std::string& data, boost::uint64_t * revision ) {
+    CRASH_REPORT_BEGIN;
+    int i = _find(uuid);
+    if (i < 0) return false;
+
+    // Make sure the unused copy is big enough
+    SessionStoreSlot * s = _slot(i);
+    SessionStoreCopy * c = &s->copies[ s->current ^ 1 ];
+    if (data.length() > c->capacity) {
+        boost::uint32_t oldCapacity = c->capacity, capacity;
+        boost::uint64_t offset;
+        if (!_allocate( data.length(), &offset, &capacity )) {
+
+            // Move to a new generation with enough free space
+            if (!_rebuild( _header()->slots, data.length() )) return false;
+            i = _find(uuid);
+            if (i < 0) return false;
+            s = _slot(i);
+            c = &s->copies[ s->current ^ 1 ];
+            oldCapacity = 0;
+            if (!_allocate( data.length(), &offset, &capacity )) return false;
+
+        }
+        c->offset = offset;
+        c->capacity = capacity;
+        _header()->garbage += oldCapacity;
+    }
+
+    // Write the record and publish it
+    if (!data.empty()) memcpy( (char *)region->get_address() + c->offset, data.c_str(), data.length() );
+    c->length = data.length();
+    boost::atomic_thread_fence( boost::memory_order_release );
+    s->current ^= 1;
+
+    // Count the change
+    SessionStoreHeader * h = _header();
+    s->changes = ++h->changes;
+    if (revision != NULL) *revision = s->changes;
+
+    // Compact the file if more than half of the heap is unused
+    if ((h->garbage > SESSIONSTORE_MIN_CAPACITY * 8) && (h->garbage * 2 > h->heapEnd))
+        _rebuild( h->slots, 0 );
+
+    return true;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Write a new generation of the store with the live records, the given
+ * index size and at least the given free heap space, and switch to it.
+ */
+bool SessionStore::_rebuild ( size_t slots, size_t reserve ) {
+    CRASH_REPORT_BEGIN;
+    std::vector< std::pair< std::string, std::string > > records;
+    std::vector< boost::uint64_t > changes;
+    boost::uint64_t totalChanges = 0;
+    boost::system::error_code ec;
+
+    // Collect the live records
+    size_t heapSize = 0;
+    if (region != NULL) {
+        SessionStoreHeader * h = _header();
+        for (boost::uint32_t i=0; i<h->slots; i++) {
+            SessionStoreSlot * s = _slot(i);
+            if (s->state != 1) continue;
+            SessionStoreCopy * c = &s->copies[ s->current ];
+            records.push_back( std::make_pair(
+                std::string( s->uuid, strnlen(s->uuid, sizeof(s->uuid)) ),
+                std::string( (const char *)region->get_address() + c->offset, c->length )
+            ));
+            changes.push_back( s->changes );
+            heapSize += recordCapacity( c->length );
+        }
+        totalChanges = h->changes;
+    }
+
+    // Keep the index at most half-full
+    while (records.size() * 2 >= slots) slots *= 2;
+
+    // Leave room for the second copy of every record and the new ones
+    size_t heapStart = sizeof(SessionStoreHeader) + slots * sizeof(SessionStoreSlot);
+    size_t fileSize = heapStart + (heapSize + recordCapacity(reserve)) * 2 + SESSIONSTORE_MIN_CAPACITY * SESSIONSTORE_INITIAL_SLOTS;
+
+    // Prepare the new file contents
+    std::vector<char> buffer( heapStart + heapSize, 0 );
+    SessionStoreHeader * h = (SessionStoreHeader *) &buffer[0];
+    SessionStoreSlot * index = (SessionStoreSlot *) &buffer[sizeof(SessionStoreHeader)];
+    memcpy( h->magic, SESSIONSTORE_MAGIC, sizeof(h->magic) );
+    h->version = SESSIONSTORE_VERSION;
+    h->slots = slots;
+    h->used = records.size();
+    h->heapEnd = heapStart;
+    h->changes = totalChanges;
+
+    // Place the records
+    for (size_t r = 0; r < records.size(); ++r) {
+        boost::uint32_t i = uuidHash(records[r].first) & (slots - 1);
+        while (index[i].state != 0) i = (i + 1) & (slots - 1);
+        SessionStoreSlot * s = &index[i];
+        SessionStoreCopy * c = &s->copies[0];
+        strncpy( s->uuid, records[r].first.c_str(), sizeof(s->uuid) - 1 );
+        s->state = 1;
+        s->changes = changes[r];
+        c->length = records[r].second.length();
+        c->capacity = recordCapacity( c->length );
+        c->offset = h->heapEnd;
+        if (!records[r].second.empty()) memcpy( &buffer[c->offset], records[r].second.c_str(), c->length );
+        h->heapEnd += c->capacity;
+    }
+
+    // Write the new generation and extend it with the free heap space
+    long newGeneration = generation + 1;
+    std::string newFile = _dataFile( newGeneration );
+    std::ofstream ofs( newFile.c_str(), std::ofstream::out | std::ofstream::trunc | std::ofstream::binary );
+    if (ofs.fail()) {
+        CVMWA_LOG("Error", "Unable to create session store " << newFile);
+        return false;
+    }
+    ofs.write( &buffer[0], buffer.size() );
+    ofs.close();
+    if (!ofs.fail()) boost::filesystem::resize_file( newFile, fileSize, ec );
+    if (ofs.fail() || ec) {
+        CVMWA_LOG("Error", "Unable to write session store " << newFile);
+        remove( newFile.c_str() );
+        return false;
+    }
+
+    // Let the other processes know that the file is replaced. If we are
+    // interrupted before switching, the flag is cleared by the next _open.
+    if (region != NULL) _header()->retired = 1;
+
+    // Switch to the new generation
+    if (!_writeGeneration( newGeneration )) {
+        if (region != NULL) _header()->retired = 0;
+        remove( newFile.c_str() );
+        return false;
+    }
+
+    // Remove the previous generations. On Windows this fails for the files
+    // that are still mapped by other processes, they are removed next time.
+    _close();
+    boost::filesystem::path dir = boost::filesystem::path( file ).parent_path();
+    std::string base = boost::filesystem::path( file ).filename().string() + ".";
+    for (boost::filesystem::directory_iterator it( dir, ec ), end; !ec && (it != end); it.increment(ec)) {
+        std::string name = it->path().filename().string();
+        if ((name.compare(0, base.length(), base) != 0) || (name.length() == base.length())) continue;
+        if (name.find_first_not_of("0123456789", base.length()) != std::string::npos) continue;
+        if (ston<long>( name.substr(base.length()) ) == newGeneration) continue;
+        boost::system::error_code rec;
+        boost::filesystem::remove( it->path(), rec );
+    }
+
+    return _open();
+    CRASH_REPORT_END;
+}
+
+/**
+ * Return the UUIDs of the sessions in the store
+ */
+std::vector< std::string > SessionStore::enumSessions ( ) {
+    CRASH_REPORT_BEGIN;
+    std::vector< std::string > result;
+    SESSIONSTORE_LOCK;
+    if (!_ensureMapped()) return result;
+
+    // Collect the used slots
+    SessionStoreHeader * h = _header();
+    for (boost::uint32_t i=0; i<h->slots; i++) {
+        SessionStoreSlot * s = _slot(i);
+        if (s->state == 1)
+            result.push_back( std::string( s->uuid, strnlen(s->uuid, sizeof(s->uuid)) ) );
+    }
+
+    return result;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Check if the given session exists in the store
+ */
+bool SessionStore::contains ( const std::string& uuid ) {
+    CRASH_REPORT_BEGIN;
+    SESSIONSTORE_LOCK;
+    if (!_ensureMapped()) return false;
+    return (_find(uuid) >= 0);
+    CRASH_REPORT_END;
+}
+
+/**
+ * Populate the given dictionary from the record of the specified session
+ */
+bool SessionStore::load ( const std::string& uuid, std::map<const std::string, const std::string> * map, boost::uint64_t * revision ) {
+    CRASH_REPORT_BEGIN;
+    SESSIONSTORE_LOCK;
+    if (!_ensureMapped()) return false;
+
+    // Find record
+    int i = _find(uuid);
+    if (i < 0) return false;
+
+    // Decode record
+    SessionStoreSlot * s = _slot(i);
+    SessionStoreCopy * c = &s->copies[ s->current ];
+    if (!deserializeMap( (const char *)region->get_address() + c->offset, c->length, map )) {
+        CVMWA_LOG("Error", "Corrupted record for session " << uuid << " in the session store");
+        return false;
+    }
+
+    if (revision != NULL) *revision = s->changes;
+    return true;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Return the revision of the record of the specified session
+ */
+boost::uint64_t SessionStore::revision ( const std::string& uuid ) {
+    CRASH_REPORT_BEGIN;
+    SESSIONSTORE_LOCK;
+    if (!_ensureMapped()) return 0;
+    int i = _find(uuid);
+    if (i < 0) return 0;
+    return _slot(i)->changes;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Read the value of a single parameter from the record of the specified session
+ */
+bool SessionStore::lookup ( const std::string& uuid, const std::string& key, std::string * value ) {
+    CRASH_REPORT_BEGIN;
+    SESSIONSTORE_LOCK;
+    if (!_ensureMapped()) return false;
+
+    // Find record
+    int i = _find(uuid);
+    if (i < 0) return false;
+
+    // Scan the record for the key
+    SessionStoreSlot * s = _slot(i);
+    SessionStoreCopy * c = &s->copies[ s->current ];
+    return findValue( (const char *)region->get_address() + c->offset, c->length, key, value );
+
+    CRASH_REPORT_END;
+}
+
+/**
+ * Store the contents of the given dictionary to the record of the specified session
+ */
+bool SessionStore::store ( const std::string& uuid, std::map<const std::string, const std::string> * map, bool create, boost::uint64_t * revision ) {
+    CRASH_REPORT_BEGIN;
+    if (uuid.empty() || (uuid.length() >= sizeof(((SessionStoreSlot *)0)->uuid))) return false;
+
+    // Serialize outside the lock
+    std::string data;
+    serializeMap( map, &data );
+
+    SESSIONSTORE_LOCK;
+    if (!_ensureMapped()) return false;
+
+    // Create record if missing
+    int i = _find(uuid);
+    if (i < 0) {
+        if (!create) return false;
+
+        // Grow or clean-up the index if it's more than half-full
+        SessionStoreHeader * h = _header();
+        if ((h->used + h->deleted + 1) * 2 > h->slots) {
+            if (!_rebuild( h->slots, data.length() )) return false;
+        }
+        if (_insert(uuid) < 0) return false;
+
+    } else if ((revision != NULL) && (*revision != 0) && (_slot(i)->changes != *revision)) {
+
+        // The record was changed by someone else
+        return false;
+
+    }
+
+    return _write( uuid, data, revision );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Remove the record of the specified session
+ */
+bool SessionStore::erase ( const std::string& uuid ) {
+    CRASH_REPORT_BEGIN;
+    SESSIONSTORE_LOCK;
+    if (!_ensureMapped()) return false;
+
+    // Find record
+    int i = _find(uuid);
+    if (i < 0) return false;
+
+    // Mark as deleted
+    SessionStoreHeader * h = _header();
+    SessionStoreSlot * s = _slot(i);
+    s->state = 2;
+    s->changes = ++h->changes;
+    h->used--;
+    h->deleted++;
+    h->garbage += s->copies[0].capacity + s->copies[1].capacity;
+
+    return true;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Write the modified pages of the store to the disk
+ */
+bool SessionStore::flush ( ) {
+    CRASH_REPORT_BEGIN;
+    SESSIONSTORE_LOCK;
+    if (region == NULL) return true;
+    return region->flush();
+    CRASH_REPORT_END;
+}
+
+/**
+ * Queue the record of the given map to be written by the sync thread
+ */
+void SessionStore::scheduleWrite ( const SessionStoreMapPtr& map ) {
+    CRASH_REPORT_BEGIN;
+    {
+        boost::unique_lock<boost::mutex> lock(syncMutex);
+
+        // Keep the time of the first change
+        if (flushQueue.find( map.get() ) == flushQueue.end()) {
+            flushQueue[ map.get() ] = std::make_pair( boost::weak_ptr< SessionStoreMap >( map ), getTimeInMs() );
+        }
+        startSyncThread();
+    }
+    syncCond.notify_all();
+    CRASH_REPORT_END;
+}
+
+/**
+ * Watch the given map for changes done by other processes
+ */
+void SessionStore::watch ( const SessionStoreMapPtr& map ) {
+    CRASH_REPORT_BEGIN;
+    {
+        boost::unique_lock<boost::mutex> lock(syncMutex);
+        watched[ map.get() ] = boost::weak_ptr< SessionStoreMap >( map );
+        startSyncThread();
+    }
+    syncCond.notify_all();
+    CRASH_REPORT_END;
+}
+
+/**
+ * Start the sync thread if it's not already running
+ */
+void SessionStore::startSyncThread ( ) {
+    CRASH_REPORT_BEGIN;
+    if (syncThread == NULL) {
+        syncThreadExit = false;
+        syncThread = new boost::thread( boost::bind( &SessionStore::syncThreadLoop, this ) );
+    }
+    CRASH_REPORT_END;
+}
+
+/**
+ * The sync thread, that writes the records of the queued maps when their flush
+ * delay expires and merges the changes done by other processes to the watched maps.
+ */
+void SessionStore::syncThreadLoop ( ) {
+    CRASH_REPORT_BEGIN;
+    boost::unique_lock<boost::mutex> lock(syncMutex);
+    std::vector< SessionStoreMapPtr > due, check;
+    unsigned long long lastCheck = 0;
+    boost::uint64_t seenChanges = 0;
+
+    while (!syncThreadExit) {
+
+        // Wait for something to do
+        if (flushQueue.empty() && watched.empty()) {
+            syncCond.wait(lock);
+            continue;
+        }
+
+        // Collect the maps whose delay expired
+        unsigned long long now = getTimeInMs(), wait = SESSIONSTORE_WATCH_INTERVAL;
+        for (std::map< SessionStoreMap *, std::pair< boost::weak_ptr< SessionStoreMap >, unsigned long long > >::iterator
+                it = flushQueue.begin(); it != flushQueue.end(); ) {
+            unsigned long long elapsed = now - it->second.second;
+            if (elapsed < SESSIONSTORE_FLUSH_DELAY) {
+                if (SESSIONSTORE_FLUSH_DELAY - elapsed < wait) wait = SESSIONSTORE_FLUSH_DELAY - elapsed;
+                ++it;
+                continue;
+            }
+            SessionStoreMapPtr map = it->second.first.lock();
+            if (map) due.push_back( map );
+            flushQueue.erase( it++ );
+        }
+
+        // Collect the watched maps at every watch interval
+        if (!watched.empty()) {
+            if (now - lastCheck >= SESSIONSTORE_WATCH_INTERVAL) {
+                lastCheck = now;
+                for (std::map< SessionStoreMap *, boost::weak_ptr< SessionStoreMap > >::iterator it = watched.begin(); it != watched.end(); ) {
+                    SessionStoreMapPtr map = it->second.lock();
+                    if (map) {
+                        check.push_back( map );
+                        ++it;
+                    } else {
+                        watched.erase( it++ );
+                    }
+                }
+            } else if (SESSIONSTORE_WATCH_INTERVAL - (now - lastCheck) < wait) {
+                wait = SESSIONSTORE_WATCH_INTERVAL - (now - lastCheck);
+            }
+        }
+
+        // Wait for the next one
+        if (due.empty() && check.empty()) {
+            syncCond.timed_wait(lock, boost::posix_time::milliseconds( wait ));
+            continue;
+        }
+
+        // Work without holding the lock
+        lock.unlock();
+        SessionStorePtr self = shared_from_this();
+
+        // Write the pending changes
+        for (std::vector< SessionStoreMapPtr >::iterator it = due.begin(); it != due.end(); ++it)
+            (*it)->writeRecord();
+        due.clear();
+
+        // Merge the external changes, if the store was changed since the last check
+        if (!check.empty()) {
+            boost::uint64_t changes = seenChanges;
+            {
+                SESSIONSTORE_LOCK;
+                if (_ensureMapped()) changes = _header()->changes;
+            }
+            if (changes != seenChanges) {
+                seenChanges = changes;
+                for (std::vector< SessionStoreMapPtr >::iterator it = check.begin(); it != check.end(); ++it)
+                    (*it)->mergeExternal();
+            }
+            check.clear();
+        }
+
+        // If we released the last map, the store is destroyed with
+        // our reference and the thread must not touch it again.
+        if (self.unique()) {
+            self.reset();
+            return;
+        }
+        self.reset();
+        lock.lock();
+
+    }
+
+    CRASH_REPORT_END;
+}
+
+/**
+ * Import the sessions stored in the runtime config files with the
+ * specified prefix and remove the files.
+ */
+int SessionStore::migrate ( const std::string& prefix ) {
+    CRASH_REPORT_BEGIN;
+    int count = 0;
+
+    std::vector< std::string > files = LocalConfig::runtime()->enumFiles( prefix );
+    for (std::vector< std::string >::iterator it = files.begin(); it != files.end(); ++it) {
+        LocalConfigPtr cfg = LocalConfig::forRuntime( *it );
+
+        // Copy all the parameters (including the sub-groups)
+        std::map<const std::string, const std::string> map( *cfg->parameters );
+        std::map<const std::string, const std::string>::iterator uuid = map.find("uuid");
+        if (uuid == map.end()) {
+            CVMWA_LOG("Warning", "Missing 'uuid' in file " << *it << ", not migrating" );
+            continue;
+        }
+
+        // Import and remove file
+        CVMWA_LOG("Info", "Migrating session config " << *it << " to the session store");
+        if (this->store( uuid->second, &map )) {
+            cfg->clearAll();
+            count++;
+        }
+    }
+
+    return count;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Return a ParameterMap that is backed by the record of the specified session
+ */
+ParameterMapPtr SessionStore::session ( const std::string& uuid, bool create ) {
+    CRASH_REPORT_BEGIN;
+
+    // Create an empty record if requested
+    if (create && !contains(uuid)) {
+        std::map<const std::string, const std::string> empty;
+        store( uuid, &empty );
+    }
+
+    return boost::make_shared< SessionStoreMap >( shared_from_this(), uuid );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Create a map for the specified session. The record is decoded
+ * when the parameters are accessed for the first time.
+ */
+SessionStoreMap::SessionStoreMap ( SessionStorePtr store, const std::string& uuid ) : ParameterMap(), store(store), uuid(uuid),
+    dirtyMutex(), dirty(false), revision(0), base(), touched() {
+    CRASH_REPORT_BEGIN;
+    setUnloaded();
+    CRASH_REPORT_END;
+}
+
+/**
+ * Write the pending changes to the store
+ */
+SessionStoreMap::~SessionStoreMap ( ) {
+    CRASH_REPORT_BEGIN;
+    writeRecord();
+    CRASH_REPORT_END;
+}
+
+/**
+ * Decode the record of the session and start watching it
+ */
+void SessionStoreMap::loadParameters ( ) {
+    CRASH_REPORT_BEGIN;
+    boost::uint64_t rev = 0;
+    store->load( uuid, parameters.get(), &rev );
+    {
+        boost::unique_lock<boost::mutex> lock(dirtyMutex);
+        revision = rev;
+        base = boost::make_shared< std::map< const std::string, const std::string > >( *parameters );
+    }
+    store->watch( boost::static_pointer_cast< SessionStoreMap >( shared_from_this() ) );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Remember the keys changed locally, so the external changes don't override them
+ */
+void SessionStoreMap::touchKey ( const std::string& key ) {
+    CRASH_REPORT_BEGIN;
+    boost::unique_lock<boost::mutex> lock(dirtyMutex);
+    touched.insert( key );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Return a string parameter value. If the record is not decoded yet,
+ * the value is read directly from the store.
+ */
+std::string SessionStoreMap::get ( const std::string& name, std::string defaultValue, bool strict ) {
+    CRASH_REPORT_BEGIN;
+    if (!strict && unloaded.load( boost::memory_order_acquire )) {
+
+        // Mutex for thread-safety
+        boost::shared_lock<boost::shared_mutex> lock(*parametersMutex);
+        if (unloaded.load( boost::memory_order_relaxed )) {
+            std::string value;
+            if (store->lookup( uuid, prefix + name, &value )) return value;
+
+            // Fall back to the defaults
+            std::map<const std::string, const std::string>::iterator it = pendingDefaults.find( prefix + name );
+            if (it != pendingDefaults.end()) return it->second;
+            return defaultValue;
+        }
+
+    }
+    return ParameterMap::get( name, defaultValue, strict );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Mark the record as changed and let the store write it later. If the
+ * record was removed (the session was deleted), the changes are discarded.
+ */
+void SessionStoreMap::commitChanges ( ) {
+    CRASH_REPORT_BEGIN;
+    {
+        boost::unique_lock<boost::mutex> lock(dirtyMutex);
+        dirty = true;
+    }
+    store->scheduleWrite( boost::static_pointer_cast< SessionStoreMap >( shared_from_this() ) );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Write the pending changes to the record in the store
+ */
+bool SessionStoreMap::writeRecord ( ) {
+    CRASH_REPORT_BEGIN;
+    {
+        // Check and reset the dirty flag
+        boost::unique_lock<boost::mutex> lock(dirtyMutex);
+        if (!dirty) return true;
+        dirty = false;
+    }
+
+    for (int attempt = 0; attempt < 2; attempt++) {
+        {
+            // Write the record, unless another process changed it since we read it
+            boost::shared_lock<boost::shared_mutex> lock(*parametersMutex);
+            boost::uint64_t rev;
+            {
+                boost::unique_lock<boost::mutex> dirtyLock(dirtyMutex);
+                rev = revision;
+            }
+            if (store->store( uuid, parameters.get(), false, &rev )) {
+                boost::unique_lock<boost::mutex> dirtyLock(dirtyMutex);
+                revision = rev;
+                base = boost::make_shared< std::map< const std::string, const std::string > >( *parameters );
+                touched.clear();
+                return true;
+            }
+        }
+
+        // Merge the external changes and try again
+        if (!mergeExternal()) break;
+    }
+
+    // Keep the changes pending if the record still exists, so we can retry later
+    if (store->contains( uuid )) {
+        boost::unique_lock<boost::mutex> dirtyLock(dirtyMutex);
+        dirty = true;
+    }
+    return false;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Merge the changes done to the record by other processes, preferring the
+ * local changes that are not written yet.
+ */
+bool SessionStoreMap::mergeExternal ( ) {
+    CRASH_REPORT_BEGIN;
+    typedef std::map< const std::string, const std::string > dataMap;
+    std::vector< std::string > changedKeys;
+
+    {
+        // Mutex for making this thread-safe
+        boost::unique_lock<boost::shared_mutex> lock(*parametersMutex);
+
+        // The record is read directly from the store until it's decoded
+        if (unloaded.load( boost::memory_order_relaxed )) return false;
+
+        // Check if the record was changed
+        boost::uint64_t rev;
+        {
+            boost::unique_lock<boost::mutex> dirtyLock(dirtyMutex);
+            rev = revision;
+        }
+        if (store->revision( uuid ) == rev) return false;
+
+        // Load the new record (unless the session was removed)
+        dataMap record;
+        if (!store->load( uuid, &record, &rev )) return false;
+
+        // Find the keys changed by the other processes
+        boost::unique_lock<boost::mutex> dirtyLock(dirtyMutex);
+        std::set< std::string > keys;
+        for (dataMap::iterator it = base->begin(); it != base->end(); ++it) {
+            dataMap::iterator rt = record.find( it->first );
+            if ((rt == record.end()) || (rt->second != it->second))
+                keys.insert( it->first );
+        }
+        for (dataMap::iterator it = record.begin(); it != record.end(); ++it) {
+            if (base->find( it->first ) == base->end())
+                keys.insert( it->first );
+        }
+
+        // Apply them, skipping the keys that we have changed locally
+        for (std::set< std::string >::iterator it = keys.begin(); it != keys.end(); ++it) {
+            if (touched.find( *it ) != touched.end()) continue;
+            dataMap::iterator rt = record.find( *it ), pt = parameters->find( *it );
+            if (rt != record.end()) {
+                if ((pt != parameters->end()) && (pt->second == rt->second)) continue;
+                putOnMap( parameters, *it, rt->second );
+            } else {
+                if (pt == parameters->end()) continue;
+                parameters->erase( pt );
+            }
+            changedKeys.push_back( *it );
+        }
+
+        // This is now the record we have seen
+        revision = rev;
+        base = boost::make_shared< dataMap >( record );
+    }
+
+    // Notify listeners
+    if (!changedKeys.empty()) notifyChanges( changedKeys );
+    return true;
+
+    CRASH_REPORT_END;
+}
+
+/**
+ * Fire the "changed" event with the specified keys
+ */
+void SessionStoreMap::notifyChanges ( const std::vector< std::string >& keys ) {
+    CRASH_REPORT_BEGIN;
+    ArgumentList args;
+    for (std::vector<std::string>::const_iterator it = keys.begin(); it != keys.end(); ++it)
+        args( *it );
+    this->fire( "changed", args );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Write the pending changes and the modified pages of the store to the disk
+ */
+bool SessionStoreMap::flush ( ) {
+    CRASH_REPORT_BEGIN;
+    bool ans = writeRecord();
+    return store->flush() && ans;
+    CRASH_REPORT_END;
+}
@@ -35,6 +35,7 @@ void SimpleFSM::FSMRegistryBegin() {
     CRASH_REPORT_BEGIN;
     // Reset
     fsmNodes.clear();
+    fsmNodeIndex.clear();
     fsmTmpRouteLinks.clear();
     fsmCurrentPath.clear();
     fsmRootNode = NULL;
@@ -42,6 +43,41 @@ void SimpleFSM::FSMRegistryBegin() {
     CRASH_REPORT_END;
 }
 
+/**
+ * Allocate (or reset) the node with the given ID in the dense node array
+ */
+FSMNode * SimpleFSM::_registryNode( int id, const std::vector<int> & links ) {
+    CRASH_REPORT_BEGIN;
+
+    // Grow the ID index if needed
+    if (id >= (int)fsmNodeIndex.size())
+        fsmNodeIndex.resize( id+1, -1 );
+
+    // Allocate a new node if this ID is not yet registered
+    int idx = fsmNodeIndex[id];
+    if (idx < 0) {
+        idx = fsmNodes.size();
+        fsmNodeIndex[id] = idx;
+        fsmNodes.push_back( FSMNode() );
+        fsmTmpRouteLinks.push_back( std::vector<int>() );
+    }
+
+    // Initialize node
+    FSMNode * node = &fsmNodes[idx];
+    node->id = id;
+    node->type = 0;
+    node->thunk = NULL;
+    node->handler = 0;
+    node->children.clear();
+
+    // Store route mapping to temp routes vector
+    // (Will be synced by FSMRegistryEnd)
+    fsmTmpRouteLinks[idx] = links;
+    return node;
+
+    CRASH_REPORT_END;
+}
+
 /**
  * Add entry to the FSM registry
  */
@@ -51,44 +87,49 @@ void SimpleFSM::FSMRegistryAdd( int id, fsmHandler handler, ... ) {
     va_list pl;
     int l;
 
-    // Initialize node
-    fsmNodes[id].id = id;
-    fsmNodes[id].handler = handler;
-    fsmNodes[id].children.clear();
-    
-    // Store route mapping to temp routes vector
-    // (Will be synced by FSMRegistryEnd)
+    // Collect route links
     va_start(pl, handler);
     while ((l = va_arg(pl,int)) != 0) {
         v.push_back(l);
     }
     va_end(pl);
-    fsmTmpRouteLinks[id] = v;
+
+    // Initialize node
+    _registryNode( id, v )->handler = handler;
     CRASH_REPORT_END;
 }
 
+/**
+ * Return the node with the given ID or NULL if it's missing
+ */
+FSMNode * SimpleFSM::FSMNodeByID( int id ) {
+    if ((id < 0) || (id >= (int)fsmNodeIndex.size())) return NULL;
+    int idx = fsmNodeIndex[id];
+    if (idx < 0) return NULL;
+    return &fsmNodes[idx];
+}
+
 /**
  * Complete FSM registry decleration and build FSM tree
  */
 void SimpleFSM::FSMRegistryEnd( int rootID ) {
     CRASH_REPORT_BEGIN;
-	std::map<int,FSMNode>::iterator pt;
-	std::vector<FSMNode*> 			nodePtr;
-	std::vector<int> 				links;
 
-	// Build FSM linked list
-	for (std::map<int,FSMNode>::iterator it = fsmNodes.begin(); it != fsmNodes.end(); ++it) {
-		int id = (*it).first;
-		FSMNode * node = &((*it).second);
+	// Build FSM linked list (the node array is not modified from now on,
+	// so it's safe to keep pointers to its elements)
+	for (size_t i=0; i<fsmNodes.size(); ++i) {
+		FSMNode * node = &fsmNodes[i];
+		std::vector<int> & links = fsmTmpRouteLinks[i];
 
 		// Create links
-		nodePtr.clear();
-		links = fsmTmpRouteLinks[id];
 		for (std::vector<int>::iterator jt = links.begin(); jt != links.end(); ++jt) {
 
-			// Get pointer to node element in map
-			pt = fsmNodes.find( *jt );
-			FSMNode * refNode = &((*pt).second);
+			// Get pointer to node element
+			FSMNode * refNode = FSMNodeByID( *jt );
+			if (refNode == NULL) {
+				CVMWA_LOG("Error", "FSM node " << node->id << " links to missing node " << *jt);
+				continue;
+			}
 
 			// Update node
 			node->children.push_back( refNode );
@@ -99,8 +140,7 @@ void SimpleFSM::FSMRegistryEnd( int rootID ) {
 
 	// Fetch root node
 	fsmTargetState = rootID;
-	pt = fsmNodes.find( rootID );
-	fsmRootNode = &((*pt).second);
+	fsmRootNode = FSMNodeByID( rootID );
 
 	// Reset current node
 	fsmCurrentNode = fsmRootNode;
@@ -120,7 +160,9 @@ bool SimpleFSM::_callHandler( FSMNode * node, bool inThread ) {
 	try {
 
 		// Run the new state
-		if (node->handler)
+		if (node->thunk != NULL)
+			(*node->thunk)( this );
+		else if (node->handler)
 			node->handler();
 
 	} catch (boost::thread_interrupted &e) {
@@ -176,7 +218,7 @@ bool SimpleFSM::FSMContinue( bool inThread ) {
 	// Skip state nodes
     { /* mutex(fsmCurrentPath)) */
         boost::unique_lock<boost::mutex> lock(fsmPathMutex);
-        while ((!next->handler) && !fsmCurrentPath.empty()) {
+        while ((!next->hasHandler()) && !fsmCurrentPath.empty()) {
             lock.unlock();
             FSMEnteringState( next->id, false );
             lock.lock();
@@ -305,7 +347,7 @@ void SimpleFSM::FSMGoto(int state, int stripPathComponents) {
 			pathCount = 0;
 			for (std::list<FSMNode*>::iterator j= fsmCurrentPath.begin(); j!=fsmCurrentPath.end(); ++j) {
 				FSMNode* node = *j;
-				if (node->handler) pathCount++;
+				if (node->hasHandler()) pathCount++;
 			}
 		}
 
@@ -357,19 +399,19 @@ void SimpleFSM::FSMJump(int state) {
 	}
 
 	// Pick the current node
-	std::map<int,FSMNode>::iterator it = fsmNodes.find( state );
+	FSMNode * node = FSMNodeByID( state );
 
-	if (it == fsmNodes.end()) {
+	if (node == NULL) {
 		// Skip missing nodes
 		fsmCurrentNode = fsmRootNode;
 
 	} else {
 
         // Change current node
-        fsmCurrentNode = &it->second;
+        fsmCurrentNode = node;
 
         // Handle only non-state nodes
-        if (fsmCurrentNode->handler) {
+        if (fsmCurrentNode->hasHandler()) {
 		    // We are entering the given state
 		    FSMEnteringState( fsmCurrentNode->id, true );
 
@@ -390,14 +432,12 @@ void SimpleFSM::FSMJump(int state) {
 void SimpleFSM::FSMSkew(int state) {
     CRASH_REPORT_BEGIN;
     CVMWA_LOG("Debug", "Skewing through " << state << " towards " << fsmTargetState);
-	std::map<int,FSMNode>::iterator pt;
-
 	// Search given state
-	pt = fsmNodes.find( state );
-	if (pt == fsmNodes.end()) return;
+	FSMNode * node = FSMNodeByID( state );
+	if (node == NULL) return;
 
 	// Switch current node to the skewed state
-	fsmCurrentNode = &((*pt).second);
+	fsmCurrentNode = node;
 
 	// Notify state change
 	bool isEmpty = false;
@@ -632,15 +672,14 @@ void SimpleFSM::FSMWaitFor ( int state, int timeout ) {
     CVMWA_LOG("Debug", "Waiting for state " << state );
 
 	// Find the state
-	std::map<int,FSMNode>::iterator pt;
-	pt = fsmNodes.find( state );
-	if (pt == fsmNodes.end()) return;
+	FSMNode * node = FSMNodeByID( state );
+	if (node == NULL) return;
 
 	// If we are already on this state, don't do anything
 	if (fsmCurrentNode == fsmwState) return;
 
 	// Switch to the target state
-	fsmwState = &((*pt).second);
+	fsmwState = node;
 
 	/*
     {
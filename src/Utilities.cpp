@@ -34,6 +34,9 @@
 
 #include <boost/filesystem.hpp> 
 #include <boost/filesystem/path.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/bind.hpp>
+#include <boost/type_traits/is_integral.hpp>
 #include <openssl/evp.h>
 #include <errno.h>
 #include "zlib.h"
@@ -63,22 +66,100 @@ std::string appDataDir = "";
 /* A list of named mutexes in this process (static) */
 std::map< std::string, sharedMutex >    namedMutexStack;
 
+/**
+ * Parse an integer in the given base without using the stream and locale machinery.
+ * Like the stream extraction, leading whitespace and a sign are accepted, parsing
+ * stops at the first invalid character and a missing or out-of-range number is 0.
+ */
+template <typename T> static T parseInteger( const std::string &Text, const unsigned int base ) {
+    const char * p = Text.c_str(), * e = p + Text.length();
+
+    // Skip whitespace and sign
+    while ((p < e) && isspace((unsigned char)*p)) ++p;
+    bool neg = false;
+    if ((p < e) && ((*p == '-') || (*p == '+'))) {
+        neg = (*p == '-'); ++p;
+    }
+
+    // Skip the hex prefix
+    if ((base == 16) && (e - p > 2) && (p[0] == '0') && ((p[1] == 'x') || (p[1] == 'X')) && isxdigit((unsigned char)p[2]))
+        p += 2;
+
+    // Largest magnitude we can represent
+    const boost::uint64_t limit = (neg && std::numeric_limits<T>::is_signed)
+        ? (boost::uint64_t)std::numeric_limits<T>::max() + 1
+        : (boost::uint64_t)std::numeric_limits<T>::max();
+
+    // Collect digits
+    const char * start = p;
+    boost::uint64_t v = 0;
+    for (; p < e; ++p) {
+        unsigned int d;
+        if ((*p >= '0') && (*p <= '9')) d = *p - '0';
+        else if ((base == 16) && (*p >= 'a') && (*p <= 'f')) d = *p - 'a' + 10;
+        else if ((base == 16) && (*p >= 'A') && (*p <= 'F')) d = *p - 'A' + 10;
+        else break;
+        if (v > (limit - d) / base) return 0;
+        v = v * base + d;
+    }
+    if (p == start) return 0;
+
+    // Apply sign (unsigned types wrap around, like strtoul)
+    if (!neg) return (T)v;
+    if (std::numeric_limits<T>::is_signed) return (T)( -(boost::int64_t)(v - 1) - 1 );
+    return (T)( 0 - v );
+}
+
+/**
+ * Format an integer without using the stream and locale machinery
+ */
+template <typename T> static std::string formatInteger( const T value ) {
+    char buf[24], * p = buf + sizeof(buf);
+    bool neg = std::numeric_limits<T>::is_signed && (value < (T)0);
+    boost::uint64_t v = neg ? 0 - (boost::uint64_t)(boost::int64_t)value : (boost::uint64_t)value;
+    do {
+        *--p = (char)('0' + (v % 10));
+        v /= 10;
+    } while (v != 0);
+    if (neg) *--p = '-';
+    return std::string( p, buf + sizeof(buf) - p );
+}
+
+/**
+ * Integer types are converted with the functions above, the rest
+ * through a stream with the classic locale.
+ */
+template <typename T> static T parseNumber( const std::string &Text, boost::true_type ) {
+    return parseInteger<T>( Text, 10 );
+}
+template <typename T> static T parseNumber( const std::string &Text, boost::false_type ) {
+    std::istringstream ss(Text); T result;
+    ss.imbue( std::locale::classic() );
+    return ss >> result ? result : 0;
+}
+template <typename T> static std::string formatNumber( const T value, boost::true_type ) {
+    return formatInteger<T>( value );
+}
+template <typename T> static std::string formatNumber( const T value, boost::false_type ) {
+    std::ostringstream out;
+    out.imbue( std::locale::classic() );
+    out << value;
+    return out.str();
+}
+
 /**
  * Convert an std::string to a number
  */
 template <typename T> T ston( const string &Text ) {
-	stringstream ss(Text); T result;
-	return ss >> result ? result : 0;
+    return parseNumber<T>( Text, boost::is_integral<T>() );
 }
 
 template <typename T> T hex_ston( const std::string &Text ) {
-    stringstream ss; T result; ss << std::hex << Text;
-    return ss >> result ? result : 0;
+    return parseInteger<T>( Text, 16 );
 }
 
 template <typename T> std::string ntos( T &value ) {
-    std::stringstream out; out << value;
-    return out.str();
+    return formatNumber<T>( value, boost::is_integral<T>() );
 }
 
 /**
@@ -90,6 +171,7 @@ template long hex_ston<long>( const std::string &Text );
 template int ston<int>( const std::string &Text );
 template unsigned int ston<unsigned int>( const std::string &Text );
 template long ston<long>( const std::string &Text );
+template long long ston<long long>( const std::string &Text );
 template size_t ston<size_t>( const std::string &Text );
 template double ston<double>( const std::string &Text );
 template float ston<float>( const std::string &Text );
@@ -97,6 +179,7 @@ template float ston<float>( const std::string &Text );
 template std::string ntos<int>( int &value );
 template std::string ntos<unsigned int>( unsigned int &value );
 template std::string ntos<long>( long &value );
+template std::string ntos<long long>( long long &value );
 template std::string ntos<size_t>( size_t &value );
 template std::string ntos<double>( double &value );
 template std::string ntos<float>( float &value );
@@ -1325,46 +1408,140 @@ int digest_buffer( const std::string& buffer, const EVP_MD * md, string * dst, b
     CRASH_REPORT_END;
 }
 
+/**
+ * Reads a file in the background into two alternating buffers, so the next
+ * block is read while the current one is hashed
+ */
+class DigestFileReader {
+public:
+
+    /**
+     * Start reading the specified (open) file
+     */
+    DigestFileReader( FILE * file ) : file(file), error(false) {
+        for (int i = 0; i < 2; i++) {
+            memory[i].resize( DIGEST_READ_BLOCK + DIGEST_BUFFER_ALIGN );
+            buffer[i] = &memory[i][0] + (DIGEST_BUFFER_ALIGN - (size_t)&memory[i][0] % DIGEST_BUFFER_ALIGN) % DIGEST_BUFFER_ALIGN;
+            length[i] = 0;
+            filled[i] = false;
+        }
+        thread = boost::thread( boost::bind( &DigestFileReader::readLoop, this ) );
+    }
+
+    /**
+     * Wait for the reader thread
+     */
+    ~DigestFileReader() {
+        thread.join();
+    }
+
+    /**
+     * Wait for the specified buffer to be filled and return its length. The
+     * file ends with the first block shorter than DIGEST_READ_BLOCK.
+     */
+    size_t wait( int i ) {
+        boost::unique_lock< boost::mutex > lock( mutex );
+        while (!filled[i]) cond.wait( lock );
+        return length[i];
+    }
+
+    /**
+     * Give the specified buffer back to the reader thread
+     */
+    void release( int i ) {
+        boost::unique_lock< boost::mutex > lock( mutex );
+        filled[i] = false;
+        cond.notify_all();
+    }
+
+    std::vector< char >     memory[2];
+    char *                  buffer[2];
+    size_t                  length[2];
+    bool                    filled[2];
+    bool                    error;
+
+private:
+
+    /**
+     * Fill the buffers in turn until the end of the file
+     */
+    void readLoop() {
+        for (int i = 0; ; i = 1 - i) {
+            {
+                boost::unique_lock< boost::mutex > lock( mutex );
+                while (filled[i]) cond.wait( lock );
+            }
+            size_t len = fread( buffer[i], 1, DIGEST_READ_BLOCK, file );
+            boost::unique_lock< boost::mutex > lock( mutex );
+            if (len < DIGEST_READ_BLOCK) error = (ferror( file ) != 0);
+            length[i] = len;
+            filled[i] = true;
+            cond.notify_all();
+            if (len < DIGEST_READ_BLOCK) break;
+        }
+    }
+
+    FILE *                  file;
+    boost::mutex            mutex;
+    boost::condition_variable cond;
+    boost::thread           thread;
+
+};
+
 /**
  * Calculate the digest of the given filename
  */
 int digest_file( const std::string& path, const EVP_MD * md, string * dst, bool hex ) {
     CRASH_REPORT_BEGIN;
-    const int FREAD_CHUNK = 4096; // Filesystems have 4k or 8k chunks
     unsigned int md_len;
     unsigned char md_value[EVP_MAX_MD_SIZE];
 
-    // Open file
-    std::ifstream file( path.c_str(), std::ios::binary );
-    if(!file.good()) return -534;
+    // Check the file
+    if (!file_exists( path )) return -534;
+
+    // Open file. The reads go straight to our buffers.
+    FILE * file = fopen( path.c_str(), "rb" );
+    if (file == NULL) return -534;
+    setvbuf( file, NULL, _IONBF, 0 );
 
     // Initialize EVP subsystem
     EVP_MD_CTX *mdctx;
     mdctx = EVP_MD_CTX_create();
     EVP_DigestInit_ex(mdctx, md, NULL);
 
-    // Prepare file scanning buffers
-    char read_buffer[FREAD_CHUNK];
-    while(!file.eof()) {
-
-        // Read file chunk
-        file.read( read_buffer, FREAD_CHUNK );
-
-        // Check for errors while reading
-        if (file.bad()) {    
-            EVP_MD_CTX_destroy(mdctx);
-            return -534;
+    // Hash each block while the reader thread reads the next one. The waits
+    // are not interruption points, the reader thread must always be joined.
+    long long bytes = 0;
+    long startTime = getMillis();
+    bool failed;
+    {
+        boost::this_thread::disable_interruption di;
+        DigestFileReader reader( file );
+        for (int i = 0; ; i = 1 - i) {
+            size_t len = reader.wait( i );
+            EVP_DigestUpdate(mdctx, reader.buffer[i], len);
+            bytes += len;
+            reader.release( i );
+            if (len < DIGEST_READ_BLOCK) break;
         }
-
-        // Update digest
-        EVP_DigestUpdate(mdctx, read_buffer, file.gcount());
+        failed = reader.error;
     }
 
     // Close file
-    file.close();
+    fclose( file );
+
+    // Check for errors while reading
+    if (failed) {
+        EVP_MD_CTX_destroy(mdctx);
+        return -534;
+    }
 
     // Checksum
     EVP_DigestFinal_ex(mdctx, md_value, &md_len);
+    long elapsed = getMillis() - startTime;
+    if (elapsed > 0) {
+        CVMWA_LOG("Debug", "Calculated the digest of " << bytes << " bytes at " << std::fixed << std::setprecision(2) << ((double)bytes / elapsed / 1e6) << " GB/s");
+    }
 
     // Convert to hex & upload to dst
     if (hex) {
@@ -2068,12 +2245,277 @@ bool isSanitized( std::string * check, const char * chars ) {
     CRASH_REPORT_END;
 }
 
+/**
+ * Check if the buffer contains only zeros
+ */
+inline bool __isZero( const char * data, size_t length ) {
+    return (length == 0) || ((data[0] == 0) && (memcmp( data, data + 1, length - 1 ) == 0));
+}
+
+/**
+ * Write the data to the stream, leaving holes for the blocks of zeros
+ */
+bool writeSparse( std::ostream& out, const char * data, size_t length ) {
+    CRASH_REPORT_BEGIN;
+    size_t pos = 0;
+    while (pos < length) {
+
+        // Find the run of blocks that are all zeros (or not)
+        size_t end = pos + std::min( (size_t)SPARSE_BLOCK_SIZE, length - pos );
+        bool zero = __isZero( data + pos, end - pos );
+        while (end < length) {
+            size_t next = std::min( (size_t)SPARSE_BLOCK_SIZE, length - end );
+            if (__isZero( data + end, next ) != zero) break;
+            end += next;
+        }
+
+        // Skip the zeros, write the rest
+        if (zero) {
+            out.seekp( end - pos, std::ios_base::cur );
+        } else {
+            out.write( data + pos, end - pos );
+        }
+        if (!out.good()) return false;
+        pos = end;
+
+    }
+    return true;
+    CRASH_REPORT_END;
+}
+
+/**
+ * A block of a BGZF (block-compressed gzip) file
+ */
+struct BGZFBlock {
+    boost::uint64_t     offset;         // Offset of the block in the compressed file
+    boost::uint32_t     size;           // Size of the block in the compressed file
+    boost::uint64_t     output;         // Offset of the block contents in the decompressed file
+    boost::uint32_t     length;         // Size of the block contents
+};
+
+/**
+ * Read little-endian integers from a buffer
+ */
+inline boost::uint32_t __bgzfU16( const unsigned char * p ) { return p[0] | (p[1] << 8); }
+inline boost::uint32_t __bgzfU32( const unsigned char * p ) { return p[0] | (p[1] << 8) | (p[2] << 16) | ((boost::uint32_t)p[3] << 24); }
+
+/**
+ * Build the list of the blocks of a BGZF file. The size of every block is stored in
+ * the 'BC' extra field of it's gzip header and the size of it's contents at it's end,
+ * so the file can be split without decompressing it. Returns false if the file is not
+ * in BGZF format.
+ */
+bool __bgzfIndex( const std::string& src, std::vector< BGZFBlock > * blocks, boost::uint64_t * total ) {
+    CRASH_REPORT_BEGIN;
+    std::ifstream in( src.c_str(), std::ifstream::binary );
+    if (!in.good()) return false;
+
+    boost::uint64_t size = boost::filesystem::file_size( src );
+    boost::uint64_t offset = 0;
+    boost::uint64_t output = 0;
+    unsigned char header[12];
+    unsigned char trailer[4];
+    std::vector< unsigned char > extra;
+    while (offset < size) {
+
+        // Read the gzip header, that must have only the extra field
+        in.seekg( offset );
+        in.read( (char*) header, sizeof(header) );
+        if (in.gcount() != sizeof(header)) return false;
+        if ((header[0] != 31) || (header[1] != 139) || (header[2] != 8) || (header[3] != 4)) return false;
+
+        // Look for the 'BC' subfield with the size of the block
+        size_t xlen = __bgzfU16( &header[10] );
+        long bsize = -1;
+        extra.resize( xlen );
+        if (xlen > 0) in.read( (char*) &extra[0], xlen );
+        if ((size_t)in.gcount() != xlen) return false;
+        for (size_t p = 0; p + 4 <= xlen; p += 4 + __bgzfU16( &extra[p+2] )) {
+            if ((extra[p] == 'B') && (extra[p+1] == 'C') && (__bgzfU16( &extra[p+2] ) == 2) && (p + 6 <= xlen))
+                bsize = __bgzfU16( &extra[p+4] );
+        }
+        if (bsize < 0) return false;
+
+        // Check the size of the block
+        BGZFBlock block;
+        block.offset = offset;
+        block.size = bsize + 1;
+        if ((block.size < 12 + xlen + 8) || (offset + block.size > size)) return false;
+
+        // Read the size of it's contents from the trailer
+        in.seekg( offset + block.size - 4 );
+        in.read( (char*) trailer, sizeof(trailer) );
+        if (in.gcount() != sizeof(trailer)) return false;
+        block.output = output;
+        block.length = __bgzfU32( trailer );
+        if (block.length > GZ_BLOCK_SIZE) return false;
+
+        blocks->push_back( block );
+        output += block.length;
+        offset += block.size;
+    }
+
+    *total = output;
+    return !blocks->empty();
+    CRASH_REPORT_END;
+}
+
+/**
+ * Worker thread that decompresses batches of BGZF blocks in place
+ */
+void __bgzfInflate( const std::string& src, const std::string& dst, const std::vector< BGZFBlock > * blocks,
+                    size_t * next, boost::mutex * mutex, int * result ) {
+    CRASH_REPORT_BEGIN;
+    std::ifstream in( src.c_str(), std::ifstream::binary );
+    std::fstream out( dst.c_str(), std::fstream::in | std::fstream::out | std::fstream::binary );
+    if (!in.good() || !out.good()) {
+        boost::unique_lock<boost::mutex> lock(*mutex);
+        CVMWA_LOG("Error", "Unable to open the files for decompression");
+        *result = HVE_IO_ERROR;
+        return;
+    }
+
+    // Raw inflate, we parse the gzip headers ourselves
+    z_stream zs;
+    memset( &zs, 0, sizeof(zs) );
+    if (inflateInit2( &zs, -15 ) != Z_OK) {
+        boost::unique_lock<boost::mutex> lock(*mutex);
+        *result = HVE_IO_ERROR;
+        return;
+    }
+
+    std::vector< unsigned char > input( GZ_BLOCK_SIZE );
+    std::vector< unsigned char > output( GZ_BLOCK_SIZE );
+    int ans = HVE_OK;
+    for (;;) {
+
+        // Pick the next batch of blocks
+        size_t first, last;
+        {
+            boost::unique_lock<boost::mutex> lock(*mutex);
+            if ((*result != HVE_OK) || (*next >= blocks->size())) break;
+            first = *next;
+            last = std::min( first + DECOMPRESS_BATCH_BLOCKS, blocks->size() );
+            *next = last;
+        }
+
+        // The blocks of a batch are consecutive both in the input and in the output
+        in.seekg( (*blocks)[first].offset );
+        out.seekp( (*blocks)[first].output );
+        for (size_t i = first; (i < last) && (ans == HVE_OK); i++) {
+            const BGZFBlock & block = (*blocks)[i];
+
+            // Read the block
+            in.read( (char*) &input[0], block.size );
+            if ((size_t)in.gcount() != block.size) {
+                ans = HVE_IO_ERROR;
+                break;
+            }
+
+            // Inflate it
+            size_t hlen = 12 + __bgzfU16( &input[10] );
+            inflateReset( &zs );
+            zs.next_in = &input[hlen];
+            zs.avail_in = block.size - hlen - 8;
+            zs.next_out = &output[0];
+            zs.avail_out = output.size();
+            if ((inflate( &zs, Z_FINISH ) != Z_STREAM_END) || (zs.total_out != block.length)) {
+                ans = HVE_IO_ERROR;
+                break;
+            }
+
+            // Validate and write the contents
+            if (crc32( crc32(0L, Z_NULL, 0), &output[0], block.length ) != __bgzfU32( &input[block.size - 8] )) {
+                ans = HVE_IO_ERROR;
+                break;
+            }
+            if (!writeSparse( out, (const char*) &output[0], block.length )) {
+                ans = HVE_IO_ERROR;
+                break;
+            }
+        }
+        if (!out.good()) ans = HVE_IO_ERROR;
+
+        // Stop all the workers on error
+        if (ans != HVE_OK) {
+            boost::unique_lock<boost::mutex> lock(*mutex);
+            CVMWA_LOG("Error", "Unable to decompress block " << first << " of " << src);
+            *result = ans;
+            break;
+        }
+    }
+
+    inflateEnd( &zs );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Decompress a BGZF file, splitting the blocks to all the cores
+ */
+int __bgzfDecompress( const std::string& src, const std::string& dst, const std::vector< BGZFBlock >& blocks, boost::uint64_t total ) {
+    CRASH_REPORT_BEGIN;
+
+    // Allocate the output file, so the blocks can be written at their offsets.
+    // This doesn't use any disk space, only the non-zero blocks do.
+    {
+        std::ofstream out( dst.c_str(), std::ofstream::binary | std::ofstream::trunc );
+        if (!out.good()) {
+            CVMWA_LOG("Error", "Unable to open file file `" << dst << "' for writing.");
+            return HVE_IO_ERROR;
+        }
+    }
+    try {
+        boost::filesystem::resize_file( dst, total );
+    } catch (const boost::filesystem::filesystem_error& e) {
+        CVMWA_LOG("Error", "Unable to allocate `" << dst << "' (" << e.what() << ")");
+        return HVE_IO_ERROR;
+    }
+
+    // Start one worker per core
+    size_t batches = (blocks.size() + DECOMPRESS_BATCH_BLOCKS - 1) / DECOMPRESS_BATCH_BLOCKS;
+    size_t numThreads = std::max( boost::thread::hardware_concurrency(), 1u );
+    numThreads = std::min( numThreads, batches );
+    CVMWA_LOG("Info", "Decompressing " << blocks.size() << " blocks of " << src << " using " << numThreads << " threads");
+
+    size_t next = 0;
+    boost::mutex mutex;
+    int result = HVE_OK;
+    boost::thread_group workers;
+    for (size_t i = 0; i < numThreads; i++)
+        workers.create_thread( boost::bind( &__bgzfInflate, src, dst, &blocks, &next, &mutex, &result ) );
+    try {
+        workers.join_all();
+    } catch (boost::thread_interrupted &) {
+
+        // The workers use our stack and write to the output file, so stop them
+        // (after their current batch) before unwinding
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            result = HVE_IO_ERROR;
+        }
+        boost::this_thread::disable_interruption di;
+        workers.join_all();
+        throw;
+
+    }
+
+    return result;
+    CRASH_REPORT_END;
+}
+
 /**
  * Decompress a GZipped file from src and write it to dst
  */
 int decompressFile( const std::string& src, const std::string& dst ) {
     CRASH_REPORT_BEGIN;
+
+    // Block-compressed files are decompressed in parallel
+    std::vector< BGZFBlock > blocks;
+    boost::uint64_t total = 0;
+    if (__bgzfIndex( src, &blocks, &total ))
+        return __bgzfDecompress( src, dst, blocks, total );
     
+
     // Try to open gzfile
     gzFile file;
     file = gzopen ( src.c_str(), "rb" );
@@ -2091,7 +2533,7 @@ int decompressFile( const std::string& src, const std::string& dst ) {
     gzbuffer( file, GZ_BLOCK_SIZE );
     
     // Decompress
-    int bytes_written = 0;
+    unsigned long long bytes_written = 0;
     while (1) {
         int err;                    
         int bytes_read;
@@ -2102,7 +2544,11 @@ int decompressFile( const std::string& src, const std::string& dst ) {
         if (bytes_read > 0) bytes_written+=bytes_read;
         
         // Write block
-        out.write( (const char *) buffer, bytes_read );
+        if ((bytes_read > 0) && !writeSparse( out, (const char *) buffer, bytes_read )) {
+            CVMWA_LOG("Error", "Unable to write to `" << dst << "'");
+            gzclose(file);
+            return HVE_IO_ERROR;
+        }
         
         // Check for error/completion
         if (bytes_read < GZ_BLOCK_SIZE - 1) {
@@ -2125,6 +2571,14 @@ int decompressFile( const std::string& src, const std::string& dst ) {
     // Close streams
     out.close();
     gzclose(file);
+
+    // Write the trailing hole
+    try {
+        boost::filesystem::resize_file( dst, bytes_written );
+    } catch (const boost::filesystem::filesystem_error& e) {
+        CVMWA_LOG("Error", "Unable to resize `" << dst << "' (" << e.what() << ")");
+        return HVE_IO_ERROR;
+    }
     
     // If we did not read something, the file
     // was not in GZ-format